@@ -3,7 +3,8 @@ QT -= gui
 QT += network
 
 DEFINES += TESTING \
-           "FLASHMQ_VERSION=\\\"0.0.0\\\""
+           "FLASHMQ_VERSION=\\\"0.0.0\\\"" \
+           FLASHMQ_IO_URING
 
 INCLUDEPATH += ..
 
@@ -62,6 +63,15 @@ SOURCES +=  tst_maintests.cpp \
     ../pluginloader.cpp \
     ../queuedtasks.cpp \
     ../acksender.cpp \
+    ../subtopickey.cpp \
+    ../iouring.cpp \
+    ../aclcache.cpp \
+    ../timerwheel.cpp \
+    ../durationhistogram.cpp \
+    ../shardedcounter.cpp \
+    ../retainedmessageswal.cpp \
+    ../retainedmessagesmapping.cpp \
+    ../threadspause.cpp \
     conffiletemp.cpp \
     flashmqtempdir.cpp \
     mainappthread.cpp \
@@ -122,6 +132,16 @@ HEADERS += \
     ../pluginloader.h \
     ../queuedtasks.h \
     ../acksender.h \
+    ../subtopickey.h \
+    ../flatmap.h \
+    ../iouring.h \
+    ../aclcache.h \
+    ../timerwheel.h \
+    ../durationhistogram.h \
+    ../shardedcounter.h \
+    ../retainedmessageswal.h \
+    ../retainedmessagesmapping.h \
+    ../threadspause.h \
     conffiletemp.h \
     flashmqtempdir.h \
     mainappthread.h \
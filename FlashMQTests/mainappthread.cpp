@@ -94,3 +94,13 @@ std::shared_ptr<SubscriptionStore> MainAppThread::getStore()
 {
     return appInstance->getSubscriptionStore();
 }
+
+std::vector<std::shared_ptr<ThreadData>> MainAppThread::getThreads()
+{
+    return appInstance->threads;
+}
+
+void MainAppThread::saveState()
+{
+    appInstance->saveState(appInstance->settings);
+}
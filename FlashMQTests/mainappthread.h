@@ -36,6 +36,8 @@ public slots:
     void stopApp();
     void waitForStarted();
     std::shared_ptr<SubscriptionStore> getStore();
+    std::vector<std::shared_ptr<ThreadData>> getThreads();
+    void saveState();
 
 signals:
 
@@ -138,6 +138,10 @@ AuthResult flashmq_plugin_login_check(void *thread_data, const std::string &clie
     if (username == "failme")
         return AuthResult::login_denied;
 
+    // Decided in flashmq_plugin_check_batch().
+    if (username == "batch")
+        return AuthResult::async;
+
     if (username == "getaddress")
     {
         std::string text;
@@ -196,12 +200,34 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
     if (access == AclAccess::register_will && topic == "will/disallowed")
         return AuthResult::acl_denied;
 
-    if (topic == "removeclient" || topic == "removeclientandsession")
+    // Only the publisher, not the receivers, so they get the publish after the publisher's DISCONNECT, like in testWillDuringBatchedFlush().
+    if ((topic == "removeclient" || topic == "removeclientandsession") && access == AclAccess::write)
         flashmq_plugin_remove_client(clientid, topic == "removeclientandsession", ServerDisconnectReasons::NormalDisconnect);
 
     if (clientid == "unsubscribe" && access == AclAccess::write)
         flashmq_plugin_remove_subscription(clientid, topic);
 
+    // Pretend to ask a slow back-end, without blocking the thread. The checks are done in a task, after a delay.
+    if (username == "async_acl" && (access == AclAccess::write || access == AclAccess::subscribe))
+    {
+        uint64_t checkId = 0;
+        std::weak_ptr<Client> client = flashmq_get_acl_check_client(checkId);
+        const AuthResult result = topic.find("denied") == std::string::npos ? AuthResult::success : AuthResult::acl_denied;
+
+        auto delayedResult = [client, checkId, result]() {
+            flashmq_continue_async_acl_check(client, checkId, result);
+
+            // A duplicate must be ignored, and not decide the next packet, like 'async/denied' in testAsyncAclCheck().
+            flashmq_continue_async_acl_check(client, checkId, AuthResult::success);
+        };
+
+        flashmq_add_task(delayedResult, 100);
+        return AuthResult::async;
+    }
+
+    if (username == "batch" && (access == AclAccess::write || access == AclAccess::subscribe))
+        return AuthResult::async;
+
     if (clientid == "generate_publish")
     {
         flashmq_logf(LOG_INFO, "Publishing from plugin.");
@@ -214,6 +240,36 @@ AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, c
     return AuthResult::success;
 }
 
+void flashmq_plugin_check_batch(void *thread_data, const std::vector<FlashMQCheckRequest> &requests)
+{
+    (void)thread_data;
+
+    bool throwAfterAnswering = false;
+
+    for (const FlashMQCheckRequest &request : requests)
+    {
+        // The other async checks are continued elsewhere.
+        if (request.username != "batch")
+            continue;
+
+        if (request.access == AclAccess::none)
+        {
+            throwAfterAnswering |= request.password == "success_then_throw";
+
+            const AuthResult result = request.password.find("success") == 0 ? AuthResult::success : AuthResult::login_denied;
+            flashmq_continue_async_authentication(request.client, result, "", "");
+        }
+        else
+        {
+            const AuthResult result = request.topic.find("denied") == std::string::npos ? AuthResult::success : AuthResult::acl_denied;
+            flashmq_continue_async_acl_check(request.client, request.aclCheckId, result);
+        }
+    }
+
+    if (throwAfterAnswering)
+        throw std::runtime_error("Throwing after answering, on request.");
+}
+
 AuthResult flashmq_plugin_extended_auth(void *thread_data, const std::string &clientid, ExtendedAuthStage stage, const std::string &authMethod,
                                         const std::string &authData, const std::vector<std::pair<std::string, std::string>> *userProperties, std::string &returnData,
                                         std::string &username, const std::weak_ptr<Client> &client)
@@ -1,6 +1,7 @@
 #include "tst_maintests.h"
 
 #include <sys/sysinfo.h>
+#include <algorithm>
 
 void MainTests::testWillDenialByPlugin()
 {
@@ -501,6 +502,135 @@ void MainTests::testSimpleAuthAsync()
     }
 }
 
+/**
+ * @brief MainTests::testAsyncAclCheck uses the test plugin's mock back-end, which answers ACL checks of user 'async_acl' after 100 ms. The
+ * publishes must wait for it in order, without holding up other clients.
+ */
+void MainTests::testAsyncAclCheck()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("plugin plugins/libtest_plugin.so.0.0.1");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("#", 0);
+
+    FlashMQTestClient asyncClient;
+    asyncClient.start();
+    asyncClient.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect) {
+        connect.username = "async_acl";
+    });
+
+    // Throws when the suback doesn't come, or indicates an error.
+    asyncClient.subscribe("async/subscribe", 0);
+
+    FlashMQTestClient normalClient;
+    normalClient.start();
+    normalClient.connectClient(ProtocolVersion::Mqtt5);
+
+    asyncClient.publish("async/one", "1", 0);
+    asyncClient.publish("async/denied", "2", 0);
+    asyncClient.publish("async/two", "3", 0);
+    normalClient.publish("normal", "4", 0);
+
+    receiver.waitForMessageCount(3, 2);
+
+    MYCASTCOMPARE(receiver.receivedPublishes.size(), 3);
+    QCOMPARE(receiver.receivedPublishes[0].getTopic(), "normal");
+    QCOMPARE(receiver.receivedPublishes[1].getTopic(), "async/one");
+    QCOMPARE(receiver.receivedPublishes[2].getTopic(), "async/two");
+
+    receiver.clearReceivedLists();
+
+    // The ack of a QoS publish waits for the check too.
+    asyncClient.publish("async/qos", "5", 1);
+
+    receiver.waitForMessageCount(1);
+    MYCASTCOMPARE(receiver.receivedPublishes.size(), 1);
+    QCOMPARE(receiver.receivedPublishes[0].getTopic(), "async/qos");
+}
+
+/**
+ * @brief MainTests::testCheckBatch tests that checks the plugin returns async for are given to flashmq_plugin_check_batch(), and can be
+ * continued from there.
+ */
+void MainTests::testCheckBatch()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("plugin plugins/libtest_plugin.so.0.0.1");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    {
+        FlashMQTestClient client;
+        client.start();
+        client.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect) {
+            connect.username = "batch";
+            connect.password = "fail";
+        });
+
+        QVERIFY(client.receivedPackets.size() == 1);
+        ConnAckData connAckData = client.receivedPackets.front().parseConnAckData();
+        QVERIFY(connAckData.reasonCode == ReasonCodes::NotAuthorized);
+    }
+
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("#", 0);
+
+    FlashMQTestClient client;
+    client.start();
+    client.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect) {
+        connect.username = "batch";
+        connect.password = "success";
+    });
+
+    QVERIFY(client.receivedPackets.size() == 1);
+    ConnAckData connAckData = client.receivedPackets.front().parseConnAckData();
+    QVERIFY(connAckData.reasonCode == ReasonCodes::Success);
+
+    client.subscribe("batch/subscribe", 0);
+
+    client.publish("batch/denied", "1", 0);
+    client.publish("batch/allowed", "2", 1);
+
+    receiver.waitForMessageCount(1);
+    MYCASTCOMPARE(receiver.receivedPublishes.size(), 1);
+    QCOMPARE(receiver.receivedPublishes[0].getTopic(), "batch/allowed");
+
+    receiver.clearReceivedLists();
+
+    // The plugin answers this login and then throws. The error for the checks it didn't answer must not reach this client too.
+    FlashMQTestClient throwingClient;
+    throwingClient.start();
+    throwingClient.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect) {
+        connect.username = "batch";
+        connect.password = "success_then_throw";
+    });
+
+    QVERIFY(throwingClient.receivedPackets.size() == 1);
+    connAckData = throwingClient.receivedPackets.front().parseConnAckData();
+    QVERIFY(connAckData.reasonCode == ReasonCodes::Success);
+
+    throwingClient.publish("batch/after_throw", "3", 1);
+
+    receiver.waitForMessageCount(1);
+    MYCASTCOMPARE(receiver.receivedPublishes.size(), 1);
+    QCOMPARE(receiver.receivedPublishes[0].getTopic(), "batch/after_throw");
+}
+
 void MainTests::testClientRemovalByPlugin()
 {
     std::list<std::string> methods { "removeclient", "removeclientandsession"};
@@ -547,6 +677,55 @@ void MainTests::testClientRemovalByPlugin()
     }
 }
 
+/**
+ * @brief MainTests::testWillDuringBatchedFlush makes a client's DISCONNECT and a write to the subscriber of its will go in the same batch of
+ * io_uring writes. Removing the client publishes its will to the subscriber, whose write buffer may not be locked by the batch anymore then.
+ */
+void MainTests::testWillDuringBatchedFlush()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("plugin plugins/libtest_plugin.so.0.0.1");
+    confFile.writeLine("thread_count 1");
+    confFile.writeLine("batched_write_flushing yes");
+    confFile.writeLine("io_uring_batched_sends yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("removeclient", 0);
+    receiver.subscribe("will/batched", 0);
+
+    FlashMQTestClient sender;
+    sender.start();
+    std::shared_ptr<WillPublish> will = std::make_shared<WillPublish>();
+    will->topic = "will/batched";
+    will->payload = "gone";
+    sender.setWill(will);
+    sender.connectClient(ProtocolVersion::Mqtt5);
+
+    // The plugin disconnects the sender during the ACL check, so the DISCONNECT is queued before the receiver's copy of the publish.
+    sender.publish("removeclient", "asdf", 0);
+    sender.waitForDisconnectPacket();
+
+    receiver.waitForMessageCount(2);
+
+    MYCASTCOMPARE(receiver.receivedPublishes.size(), 2);
+
+    std::vector<std::string> topics;
+    for (const MqttPacket &pack : receiver.receivedPublishes)
+        topics.push_back(pack.getTopic());
+    std::sort(topics.begin(), topics.end());
+
+    QCOMPARE(topics.at(0), "removeclient");
+    QCOMPARE(topics.at(1), "will/batched");
+}
+
 void MainTests::testSubscriptionRemovalByPlugin()
 {
     ConfFileTemp confFile;
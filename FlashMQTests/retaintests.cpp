@@ -471,7 +471,8 @@ void MainTests::test_retained_tree_purging()
     store->expireRetainedMessages();
 
     std::vector<RetainedMessage> list;
-    store->getRetainedMessages(&store->retainedMessagesRoot, list);
+    std::vector<MappedRetainedMessage> mappedList;
+    store->getRetainedMessages(&store->retainedMessagesRoot, list, mappedList);
 
     QVERIFY(std::none_of(list.begin(), list.end(), [](RetainedMessage &rm) {
         return rm.publish.payload == "willexpire";
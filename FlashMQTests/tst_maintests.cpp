@@ -20,9 +20,20 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <list>
 #include <unordered_map>
 #include <sys/sysinfo.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <malloc.h>
 #include <fstream>
+#include <thread>
+#include <algorithm>
 
 #include "utils.h"
+#include "flatmap.h"
+#include "aclcache.h"
+#include "timerwheel.h"
+#include "durationhistogram.h"
+#include "shardedcounter.h"
+#include "globalstats.h"
 
 MainTests::MainTests()
 {
@@ -901,6 +912,88 @@ void MainTests::testRetainedMessageDB()
     }
 }
 
+/**
+ * @brief MainTests::testRetainedMessageDBCorrupt tests that the messages before a damaged block are still loaded, and that a damaged
+ * header or checksum table makes the file unusable. Either way, the file is moved aside.
+ */
+void MainTests::testRetainedMessageDBCorrupt()
+{
+    FlashMQTempDir tempDir;
+    const std::string dbPath = tempDir.getPath() + "/retained.db";
+
+    auto save = [&]() {
+        std::vector<RetainedMessage> messages;
+
+        // Enough to be parsed by multiple threads, and to be several blocks.
+        for (int i = 0; i < 10000; i++)
+            messages.emplace_back(Publish(formatString("corrupt/%d", i), formatString("payload %d", i), 1));
+
+        RetainedMessagesDB db(dbPath);
+        db.openWrite();
+        db.saveData(messages);
+        db.closeFile();
+    };
+
+    auto damage = [&](size_t offset, char c) {
+        std::fstream file(dbPath, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(offset);
+        file.put(c);
+    };
+
+    auto load = [&]() {
+        RetainedMessagesDB db(dbPath);
+        db.openRead();
+        return db.readData();
+    };
+
+    // Whatever is loaded must be the messages from the start, in order.
+    auto verifyLoaded = [&](const std::list<RetainedMessage> &messages) {
+        int i = 0;
+        for (const RetainedMessage &rm : messages)
+        {
+            QCOMPARE(rm.publish.topic, formatString("corrupt/%d", i));
+            QCOMPARE(rm.publish.payload, formatString("payload %d", i));
+            i++;
+        }
+    };
+
+    auto loadAndExpectCorrupt = [&]() {
+        try
+        {
+            load();
+            QVERIFY2(false, "We should have run into an exception.");
+        }
+        catch (std::exception &ex)
+        {
+            QVERIFY(std::string(ex.what()).find("is corrupt") != std::string::npos);
+        }
+
+        QVERIFY(getFileSize(dbPath) < 0);
+    };
+
+    save();
+    const std::list<RetainedMessage> all = load();
+    MYCASTCOMPARE(all.size(), 10000);
+    verifyLoaded(all);
+
+    // The last bytes are the checksum table.
+    damage(getFileSize(dbPath) - 1, 'X');
+    loadAndExpectCorrupt();
+
+    // The block size.
+    save();
+    damage(MAGIC_STRING_LENGH + 3, 0x7F);
+    loadAndExpectCorrupt();
+
+    save();
+    damage(TOTAL_HEADER_SIZE + 200000, 'X');
+    const std::list<RetainedMessage> partial = load();
+    QVERIFY(partial.size() > 1000);
+    QVERIFY(partial.size() < 10000);
+    verifyLoaded(partial);
+    QVERIFY(getFileSize(dbPath) < 0);
+}
+
 void MainTests::testRetainedMessageDBNotPresent()
 {
     try
@@ -949,6 +1042,277 @@ void MainTests::testRetainedMessageDBEmptyList()
     }
 }
 
+/**
+ * @brief MainTests::testRetainedMessagesWal tests that the changes after the last save of the DB are recovered from the log, that
+ * compacting removes the old log, and benchmarks the recovery.
+ */
+void MainTests::testRetainedMessagesWal()
+{
+    FlashMQTempDir tempDir;
+    const std::string dbPath = tempDir.getPath() + "/retained.db";
+    GlobalStats *globalStats = GlobalStats::getInstance();
+    const uint64_t walBytesBefore = globalStats->retainedMessagesWalBytesWritten.get();
+    const uint64_t dbBytesBefore = globalStats->retainedMessagesDbBytesWritten.get();
+
+    auto setRetained = [](SubscriptionStore &store, const std::string &topic, const std::string &payload) {
+        Publish p(topic, payload, 1);
+        p.retain = true;
+        store.setRetainedMessage(p, p.getSubtopics());
+    };
+
+    {
+        SubscriptionStore store;
+        store.startRetainedMessagesWal(dbPath);
+
+        for (int i = 0; i < 100; i++)
+            setRetained(store, formatString("wal/%d", i), "first");
+
+        store.saveRetainedMessages(dbPath);
+        MYCASTCOMPARE(RetainedMessagesWal::findFiles(dbPath).size(), 1);
+
+        for (int round = 0; round < 10; round++)
+        {
+            for (int i = 0; i < 100; i++)
+                setRetained(store, formatString("wal/%d", i), formatString("round %d", round));
+        }
+
+        setRetained(store, "wal/0", "");
+
+        // The $SYS topics are not saved, so not logged either.
+        setRetained(store, "$SYS/wal", "not logged");
+
+        store.syncRetainedMessagesWal();
+
+        // Not saving the DB again, like a crash.
+    }
+
+    {
+        SubscriptionStore store;
+        store.loadRetainedMessages(dbPath);
+
+        MYCASTCOMPARE(store.getRetainedMessageCount(), 99);
+
+        std::vector<RetainedMessage> messages;
+        std::vector<MappedRetainedMessage> mappedMessages;
+        store.getRetainedMessages(&store.retainedMessagesRoot, messages, mappedMessages);
+        MYCASTCOMPARE(messages.size(), 99);
+
+        for (const RetainedMessage &rm : messages)
+        {
+            QVERIFY(rm.publish.topic != "wal/0");
+            QCOMPARE(rm.publish.payload, std::string("round 9"));
+        }
+
+        std::vector<RetainedMessage> dollarMessages;
+        store.getRetainedMessages(&store.retainedMessagesRootDollar, dollarMessages, mappedMessages);
+        QVERIFY(dollarMessages.empty());
+
+        store.startRetainedMessagesWal(dbPath);
+        MYCASTCOMPARE(RetainedMessagesWal::findFiles(dbPath).size(), 2);
+
+        store.saveRetainedMessages(dbPath);
+        MYCASTCOMPARE(RetainedMessagesWal::findFiles(dbPath).size(), 1);
+    }
+
+    const uint64_t walBytes = globalStats->retainedMessagesWalBytesWritten.get() - walBytesBefore;
+    const uint64_t dbBytes = globalStats->retainedMessagesDbBytesWritten.get() - dbBytesBefore;
+    QVERIFY(walBytes > 0);
+    QVERIFY(dbBytes > 0);
+
+    // The log has the 1100 changes once, and the DB was saved twice with about 100 messages.
+    const double amplification = static_cast<double>(walBytes + dbBytes) / walBytes;
+    QVERIFY(amplification < 1.5);
+
+    SubscriptionStore store;
+    store.loadRetainedMessages(dbPath);
+    MYCASTCOMPARE(store.getRetainedMessageCount(), 99);
+
+    // Changes after compacting end up in the new log, and are replayed over the compacted DB.
+    store.startRetainedMessagesWal(dbPath);
+    setRetained(store, "wal/1", "after compacting");
+    store.syncRetainedMessagesWal();
+
+    QBENCHMARK
+    {
+        SubscriptionStore recovered;
+        recovered.loadRetainedMessages(dbPath);
+        MYCASTCOMPARE(recovered.getRetainedMessageCount(), 99);
+    }
+
+    SubscriptionStore recovered;
+    recovered.loadRetainedMessages(dbPath);
+
+    std::vector<RetainedMessage> messages;
+    std::vector<MappedRetainedMessage> mappedMessages;
+    recovered.getRetainedMessages(&recovered.retainedMessagesRoot, messages, mappedMessages);
+    auto pos = std::find_if(messages.begin(), messages.end(), [](const RetainedMessage &rm) { return rm.publish.topic == "wal/1"; });
+    QVERIFY(pos != messages.end());
+    QCOMPARE(pos->publish.payload, std::string("after compacting"));
+}
+
+/**
+ * @brief MainTests::testRetainedMessagesWalWriteFailure makes writing the log fail halfway, by limiting the file size, and tests that the
+ * next sync continues where it stopped, so all changes are replayed, in order.
+ */
+void MainTests::testRetainedMessagesWalWriteFailure()
+{
+    FlashMQTempDir tempDir;
+    const std::string dbPath = tempDir.getPath() + "/retained.db";
+
+    auto setRetained = [](SubscriptionStore &store, const std::string &topic, const std::string &payload) {
+        Publish p(topic, payload, 1);
+        p.retain = true;
+        store.setRetainedMessage(p, p.getSubtopics());
+    };
+
+    {
+        SubscriptionStore store;
+        store.startRetainedMessagesWal(dbPath);
+
+        for (int i = 0; i < 100; i++)
+            setRetained(store, formatString("wal/%d", i), "first");
+
+        store.syncRetainedMessagesWal();
+
+        const std::vector<std::pair<uint64_t, std::string>> files = RetainedMessagesWal::findFiles(dbPath);
+        MYCASTCOMPARE(files.size(), 1);
+        const ssize_t walSize = getFileSize(files.front().second);
+        QVERIFY(walSize > 0);
+
+        for (int i = 0; i < 100; i++)
+            setRetained(store, formatString("wal/%d", i), "second");
+
+        struct rlimit oldLimit;
+        QVERIFY(getrlimit(RLIMIT_FSIZE, &oldLimit) == 0);
+        struct rlimit limit = oldLimit;
+        limit.rlim_cur = walSize + 1001;
+        auto oldHandler = signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limit);
+
+        bool failed = false;
+
+        try
+        {
+            store.syncRetainedMessagesWal();
+        }
+        catch (std::exception &)
+        {
+            failed = true;
+        }
+
+        setrlimit(RLIMIT_FSIZE, &oldLimit);
+        signal(SIGXFSZ, oldHandler);
+
+        QVERIFY(failed);
+        QCOMPARE(getFileSize(files.front().second), walSize + 1001);
+
+        for (int i = 0; i < 50; i++)
+            setRetained(store, formatString("wal/%d", i), "third");
+
+        store.syncRetainedMessagesWal();
+    }
+
+    SubscriptionStore store;
+    store.loadRetainedMessages(dbPath);
+    MYCASTCOMPARE(store.getRetainedMessageCount(), 100);
+
+    std::vector<RetainedMessage> messages;
+    std::vector<MappedRetainedMessage> mappedMessages;
+    store.getRetainedMessages(&store.retainedMessagesRoot, messages, mappedMessages);
+    MYCASTCOMPARE(messages.size(), 100);
+
+    for (const RetainedMessage &rm : messages)
+    {
+        const int i = std::stoi(rm.publish.topic.substr(4));
+        QCOMPARE(rm.publish.payload, std::string(i < 50 ? "third" : "second"));
+    }
+}
+
+void MainTests::testRetainedMessagesLazyLoading()
+{
+    FlashMQTempDir tempDir;
+    const std::string dbPath = tempDir.getPath() + "/retained.db";
+
+    auto setRetained = [](SubscriptionStore &store, const std::string &topic, const std::string &payload) {
+        Publish p(topic, payload, 1);
+        p.retain = true;
+        store.setRetainedMessage(p, p.getSubtopics());
+    };
+
+    auto getRetained = [](SubscriptionStore &store, const std::string &topic) {
+        std::vector<std::string> subtopics;
+        splitTopic(topic, subtopics);
+        std::forward_list<Publish> packetList;
+        int count = 0;
+        SubscriptionStore::giveClientRetainedMessagesRecursively(subtopics.begin(), subtopics.end(), &store.retainedMessagesRoot, false,
+                                                                 packetList, count);
+        std::map<std::string, std::string> result;
+        for (const Publish &p : packetList)
+            result[p.topic] = p.payload;
+        return result;
+    };
+
+    {
+        SubscriptionStore store;
+
+        for (int i = 0; i < 50; i++)
+            setRetained(store, formatString("lazy/%d", i), formatString("payload %d", i));
+
+        store.saveRetainedMessages(dbPath);
+    }
+
+    ConfFileTemp confFile;
+    confFile.writeLine("retained_messages_lazy_loading true");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    SubscriptionStore store;
+    store.loadRetainedMessages(dbPath);
+    MYCASTCOMPARE(store.getRetainedMessageCount(), 50);
+
+    {
+        std::vector<RetainedMessage> messages;
+        std::vector<MappedRetainedMessage> mappedMessages;
+        store.getRetainedMessages(&store.retainedMessagesRoot, messages, mappedMessages);
+        QVERIFY(messages.empty());
+        MYCASTCOMPARE(mappedMessages.size(), 50);
+    }
+
+    std::map<std::string, std::string> retained = getRetained(store, "lazy/#");
+    MYCASTCOMPARE(retained.size(), 50);
+    QCOMPARE(retained["lazy/7"], std::string("payload 7"));
+
+    setRetained(store, "lazy/1", "changed");
+    setRetained(store, "lazy/2", "");
+    MYCASTCOMPARE(store.getRetainedMessageCount(), 49);
+
+    {
+        std::vector<RetainedMessage> messages;
+        std::vector<MappedRetainedMessage> mappedMessages;
+        store.getRetainedMessages(&store.retainedMessagesRoot, messages, mappedMessages);
+        MYCASTCOMPARE(messages.size(), 1);
+        MYCASTCOMPARE(mappedMessages.size(), 48);
+    }
+
+    // This replaces the mapped file, but the mapping stays valid.
+    store.saveRetainedMessages(dbPath);
+    QCOMPARE(getRetained(store, "lazy/3")["lazy/3"], std::string("payload 3"));
+
+    SubscriptionStore reloaded;
+    reloaded.loadRetainedMessages(dbPath);
+    MYCASTCOMPARE(reloaded.getRetainedMessageCount(), 49);
+
+    retained = getRetained(reloaded, "lazy/+");
+    MYCASTCOMPARE(retained.size(), 49);
+    QCOMPARE(retained["lazy/1"], std::string("changed"));
+    QCOMPARE(retained["lazy/49"], std::string("payload 49"));
+    QVERIFY(retained.find("lazy/2") == retained.end());
+}
+
 void MainTests::testSavingSessions()
 {
     try
@@ -1078,6 +1442,209 @@ void MainTests::testSavingSessions()
     }
 }
 
+/**
+ * @brief MainTests::testSavingSessionsInSections saves enough to need several sections of sessions and of subscriptions, written by multiple threads.
+ */
+void MainTests::testSavingSessionsInSections()
+{
+    try
+    {
+        Settings settings;
+        PluginLoader pluginLoader;
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+        Authentication auth(settings);
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        const int sessionCount = 3000;
+        const int subscriptionsPerSession = 10;
+        const std::string payload(1000, 'x');
+        std::vector<std::shared_ptr<Session>> sessions;
+        std::vector<std::string> subtopics;
+
+        for (int i = 0; i < sessionCount; i++)
+        {
+            std::shared_ptr<Client> c(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+            c->setClientProperties(ProtocolVersion::Mqtt5, formatString("c%d", i), "user", true, 60);
+            store->registerClientAndKickExistingOne(c, false, 512, 600);
+
+            for (int j = 0; j < subscriptionsPerSession; j++)
+            {
+                splitTopic(formatString("topic/%d/%d", j, i), subtopics);
+                store->addSubscription(c, subtopics, 1);
+            }
+
+            std::shared_ptr<Session> ses = c->getSession();
+            sessions.push_back(ses);
+            c.reset();
+
+            Publish publish("a/b/c", payload, 1);
+            MqttPacket publishPacket(ProtocolVersion::Mqtt5, publish);
+            PublishCopyFactory fac(&publishPacket);
+            ses->writePacket(fac, 1);
+        }
+
+        store->saveSessionsAndSubscriptions("/tmp/flashmqtests_sessions_sections.db");
+
+        std::shared_ptr<SubscriptionStore> store2(new SubscriptionStore());
+        store2->loadSessionsAndSubscriptions("/tmp/flashmqtests_sessions_sections.db");
+
+        MYCASTCOMPARE(store2->sessionsById.size(), sessionCount);
+
+        for (const std::shared_ptr<Session> &ses : sessions)
+        {
+            std::shared_ptr<Session> &ses2 = store2->sessionsById[ses->getClientId()];
+            QVERIFY(ses2);
+            MYCASTCOMPARE(ses2->qosPacketQueue.size(), 1);
+            QCOMPARE(ses2->qosPacketQueue.next()->getPublish().payload, payload);
+        }
+
+        std::unordered_map<std::string, std::list<SubscriptionForSerializing>> store2Subscriptions;
+        store2->getSubscriptions(&store2->root, "", true, store2Subscriptions);
+
+        MYCASTCOMPARE(store2Subscriptions.size(), sessionCount * subscriptionsPerSession);
+
+        for (auto &pair : store2Subscriptions)
+        {
+            MYCASTCOMPARE(pair.second.size(), 1);
+            QCOMPARE(pair.second.front().qos, 1);
+        }
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testSessionsDBDamaged tests that a damaged block makes the whole sessions file corrupt, instead of loading the sessions
+ * before it, without their subscriptions.
+ */
+void MainTests::testSessionsDBDamaged()
+{
+    try
+    {
+        Settings settings;
+        PluginLoader pluginLoader;
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+        std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+        Authentication auth(settings);
+        ThreadGlobals::assign(&auth);
+        ThreadGlobals::assignThreadData(t.get());
+
+        FlashMQTempDir tempDir;
+        const std::string dbPath = tempDir.getPath() + "/sessions.db";
+        std::vector<std::string> subtopics;
+
+        // Enough to be several blocks.
+        for (int i = 0; i < 1000; i++)
+        {
+            std::shared_ptr<Client> c(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+            c->setClientProperties(ProtocolVersion::Mqtt5, formatString("damaged%d", i), "user", true, 60);
+            store->registerClientAndKickExistingOne(c, false, 512, 600);
+
+            splitTopic(formatString("damaged/%d", i), subtopics);
+            store->addSubscription(c, subtopics, 1);
+
+            std::shared_ptr<Session> ses = c->getSession();
+            c.reset();
+
+            Publish publish("damaged", std::string(200, 'x'), 1);
+            MqttPacket publishPacket(ProtocolVersion::Mqtt5, publish);
+            PublishCopyFactory fac(&publishPacket);
+            ses->writePacket(fac, 1);
+        }
+
+        store->saveSessionsAndSubscriptions(dbPath);
+        QVERIFY(getFileSize(dbPath) > 2 * 64 * 1024);
+
+        {
+            std::fstream file(dbPath, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(TOTAL_HEADER_SIZE + 100000);
+            file.put('X');
+        }
+
+        try
+        {
+            SessionsAndSubscriptionsDB db(dbPath);
+            db.openRead();
+            db.readData();
+            QVERIFY2(false, "We should have run into an exception.");
+        }
+        catch (std::exception &ex)
+        {
+            QVERIFY(std::string(ex.what()).find("is corrupt") != std::string::npos);
+        }
+
+        QVERIFY(getFileSize(dbPath) < 0);
+    }
+    catch (std::exception &ex)
+    {
+        QVERIFY2(false, ex.what());
+    }
+}
+
+/**
+ * @brief MainTests::testSaveStateInChildProcess saves a running server's state in a forked child, and checks it by loading the files.
+ */
+void MainTests::testSaveStateInChildProcess()
+{
+    FlashMQTempDir storageDir;
+
+    ConfFileTemp confFile;
+    confFile.writeLine(formatString("storage_dir %s", storageDir.getPath().c_str()));
+    confFile.writeLine("save_state_in_child_process yes");
+    confFile.writeLine("allow_anonymous yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect){
+        connect.clientid = "ForkReceiver";
+    });
+    receiver.subscribe("fork/#", 1);
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+    Publish pub("fork/retained", "forked", 1);
+    pub.retain = true;
+    sender.publish(pub);
+
+    GlobalStats *globalStats = GlobalStats::getInstance();
+    const uint64_t forksBefore = globalStats->saveStateForkPause.getCount();
+
+    mainApp->saveState();
+
+    MYCASTCOMPARE(globalStats->saveStateForkPause.getCount(), forksBefore + 1);
+
+    std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+    store->loadRetainedMessages(storageDir.getPath() + "/retained.db");
+    store->loadSessionsAndSubscriptions(storageDir.getPath() + "/sessions.db");
+
+    std::vector<RetainedMessage> retained;
+    std::vector<MappedRetainedMessage> mappedRetained;
+    store->getRetainedMessages(&store->retainedMessagesRoot, retained, mappedRetained);
+    MYCASTCOMPARE(retained.size(), 1);
+    QCOMPARE(retained.front().publish.topic, "fork/retained");
+    QCOMPARE(retained.front().publish.payload, "forked");
+
+    QVERIFY(store->sessionsById.find("ForkReceiver") != store->sessionsById.end());
+
+    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptions;
+    store->getSubscriptions(&store->root, "", true, subscriptions);
+    MYCASTCOMPARE(subscriptions["fork/#"].size(), 1);
+    QCOMPARE(subscriptions["fork/#"].front().clientId, "ForkReceiver");
+}
+
 void MainTests::testParsePacketHelper(const std::string &topic, uint8_t from_qos, bool retain)
 {
     Logger::getInstance()->setFlags(false, false, true);
@@ -2195,6 +2762,1119 @@ void MainTests::testPublishToItself()
 
 }
 
+/**
+ * @brief MainTests::testPublishDeliveryHelper subscribes the receivers and checks they all get the publishes of a new sender, in order.
+ * @param receivers connected clients. Each subscribes with a QoS from 0 to 'maxQos', in turn.
+ * @param topic
+ * @param payloads are published with a QoS from 0 to 'maxQos', in turn.
+ * @param maxQos
+ */
+void MainTests::testPublishDeliveryHelper(std::list<FlashMQTestClient> &receivers, const std::string &topic, const std::vector<std::string> &payloads,
+                                          uint8_t maxQos)
+{
+    int receiverIndex = 0;
+
+    for (FlashMQTestClient &receiver : receivers)
+    {
+        receiver.subscribe(topic, receiverIndex++ % (maxQos + 1));
+    }
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+
+    for (size_t i = 0; i < payloads.size(); i++)
+    {
+        sender.publish(topic, payloads.at(i), i % (maxQos + 1));
+    }
+
+    receiverIndex = 0;
+
+    for (FlashMQTestClient &receiver : receivers)
+    {
+        const uint8_t subscriptionQos = receiverIndex++ % (maxQos + 1);
+
+        receiver.waitForMessageCount(payloads.size());
+
+        MYCASTCOMPARE(receiver.receivedPublishes.size(), payloads.size());
+
+        for (size_t i = 0; i < payloads.size(); i++)
+        {
+            const MqttPacket &pack = receiver.receivedPublishes.at(i);
+            QCOMPARE(pack.getTopic(), topic);
+            QVERIFY(pack.getPayloadCopy() == payloads.at(i));
+            MYCASTCOMPARE(pack.getQos(), std::min<uint8_t>(i % (maxQos + 1), subscriptionQos));
+        }
+    }
+}
+
+/**
+ * @brief MainTests::testCrossThreadPublishBatching tests that receivers spread over several threads get everything in order when
+ * publishes for other threads are handed over in batches.
+ */
+void MainTests::testCrossThreadPublishBatching()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 4");
+    confFile.writeLine("cross_thread_publish_batching yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    std::list<FlashMQTestClient> receivers;
+
+    for (int i = 0; i < 8; i++)
+    {
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(i % 2 == 0 ? ProtocolVersion::Mqtt5 : ProtocolVersion::Mqtt311);
+    }
+
+    const std::vector<std::shared_ptr<ThreadData>> threads = mainApp->getThreads();
+
+    // Round robin puts two receivers in each thread.
+    for (const std::shared_ptr<ThreadData> &thread : threads)
+    {
+        MYCASTCOMPARE(thread->getNrOfClients(), 2);
+    }
+
+    std::vector<uint64_t> sentBefore;
+    for (const std::shared_ptr<ThreadData> &thread : threads)
+    {
+        sentBefore.push_back(thread->sentMessageCounter.get());
+    }
+
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 20; i++)
+    {
+        payloads.push_back(formatString("message %d", i));
+    }
+
+    testPublishDeliveryHelper(receivers, "batched/topic", payloads, 1);
+
+    // Sent messages are counted by the thread that writes them, which must be the thread of the receivers, not of the sender.
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        MYCASTCOMPARE(threads.at(i)->sentMessageCounter.get() - sentBefore.at(i), 2 * payloads.size());
+    }
+}
+
+/**
+ * @brief MainTests::testCrossThreadPublishUserProperties sends publishes with properties to receivers in several threads at once. Writing
+ * changes the client specific properties, so the threads can't share the property builder.
+ */
+void MainTests::testCrossThreadPublishUserProperties()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 4");
+    confFile.writeLine("cross_thread_publish_batching yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    std::list<FlashMQTestClient> receivers;
+
+    for (int i = 0; i < 12; i++)
+    {
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(ProtocolVersion::Mqtt5);
+        receiver.subscribe("props/#", 1);
+    }
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+
+    const int messageCount = 200;
+
+    for (int i = 0; i < messageCount; i++)
+    {
+        Publish pub("props/topic", formatString("message %d", i), 1);
+        pub.constructPropertyBuilder();
+        pub.setExpireAfter(300);
+        pub.propertyBuilder->writeUserProperty("mykey", formatString("myval %d", i));
+        pub.propertyBuilder->writeUserProperty("mykeyhaha", "myvalhaha");
+        sender.publish(pub);
+    }
+
+    for (FlashMQTestClient &receiver : receivers)
+    {
+        receiver.waitForMessageCount(messageCount);
+
+        MYCASTCOMPARE(receiver.receivedPublishes.size(), messageCount);
+
+        for (int i = 0; i < messageCount; i++)
+        {
+            MqttPacket &pack = receiver.receivedPublishes.at(i);
+            QCOMPARE(pack.getPayloadCopy(), formatString("message %d", i));
+
+            const std::vector<std::pair<std::string, std::string>> *properties = pack.getUserProperties();
+
+            QVERIFY(properties);
+            MYCASTCOMPARE(properties->size(), 2);
+            QCOMPARE(properties->at(0).first, "mykey");
+            QCOMPARE(properties->at(0).second, formatString("myval %d", i));
+            QCOMPARE(properties->at(1).first, "mykeyhaha");
+            QCOMPARE(properties->at(1).second, "myvalhaha");
+        }
+    }
+}
+
+/**
+ * @brief MainTests::testBatchedWriteFlushing uses one thread, so all writes to receivers are deferred to the end of the loop iteration.
+ */
+void MainTests::testBatchedWriteFlushing()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 1");
+    confFile.writeLine("batched_write_flushing yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    std::list<FlashMQTestClient> receivers;
+
+    for (int i = 0; i < 8; i++)
+    {
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(i % 2 == 0 ? ProtocolVersion::Mqtt5 : ProtocolVersion::Mqtt311);
+    }
+
+    std::shared_ptr<ThreadData> thread = mainApp->getThreads().at(0);
+    const uint64_t epollCtlsBefore = thread->epollCtlCounter.get();
+
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 20; i++)
+    {
+        payloads.push_back(formatString("message %d", i));
+    }
+
+    testPublishDeliveryHelper(receivers, "flushed/topic", payloads, 1);
+
+    // Writing without the flushing sets and clears EPOLLOUT for each write to a receiver, so that would be hundreds.
+    const uint64_t epollCtls = thread->epollCtlCounter.get() - epollCtlsBefore;
+    QVERIFY2(epollCtls < payloads.size(), formatString("%lu epoll_ctl calls", epollCtls).c_str());
+}
+
+/**
+ * @brief MainTests::testSharedPayloads sends payloads around the threshold, mixed with small ones, to see the write buffer and shared payloads stay in order.
+ */
+void MainTests::testSharedPayloads()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("shared_payload_min_bytes 1000");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    std::list<FlashMQTestClient> receivers;
+
+    for (int i = 0; i < 4; i++)
+    {
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(i % 2 == 0 ? ProtocolVersion::Mqtt5 : ProtocolVersion::Mqtt311);
+    }
+
+    const std::vector<size_t> sizes {10, 999, 1000, 5000, 100000};
+    std::vector<std::string> payloads;
+    size_t bigPayloads = 0;
+
+    for (int i = 0; i < 20; i++)
+    {
+        const std::string &payload = payloads.emplace_back(sizes.at(i % sizes.size()), static_cast<char>('a' + i));
+
+        if (payload.size() >= 1000)
+            bigPayloads++;
+    }
+
+    testPublishDeliveryHelper(receivers, "shared/topic", payloads, 2);
+
+    uint64_t sharedPayloadCount = 0;
+    for (const std::shared_ptr<ThreadData> &thread : mainApp->getThreads())
+    {
+        sharedPayloadCount += thread->sharedPayloadCounter.get();
+    }
+
+    MYCASTCOMPARE(sharedPayloadCount, bigPayloads * receivers.size());
+}
+
+/**
+ * @brief MainTests::testIoUringBatchedSends sends small and shared payloads to many receivers in one thread, so they're sent in batches with io_uring.
+ */
+void MainTests::testIoUringBatchedSends()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 1");
+    confFile.writeLine("batched_write_flushing yes");
+    confFile.writeLine("io_uring_batched_sends yes");
+    confFile.writeLine("shared_payload_min_bytes 1000");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    std::list<FlashMQTestClient> receivers;
+
+    for (int i = 0; i < 10; i++)
+    {
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(i % 2 == 0 ? ProtocolVersion::Mqtt5 : ProtocolVersion::Mqtt311);
+    }
+
+    std::vector<std::string> payloads;
+    for (int i = 0; i < 20; i++)
+    {
+        payloads.push_back(i % 3 == 0 ? std::string(2000 + i, 'a' + i) : formatString("message %d", i));
+    }
+
+    testPublishDeliveryHelper(receivers, "uring/topic", payloads, 1);
+
+    std::shared_ptr<ThreadData> thread = mainApp->getThreads().at(0);
+
+    if (thread->ioUringUnavailable)
+        QSKIP("The kernel doesn't let us use io_uring, so the normal writes were used.");
+
+    // At least one send per receiver, or more when a batch took part of a write buffer.
+    QVERIFY(thread->ioUringSendCounter.get() >= receivers.size());
+}
+
+/**
+ * @brief MainTests::testListenSocketsPerThread connects clients that are accepted by the worker threads, and sends messages between them.
+ */
+void MainTests::testListenSocketsPerThread()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 4");
+    confFile.writeLine("listen_sockets_per_thread yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    GlobalStats *globalStats = GlobalStats::getInstance();
+    const uint64_t mainThreadConnectsBefore = globalStats->socketConnects.get();
+
+    std::list<FlashMQTestClient> receivers;
+
+    for (int i = 0; i < 12; i++)
+    {
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(ProtocolVersion::Mqtt5);
+    }
+
+    testPublishDeliveryHelper(receivers, "perthread/topic", {"hello"}, 0);
+
+    uint64_t threadConnects = 0;
+    for (const std::shared_ptr<ThreadData> &thread : mainApp->getThreads())
+    {
+        threadConnects += thread->socketConnectCounter.get();
+    }
+
+    // The receivers and the sender, all accepted by the worker threads and none by the main thread.
+    MYCASTCOMPARE(threadConnects, receivers.size() + 1);
+    MYCASTCOMPARE(globalStats->socketConnects.get(), mainThreadConnectsBefore);
+}
+
+/**
+ * @brief MainTests::testLeastLoadedThreadAssignment empties one thread, and checks new clients are given to it, where round robin would
+ * have given them to the other threads.
+ */
+void MainTests::testLeastLoadedThreadAssignment()
+{
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine("thread_count 4");
+    confFile.writeLine("client_thread_assignment least_loaded");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    const std::vector<std::shared_ptr<ThreadData>> threads = mainApp->getThreads();
+    std::list<FlashMQTestClient> receivers;
+    std::vector<size_t> threadOfReceiver;
+
+    auto connectReceiver = [&](ProtocolVersion protocolVersion) {
+        std::vector<int> countsBefore;
+        for (const std::shared_ptr<ThreadData> &thread : threads)
+        {
+            countsBefore.push_back(thread->getNrOfClients());
+        }
+
+        FlashMQTestClient &receiver = receivers.emplace_back();
+        receiver.start();
+        receiver.connectClient(protocolVersion);
+
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            if (threads.at(i)->getNrOfClients() > countsBefore.at(i))
+                return i;
+        }
+
+        return threads.size();
+    };
+
+    for (int i = 0; i < 8; i++)
+    {
+        threadOfReceiver.push_back(connectReceiver(ProtocolVersion::Mqtt5));
+    }
+
+    for (const std::shared_ptr<ThreadData> &thread : threads)
+    {
+        MYCASTCOMPARE(thread->getNrOfClients(), 2);
+    }
+
+    // Round robin would give the next clients to the first threads, so we empty the last.
+    const size_t emptiedThread = threads.size() - 1;
+
+    size_t receiverIndex = 0;
+    for (auto pos = receivers.begin(); pos != receivers.end(); receiverIndex++)
+    {
+        if (threadOfReceiver.at(receiverIndex) == emptiedThread)
+            pos = receivers.erase(pos);
+        else
+            pos++;
+    }
+
+    for (int n = 0; n < 500 && threads.at(emptiedThread)->getNrOfClients() > 0; n++)
+    {
+        usleep(10000);
+    }
+
+    MYCASTCOMPARE(threads.at(emptiedThread)->getNrOfClients(), 0);
+
+    for (int i = 0; i < 2; i++)
+    {
+        MYCASTCOMPARE(connectReceiver(ProtocolVersion::Mqtt311), emptiedThread);
+    }
+
+    testPublishDeliveryHelper(receivers, "leastloaded/topic", {"hello"}, 0);
+}
+
+void MainTests::testAclCache()
+{
+    AclCache cache;
+    AuthResult result = AuthResult::error;
+
+    QVERIFY(!cache.enabled());
+
+    cache.setSize(100);
+    QVERIFY(cache.enabled());
+
+    QVERIFY(!cache.get("clientid", "user", "one/two", AclAccess::read, result));
+
+    cache.set("clientid", "user", "one/two", AclAccess::read, AuthResult::acl_denied);
+    cache.set("clientid", "user", "one/three", AclAccess::read, AuthResult::success);
+
+    QVERIFY(cache.get("clientid", "user", "one/two", AclAccess::read, result));
+    QCOMPARE(result, AuthResult::acl_denied);
+    QVERIFY(cache.get("clientid", "user", "one/three", AclAccess::read, result));
+    QCOMPARE(result, AuthResult::success);
+
+    QVERIFY(!cache.get("clientid", "user", "one/two", AclAccess::write, result));
+    QVERIFY(!cache.get("clientid", "otheruser", "one/two", AclAccess::read, result));
+    QVERIFY(!cache.get("otherclientid", "user", "one/two", AclAccess::read, result));
+
+    MYCASTCOMPARE(cache.hits.get(), 2);
+    MYCASTCOMPARE(cache.misses.get(), 4);
+
+    AclCache::invalidateAll();
+
+    QVERIFY(!cache.get("clientid", "user", "one/two", AclAccess::read, result));
+    QVERIFY(!cache.get("clientid", "user", "one/three", AclAccess::read, result));
+
+    // With only one place, the last one replaces the others.
+    cache.setSize(1);
+    cache.set("clientid", "user", "one/two", AclAccess::read, AuthResult::acl_denied);
+    cache.set("clientid", "user", "one/three", AclAccess::read, AuthResult::success);
+    QVERIFY(!cache.get("clientid", "user", "one/two", AclAccess::read, result));
+    QVERIFY(cache.get("clientid", "user", "one/three", AclAccess::read, result));
+    QCOMPARE(result, AuthResult::success);
+
+    cache.setSize(0);
+    QVERIFY(!cache.enabled());
+}
+
+/**
+ * @brief MainTests::testPreauthorizeLiteralSubscriptions tests that subscriptions without wildcards that are authorized at subscribe time
+ * get what they're allowed to read, also after the authorization is invalidated, and nothing else.
+ */
+void MainTests::testPreauthorizeLiteralSubscriptions()
+{
+    ConfFileTemp aclFile;
+    aclFile.writeLine("topic readwrite open/#");
+    aclFile.writeLine("topic write closed/#");
+    aclFile.closeFile();
+
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine(formatString("mosquitto_acl_file %s", aclFile.getFilePath().c_str()));
+    confFile.writeLine("preauthorize_literal_subscriptions yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    FlashMQTestClient receiver;
+    receiver.start();
+    receiver.connectClient(ProtocolVersion::Mqtt5);
+    receiver.subscribe("open/literal", 0);
+    receiver.subscribe("closed/literal", 0);
+    receiver.subscribe("$share/group/open/shared", 0);
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+
+    for (int i = 0; i < 2; i++)
+    {
+        receiver.clearReceivedLists();
+
+        // Deliveries after the invalidation don't use the authorization from subscribe time.
+        if (i > 0)
+            AclCache::invalidateAll();
+
+        sender.publish("closed/literal", "not for you", 0);
+        sender.publish("open/literal", "hello", 0);
+        sender.publish("open/shared", "hello shared", 0);
+
+        receiver.waitForMessageCount(2);
+
+        MYCASTCOMPARE(receiver.receivedPublishes.size(), 2);
+        QCOMPARE(receiver.receivedPublishes.at(0).getTopic(), "open/literal");
+        QCOMPARE(receiver.receivedPublishes.at(0).getPayloadCopy(), "hello");
+        QCOMPARE(receiver.receivedPublishes.at(1).getTopic(), "open/shared");
+        QCOMPARE(receiver.receivedPublishes.at(1).getPayloadCopy(), "hello shared");
+    }
+}
+
+/**
+ * @brief MainTests::testPreauthorizationAfterTakeover tests that when a session is taken over with another username, the subscriptions
+ * authorized for the old one don't deliver, without dropping the preauthorizations of other sessions.
+ */
+void MainTests::testPreauthorizationAfterTakeover()
+{
+    ConfFileTemp aclFile;
+    aclFile.writeLine("topic write taken/#");
+    aclFile.writeLine("user one");
+    aclFile.writeLine("topic read taken/literal");
+    aclFile.closeFile();
+
+    ConfFileTemp confFile;
+    confFile.writeLine("allow_anonymous yes");
+    confFile.writeLine(formatString("mosquitto_acl_file %s", aclFile.getFilePath().c_str()));
+    confFile.writeLine("preauthorize_literal_subscriptions yes");
+    confFile.closeFile();
+
+    std::vector<std::string> args {"--config-file", confFile.getFilePath()};
+
+    cleanup();
+    init(args);
+
+    FlashMQTestClient other;
+    other.start();
+    other.connectClient(ProtocolVersion::Mqtt5, true, 0, [](Connect &connect) {
+        connect.username = "one";
+    });
+    other.subscribe("taken/literal", 0);
+
+    {
+        FlashMQTestClient taker;
+        taker.start();
+        taker.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect) {
+            connect.clientid = "taker";
+            connect.username = "one";
+        });
+        taker.subscribe("taken/literal", 0);
+    }
+
+    const uint32_t generation = AclCache::getGeneration();
+
+    FlashMQTestClient taker;
+    taker.start();
+    taker.connectClient(ProtocolVersion::Mqtt5, false, 120, [](Connect &connect) {
+        connect.clientid = "taker";
+        connect.username = "two";
+    });
+
+    QCOMPARE(AclCache::getGeneration(), generation);
+
+    FlashMQTestClient sender;
+    sender.start();
+    sender.connectClient(ProtocolVersion::Mqtt5);
+    sender.publish("taken/literal", "for one", 0);
+
+    other.waitForMessageCount(1);
+    MYCASTCOMPARE(other.receivedPublishes.size(), 1);
+    QCOMPARE(other.receivedPublishes.front().getTopic(), "taken/literal");
+
+    usleep(100000);
+    taker.waitForMessageCount(0);
+    QVERIFY(taker.receivedPublishes.empty());
+}
+
+/**
+ * @brief MainTests::testAclTreeManyRules tests an ACL tree with a rule file of realistic size, including changing it after checking, and
+ * benchmarks checks.
+ */
+void MainTests::testAclTreeManyRules()
+{
+    AclTree aclTree;
+
+    for (int i = 0; i < 10000; i++)
+    {
+        aclTree.addTopic(formatString("devices/%d/+/data/#", i), AclGrant::Read, AclTopicType::Strings, formatString("user%d", i % 100));
+
+        if (i % 10 == 0)
+            aclTree.addTopic(formatString("fleet/%d/cmd", i), AclGrant::Write, AclTopicType::Strings, formatString("user%d", i % 100));
+    }
+
+    aclTree.addTopic("users/%u/#", AclGrant::ReadWrite, AclTopicType::Patterns);
+    aclTree.addTopic("clients/%c/+", AclGrant::ReadWrite, AclTopicType::Patterns);
+    aclTree.compile();
+
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/105/x/data/temp", '/'), AclGrant::Read, "user5", "client5"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/105/x/data/temp", '/'), AclGrant::Write, "user5", "client5"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/106/x/data/temp", '/'), AclGrant::Read, "user5", "client5"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/105/x/data", '/'), AclGrant::Read, "user5", "client5"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("fleet/1010/cmd", '/'), AclGrant::Write, "user10", "client5"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("fleet/1010/cmd", '/'), AclGrant::Write, "user11", "client5"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("users/user5/bla", '/'), AclGrant::Write, "user5", "client5"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("users/user6/bla", '/'), AclGrant::Write, "user5", "client5"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("clients/client5/bla", '/'), AclGrant::Read, "nobody", "client5"), AuthResult::success);
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/105/x/data/temp", '/'), AclGrant::Read, "nobody", "client5"), AuthResult::acl_denied);
+
+    // Adding rules after checking has to be seen by the next check.
+    aclTree.addTopic("devices/105/x/data/temp", AclGrant::Deny, AclTopicType::Strings, "user5");
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/105/x/data/temp", '/'), AclGrant::Read, "user5", "client5"), AuthResult::acl_denied);
+    QCOMPARE(aclTree.findPermission(splitToVector("devices/105/x/data/humidity", '/'), AclGrant::Read, "user5", "client5"), AuthResult::success);
+
+    std::vector<std::vector<std::string>> topics;
+    for (int i = 0; i < 1000; i++)
+        topics.push_back(splitToVector(formatString("devices/%d/x/data/temp", (i * 37) % 10000), '/'));
+
+    int i = 0;
+    QBENCHMARK
+    {
+        aclTree.findPermission(topics[i++ % topics.size()], AclGrant::Read, "user5", "client5");
+    }
+}
+
+/**
+ * @brief MainTests::testPublishRecursivelyFanOut tests collecting the receivers of a publish on a tree with many subscribers, and benchmarks it.
+ */
+void MainTests::testPublishRecursivelyFanOut()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t.get());
+
+    const std::vector<std::string> patterns {"fan/out/topic", "fan/+/topic", "fan/#", "fan/out/other"};
+    std::vector<std::shared_ptr<Client>> clients;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        std::shared_ptr<Client> &c = clients.emplace_back(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+        c->setClientProperties(ProtocolVersion::Mqtt5, formatString("fanout%d", i), "user", true, 60);
+        store->registerClientAndKickExistingOne(c, false, 512, 120);
+
+        std::vector<std::string> subtopics;
+        splitTopic(patterns.at(i % patterns.size()), subtopics);
+        store->addSubscription(c, subtopics, i % 3);
+    }
+
+    std::vector<std::string> subtopics;
+    splitTopic("fan/out/topic", subtopics);
+    std::vector<size_t> subtopicHashes;
+    hashSubtopics(subtopics, subtopicHashes);
+
+    std::vector<ReceivingSubscriber> receivers;
+    store->publishRecursively(subtopics.begin(), subtopics.end(), subtopicHashes.begin(), &store->root, receivers, 0);
+
+    MYCASTCOMPARE(receivers.size(), 750);
+
+    for (const ReceivingSubscriber &r : receivers)
+    {
+        QVERIFY(r.session);
+        QVERIFY(r.qos <= 2);
+    }
+
+    QBENCHMARK
+    {
+        receivers.clear();
+        store->publishRecursively(subtopics.begin(), subtopics.end(), subtopicHashes.begin(), &store->root, receivers, 0);
+    }
+
+    MYCASTCOMPARE(receivers.size(), 750);
+}
+
+/**
+ * @brief MainTests::testFlatMap tests growing past the index threshold and back, because erasing moves the last element.
+ */
+void MainTests::testFlatMap()
+{
+    FlatMap<std::string, int> map;
+
+    for (int i = 0; i < 100; i++)
+    {
+        map[formatString("key%d", i)] = i;
+    }
+
+    MYCASTCOMPARE(map.size(), 100);
+    QVERIFY(!map.emplace("key5", 1000).second);
+
+    for (int i = 0; i < 100; i++)
+    {
+        auto pos = map.find(formatString("key%d", i));
+        QVERIFY(pos != map.end());
+        QCOMPARE(pos->second, i);
+    }
+
+    auto it = map.begin();
+    while (it != map.end())
+    {
+        if (it->second % 3 != 0)
+            it = map.erase(it);
+        else
+            it++;
+    }
+
+    MYCASTCOMPARE(map.size(), 34);
+
+    for (int i = 0; i < 100; i++)
+    {
+        auto pos = map.find(formatString("key%d", i));
+
+        if (i % 3 == 0)
+        {
+            QVERIFY(pos != map.end());
+            QCOMPARE(pos->second, i);
+        }
+        else
+        {
+            QVERIFY(pos == map.end());
+        }
+    }
+
+    while (map.size() > 1)
+    {
+        map.erase(map.begin());
+    }
+
+    const std::string lastKey = map.begin()->first;
+    QVERIFY(map.find(lastKey) == map.begin());
+
+    map.erase(map.begin());
+    QVERIFY(map.empty());
+    QVERIFY(map.begin() == map.end());
+
+    // The index only has hashes, so keys with the same hash must be told apart by the key, also after erasing moved them.
+    struct CollidingHash
+    {
+        size_t operator()(const std::string &) const { return 1; }
+    };
+
+    FlatMap<std::string, int, CollidingHash> collidingMap;
+
+    for (int i = 0; i < 20; i++)
+    {
+        collidingMap[formatString("key%d", i)] = i;
+    }
+
+    collidingMap.erase(collidingMap.find("key3"));
+    collidingMap.erase(collidingMap.find("key12"));
+
+    MYCASTCOMPARE(collidingMap.size(), 18);
+    QVERIFY(collidingMap.find("key3") == collidingMap.end());
+    QVERIFY(collidingMap.find("key12") == collidingMap.end());
+
+    for (int i = 0; i < 20; i++)
+    {
+        if (i == 3 || i == 12)
+            continue;
+
+        auto pos = collidingMap.find(formatString("key%d", i));
+        QVERIFY(pos != collidingMap.end());
+        QCOMPARE(pos->second, i);
+    }
+}
+
+/**
+ * @brief MainTests::testSubscriptionMemoryUsage measures the heap memory per subscription with mallinfo2(), for one session subscribing
+ * to a topic per device, and to four topics per device. The result is printed, to compare changes to the subscription tree.
+ */
+void MainTests::testSubscriptionMemoryUsage()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t.get());
+
+    const int count = 200000;
+
+    for (int variant = 0; variant < 2; variant++)
+    {
+        std::shared_ptr<SubscriptionStore> store(new SubscriptionStore());
+
+        std::shared_ptr<Client> c(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+        c->setClientProperties(ProtocolVersion::Mqtt5, "memoryuser", "user", true, 60);
+        store->registerClientAndKickExistingOne(c, false, 512, 120);
+
+        std::vector<std::string> subtopics;
+
+        const struct mallinfo2 before = mallinfo2();
+
+        for (int i = 0; i < count; i++)
+        {
+            const std::string topic = variant == 0 ? formatString("devices/%d/telemetry", i) : formatString("devices/%d/sensor%d", i / 4, i % 4);
+            splitTopic(topic, subtopics);
+            store->addSubscription(c, subtopics, 0);
+        }
+
+        const struct mallinfo2 after = mallinfo2();
+
+        const size_t bytes = (after.uordblks + after.hblkhd) - (before.uordblks + before.hblkhd);
+        const double bytesPerSubscription = static_cast<double>(bytes) / count;
+
+        qDebug() << (variant == 0 ? "devices/<n>/telemetry:" : "devices/<n/4>/sensor<0-3>:") << bytesPerSubscription << "bytes per subscription";
+
+        QVERIFY(bytesPerSubscription > 0);
+        QVERIFY(bytesPerSubscription < 600);
+    }
+}
+
+/**
+ * @brief MainTests::testTimerWheel tests expiry order over all levels of the wheel, cancelling, adding from a callback and the handoff.
+ */
+void MainTests::testTimerWheel()
+{
+    TimerWheel<int> wheel;
+    const uint64_t start = TimerWheelBase::now();
+
+    // From within a level 0 slot to beyond the reach of the top level.
+    const std::vector<uint64_t> delays {0, 1, 63, 64, 65, 4095, 4096, 300000, 86400000, 100000000000};
+    std::vector<uint64_t> handles;
+
+    for (size_t i = 0; i < delays.size(); i++)
+    {
+        int value = static_cast<int>(i);
+        handles.push_back(wheel.add(start + delays.at(i), std::move(value)));
+    }
+
+    int expired = 70;
+    wheel.add(start - 1000, std::move(expired));
+
+    MYCASTCOMPARE(wheel.size(), delays.size() + 1);
+
+    QVERIFY(wheel.cancel(handles.at(2)));
+    QVERIFY(!wheel.cancel(handles.at(2)));
+    MYCASTCOMPARE(wheel.size(), delays.size());
+
+    std::vector<int> fired;
+    auto collect = [&](int &i) { fired.push_back(i); };
+
+    // Within a tick, the order is not defined.
+    wheel.advance(start + 64, collect);
+    std::sort(fired.begin(), fired.begin() + 2);
+    QVERIFY(fired == std::vector<int>({0, 70, 1, 3}));
+
+    fired.clear();
+    wheel.advance(start + 4096, collect);
+    QVERIFY(fired == std::vector<int>({4, 5, 6}));
+
+    // Adding from the callback, for a tick that's already passed, is done the next time.
+    fired.clear();
+    wheel.advance(start + 86400000, [&](int &i) {
+        fired.push_back(i);
+        int again = i + 100;
+        if (i < 100)
+            wheel.add(start, std::move(again));
+    });
+    QVERIFY(fired == std::vector<int>({7, 8}));
+
+    fired.clear();
+    wheel.advance(start + 86400001, collect);
+    std::sort(fired.begin(), fired.end());
+    QVERIFY(fired == std::vector<int>({107, 108}));
+
+    QVERIFY(wheel.getMsTillNext(start + 86400001) > 0);
+    MYCASTCOMPARE(wheel.size(), 1);
+
+    fired.clear();
+    wheel.advance(start + 100000000000, collect);
+    QVERIFY(fired == std::vector<int>({9}));
+    QVERIFY(wheel.empty());
+    QCOMPARE(wheel.getMsTillNext(start + 100000000000), std::numeric_limits<uint32_t>::max());
+
+    // Running out of time keeps the rest for the next time, also when nothing new expired.
+    for (int i = 0; i < 100; i++)
+    {
+        int value = i;
+        wheel.add(start + 100000000001, std::move(value));
+    }
+
+    fired.clear();
+    QVERIFY(!wheel.advance(start + 100000000001, collect, std::chrono::steady_clock::now() - std::chrono::seconds(1)));
+    QVERIFY(fired.empty());
+    QCOMPARE(wheel.getMsTillNext(start + 100000000001), static_cast<uint32_t>(0));
+    QVERIFY(wheel.advance(start + 100000000001, collect));
+    MYCASTCOMPARE(fired.size(), 100);
+    QVERIFY(wheel.empty());
+
+    TimerHandoff<int> handoff;
+    const uint64_t later = start + 100000000010;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&handoff, later, t]() {
+            for (int i = 0; i < 1000; i++)
+            {
+                int value = t * 1000 + i;
+                handoff.push(later, std::move(value));
+            }
+        });
+    }
+
+    for (std::thread &t : threads)
+        t.join();
+
+    handoff.moveInto(wheel);
+    QVERIFY(handoff.empty());
+    MYCASTCOMPARE(wheel.size(), 4000);
+
+    fired.clear();
+    wheel.advance(later, collect);
+    std::sort(fired.begin(), fired.end());
+    MYCASTCOMPARE(fired.size(), 4000);
+    QCOMPARE(fired.front(), 0);
+    QCOMPARE(fired.back(), 3999);
+}
+
+/**
+ * @brief MainTests::testDurationHistogram tests that percentiles are the upper bound of the power of two bucket, capped by the maximum.
+ */
+void MainTests::testDurationHistogram()
+{
+    DurationHistogram histogram;
+
+    QCOMPARE(histogram.getPercentileMicroseconds(50), static_cast<uint64_t>(0));
+
+    for (int i = 0; i < 98; i++)
+    {
+        histogram.record(std::chrono::microseconds(100));
+    }
+
+    histogram.record(std::chrono::nanoseconds(10));
+    histogram.record(std::chrono::milliseconds(5));
+
+    MYCASTCOMPARE(histogram.getCount(), 100);
+    MYCASTCOMPARE(histogram.getMaxMicroseconds(), 5000);
+    MYCASTCOMPARE(histogram.getPercentileMicroseconds(1), 1);
+    MYCASTCOMPARE(histogram.getPercentileMicroseconds(50), 128);
+    MYCASTCOMPARE(histogram.getPercentileMicroseconds(99), 128);
+    MYCASTCOMPARE(histogram.getPercentileMicroseconds(100), 5000);
+}
+
+/**
+ * @brief MainTests::testSubscriptionTreeSweep tests that the sweep removes the empty nodes over several slices, and keeps the ones leading to subscribers.
+ */
+void MainTests::testSubscriptionTreeSweep()
+{
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t.get());
+
+    std::shared_ptr<Client> c1(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+    c1->setClientProperties(ProtocolVersion::Mqtt5, "clientid1", "user1", true, 60);
+
+    std::shared_ptr<Client> c2(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+    c2->setClientProperties(ProtocolVersion::Mqtt5, "clientid2", "user2", true, 60);
+
+    std::shared_ptr<Session> live = std::make_shared<Session>();
+    live->assignActiveConnection(c1);
+
+    std::shared_ptr<Session> gone = std::make_shared<Session>();
+    gone->assignActiveConnection(c2);
+
+    SubscriptionNode root("root");
+    root.getOrMakeChildren("a")->getOrMakeChildren("b")->addSubscriber(live, 0, "");
+
+    SubscriptionNode *x = root.getOrMakeChildren("x");
+    for (int i = 0; i < 200; i++)
+    {
+        x->getOrMakeChildren(std::to_string(i))->getOrMakeChildren("y")->addSubscriber(gone, 0, "");
+    }
+    x->getOrMakeChildren("100")->getOrMakeChildren("z")->addSubscriber(live, 1, "");
+
+    root.childrenPlus = std::make_unique<SubscriptionNode>("+");
+    root.childrenPlus->addSubscriber(gone, 0, "share");
+
+    gone.reset();
+
+    SubscriptionTreeSweep sweep;
+    sweep.start({&root});
+
+    // A deadline in the past makes each slice as short as it can be.
+    int slices = 0;
+    size_t reclaimed = 0;
+    while (sweep.running())
+    {
+        reclaimed += sweep.advance(std::chrono::steady_clock::now() - std::chrono::seconds(1));
+        slices++;
+        QVERIFY(slices < 1000);
+    }
+
+    QVERIFY(slices > 1);
+    MYCASTCOMPARE(reclaimed, 200 + 199 + 1);
+    MYCASTCOMPARE(sweep.getReclaimed(), reclaimed);
+
+    QVERIFY(!root.childrenPlus);
+    MYCASTCOMPARE(root.children.size(), 2);
+    QVERIFY(root.getChildren("a")->getChildren("b") != nullptr);
+    MYCASTCOMPARE(x->children.size(), 1);
+    SubscriptionNode *hundred = x->getChildren("100");
+    QVERIFY(hundred != nullptr);
+    MYCASTCOMPARE(hundred->children.size(), 1);
+    MYCASTCOMPARE(hundred->getChildren("z")->getSubscribers().size(), 1);
+
+    // Once the last subscriber is gone, a next sweep removes the rest.
+    live.reset();
+    sweep.start({&root});
+    sweep.advance(std::chrono::steady_clock::time_point::max());
+    QVERIFY(!sweep.running());
+    MYCASTCOMPARE(sweep.getReclaimed(), 5);
+    QVERIFY(root.children.empty());
+}
+
+/**
+ * @brief MainTests::testSubscriptionCounts tests that the counts kept as subscriptions change are what walking the tree would give.
+ */
+void MainTests::testSubscriptionCounts()
+{
+    {
+        ShardedCounter counter;
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t < 4; t++)
+        {
+            threads.emplace_back([&counter]() {
+                for (int i = 0; i < 1000; i++)
+                    counter.add(1);
+                for (int i = 0; i < 500; i++)
+                    counter.add(-1);
+            });
+        }
+
+        for (std::thread &t : threads)
+            t.join();
+
+        MYCASTCOMPARE(counter.get(), 2000);
+    }
+
+    Settings settings;
+    PluginLoader pluginLoader;
+    std::shared_ptr<ThreadData> t(new ThreadData(0, settings, pluginLoader));
+
+    Authentication auth(settings);
+    ThreadGlobals::assign(&auth);
+    ThreadGlobals::assignThreadData(t.get());
+
+    std::shared_ptr<Client> c1(new Client(0, t, nullptr, false, false, nullptr, settings, false));
+    c1->setClientProperties(ProtocolVersion::Mqtt5, "clientid1", "user1", true, 60);
+
+    GlobalStats *globalStats = GlobalStats::getInstance();
+    const int64_t subscriptionsBefore = globalStats->subscriptions.get();
+    const int64_t groupsBefore = globalStats->sharedSubscriptionGroups.get();
+
+    std::shared_ptr<Session> ses = std::make_shared<Session>();
+    ses->assignActiveConnection(c1);
+
+    SubscriptionNode root("root");
+    SubscriptionNode *a = root.getOrMakeChildren("a");
+    SubscriptionNode *b = root.getOrMakeChildren("b");
+
+    a->addSubscriber(ses, 0, "");
+    b->addSubscriber(ses, 0, "");
+    b->addSubscriber(ses, 0, "share1");
+    b->addSubscriber(ses, 0, "share2");
+    MYCASTCOMPARE(globalStats->subscriptions.get() - subscriptionsBefore, 4);
+    MYCASTCOMPARE(globalStats->sharedSubscriptionGroups.get() - groupsBefore, 2);
+
+    // Subscribing again replaces.
+    a->addSubscriber(ses, 1, "");
+    b->addSubscriber(ses, 1, "share1");
+    MYCASTCOMPARE(globalStats->subscriptions.get() - subscriptionsBefore, 4);
+
+    a->removeSubscriber(ses, "");
+    a->removeSubscriber(ses, "");
+    b->removeSubscriber(ses, "share2");
+    MYCASTCOMPARE(globalStats->subscriptions.get() - subscriptionsBefore, 2);
+
+    // A new session of the same client takes over the place of the old one.
+    std::shared_ptr<Session> ses2 = std::make_shared<Session>();
+    ses2->assignActiveConnection(c1);
+    b->addSubscriber(ses2, 0, "");
+    MYCASTCOMPARE(globalStats->subscriptions.get() - subscriptionsBefore, 2);
+
+    ses.reset();
+    MYCASTCOMPARE(globalStats->subscriptions.get() - subscriptionsBefore, 1);
+
+    ses2.reset();
+    MYCASTCOMPARE(globalStats->subscriptions.get() - subscriptionsBefore, 0);
+
+    MYCASTCOMPARE(globalStats->sharedSubscriptionGroups.get() - groupsBefore, 2);
+
+    SubscriptionTreeSweep sweep;
+    sweep.start({&root});
+    sweep.advance(std::chrono::steady_clock::time_point::max());
+    MYCASTCOMPARE(globalStats->sharedSubscriptionGroups.get() - groupsBefore, 0);
+    QVERIFY(root.children.empty());
+}
+
 int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
@@ -47,6 +47,8 @@ class MainTests : public QObject
     std::shared_ptr<ThreadData> dummyThreadData;
 
     void testParsePacketHelper(const std::string &topic, uint8_t from_qos, bool retain);
+    void testPublishDeliveryHelper(std::list<FlashMQTestClient> &receivers, const std::string &topic, const std::vector<std::string> &payloads,
+                                   uint8_t maxQos);
 
 public:
     MainTests();
@@ -101,9 +103,16 @@ private slots:
 
     void testRetainedMessageDB();
     void testRetainedMessageDBNotPresent();
+    void testRetainedMessageDBCorrupt();
     void testRetainedMessageDBEmptyList();
+    void testRetainedMessagesWal();
+    void testRetainedMessagesWalWriteFailure();
+    void testRetainedMessagesLazyLoading();
 
     void testSavingSessions();
+    void testSavingSessionsInSections();
+    void testSessionsDBDamaged();
+    void testSaveStateInChildProcess();
 
     void testParsePacket();
 
@@ -184,6 +193,7 @@ private slots:
     void testPluginGetClientAddress();
     void testChangePublish();
     void testClientRemovalByPlugin();
+    void testWillDuringBatchedFlush();
     void testSubscriptionRemovalByPlugin();
     void testPublishByPlugin();
     void testWillDenialByPlugin();
@@ -191,6 +201,27 @@ private slots:
     void testAsyncCurl();
 
     void testPublishToItself();
+
+    void testCrossThreadPublishBatching();
+    void testCrossThreadPublishUserProperties();
+    void testPublishRecursivelyFanOut();
+    void testFlatMap();
+    void testSubscriptionMemoryUsage();
+    void testTimerWheel();
+    void testDurationHistogram();
+    void testSubscriptionTreeSweep();
+    void testSubscriptionCounts();
+    void testBatchedWriteFlushing();
+    void testSharedPayloads();
+    void testIoUringBatchedSends();
+    void testListenSocketsPerThread();
+    void testLeastLoadedThreadAssignment();
+    void testAclCache();
+    void testPreauthorizeLiteralSubscriptions();
+    void testPreauthorizationAfterTakeover();
+    void testAclTreeManyRules();
+    void testAsyncAclCheck();
+    void testCheckBatch();
 };
 
 
@@ -0,0 +1,99 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "aclcache.h"
+
+#include <functional>
+#include <string_view>
+
+std::atomic<uint32_t> AclCache::generation = 1;
+thread_local bool AclCache::pluginResultCacheable = false;
+
+uint64_t AclCache::getHash(const std::string &clientid, const std::string &username, const std::string &topic, AclAccess access)
+{
+    std::hash<std::string_view> hasher;
+
+    uint64_t h = hasher(topic);
+    h ^= hasher(clientid) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= hasher(username) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    h ^= static_cast<uint64_t>(access) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+/**
+ * @brief AclCache::setSize makes the cache the given size, rounded up to a power of two, and empty. Does nothing when the size doesn't change.
+ * @param size 0 disables the cache.
+ */
+void AclCache::setSize(size_t size)
+{
+    if (size == requestedSize)
+        return;
+
+    requestedSize = size;
+    size_t newSize = 0;
+
+    if (size > 0)
+    {
+        newSize = 1;
+        while (newSize < size)
+            newSize <<= 1;
+    }
+
+    entries.clear();
+    entries.shrink_to_fit();
+    entries.resize(newSize);
+    mask = newSize > 0 ? newSize - 1 : 0;
+}
+
+bool AclCache::get(const std::string &clientid, const std::string &username, const std::string &topic, AclAccess access, AuthResult &result)
+{
+    const uint64_t h = getHash(clientid, username, topic, access);
+    const AclCacheEntry &e = entries[h & mask];
+
+    if (e.hash != h || e.generation != generation.load(std::memory_order_relaxed) || e.access != access || e.topic != topic
+        || e.clientid != clientid || e.username != username)
+    {
+        misses.inc();
+        return false;
+    }
+
+    hits.inc();
+    result = e.result;
+    return true;
+}
+
+void AclCache::set(const std::string &clientid, const std::string &username, const std::string &topic, AclAccess access, AuthResult result)
+{
+    const uint64_t h = getHash(clientid, username, topic, access);
+    AclCacheEntry &e = entries[h & mask];
+
+    e.hash = h;
+    e.generation = generation.load(std::memory_order_relaxed);
+    e.access = access;
+    e.result = result;
+    e.clientid = clientid;
+    e.username = username;
+    e.topic = topic;
+}
+
+/**
+ * @brief AclCache::invalidateAll makes all threads' caches forget their results. Can be called from any thread.
+ */
+void AclCache::invalidateAll()
+{
+    generation.fetch_add(1, std::memory_order_relaxed);
+}
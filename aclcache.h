@@ -0,0 +1,72 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef ACLCACHE_H
+#define ACLCACHE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include "flashmq_plugin.h"
+#include "derivablecounter.h"
+
+struct AclCacheEntry
+{
+    uint64_t hash = 0;
+    uint32_t generation = 0;
+    AclAccess access = AclAccess::none;
+    AuthResult result = AuthResult::error;
+    std::string clientid;
+    std::string username;
+    std::string topic;
+};
+
+/**
+ * @brief The AclCache class remembers ACL check results per (client ID, username, topic, access), for 'acl_cache_size'.
+ *
+ * It's a fixed size table per thread, in which each key has one place, determined by its hash. A new result simply replaces what
+ * was there, so there's no eviction administration. Invalidating is done by increasing a global generation number, so it's cheap
+ * and can be done from any thread; entries from an older generation don't count.
+ */
+class AclCache
+{
+    static std::atomic<uint32_t> generation;
+
+    std::vector<AclCacheEntry> entries;
+    size_t mask = 0;
+    size_t requestedSize = 0;
+
+    static uint64_t getHash(const std::string &clientid, const std::string &username, const std::string &topic, AclAccess access);
+
+public:
+    // Set by the plugin during its ACL check, with flashmq_acl_result_cacheable().
+    static thread_local bool pluginResultCacheable;
+
+    DerivableCounter hits;
+    DerivableCounter misses;
+
+    void setSize(size_t size);
+    bool enabled() const { return !entries.empty(); }
+    bool get(const std::string &clientid, const std::string &username, const std::string &topic, AclAccess access, AuthResult &result);
+    void set(const std::string &clientid, const std::string &username, const std::string &topic, AclAccess access, AuthResult result);
+
+    static void invalidateAll();
+    static uint32_t getGeneration() { return generation.load(std::memory_order_relaxed); }
+};
+
+#endif // ACLCACHE_H
@@ -9,37 +9,40 @@
  * @param subtopic
  * @return
  */
+AclNode::AclNode(const std::string &subtopic) :
+    subtopic(subtopic)
+{
+
+}
+
 AclNode *AclNode::getChildren(const std::string &subtopic, bool registerPattern)
 {
-    std::unique_ptr<AclNode> &node = children[subtopic];
+    const SubtopicKey key(subtopic);
 
-    if (!node)
-    {
-        node = std::make_unique<AclNode>();
+    auto node_it = children.find(key);
+    if (node_it != children.end())
+        return node_it->second.get();
 
-        if (registerPattern)
-        {
-            if (subtopic == "%u")
-                this->_hasUserWildcard = true;
+    // The key points to the subtopic string of the node, so the node has to exist first.
+    std::unique_ptr<AclNode> node = std::make_unique<AclNode>(subtopic);
+    const SubtopicKey nodeKey(node->subtopic, key.getHash());
+    AclNode *result = children.emplace(nodeKey, std::move(node)).first->second.get();
 
-            if (subtopic == "%c")
-                this->_hasClientidWildcard = true;
-        }
+    if (registerPattern)
+    {
+        if (subtopic == "%u")
+            this->_hasUserWildcard = true;
+
+        if (subtopic == "%c")
+            this->_hasClientidWildcard = true;
     }
 
-    return node.get();
+    return result;
 }
 
-/**
- * @brief AclNode::getChildren is a const version, and will dererence the end iterator (crash) if it doesn't exist. So, hence the assert. Don't to that.
- * @param subtopic
- * @return
- */
-const AclNode *AclNode::getChildren(const std::string &subtopic) const
+const SubtopicMap<std::unique_ptr<AclNode>> &AclNode::getAllChildren() const
 {
-    assert(children.find(subtopic) != children.end());
-    auto node_it = children.find(subtopic);
-    return node_it->second.get();
+    return children;
 }
 
 AclNode *AclNode::getChildrenPlus()
@@ -61,15 +64,6 @@ bool AclNode::hasChildrenPlus() const
     return childrenPlus.operator bool();
 }
 
-bool AclNode::hasChild(const std::string &subtopic) const
-{
-    if (children.empty())
-        return false;
-
-    auto child_it = children.find(subtopic);
-    return child_it != children.end();
-}
-
 bool AclNode::hasPoundGrants() const
 {
     return !grantsPound.empty();
@@ -114,7 +108,7 @@ const std::vector<AclGrant> &AclNode::getGrants() const
 
 AclTree::AclTree()
 {
-    collectedPermissions.reserve(16);
+    pendingStates.reserve(16);
 }
 
 /**
@@ -128,6 +122,8 @@ void AclTree::addTopic(const std::string &pattern, AclGrant aclGrant, AclTopicTy
 {
     const std::vector<std::string> subtopics = splitToVector(pattern, '/');
 
+    compiled = false;
+
     AclNode *curEnd = &rootAnonymous;
 
     if (type == AclTopicType::Patterns)
@@ -157,49 +153,335 @@ void AclTree::addTopic(const std::string &pattern, AclGrant aclGrant, AclTopicTy
     curEnd->addGrant(aclGrant);
 }
 
-void AclTree::findPermissionRecursive(std::vector<std::string>::const_iterator cur_published_subtopic_it, std::vector<std::string>::const_iterator end,
-                                      const AclNode *this_node, std::vector<AclGrant> &collectedPermissions, const std::string &username,
-                                      const std::string &clientid) const
+uint8_t AclTree::grantToBits(AclGrant grant)
+{
+    switch (grant)
+    {
+    case AclGrant::Deny:
+        return 0x04;
+    case AclGrant::Read:
+        return 0x01;
+    case AclGrant::Write:
+        return 0x02;
+    case AclGrant::ReadWrite:
+        return 0x03;
+    }
+
+    return 0;
+}
+
+uint8_t AclTree::grantsToBits(const std::vector<AclGrant> &grants)
+{
+    uint8_t result = 0;
+
+    for (AclGrant g : grants)
+        result |= grantToBits(g);
+
+    return result;
+}
+
+/**
+ * @brief AclTree::compileNode adds the state for the node and, recursively, its children.
+ * @return the index of the state.
+ */
+uint32_t AclTree::compileNode(const AclNode &node)
+{
+    const uint32_t index = states.size();
+    states.emplace_back();
+    states[index].grants = grantsToBits(node.getGrants());
+    states[index].grantsPound = grantsToBits(node.getGrantsPound());
+
+    for (auto &pair : node.getAllChildren())
+    {
+        const uint32_t token = tokens.emplace(pair.first, tokens.size()).first->second;
+        const uint32_t target = compileNode(*pair.second);
+
+        AclEdge &edge = edges.emplace_back();
+        edge.state = index;
+        edge.token = token;
+        edge.target = target;
+        states[index].edgeCount++;
+
+        // A published '%u' matches literally, as before, so the wildcard state is the same one.
+        if (node.hasUserWildcard() && pair.first.getSubtopic() == "%u")
+            states[index].userState = target;
+
+        if (node.hasClientidWildcard() && pair.first.getSubtopic() == "%c")
+            states[index].clientidState = target;
+    }
+
+    if (node.hasChildrenPlus())
+    {
+        const uint32_t plusState = compileNode(*node.getChildrenPlus());
+        states[index].plusState = plusState;
+    }
+
+    return index;
+}
+
+/**
+ * @brief AclTree::compile turns the trees into the tables used for checking. It's done on the first check after a change, but call it
+ * after loading, so that check doesn't pay for it.
+ */
+void AclTree::compile()
+{
+    states.clear();
+    edges.clear();
+    tokens.clear();
+    rootPerUserStates.clear();
+
+    rootAnonymousState = rootAnonymous.isEmpty() ? AclState::none : compileNode(rootAnonymous);
+
+    // Usernames are tokens too, so finding the user's state is a lookup in the same table as the subtopics.
+    std::vector<std::pair<uint32_t, uint32_t>> userStates;
+    for (auto &pair : rootPerUser)
+    {
+        if (pair.second.isEmpty())
+            continue;
+
+        const uint32_t userToken = tokens.emplace(SubtopicKey(pair.first), tokens.size()).first->second;
+        userStates.emplace_back(userToken, compileNode(pair.second));
+    }
+
+    rootPatternsState = rootPatterns.isEmpty() ? AclState::none : compileNode(rootPatterns);
+
+    rootPerUserStates.assign(tokens.size(), AclState::none);
+    for (auto &pair : userStates)
+        rootPerUserStates[pair.first] = pair.second;
+
+    buildTokenTable();
+    buildEdgeTable();
+    tokens.clear();
+
+    states.shrink_to_fit();
+    compiled = true;
+}
+
+/**
+ * @brief getTokenHash is FNV-1a with a final mix. It's cheaper than std::hash for the short strings that subtopics usually are.
+ */
+static uint64_t getTokenHash(std::string_view s)
 {
-    const std::string &cur_published_subtop = *cur_published_subtopic_it;
+    uint64_t h = 0xcbf29ce484222325ULL;
 
-    if (cur_published_subtopic_it == end)
+    for (const char c : s)
     {
-        const std::vector<AclGrant> &grants = this_node->getGrants();
-        collectedPermissions.insert(collectedPermissions.end(), grants.begin(), grants.end());
-        return;
+        h ^= static_cast<uint8_t>(c);
+        h *= 0x100000001b3ULL;
     }
 
-    if (this_node->hasPoundGrants())
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @brief AclTree::buildTokenTable puts the tokens in an open addressing table at most half full, so lookups mostly take one probe in
+ * contiguous memory.
+ */
+void AclTree::buildTokenTable()
+{
+    size_t size = 2;
+    while (size < tokens.size() * 2)
+        size <<= 1;
+
+    tokenTable.clear();
+    tokenTable.resize(size);
+    tokenTableMask = size - 1;
+    tokenChars.clear();
+
+    for (auto &pair : tokens)
     {
-        const std::vector<AclGrant> &grants = this_node->getGrantsPound();
-        collectedPermissions.insert(collectedPermissions.end(), grants.begin(), grants.end());
+        const uint64_t hash = getTokenHash(pair.first.getSubtopic());
+        size_t pos = hash & tokenTableMask;
+
+        while (tokenTable[pos].id != AclState::none)
+            pos = (pos + 1) & tokenTableMask;
+
+        AclToken &t = tokenTable[pos];
+        t.hash = hash;
+        t.id = pair.second;
+        t.offset = tokenChars.size();
+        t.length = pair.first.getSubtopic().size();
+        tokenChars.append(pair.first.getSubtopic());
     }
 
-    const auto next_subtopic_it = ++cur_published_subtopic_it;
+    tokenTable.shrink_to_fit();
+    tokenChars.shrink_to_fit();
+}
 
-    if (this_node->hasChild(cur_published_subtop))
+/**
+ * @brief getEdgeHash mixes all bits of state and token into the low bits, because many states share the same tokens, and many tokens the
+ * same state.
+ */
+static size_t getEdgeHash(uint32_t state, uint32_t token)
+{
+    uint64_t h = static_cast<uint64_t>(state) << 32 | token;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+/**
+ * @brief AclTree::buildEdgeTable puts the edges in an open addressing table at most half full, keyed by state and token. That's one
+ * table for all states, so states with many children don't need a structure of their own.
+ */
+void AclTree::buildEdgeTable()
+{
+    size_t size = 2;
+    while (size < edges.size() * 2)
+        size <<= 1;
+
+    edgeTable.clear();
+    edgeTable.resize(size);
+    edgeTableMask = size - 1;
+
+    for (const AclEdge &edge : edges)
     {
-        const AclNode *sub_node = this_node->getChildren(cur_published_subtop);
-        findPermissionRecursive(next_subtopic_it, end, sub_node, collectedPermissions, username, clientid);
+        size_t pos = getEdgeHash(edge.state, edge.token) & edgeTableMask;
+
+        while (edgeTable[pos].state != AclState::none)
+            pos = (pos + 1) & edgeTableMask;
+
+        edgeTable[pos] = edge;
     }
 
-    if (this_node->hasUserWildcard() && cur_published_subtop == username)
+    edgeTable.shrink_to_fit();
+    edges.clear();
+    edges.shrink_to_fit();
+}
+
+/**
+ * @brief AclTree::getChildState
+ * @return the state the literal token leads to from the state, or AclState::none.
+ */
+uint32_t AclTree::getChildState(uint32_t state, uint32_t token) const
+{
+    size_t pos = getEdgeHash(state, token) & edgeTableMask;
+
+    while (true)
     {
-        const AclNode *sub_node = this_node->getChildren("%u");
-        findPermissionRecursive(next_subtopic_it, end, sub_node, collectedPermissions, username, clientid);
+        const AclEdge &edge = edgeTable[pos];
+
+        if (edge.state == AclState::none)
+            return AclState::none;
+
+        if (edge.state == state && edge.token == token)
+            return edge.target;
+
+        pos = (pos + 1) & edgeTableMask;
     }
+}
 
-    if (this_node->hasClientidWildcard() && cur_published_subtop == clientid)
+/**
+ * @brief AclTree::getToken
+ * @return the token of the subtopic, or AclState::none when no rule has it.
+ */
+uint32_t AclTree::getToken(const std::string &subtopic) const
+{
+    const uint64_t hash = getTokenHash(subtopic);
+    size_t pos = hash & tokenTableMask;
+
+    while (true)
     {
-        const AclNode *sub_node = this_node->getChildren("%c");
-        findPermissionRecursive(next_subtopic_it, end, sub_node, collectedPermissions, username, clientid);
+        const AclToken &t = tokenTable[pos];
+
+        if (t.id == AclState::none)
+            return AclState::none;
+
+        if (t.hash == hash && std::string_view(&tokenChars[t.offset], t.length) == subtopic)
+            return t.id;
+
+        pos = (pos + 1) & tokenTableMask;
     }
+}
+
+/**
+ * @brief AclTree::collectGrants walks the states from the root with the tokens of the published topic, and collects the grants of all the
+ * rules that match.
+ * @return grants as bit flags.
+ *
+ * It's a depth-first walk with an explicit stack, because a level can match more than one child, like a literal and a '+'. The first
+ * matching child is followed directly, and only the others are pushed on pendingStates, so with rule sets without such overlap, the
+ * stack stays empty.
+ */
+uint8_t AclTree::collectGrants(uint32_t rootState, const std::vector<std::string> &subtopicsPublish, const std::string &username,
+                               const std::string &clientid)
+{
+    const uint32_t depth = publishTokens.size();
+    uint8_t result = 0;
+
+    pendingStates.clear();
+
+    uint32_t stateIndex = rootState;
+    uint32_t level = 0;
 
-    if (this_node->hasChildrenPlus())
+    while (true)
     {
-        findPermissionRecursive(next_subtopic_it, end, this_node->getChildrenPlus(), collectedPermissions, username, clientid);
+        const AclState &state = states[stateIndex];
+        uint32_t next = AclState::none;
+
+        auto follow = [&](uint32_t child) {
+            if (next == AclState::none)
+                next = child;
+            else
+                pendingStates.emplace_back(child, level + 1);
+        };
+
+        if (level == depth)
+        {
+            result |= state.grants;
+        }
+        else
+        {
+            result |= state.grantsPound;
+
+            if (state.edgeCount > 0)
+            {
+                uint32_t &token = publishTokens[level];
+
+                if (token == unresolvedToken)
+                    token = getToken(subtopicsPublish[level]);
+
+                if (token != AclState::none)
+                {
+                    const uint32_t child = getChildState(stateIndex, token);
+
+                    if (child != AclState::none)
+                        follow(child);
+                }
+            }
+
+            if (state.userState != AclState::none && subtopicsPublish[level] == username)
+                follow(state.userState);
+
+            if (state.clientidState != AclState::none && subtopicsPublish[level] == clientid)
+                follow(state.clientidState);
+
+            if (state.plusState != AclState::none)
+                follow(state.plusState);
+        }
+
+        if (next != AclState::none)
+        {
+            stateIndex = next;
+            level++;
+            continue;
+        }
+
+        if (pendingStates.empty())
+            break;
+
+        stateIndex = pendingStates.back().first;
+        level = pendingStates.back().second;
+        pendingStates.pop_back();
     }
+
+    return result;
 }
 
 /**
@@ -221,44 +503,34 @@ AuthResult AclTree::findPermission(const std::vector<std::string> &subtopicsPubl
     assert(access == AclGrant::Read || access == AclGrant::Write);
     assert(!clientid.empty());
 
-    collectedPermissions.clear();
+    if (!compiled)
+        compile();
 
-    if (username.empty() && !rootAnonymous.isEmpty())
-        findPermissionRecursive(subtopicsPublish.begin(), subtopicsPublish.end(), &rootAnonymous, collectedPermissions, username, clientid);
+    // The tokens are looked up when first needed, and then shared by the anonymous, per-user and pattern tables.
+    publishTokens.assign(subtopicsPublish.size(), unresolvedToken);
+
+    uint8_t grants = 0;
+
+    if (username.empty() && rootAnonymousState != AclState::none)
+        grants |= collectGrants(rootAnonymousState, subtopicsPublish, username, clientid);
     else
     {
-        auto it = rootPerUser.find(username);
-        if (it != rootPerUser.end())
-        {
-            AclNode &rootOfUser = it->second;
-            if (!rootOfUser.isEmpty())
-                findPermissionRecursive(subtopicsPublish.begin(), subtopicsPublish.end(), &rootOfUser, collectedPermissions, username, clientid);
-        }
+        const uint32_t userToken = getToken(username);
+        if (userToken != AclState::none && rootPerUserStates[userToken] != AclState::none)
+            grants |= collectGrants(rootPerUserStates[userToken], subtopicsPublish, username, clientid);
     }
 
-    if (std::find(collectedPermissions.begin(), collectedPermissions.end(), AclGrant::Deny) != collectedPermissions.end())
+    // A deny always overrides all other declarations.
+    if (grants & grantToBits(AclGrant::Deny))
         return AuthResult::acl_denied;
 
-    if (!rootPatterns.isEmpty())
-        findPermissionRecursive(subtopicsPublish.begin(), subtopicsPublish.end(), &rootPatterns, collectedPermissions, username, clientid);
+    if (rootPatternsState != AclState::none)
+        grants |= collectGrants(rootPatternsState, subtopicsPublish, username, clientid);
 
-    if (collectedPermissions.empty())
+    if (grants & grantToBits(AclGrant::Deny))
         return AuthResult::acl_denied;
 
-    bool allowed = false;
-
-    for(AclGrant grant : collectedPermissions)
-    {
-        // A deny always overrides all other declarations.
-        if (grant == AclGrant::Deny)
-            return AuthResult::acl_denied;
-
-        if (access == AclGrant::Read && (grant == AclGrant::Read || grant == AclGrant::ReadWrite))
-            allowed = true;
-        if (access == AclGrant::Write && (grant == AclGrant::Write || grant == AclGrant::ReadWrite))
-            allowed = true;
-    }
-
+    const bool allowed = grants & grantToBits(access);
     AuthResult result = allowed ? AuthResult::success : AuthResult::acl_denied;
     return result;
 }
@@ -6,6 +6,7 @@
 #include <unordered_map>
 
 #include "logger.h"
+#include "subtopickey.h"
 
 enum class AclGrant
 {
@@ -31,7 +32,8 @@ class AclNode
 {
     bool empty = false;
 
-    std::unordered_map<std::string, std::unique_ptr<AclNode>> children;
+    std::string subtopic;
+    SubtopicMap<std::unique_ptr<AclNode>> children;
     std::unique_ptr<AclNode> childrenPlus; // The + sign in MQTT represents a single-level wildcard
 
     std::vector<AclGrant> grants;
@@ -41,12 +43,14 @@ class AclNode
     bool _hasClientidWildcard = false; // %c
 
 public:
+    AclNode() = default;
+    AclNode(const std::string &subtopic);
+
     AclNode *getChildren(const std::string &subtopic, bool registerPattern);
-    const AclNode *getChildren(const std::string &subtopic) const;
+    const SubtopicMap<std::unique_ptr<AclNode>> &getAllChildren() const;
     AclNode *getChildrenPlus();
     const AclNode *getChildrenPlus() const;
     bool hasChildrenPlus() const;
-    bool hasChild(const std::string &subtopic) const;
     bool hasPoundGrants() const;
     bool hasUserWildcard() const;
     bool hasClientidWildcard() const;
@@ -58,8 +62,49 @@ public:
     const std::vector<AclGrant> &getGrantsPound() const;
 };
 
+/**
+ * @brief The AclState struct is a node of the compiled AclTree. Its literal children are found in AclTree::edgeTable, by state and token.
+ */
+struct AclState
+{
+    static constexpr uint32_t none = UINT32_MAX;
+
+    uint32_t edgeCount = 0;
+    uint32_t plusState = none;
+    uint32_t userState = none; // %u
+    uint32_t clientidState = none; // %c
+    uint8_t grants = 0; // Bit flags, see AclTree::grantToBits().
+    uint8_t grantsPound = 0;
+};
+
+/**
+ * @brief The AclToken struct is a place in the open addressing table that gives the number of a subtopic.
+ */
+struct AclToken
+{
+    uint64_t hash = 0;
+    uint32_t id = UINT32_MAX;
+    uint32_t offset = 0; // Of the subtopic in AclTree::tokenChars.
+    uint32_t length = 0;
+};
+
+/**
+ * @brief The AclEdge struct is a place in the open addressing table that gives the child state of a state for a token.
+ */
+struct AclEdge
+{
+    uint32_t state = UINT32_MAX;
+    uint32_t token = 0;
+    uint32_t target = 0;
+};
+
 /**
  * @brief The AclTree class represents (Mosquitto compatible) permissions from mosquitto_acl_file. It's not thread safe, and designed for per-thread use.
+ *
+ * The trees of `AclNode`s are only used to build it up. For checking, they are compiled into flat tables of states and edges, in which
+ * subtopics are replaced by numbers ('tokens'). A check then looks up the token of each subtopic once, and walks the tables with integer
+ * compares only, without allocations. Tokens are only looked up for levels where a state has literal children, and %u and %c only
+ * compare the username and client ID at states that have them.
  */
 class AclTree
 {
@@ -68,15 +113,39 @@ class AclTree
     std::unordered_map<std::string, AclNode> rootPerUser;
     AclNode rootPatterns;
 
-    std::vector<AclGrant> collectedPermissions;
-
-    void findPermissionRecursive(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
-                                 const AclNode *node, std::vector<AclGrant> &collectedPermissions, const std::string &username, const std::string &clientid) const;
+    bool compiled = false;
+    std::vector<AclState> states;
+    std::vector<AclEdge> edges; // Only used while compiling.
+    std::vector<AclEdge> edgeTable;
+    size_t edgeTableMask = 0;
+    SubtopicMap<uint32_t> tokens; // Only used while compiling. The keys point to the subtopics in the AclNodes.
+    std::vector<AclToken> tokenTable;
+    size_t tokenTableMask = 0;
+    std::string tokenChars; // The subtopics of all tokens, so comparing them stays in a small piece of memory.
+    uint32_t rootAnonymousState = AclState::none;
+    std::vector<uint32_t> rootPerUserStates; // By token of the username.
+    uint32_t rootPatternsState = AclState::none;
+
+    static constexpr uint32_t unresolvedToken = UINT32_MAX - 1;
+
+    // Per check, reused to avoid allocations.
+    std::vector<uint32_t> publishTokens;
+    std::vector<std::pair<uint32_t, uint32_t>> pendingStates; // State and level. See collectGrants().
+
+    static uint8_t grantToBits(AclGrant grant);
+    static uint8_t grantsToBits(const std::vector<AclGrant> &grants);
+    uint32_t compileNode(const AclNode &node);
+    void buildTokenTable();
+    void buildEdgeTable();
+    uint32_t getToken(const std::string &subtopic) const;
+    uint32_t getChildState(uint32_t state, uint32_t token) const;
+    uint8_t collectGrants(uint32_t rootState, const std::vector<std::string> &subtopicsPublish, const std::string &username, const std::string &clientid);
 
 public:
     AclTree();
 
     void addTopic(const std::string &pattern, AclGrant aclGrant, AclTopicType type, const std::string &username = std::string());
+    void compile();
     AuthResult findPermission(const std::vector<std::string> &subtopicsPublish, AclGrant access, const std::string &username, const std::string &clientid);
 };
 
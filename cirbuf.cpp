@@ -22,6 +22,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <stdexcept>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
 
 #include "logger.h"
 #include "utils.h"
@@ -105,6 +106,36 @@ char CirBuf::peakAhead(uint32_t offset) const
     return b;
 }
 
+/**
+ * @brief CirBuf::getReadIoVecs gives the memory of 'count' used bytes, starting 'offset' bytes after the tail, for writev().
+ * @param offset
+ * @param count
+ * @param iov needs room for two, because the data may wrap around the end of the buffer.
+ * @return the number of iovecs filled, which is 0 when count is 0.
+ *
+ * It doesn't advance the tail.
+ */
+int CirBuf::getReadIoVecs(uint32_t offset, uint32_t count, iovec *iov)
+{
+    assert(offset + count <= usedBytes());
+
+    if (count == 0)
+        return 0;
+
+    const uint32_t start = (tail + offset) & (size - 1);
+    const uint32_t first = std::min<uint32_t>(count, size - start);
+
+    iov[0].iov_base = &buf[start];
+    iov[0].iov_len = first;
+
+    if (first == count)
+        return 1;
+
+    iov[1].iov_base = buf;
+    iov[1].iov_len = count - first;
+    return 2;
+}
+
 void CirBuf::ensureFreeSpace(size_t n, const size_t max)
 {
     if (n <= freeSpace())
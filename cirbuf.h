@@ -22,6 +22,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/uio.h>
 
 // Optimized circular buffer, works only with sizes power of two.
 class CirBuf
@@ -50,6 +51,7 @@ public:
     void advanceHead(uint32_t n);
     void advanceTail(uint32_t n);
     char peakAhead(uint32_t offset) const;
+    int getReadIoVecs(uint32_t offset, uint32_t count, struct iovec *iov);
     void ensureFreeSpace(size_t n, const size_t max = UINT_MAX);
     void doubleSize(uint factor = 2);
     uint32_t getSize() const;
@@ -38,6 +38,13 @@ StowedClientRegistrationData::StowedClientRegistrationData(bool clean_start, uin
 
 }
 
+QueuedSharedPayload::QueuedSharedPayload(const std::shared_ptr<const std::string> &payload, uint32_t writeBufBytesBefore) :
+    payload(payload),
+    writeBufBytesBefore(writeBufBytesBefore)
+{
+
+}
+
 Client::Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool websocket, bool haproxy, struct sockaddr *addr, const Settings &settings, bool fuzzMode) :
     fd(fd),
     fuzzMode(fuzzMode),
@@ -96,6 +103,7 @@ Client::~Client()
 
     if (fd > 0) // this check is essentially for testing, when working with a dummy fd.
     {
+        ThreadData::countEpollCtl();
         if (epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, NULL) != 0)
             logger->logf(LOG_ERR, "Removing fd %d of client '%s' from epoll produced error: %s", fd, repr().c_str(), strerror(errno));
         close(fd);
@@ -161,6 +169,9 @@ void Client::markAsDisconnecting()
         return;
 
     disconnecting = true;
+
+    // The waiting packets have a pointer to us.
+    packetsWaitingForAcl.clear();
 }
 
 // false means any kind of error we want to get rid of the client for.
@@ -219,10 +230,15 @@ void Client::writeText(const std::string &text)
     writebuf.ensureFreeSpace(text.size());
     writebuf.write(text.c_str(), text.length());
 
-    setReadyForWriting(true);
+    setReadyForWritingOrQueueFlush();
 }
 
-void Client::writeMqttPacket(const MqttPacket &packet)
+/**
+ * @brief Client::writeMqttPacket puts a packet in the output of this client.
+ * @param packet
+ * @param sharedPayload optional copy of the payload of the publish 'packet', which is queued instead of copying the payload into the write buffer.
+ */
+void Client::writeMqttPacket(const MqttPacket &packet, const std::shared_ptr<const std::string> &sharedPayload)
 {
     const size_t packetSize = packet.getSizeIncludingNonPresentHeader();
 
@@ -239,17 +255,42 @@ void Client::writeMqttPacket(const MqttPacket &packet)
     // could be enhanced a lot, but it's a start.
     const uint32_t growBufMaxTo = std::min<int>(packetSize * 1000, this->maxOutgoingPacketSize);
 
-    // Grow as far as we can. We have to make room for one MQTT packet.
-    writebuf.ensureFreeSpace(packetSize, growBufMaxTo);
-
-    // And drop a publish when it doesn't fit, even after resizing. This means we do allow pings. And
-    // QoS packet are queued and limited elsewhere.
-    if (packet.packetType == PacketType::PUBLISH && packet.getQos() == 0 && packetSize > writebuf.freeSpace())
+    if (sharedPayload)
     {
-        return;
+        assert(packet.packetType == PacketType::PUBLISH);
+        assert(sharedPayload->size() == packet.getPayloadLen());
+
+        // The pending shared payloads count as if they were in the write buffer, for the same limit.
+        if (packet.getQos() == 0 && writebuf.usedBytes() + sharedPayloadBytesPending + packetSize > growBufMaxTo)
+        {
+            return;
+        }
+
+        writebuf.ensureFreeSpace(packetSize - sharedPayload->size(), growBufMaxTo);
+        packet.readIntoBufExceptPayload(writebuf);
+
+        const uint32_t bytesBefore = writebuf.usedBytes() - writeBufBytesBeforeSharedPayloads;
+        sharedPayloads.emplace_back(sharedPayload, bytesBefore);
+        writeBufBytesBeforeSharedPayloads += bytesBefore;
+        sharedPayloadBytesPending += sharedPayload->size();
+
+        ThreadData *td = ThreadGlobals::getThreadData();
+        td->sharedPayloadCounter.inc();
     }
+    else
+    {
+        // Grow as far as we can. We have to make room for one MQTT packet.
+        writebuf.ensureFreeSpace(packetSize, growBufMaxTo);
 
-    packet.readIntoBuf(writebuf);
+        // And drop a publish when it doesn't fit, even after resizing. This means we do allow pings. And
+        // QoS packet are queued and limited elsewhere.
+        if (packet.packetType == PacketType::PUBLISH && packet.getQos() == 0 && packetSize > writebuf.freeSpace())
+        {
+            return;
+        }
+
+        packet.readIntoBuf(writebuf);
+    }
 
     if (packet.packetType == PacketType::PUBLISH)
     {
@@ -259,7 +300,7 @@ void Client::writeMqttPacket(const MqttPacket &packet)
     else if (packet.packetType == PacketType::DISCONNECT)
         setReadyForDisconnect();
 
-    setReadyForWriting(true);
+    setReadyForWritingOrQueueFlush();
 }
 
 void Client::writeMqttPacketAndBlameThisClient(PublishCopyFactory &copyFactory, uint8_t max_qos, uint16_t packet_id)
@@ -291,15 +332,23 @@ void Client::writeMqttPacketAndBlameThisClient(PublishCopyFactory &copyFactory,
         p->setQos(copyFactory.getEffectiveQos(max_qos));
     }
 
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    if (settings->sharedPayloadMinBytes > 0 && p->getPayloadLen() >= settings->sharedPayloadMinBytes && !ioWrapper.isSsl() && !ioWrapper.isWebsocket())
+    {
+        writeMqttPacketAndBlameThisClient(*p, copyFactory.getSharedPayload());
+        return;
+    }
+
     writeMqttPacketAndBlameThisClient(*p);
 }
 
 // Helper method to avoid the exception ending up at the sender of messages, which would then get disconnected.
-void Client::writeMqttPacketAndBlameThisClient(const MqttPacket &packet)
+void Client::writeMqttPacketAndBlameThisClient(const MqttPacket &packet, const std::shared_ptr<const std::string> &sharedPayload)
 {
     try
     {
-        this->writeMqttPacket(packet);
+        this->writeMqttPacket(packet, sharedPayload);
     }
     catch (std::exception &ex)
     {
@@ -321,7 +370,7 @@ void Client::writePingResp()
     writebuf.headPtr()[0] = 0;
     writebuf.advanceHead(1);
 
-    setReadyForWriting(true);
+    setReadyForWritingOrQueueFlush();
 }
 
 bool Client::writeBufIntoFd()
@@ -334,9 +383,15 @@ bool Client::writeBufIntoFd()
     if (disconnecting)
         return false;
 
+    flushQueued = false;
+
     IoWrapResult error = IoWrapResult::Success;
+
+    if (!sharedPayloads.empty())
+        error = writeSharedPayloadsIntoFd();
+
     int n;
-    while (writebuf.usedBytes() > 0 || ioWrapper.hasPendingWrite())
+    while (error != IoWrapResult::Wouldblock && (writebuf.usedBytes() > 0 || ioWrapper.hasPendingWrite()))
     {
         n = ioWrapper.writeWebsocketAndOrSsl(fd, writebuf.tailPtr(), writebuf.maxReadSize(), &error);
 
@@ -349,12 +404,177 @@ bool Client::writeBufIntoFd()
             break;
     }
 
-    const bool bufferHasData = writebuf.usedBytes() > 0;
+    const bool bufferHasData = writebuf.usedBytes() > 0 || !sharedPayloads.empty();
     setReadyForWriting(bufferHasData || error == IoWrapResult::Wouldblock);
 
     return true;
 }
 
+/**
+ * @brief Client::getWriteIoVecs makes iovecs of the pending data: the write buffer and the shared payloads in between, in order. Call under writeBufMutex.
+ * @param iov
+ * @param iovcnt is the size of iov.
+ * @return the amount of iovecs used. When not all shared payloads fit, the write buffer data after the last included one is left out.
+ */
+int Client::getWriteIoVecs(iovec *iov, int iovcnt)
+{
+    // Per payload, up to two for the write buffer bytes before it (it's circular), and one for the payload. Two are kept for the rest.
+    const int maxForPayloads = iovcnt - 2;
+
+    int used = 0;
+    uint32_t writeBufOffset = 0;
+    size_t payloadsIncluded = 0;
+
+    for (const QueuedSharedPayload &p : sharedPayloads)
+    {
+        if (used + 3 > maxForPayloads)
+            break;
+
+        used += writebuf.getReadIoVecs(writeBufOffset, p.writeBufBytesBefore, &iov[used]);
+        writeBufOffset += p.writeBufBytesBefore;
+
+        iov[used].iov_base = const_cast<char*>(p.payload->data() + p.sent);
+        iov[used].iov_len = p.payload->size() - p.sent;
+        used++;
+
+        payloadsIncluded++;
+    }
+
+    if (payloadsIncluded == sharedPayloads.size())
+        used += writebuf.getReadIoVecs(writeBufOffset, writebuf.usedBytes() - writeBufOffset, &iov[used]);
+
+    return used;
+}
+
+/**
+ * @brief Client::writeSharedPayloadsIntoFd writes the write buffer and the shared payloads in between, in order, with writev. Call under writeBufMutex.
+ * @return Wouldblock when the socket is full, or Success when all shared payloads are sent. Write buffer data after the last one may be left.
+ */
+IoWrapResult Client::writeSharedPayloadsIntoFd()
+{
+    struct iovec iov[maxWriteIoVecs];
+
+    IoWrapResult error = IoWrapResult::Success;
+
+    while (!sharedPayloads.empty())
+    {
+        const int iovcnt = getWriteIoVecs(iov, maxWriteIoVecs);
+
+        const ssize_t n = ioWrapper.writevPlain(fd, iov, iovcnt, &error);
+
+        if (n > 0)
+            advanceAfterWritev(n);
+
+        if (error == IoWrapResult::Interrupted)
+            continue;
+        if (error == IoWrapResult::Wouldblock)
+            break;
+    }
+
+    return error;
+}
+
+/**
+ * @brief Client::advanceAfterWritev consumes bytes written from the iovecs of getWriteIoVecs, from the write buffer and payloads, in order.
+ * @param n
+ */
+void Client::advanceAfterWritev(size_t n)
+{
+    while (n > 0 && !sharedPayloads.empty())
+    {
+        QueuedSharedPayload &front = sharedPayloads.front();
+
+        const uint32_t fromWriteBuf = std::min<size_t>(n, front.writeBufBytesBefore);
+        writebuf.advanceTail(fromWriteBuf);
+        front.writeBufBytesBefore -= fromWriteBuf;
+        writeBufBytesBeforeSharedPayloads -= fromWriteBuf;
+        n -= fromWriteBuf;
+
+        const size_t fromPayload = std::min<size_t>(n, front.payload->size() - front.sent);
+        front.sent += fromPayload;
+        sharedPayloadBytesPending -= fromPayload;
+        n -= fromPayload;
+
+        if (front.writeBufBytesBefore == 0 && front.sent == front.payload->size())
+            sharedPayloads.pop_front();
+    }
+
+    writebuf.advanceTail(n);
+}
+
+/**
+ * @brief Client::startFlushRound makes sure a client is flushed once per round of ThreadData::flushQueuedClientWrites().
+ * @param round
+ * @return false when the client was already flushed in this round.
+ *
+ * A client can be queued twice, because writeBufIntoFd() on EPOLLOUT clears the flag that prevents it. Flushing it twice in a round of
+ * batched writes would make prepareBatchedWrite() lock the write buffer we already hold.
+ */
+bool Client::startFlushRound(uint64_t round)
+{
+    if (lastFlushRound == round)
+        return false;
+
+    lastFlushRound = round;
+    return true;
+}
+
+#ifdef FLASHMQ_IO_URING
+/**
+ * @brief Client::prepareBatchedWrite locks the write buffer and fills in the msghdr of a batched write, for ThreadData::flushQueuedClientWrites().
+ * @param w
+ * @return false when it can't be done; use writeBufIntoFd() then. This is the case for SSL and websockets, and when the lock is taken.
+ */
+bool Client::prepareBatchedWrite(BatchedWrite &w)
+{
+    if (ioWrapper.isSsl() || ioWrapper.isWebsocket())
+        return false;
+
+    std::unique_lock<std::mutex> lock(writeBufMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+        return false;
+
+    if (disconnecting)
+        return false;
+
+    const int iovcnt = getWriteIoVecs(w.iov, maxWriteIoVecs);
+
+    if (iovcnt == 0)
+        return false;
+
+    flushQueued = false;
+
+    memset(&w.msg, 0, sizeof(struct msghdr));
+    w.msg.msg_iov = w.iov;
+    w.msg.msg_iovlen = iovcnt;
+    w.lock = std::move(lock);
+
+    return true;
+}
+
+/**
+ * @brief Client::finishBatchedWrite processes the result of a write prepared with prepareBatchedWrite(), and releases the lock.
+ * @param w
+ * @param result is like the return value of sendmsg(), but with -errno on error.
+ *
+ * When not everything was written, we wait for EPOLLOUT, like writeBufIntoFd() does.
+ */
+void Client::finishBatchedWrite(BatchedWrite &w, int result)
+{
+    std::unique_lock<std::mutex> lock(std::move(w.lock));
+    assert(lock.owns_lock());
+
+    if (result > 0)
+        advanceAfterWritev(result);
+
+    if (result < 0 && result != -EAGAIN && result != -EWOULDBLOCK && result != -EINTR)
+        throw std::runtime_error(strerror(-result));
+
+    const bool bufferHasData = writebuf.usedBytes() > 0 || !sharedPayloads.empty();
+    setReadyForWriting(bufferHasData);
+}
+#endif
+
 const sockaddr *Client::getAddr() const
 {
     return reinterpret_cast<const struct sockaddr*>(&this->addr);
@@ -388,6 +608,10 @@ bool Client::keepAliveExpired()
     if (keepalive == 0)
         return false;
 
+    // We're not reading while packets wait for an asynchronous ACL check, so we would miss its PINGREQs.
+    if (!packetsWaitingForAcl.empty())
+        return false;
+
     const std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
 
     if (!authenticated)
@@ -627,6 +851,30 @@ void Client::setReadyForWriting(bool val)
     ev.data.fd = fd;
     ev.events = readyForReading*EPOLLIN | readyForWriting*EPOLLOUT;
     check<std::runtime_error>(epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev));
+    ThreadData::countEpollCtl();
+}
+
+/**
+ * @brief Client::setReadyForWritingOrQueueFlush is for after writing into the write buffer. Call it under writeBufMutex.
+ *
+ * With 'batched_write_flushing', when we're in the client's own thread, the client is queued for flushing at the end of the event
+ * loop iteration, instead of going through epoll with EPOLLOUT. That saves two epoll_ctl calls when the socket can take the data.
+ */
+void Client::setReadyForWritingOrQueueFlush()
+{
+    ThreadData *td = ThreadGlobals::getThreadData();
+
+    if (!td || !td->settingsLocalCopy.batchedWriteFlushing || td->epollfd != this->epoll_fd || readyForWriting || disconnecting)
+    {
+        setReadyForWriting(true);
+        return;
+    }
+
+    if (flushQueued)
+        return;
+
+    flushQueued = true;
+    td->queueClientFlush(fd);
 }
 
 void Client::setReadyForReading(bool val)
@@ -660,6 +908,7 @@ void Client::setReadyForReading(bool val)
 
         ev.events = readyForReading*EPOLLIN | readyForWriting*EPOLLOUT;
         check<std::runtime_error>(epoll_ctl(this->epoll_fd, EPOLL_CTL_MOD, fd, &ev));
+        ThreadData::countEpollCtl();
     }
 }
 
@@ -701,6 +950,81 @@ void Client::setAddr(const std::string &address)
 void Client::bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender)
 {
     MqttPacket::bufferToMqttPackets(readbuf, packetQueueIn, sender);
+    setReadyForReading(readbuf.freeSpace() > 0 && packetsWaitingForAcl.empty());
+}
+
+/**
+ * @brief Client::parkPacketIfWaitingForAcl puts the packet in front of the waiting packets, when it waits for an asynchronous ACL check.
+ * @return whether the packet waits.
+ *
+ * We don't read from the socket while packets wait, so they can't pile up.
+ */
+bool Client::parkPacketIfWaitingForAcl(MqttPacket &packet)
+{
+    if (!packet.isWaitingForAsyncAclCheck())
+        return false;
+
+    // The waiting packets have a pointer to us, so we can't keep them once disconnecting.
+    if (disconnecting)
+        return true;
+
+    packetsWaitingForAcl.push_front(std::move(packet));
+    setReadyForReading(false);
+    return true;
+}
+
+/**
+ * @brief Client::handlePacket handles an incoming packet, or makes it wait when an earlier packet waits for an asynchronous ACL check, to
+ * keep the order.
+ */
+void Client::handlePacket(MqttPacket &packet)
+{
+    if (!packetsWaitingForAcl.empty())
+    {
+        packetsWaitingForAcl.push_back(std::move(packet));
+        return;
+    }
+
+    packet.handle();
+    parkPacketIfWaitingForAcl(packet);
+}
+
+/**
+ * @brief Client::continueAfterAsyncAclCheck finishes the packet that waited for the plugin, and handles the packets after it, until
+ * one needs an asynchronous ACL check again.
+ * @param checkId must be the one of the check the packet waits for. Otherwise, the continuation is late, duplicate or bogus, and it's
+ * ignored, so it can't decide another packet.
+ */
+void Client::continueAfterAsyncAclCheck(uint64_t checkId, AuthResult result)
+{
+    if (packetsWaitingForAcl.empty() || checkId != lastAsyncAclCheckId)
+    {
+        logger->logf(LOG_WARNING, "Ignoring continuation of ACL check %lu of client '%s', which is not the one waiting.", checkId, repr().c_str());
+        return;
+    }
+
+    // We weren't reading while we waited, so that silence doesn't count against the client's keep-alive.
+    lastActivity = std::chrono::steady_clock::now();
+
+    {
+        MqttPacket packet = std::move(packetsWaitingForAcl.front());
+        packetsWaitingForAcl.pop_front();
+        packet.continueAfterAsyncAclCheck(result);
+
+        if (parkPacketIfWaitingForAcl(packet))
+            return;
+    }
+
+    while (!packetsWaitingForAcl.empty())
+    {
+        MqttPacket packet = std::move(packetsWaitingForAcl.front());
+        packetsWaitingForAcl.pop_front();
+        packet.handle();
+
+        if (parkPacketIfWaitingForAcl(packet))
+            return;
+    }
+
     setReadyForReading(readbuf.freeSpace() > 0);
 }
 
@@ -24,6 +24,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <mutex>
 #include <iostream>
 #include <time.h>
+#include <deque>
+#include <sys/socket.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -52,6 +54,23 @@ struct StowedClientRegistrationData
     StowedClientRegistrationData(bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval);
 };
 
+/**
+ * @brief The QueuedSharedPayload struct is a payload that is sent from a buffer shared by all receivers, instead of being copied into the
+ * write buffer. The packet header is in the write buffer. See 'shared_payload_min_bytes'.
+ */
+struct QueuedSharedPayload
+{
+    std::shared_ptr<const std::string> payload;
+    uint32_t writeBufBytesBefore = 0; // The bytes in the write buffer that go before this payload, counting from the previous one.
+    size_t sent = 0;
+
+    QueuedSharedPayload(const std::shared_ptr<const std::string> &payload, uint32_t writeBufBytesBefore);
+};
+
+#ifdef FLASHMQ_IO_URING
+struct BatchedWrite;
+#endif
+
 class Client
 {
     friend class IoWrapper;
@@ -74,11 +93,16 @@ class Client
 
     CirBuf readbuf;
     CirBuf writebuf;
+    std::deque<QueuedSharedPayload> sharedPayloads;
+    uint32_t writeBufBytesBeforeSharedPayloads = 0;
+    size_t sharedPayloadBytesPending = 0;
 
     bool authenticated = false;
     bool connectPacketSeen = false;
     bool readyForWriting = false;
     bool readyForReading = true;
+    bool flushQueued = false;
+    uint64_t lastFlushRound = 0;
     bool disconnectWhenBytesWritten = false;
     bool disconnecting = false;
     std::string disconnectReason;
@@ -107,15 +131,28 @@ class Client
 
     std::unique_ptr<StowedClientRegistrationData> registrationData;
 
+    // The packet at the front waits for an asynchronous ACL check, the others for their turn. See flashmq_continue_async_acl_check().
+    std::deque<MqttPacket> packetsWaitingForAcl;
+
+    // Identifies the last ACL check the plugin could answer asynchronously, so continuations of other checks can be ignored.
+    uint64_t lastAsyncAclCheckId = 0;
+
     Logger *logger = Logger::getInstance();
 
     sockaddr_in6 addr;
 
     void setReadyForWriting(bool val);
+    void setReadyForWritingOrQueueFlush();
     void setReadyForReading(bool val);
     void setAddr(const std::string &address);
+    int getWriteIoVecs(struct iovec *iov, int iovcnt);
+    IoWrapResult writeSharedPayloadsIntoFd();
+    void advanceAfterWritev(size_t n);
+    bool parkPacketIfWaitingForAcl(MqttPacket &packet);
 
 public:
+    static constexpr int maxWriteIoVecs = 50;
+
     Client(int fd, std::shared_ptr<ThreadData> threadData, SSL *ssl, bool websocket, bool haproxy, struct sockaddr *addr, const Settings &settings, bool fuzzMode=false);
     Client(const Client &other) = delete;
     Client(Client &&other) = delete;
@@ -134,6 +171,9 @@ public:
     void markAsDisconnecting();
     bool readFdIntoBuffer();
     void bufferToMqttPackets(std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender);
+    void handlePacket(MqttPacket &packet);
+    uint64_t startAsyncAclCheck() { return ++lastAsyncAclCheckId; }
+    void continueAfterAsyncAclCheck(uint64_t checkId, AuthResult result);
     void setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive);
     void setClientProperties(ProtocolVersion protocolVersion, const std::string &clientId, const std::string username, bool connectPacketSeen, uint16_t keepalive,
                              uint32_t maxOutgoingPacketSize, uint16_t maxOutgoingTopicAliasValue);
@@ -154,12 +194,17 @@ public:
 
     void writeText(const std::string &text);
     void writePingResp();
-    void writeMqttPacket(const MqttPacket &packet);
+    void writeMqttPacket(const MqttPacket &packet, const std::shared_ptr<const std::string> &sharedPayload = std::shared_ptr<const std::string>());
     void writeMqttPacketAndBlameThisClient(PublishCopyFactory &copyFactory, uint8_t max_qos, uint16_t packet_id);
-    void writeMqttPacketAndBlameThisClient(const MqttPacket &packet);
+    void writeMqttPacketAndBlameThisClient(const MqttPacket &packet, const std::shared_ptr<const std::string> &sharedPayload = std::shared_ptr<const std::string>());
     bool writeBufIntoFd();
+    bool startFlushRound(uint64_t round);
+#ifdef FLASHMQ_IO_URING
+    bool prepareBatchedWrite(BatchedWrite &w);
+    void finishBatchedWrite(BatchedWrite &w, int result);
+#endif
     bool isBeingDisconnected() const { return disconnectWhenBytesWritten; }
-    bool readyForDisconnecting() const { return disconnectWhenBytesWritten && writebuf.usedBytes() == 0; }
+    bool readyForDisconnecting() const { return disconnectWhenBytesWritten && writebuf.usedBytes() == 0 && sharedPayloads.empty(); }
 
     // Do this before calling an action that makes this client ready for writing, so that the EPOLLOUT will handle it.
     void setReadyForDisconnect() { disconnectWhenBytesWritten = true; }
@@ -204,4 +249,18 @@ public:
 
 };
 
+#ifdef FLASHMQ_IO_URING
+/**
+ * @brief The BatchedWrite struct is a client's send that is submitted to io_uring together with those of other clients. It holds
+ * the client's writeBufMutex from Client::prepareBatchedWrite() until Client::finishBatchedWrite(), so the iovecs stay valid.
+ */
+struct BatchedWrite
+{
+    std::shared_ptr<Client> client;
+    std::unique_lock<std::mutex> lock;
+    struct msghdr msg;
+    struct iovec iov[Client::maxWriteIoVecs];
+};
+#endif
+
 #endif // CLIENT_H
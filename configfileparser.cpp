@@ -134,12 +134,26 @@ ConfigFileParser::ConfigFileParser(const std::string &path) :
     validKeys.insert("max_qos_bytes_pending_per_client");
     validKeys.insert("wills_enabled");
     validKeys.insert("retained_messages_mode");
+    validKeys.insert("retained_messages_wal");
+    validKeys.insert("retained_messages_wal_sync_interval_ms");
+    validKeys.insert("retained_messages_lazy_loading");
+    validKeys.insert("save_state_in_child_process");
     validKeys.insert("expire_retained_messages_after_seconds");
     validKeys.insert("expire_retained_messages_time_budget_ms");
+    validKeys.insert("expire_sessions_time_budget_ms");
+    validKeys.insert("subscription_tree_cleanup_slice_ms");
     validKeys.insert("websocket_set_real_ip_from");
     validKeys.insert("shared_subscription_targeting");
     validKeys.insert("max_incoming_topic_alias_value");
     validKeys.insert("max_outgoing_topic_alias_value");
+    validKeys.insert("cross_thread_publish_batching");
+    validKeys.insert("batched_write_flushing");
+    validKeys.insert("shared_payload_min_bytes");
+    validKeys.insert("io_uring_batched_sends");
+    validKeys.insert("listen_sockets_per_thread");
+    validKeys.insert("client_thread_assignment");
+    validKeys.insert("acl_cache_size");
+    validKeys.insert("preauthorize_literal_subscriptions");
 
     validListenKeys.insert("port");
     validListenKeys.insert("protocol");
@@ -532,6 +546,34 @@ void ConfigFileParser::loadFile(bool test)
                         throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
                 }
 
+                if (testKeyValidity(key, "retained_messages_wal", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.retainedMessagesWal = tmp;
+                }
+
+                if (testKeyValidity(key, "retained_messages_wal_sync_interval_ms", validKeys))
+                {
+                    const int newVal = std::stoi(value);
+                    if (newVal <= 0)
+                    {
+                        throw ConfigFileException(formatString("retained_messages_wal_sync_interval_ms value '%d' is invalid. It must be at least 1.", newVal));
+                    }
+                    tmpSettings.retainedMessagesWalSyncIntervalMs = newVal;
+                }
+
+                if (testKeyValidity(key, "retained_messages_lazy_loading", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.retainedMessagesLazyLoading = tmp;
+                }
+
+                if (testKeyValidity(key, "save_state_in_child_process", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.saveStateInChildProcess = tmp;
+                }
+
                 if (testKeyValidity(key, "expire_retained_messages_after_seconds", validKeys))
                 {
                     uint32_t newVal = std::stoi(value);
@@ -548,6 +590,26 @@ void ConfigFileParser::loadFile(bool test)
                     tmpSettings.expireRetainedMessagesTimeBudgetMs = newVal;
                 }
 
+                if (testKeyValidity(key, "expire_sessions_time_budget_ms", validKeys))
+                {
+                    const int newVal = std::stoi(value);
+                    if (newVal <= 0)
+                    {
+                        throw ConfigFileException(formatString("expire_sessions_time_budget_ms value '%d' is invalid. It must be at least 1.", newVal));
+                    }
+                    tmpSettings.expireSessionsTimeBudgetMs = newVal;
+                }
+
+                if (testKeyValidity(key, "subscription_tree_cleanup_slice_ms", validKeys))
+                {
+                    const int newVal = std::stoi(value);
+                    if (newVal <= 0)
+                    {
+                        throw ConfigFileException(formatString("subscription_tree_cleanup_slice_ms value '%d' is invalid. It must be at least 1.", newVal));
+                    }
+                    tmpSettings.subscriptionTreeCleanupSliceMs = newVal;
+                }
+
                 if (testKeyValidity(key, "websocket_set_real_ip_from", validKeys))
                 {
                     Network net(value);
@@ -565,6 +627,72 @@ void ConfigFileParser::loadFile(bool test)
                     else
                         throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
                 }
+
+                if (testKeyValidity(key, "cross_thread_publish_batching", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.crossThreadPublishBatching = tmp;
+                }
+
+                if (testKeyValidity(key, "batched_write_flushing", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.batchedWriteFlushing = tmp;
+                }
+
+                if (testKeyValidity(key, "shared_payload_min_bytes", validKeys))
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0)
+                    {
+                        throw ConfigFileException(formatString("shared_payload_min_bytes value '%d' is invalid. Valid values are 0 or higher. 0 means disabled.", newVal));
+                    }
+                    tmpSettings.sharedPayloadMinBytes = newVal;
+                }
+
+                if (testKeyValidity(key, "io_uring_batched_sends", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+#ifndef FLASHMQ_IO_URING
+                    if (tmp)
+                        throw ConfigFileException("io_uring_batched_sends can't be enabled: FlashMQ was built without io_uring support.");
+#endif
+                    tmpSettings.ioUringBatchedSends = tmp;
+                }
+
+                if (testKeyValidity(key, "listen_sockets_per_thread", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.listenSocketsPerThread = tmp;
+                }
+
+                if (testKeyValidity(key, "client_thread_assignment", validKeys))
+                {
+                    const std::string _val = str_tolower(value);
+
+                    if (_val == "round_robin")
+                        tmpSettings.clientThreadAssignment = ClientThreadAssignment::RoundRobin;
+                    else if (_val == "least_loaded")
+                        tmpSettings.clientThreadAssignment = ClientThreadAssignment::LeastLoaded;
+                    else
+                        throw ConfigFileException(formatString("Value '%s' for '%s' is invalid.", value.c_str(), key.c_str()));
+                }
+
+                if (testKeyValidity(key, "acl_cache_size", validKeys))
+                {
+                    int newVal = std::stoi(value);
+                    if (newVal < 0 || newVal > 16777216)
+                    {
+                        throw ConfigFileException(formatString("acl_cache_size value '%d' is invalid. Valid values are between 0 and 16777216. 0 means disabled.", newVal));
+                    }
+                    tmpSettings.aclCacheSize = newVal;
+                }
+
+                if (testKeyValidity(key, "preauthorize_literal_subscriptions", validKeys))
+                {
+                    bool tmp = stringTruthiness(value);
+                    tmpSettings.preauthorizeLiteralSubscriptions = tmp;
+                }
             }
         }
         catch (std::invalid_argument &ex) // catch for the stoi()
@@ -573,6 +701,12 @@ void ConfigFileParser::loadFile(bool test)
         }
     }
 
+    if (tmpSettings.ioUringBatchedSends && !tmpSettings.batchedWriteFlushing)
+        throw ConfigFileException("io_uring_batched_sends requires batched_write_flushing to be enabled.");
+
+    if (tmpSettings.listenSocketsPerThread && tmpSettings.clientThreadAssignment != ClientThreadAssignment::RoundRobin)
+        throw ConfigFileException("client_thread_assignment can't be used with listen_sockets_per_thread, where the kernel assigns the connections.");
+
     tmpSettings.authOptCompatWrap = AuthOptCompatWrap(pluginOpts);
     tmpSettings.flashmqpluginOpts = std::move(pluginOpts);
 
@@ -0,0 +1,76 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "durationhistogram.h"
+
+#include <algorithm>
+
+void DurationHistogram::record(std::chrono::nanoseconds duration)
+{
+    const uint64_t us = std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+    const int bucket = us == 0 ? 0 : std::min<int>(bucketCount - 1, 64 - __builtin_clzll(us));
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = maxMicroseconds.load(std::memory_order_relaxed);
+    while (us > max && !maxMicroseconds.compare_exchange_weak(max, us, std::memory_order_relaxed)) {}
+}
+
+uint64_t DurationHistogram::getCount() const
+{
+    return count.load(std::memory_order_relaxed);
+}
+
+uint64_t DurationHistogram::getMaxMicroseconds() const
+{
+    return maxMicroseconds.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief DurationHistogram::getPercentileMicroseconds
+ * @param percentile like 50 or 99.
+ * @return the upper bound of the bucket the percentile is in, but not more than the maximum seen. 0 when nothing was recorded.
+ */
+uint64_t DurationHistogram::getPercentileMicroseconds(int percentile) const
+{
+    std::array<uint64_t, bucketCount> copy;
+    uint64_t total = 0;
+
+    for (int i = 0; i < bucketCount; i++)
+    {
+        copy[i] = buckets[i].load(std::memory_order_relaxed);
+        total += copy[i];
+    }
+
+    if (total == 0)
+        return 0;
+
+    const uint64_t rank = std::max<uint64_t>(1, (total * percentile + 99) / 100);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < bucketCount; i++)
+    {
+        seen += copy[i];
+
+        if (seen >= rank)
+            return std::min<uint64_t>(1ULL << i, getMaxMicroseconds());
+    }
+
+    return getMaxMicroseconds();
+}
@@ -0,0 +1,49 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef DURATIONHISTOGRAM_H
+#define DURATIONHISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+/**
+ * @brief The DurationHistogram class counts durations in buckets of powers of two microseconds, for things like how long a lock was held.
+ *
+ * Recording is lock-free and can be done from any thread. Percentiles are the upper bound of the bucket they fall in, so they are
+ * accurate to a factor of two, which is enough to see stalls.
+ */
+class DurationHistogram
+{
+    static constexpr int bucketCount = 32;
+
+    // Bucket 0 has durations under 1 µs; bucket n has durations of at least 2^(n-1) and under 2^n µs.
+    std::array<std::atomic<uint64_t>, bucketCount> buckets {};
+    std::atomic<uint64_t> count {0};
+    std::atomic<uint64_t> maxMicroseconds {0};
+
+public:
+    void record(std::chrono::nanoseconds duration);
+    uint64_t getCount() const;
+    uint64_t getMaxMicroseconds() const;
+    uint64_t getPercentileMicroseconds(int percentile) const;
+};
+
+#endif // DURATIONHISTOGRAM_H
@@ -65,9 +65,44 @@ void flashmq_continue_async_authentication(const std::weak_ptr<Client> &client,
     if (!td)
         return;
 
+    Authentication *auth = ThreadGlobals::getAuth();
+    if (auth)
+        auth->registerCheckAnswered(c.get());
+
     td->queueContinuationOfAuthentication(c, result, authMethod, returnData);
 }
 
+std::weak_ptr<Client> flashmq_get_acl_check_client(uint64_t &check_id)
+{
+    check_id = 0;
+
+    Authentication *auth = ThreadGlobals::getAuth();
+
+    if (!auth)
+        return std::weak_ptr<Client>();
+
+    return auth->getAsyncAclCheckClient(check_id);
+}
+
+void flashmq_continue_async_acl_check(const std::weak_ptr<Client> &client, uint64_t check_id, AuthResult result)
+{
+    std::shared_ptr<Client> c = client.lock();
+
+    if (!c)
+        return;
+
+    std::shared_ptr<ThreadData> td = c->lockThreadData();
+
+    if (!td)
+        return;
+
+    Authentication *auth = ThreadGlobals::getAuth();
+    if (auth)
+        auth->registerCheckAnswered(c.get());
+
+    td->queueContinuationOfAclCheck(c, check_id, result);
+}
+
 void flashmq_publish_message(const std::string &topic, const uint8_t qos, const bool retain, const std::string &payload, uint32_t expiryInterval,
                              const std::vector<std::pair<std::string, std::string>> *userProperties,
                              const std::string *responseTopic, const std::string *correlationData, const std::string *contentType)
@@ -189,3 +224,13 @@ void flashmq_remove_task(uint32_t id)
 
     d->removeTask(id);
 }
+
+void flashmq_acl_result_cacheable()
+{
+    AclCache::pluginResultCacheable = true;
+}
+
+void flashmq_invalidate_acl_cache()
+{
+    AclCache::invalidateAll();
+}
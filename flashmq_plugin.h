@@ -31,7 +31,7 @@
 #include <functional>
 #include <string_view>
 
-#define FLASHMQ_PLUGIN_VERSION 2
+#define FLASHMQ_PLUGIN_VERSION 3
 
 // Compatible with Mosquitto, for (auth) plugin compatability.
 #define LOG_NONE 0x00
@@ -67,7 +67,8 @@ enum class AclAccess
 /**
  * @brief The AuthResult enum's numbers are compatible with Mosquitto's auth result.
  *
- * async = defer the decision until you have the result from an async call, which can be submitted with flashmq_continue_async_authentication().
+ * async = defer the decision until you have the result from an async call, which can be submitted with flashmq_continue_async_authentication(),
+ * or flashmq_continue_async_acl_check() for ACL checks.
  *
  * auth_continue = part of MQTT5 extended authentication, which can be a back-and-forth between server and client.
  */
@@ -90,6 +91,28 @@ enum class ExtendedAuthStage
     Continue = 30
 };
 
+/**
+ * @brief The FlashMQCheckRequest struct is a login or ACL check you returned AuthResult::async for. See flashmq_plugin_check_batch().
+ *
+ * For login checks, 'access' is 'none' and the fields from 'topic' on are empty. For ACL checks, the password is empty. Give the 'aclCheckId'
+ * of ACL checks to flashmq_continue_async_acl_check().
+ */
+struct FlashMQCheckRequest
+{
+    std::weak_ptr<Client> client;
+    uint64_t aclCheckId = 0;
+    AclAccess access = AclAccess::none;
+    std::string clientid;
+    std::string username;
+    std::string password;
+    std::string topic;
+    std::vector<std::string> subtopics;
+    std::string payload;
+    uint8_t qos = 0;
+    bool retain = false;
+    std::vector<std::pair<std::string, std::string>> userProperties;
+};
+
 /**
  * @brief flashmq_logf calls the internal logger of FlashMQ. The logger mutexes all access, so is thread-safe, and writes to disk
  * asynchronously, so it won't hold you up.
@@ -163,6 +186,32 @@ void flashmq_plugin_remove_subscription(const std::string &clientid, const std::
  */
 void flashmq_continue_async_authentication(const std::weak_ptr<Client> &client, AuthResult result, const std::string &authMethod, const std::string &returnData);
 
+/**
+ * @brief flashmq_get_acl_check_client gives the client whose publish or subscribe is being checked, for when you want to return
+ *        AuthResult::async from 'flashmq_plugin_acl_check()'. Only call it from there.
+ * @param check_id is set to the identifier of this check, to give to flashmq_continue_async_acl_check().
+ * @return an empty pointer when the check can't be async, like when it's for delivering a message, or for a will.
+ *
+ * [Function provided by FlashMQ]
+ */
+std::weak_ptr<Client> flashmq_get_acl_check_client(uint64_t &check_id);
+
+/**
+ * @brief flashmq_continue_async_acl_check gives the result of an ACL check for which you returned AuthResult::async.
+ * @param client as given by flashmq_get_acl_check_client().
+ * @param check_id as given by flashmq_get_acl_check_client(), or the 'aclCheckId' of a FlashMQCheckRequest. A continuation with an id
+ *        that is not of the check the client waits for is ignored, so a late or duplicate one can't decide another packet.
+ * @param result
+ *
+ * Until then, the packet, and all the packets the client sends after it, wait. So, there is ever only one async ACL check per client
+ * to continue, and the order of publishes is kept. Other clients are not held up. The result is not cached, see 'acl_cache_size'.
+ *
+ * Can be called from any thread. The action will be queued in the proper thread.
+ *
+ * [Function provided by FlashMQ]
+ */
+void flashmq_continue_async_acl_check(const std::weak_ptr<Client> &client, uint64_t check_id, AuthResult result);
+
 /**
  * @brief flashmq_publish_message Publish a message from the plugin.
  *
@@ -268,6 +317,25 @@ uint32_t flashmq_add_task(std::function<void()> f, uint32_t delay_in_ms);
  */
 void flashmq_remove_task(uint32_t id);
 
+/**
+ * @brief flashmq_acl_result_cacheable can be called in 'flashmq_plugin_acl_check()', to say the result only depends on the access,
+ *        client ID, username and topic. FlashMQ may then cache it, when 'acl_cache_size' is set. Results are otherwise not cached.
+ *
+ * Don't call it when the result depends on the payload, QoS, retain, user properties or time.
+ *
+ * [Function provided by FlashMQ]
+ */
+void flashmq_acl_result_cacheable();
+
+/**
+ * @brief flashmq_invalidate_acl_cache makes FlashMQ forget all cached ACL results, for when permissions change.
+ *
+ * Can be called from any thread.
+ *
+ * [Function provided by FlashMQ]
+ */
+void flashmq_invalidate_acl_cache();
+
 /**
  * @brief flashmq_plugin_version must return FLASHMQ_PLUGIN_VERSION.
  * @return FLASHMQ_PLUGIN_VERSION.
@@ -459,12 +527,31 @@ void flashmq_plugin_client_disconnected(void *thread_data, const std::string &cl
  * When the 'access' is 'subscribe' and it's a shared subscription (like '$share/myshare/one/two/three'), you only get
  * the effective topic filter (like 'one/two/three').
  *
+ * For 'write' and 'subscribe' checks of a client's packets, you can return AuthResult::async, when you need blocking IO to decide. See
+ * flashmq_get_acl_check_client() and flashmq_continue_async_acl_check().
+ *
  * [Must be implemented by plugin]
  */
 AuthResult flashmq_plugin_acl_check(void *thread_data, const AclAccess access, const std::string &clientid, const std::string &username,
                                     const std::string &topic, const std::vector<std::string> &subtopics, std::string_view payload,
                                     const uint8_t qos, const bool retain, const std::vector<std::pair<std::string, std::string>> *userProperties);
 
+/**
+ * @brief flashmq_plugin_check_batch gives you the login and ACL checks you returned AuthResult::async for, collected during one iteration of
+ *        the thread's event loop. You can then decide them with one request to your back-end, instead of one each, like when many
+ *        clients reconnect at once.
+ * @param thread_data is memory allocated in flashmq_plugin_allocate_thread_memory().
+ * @param requests has at most 1000 checks. More are given in several calls.
+ *
+ * Give the results with flashmq_continue_async_authentication() and flashmq_continue_async_acl_check(), as usual. That can be later,
+ * and from any thread. Checks you don't return AuthResult::async for are not in the batch, so you can still answer those directly.
+ *
+ * It's called in the event loop, so don't block here.
+ *
+ * [Can optionally be implemented by plugin, since version 3]
+ */
+void flashmq_plugin_check_batch(void *thread_data, const std::vector<FlashMQCheckRequest> &requests);
+
 /**
  * @brief flashmq_plugin_extended_auth can be used to implement MQTT 5 extended auth. This is optional.
  * @param thread_data is the memory you allocated in flashmq_plugin_allocate_thread_memory.
@@ -0,0 +1,169 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FLATMAP_H
+#define FLATMAP_H
+
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <utility>
+#include <cassert>
+
+/**
+ * @brief The FlatMap class is a map stored as one contiguous vector, for the many small maps in the subscription tree.
+ *
+ * Most nodes in the tree have only a few children and subscribers, and an unordered_map is expensive for those: it's 56 bytes
+ * when empty and an allocation per element, and looking something up is several pointer chases. Here, small maps are just
+ * searched linearly, and only when they grow past indexThreshold, a hash index pointing into the vector is made. The index
+ * only holds the hash and position of each element, so it doesn't store the keys a second time.
+ *
+ * Erasing moves the last element in the place of the erased one, so order is not preserved and iterators and references to
+ * elements are invalidated by erase and insert, like with a vector. Keys that are views (like SubtopicKey) must refer to
+ * something that doesn't move when the element moves.
+ */
+template<typename K, typename V, typename Hash = std::hash<K>, size_t indexThreshold = 8>
+class FlatMap
+{
+    typedef std::unordered_multimap<size_t, size_t> Index;
+
+    std::vector<std::pair<K, V>> items;
+    std::unique_ptr<Index> index;
+
+    void makeIndex()
+    {
+        index = std::make_unique<Index>();
+        index->reserve(items.size());
+
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            index->emplace(Hash()(items[i].first), i);
+        }
+    }
+
+    typename Index::iterator findInIndex(size_t hash, size_t position)
+    {
+        auto range = index->equal_range(hash);
+
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            if (it->second == position)
+                return it;
+        }
+
+        assert(false);
+        return index->end();
+    }
+
+public:
+    typedef typename std::vector<std::pair<K, V>>::iterator iterator;
+    typedef typename std::vector<std::pair<K, V>>::const_iterator const_iterator;
+
+    iterator begin() { return items.begin(); }
+    iterator end() { return items.end(); }
+    const_iterator begin() const { return items.begin(); }
+    const_iterator end() const { return items.end(); }
+
+    bool empty() const { return items.empty(); }
+    size_t size() const { return items.size(); }
+
+    iterator find(const K &key)
+    {
+        if (index)
+        {
+            auto range = index->equal_range(Hash()(key));
+
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (items[it->second].first == key)
+                    return items.begin() + it->second;
+            }
+
+            return items.end();
+        }
+
+        for (auto it = items.begin(); it != items.end(); ++it)
+        {
+            if (it->first == key)
+                return it;
+        }
+
+        return items.end();
+    }
+
+    const_iterator find(const K &key) const
+    {
+        return const_cast<FlatMap*>(this)->find(key);
+    }
+
+    std::pair<iterator, bool> emplace(const K &key, V &&value)
+    {
+        auto pos = find(key);
+        if (pos != items.end())
+            return std::make_pair(pos, false);
+
+        items.emplace_back(key, std::move(value));
+
+        if (index)
+            index->emplace(Hash()(items.back().first), items.size() - 1);
+        else if (items.size() > indexThreshold)
+            makeIndex();
+
+        return std::make_pair(items.end() - 1, true);
+    }
+
+    V &operator[](const K &key)
+    {
+        auto pos = find(key);
+        if (pos != items.end())
+            return pos->second;
+
+        return emplace(key, V()).first->second;
+    }
+
+    /**
+     * @brief FlatMap::erase erases by moving the last element in its place.
+     * @param pos
+     * @return iterator at the same position, which is now the element that was last, or end().
+     */
+    iterator erase(iterator pos)
+    {
+        assert(pos != items.end());
+
+        const size_t i = pos - items.begin();
+
+        if (index)
+            index->erase(findInIndex(Hash()(pos->first), i));
+
+        if (i != items.size() - 1)
+        {
+            *pos = std::move(items.back());
+
+            if (index)
+                findInIndex(Hash()(pos->first), items.size() - 1)->second = i;
+        }
+
+        items.pop_back();
+
+        if (index && items.size() <= indexThreshold / 2)
+            index.reset();
+
+        return items.begin() + i;
+    }
+};
+
+#endif // FLATMAP_H
@@ -28,6 +28,8 @@ class Session;
 class Settings;
 class Mqtt5PropertyBuilder;
 class SessionsAndSubscriptionsDB;
+class RetainedMessagesDB;
+enum class AuthResult;
 
 
 #endif // FORWARD_DECLARATIONS_H
@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 #include "derivablecounter.h"
+#include "durationhistogram.h"
+#include "shardedcounter.h"
 
 class GlobalStats
 {
@@ -13,6 +15,26 @@ public:
     static GlobalStats *getInstance();
 
     DerivableCounter socketConnects;
+    DerivableCounter subscriptionNodesReclaimed;
+
+    // What the retained messages write-ahead log and the saves of the retained messages DB write, to see the write amplification.
+    DerivableCounter retainedMessagesWalBytesWritten;
+    DerivableCounter retainedMessagesWalSyncs;
+    DerivableCounter retainedMessagesDbBytesWritten;
+
+    // Kept up to date as subscriptions come and go, so they can be published without walking the subscription tree. Subscriptions of a
+    // session count until the session is destroyed; see Session::adjustSubscriptionCount().
+    ShardedCounter subscriptions;
+    ShardedCounter sharedSubscriptionGroups;
+
+    // How long the sessions and subscriptions write lock is held by housekeeping, so it's visible when it stalls the publishes.
+    DurationHistogram sessionExpiryLockHold;
+    DurationHistogram subscriptionTreeCleanupLockHold;
+
+    // Of 'save_state_in_child_process': how long the worker threads are paused to fork, and how many pages were copied on write in the
+    // last child. The latter grows with what the broker changes while the child saves.
+    DurationHistogram saveStateForkPause;
+    std::atomic<uint64_t> saveStateCopiedOnWritePages {0};
 };
 
 #endif // GLOBALSTATS_H
@@ -0,0 +1,176 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "iouring.h"
+
+#ifdef FLASHMQ_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <algorithm>
+
+#include "utils.h"
+
+IoUring::IoUring(unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+
+    ringFd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (ringFd < 0)
+        throw std::runtime_error(formatString("io_uring_setup failed: %s", strerror(errno)));
+
+    this->entries = params.sq_entries;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    void *_sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || _sqes == MAP_FAILED)
+    {
+        const int err = errno;
+
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (cqRing != MAP_FAILED)
+            munmap(cqRing, cqRingSize);
+        if (_sqes != MAP_FAILED)
+            munmap(_sqes, sqesSize);
+        close(ringFd);
+
+        throw std::runtime_error(formatString("Mapping io_uring failed: %s", strerror(err)));
+    }
+
+    sqes = static_cast<io_uring_sqe*>(_sqes);
+
+    char *sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+    sqRingMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+    cqRingMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    sqTailLocal = *sqTail;
+}
+
+IoUring::~IoUring()
+{
+    munmap(sqes, sqesSize);
+    munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    close(ringFd);
+}
+
+/**
+ * @brief IoUring::prepareSendMsg queues a sendmsg. Nothing happens until submitAndWaitAll().
+ * @param fd
+ * @param msg must stay valid until the completion is popped.
+ * @param flags like for sendmsg(). Give MSG_DONTWAIT to get -EAGAIN, instead of the kernel waiting for the socket to be writable.
+ * @param userData is given back with the completion.
+ */
+void IoUring::prepareSendMsg(int fd, const msghdr *msg, int flags, uint64_t userData)
+{
+    if (pendingSubmissions >= entries)
+        throw std::runtime_error("Submitting more than fits in the io_uring.");
+
+    const unsigned int index = sqTailLocal & *sqRingMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = userData;
+
+    sqArray[index] = index;
+    sqTailLocal++;
+    pendingSubmissions++;
+}
+
+/**
+ * @brief IoUring::submitAndWaitAll submits the prepared operations and waits for all of them to complete, in one system call if all is well.
+ */
+void IoUring::submitAndWaitAll()
+{
+    if (pendingSubmissions == 0)
+        return;
+
+    __atomic_store_n(sqTail, sqTailLocal, __ATOMIC_RELEASE);
+
+    unsigned int toSubmit = pendingSubmissions;
+    const unsigned int toWaitFor = pendingSubmissions;
+    pendingSubmissions = 0;
+
+    unsigned int completed = 0;
+
+    while (true)
+    {
+        completed = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) - *cqHead;
+
+        if (toSubmit == 0 && completed >= toWaitFor)
+            break;
+
+        const int n = syscall(__NR_io_uring_enter, ringFd, toSubmit, toWaitFor - std::min(completed, toWaitFor), IORING_ENTER_GETEVENTS, nullptr, 0);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(formatString("io_uring_enter failed: %s", strerror(errno)));
+        }
+
+        toSubmit -= std::min<unsigned int>(n, toSubmit);
+    }
+}
+
+/**
+ * @brief IoUring::popCompletion gets the next completion.
+ * @param userData as given when preparing.
+ * @param result is what the system call would have returned, or -errno on error.
+ * @return false when there are no more.
+ */
+bool IoUring::popCompletion(uint64_t &userData, int &result)
+{
+    const unsigned int head = *cqHead;
+
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const io_uring_cqe &cqe = cqes[head & *cqRingMask];
+    userData = cqe.user_data;
+    result = cqe.res;
+
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef IOURING_H
+#define IOURING_H
+
+#ifdef FLASHMQ_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/**
+ * @brief The IoUring class is a minimal io_uring submission and completion ring, on the bare system calls, so we don't need liburing.
+ *
+ * It's used to send the output of many clients with one system call. See 'io_uring_batched_sends'. It's not thread-safe; each
+ * worker thread has its own.
+ */
+class IoUring
+{
+    int ringFd = -1;
+    unsigned int entries = 0;
+
+    void *sqRing = nullptr;
+    size_t sqRingSize = 0;
+    void *cqRing = nullptr;
+    size_t cqRingSize = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqesSize = 0;
+
+    unsigned int *sqHead = nullptr;
+    unsigned int *sqTail = nullptr;
+    unsigned int *sqRingMask = nullptr;
+    unsigned int *sqArray = nullptr;
+    unsigned int *cqHead = nullptr;
+    unsigned int *cqTail = nullptr;
+    unsigned int *cqRingMask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    unsigned int sqTailLocal = 0;
+    unsigned int pendingSubmissions = 0;
+
+public:
+    IoUring(unsigned int entries);
+    IoUring(const IoUring &other) = delete;
+    IoUring(IoUring &&other) = delete;
+    ~IoUring();
+
+    unsigned int getEntries() const { return entries; }
+    unsigned int getPendingSubmissions() const { return pendingSubmissions; }
+    void prepareSendMsg(int fd, const struct msghdr *msg, int flags, uint64_t userData);
+    void submitAndWaitAll();
+    bool popCompletion(uint64_t &userData, int &result);
+};
+
+#endif
+
+#endif // IOURING_H
@@ -417,6 +417,32 @@ ssize_t IoWrapper::writeOrSslWrite(int fd, const void *buf, size_t nbytes, IoWra
     return n;
 }
 
+/**
+ * @brief IoWrapper::writevPlain does a writev() of several buffers at once, so they don't have to be copied together first. It's only for
+ * connections without SSL and websockets, because those need to process the data into frames or records.
+ * @return bytes written, or -1 on the errors reported in 'error'. Other errors throw.
+ */
+ssize_t IoWrapper::writevPlain(int fd, const iovec *iov, int iovcnt, IoWrapResult *error)
+{
+    assert(!ssl && !websocket);
+    assert(iovcnt > 0);
+
+    *error = IoWrapResult::Success;
+
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0)
+    {
+        if (errno == EINTR)
+            *error = IoWrapResult::Interrupted;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+            *error = IoWrapResult::Wouldblock;
+        else
+            check<std::runtime_error>(n);
+    }
+
+    return n;
+}
+
 // Use a small intermediate buffer to write (partial) websocket frames to our normal read buffer. MQTT is already a frames protocol, so we don't
 // care about websocket frames being incomplete.
 ssize_t IoWrapper::readWebsocketAndOrSsl(int fd, void *buf, size_t nbytes, IoWrapResult *error)
@@ -147,6 +147,7 @@ public:
 
     ssize_t readWebsocketAndOrSsl(int fd, void *buf, size_t nbytes, IoWrapResult *error);
     ssize_t writeWebsocketAndOrSsl(int fd, const void *buf, size_t nbytes, IoWrapResult *error);
+    ssize_t writevPlain(int fd, const struct iovec *iov, int iovcnt, IoWrapResult *error);
 
     void resetBuffersIfEligible();
 };
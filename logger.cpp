@@ -21,6 +21,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <iomanip>
 #include <string.h>
 #include <functional>
+#include <pthread.h>
 
 #include "exceptions.h"
 #include "utils.h"
@@ -68,6 +69,8 @@ Logger::Logger()
 
     pthread_t native = this->writerThread.native_handle();
     pthread_setname_np(native, "LogWriter");
+
+    pthread_atfork(&Logger::prepareFork, &Logger::parentAfterFork, &Logger::childAfterFork);
 }
 
 Logger::~Logger()
@@ -232,9 +235,36 @@ void Logger::writeLog()
     }
 }
 
+/**
+ * @brief Logger::prepareFork makes sure no other thread holds the log mutex when forking, otherwise the child would find it locked forever.
+ */
+void Logger::prepareFork()
+{
+    if (instance)
+        instance->logMutex.lock();
+}
+
+void Logger::parentAfterFork()
+{
+    if (instance)
+        instance->logMutex.unlock();
+}
+
+/**
+ * @brief Logger::childAfterFork makes the child drop its log lines, because there is no writer thread. The parent logs what it reports.
+ */
+void Logger::childAfterFork()
+{
+    if (!instance)
+        return;
+
+    instance->logMutex.unlock();
+    instance->inForkedChild = true;
+}
+
 void Logger::logf(int level, const char *str, va_list valist)
 {
-    if ((level & curLogLevel) == 0)
+    if ((level & curLogLevel) == 0 || inForkedChild)
         return;
 
     time_t time = std::time(nullptr);
@@ -59,12 +59,16 @@ class Logger
     FILE *file = nullptr;
     bool alsoLogToStd = true;
     bool reload = false;
+    bool inForkedChild = false; // The writer thread doesn't exist there. See 'save_state_in_child_process'.
 
     Logger();
     ~Logger();
     std::string getLogLevelString(int level) const;
     void reOpen();
     void writeLog();
+    static void prepareFork();
+    static void parentAfterFork();
+    static void childAfterFork();
 
 public:
     static Logger *getInstance();
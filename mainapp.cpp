@@ -24,6 +24,12 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <sys/sysinfo.h>
 #include <arpa/inet.h>
 #include <memory>
+#include <limits>
+#include <cstring>
+#include <climits>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -81,9 +87,6 @@ MainApp::MainApp(const std::string &configFilePath) :
         timer.addCallback(f, interval, "Purge expired retained messages.");
     }
 
-    auto fKeepAlive = std::bind(&MainApp::queueKeepAliveCheckAtAllThreads, this);
-    timer.addCallback(fKeepAlive, 5000, "keep-alive check");
-
     auto fPasswordFileReload = std::bind(&MainApp::queuePasswordFileReloadAllThreads, this);
     timer.addCallback(fPasswordFileReload, 2000, "Password file reload.");
 
@@ -100,18 +103,25 @@ MainApp::MainApp(const std::string &configFilePath) :
     {
         const std::string retainedDbPath = settings.getRetainedMessagesDBFile();
         if (settings.retainedMessagesMode == RetainedMessagesMode::Enabled)
+        {
             subscriptionStore->loadRetainedMessages(settings.getRetainedMessagesDBFile());
+
+            if (settings.retainedMessagesWal)
+            {
+                subscriptionStore->startRetainedMessagesWal(retainedDbPath);
+
+                auto fSyncWal = std::bind(&MainApp::syncRetainedMessagesWal, this);
+                timer.addCallback(fSyncWal, settings.retainedMessagesWalSyncIntervalMs, "Sync retained messages write-ahead log.");
+            }
+        }
         else
             logger->logf(LOG_INFO, "Not loading '%s', because 'retained_messages_mode' is not 'enabled'.", retainedDbPath.c_str());
 
         subscriptionStore->loadSessionsAndSubscriptions(settings.getSessionsDBFile());
     }
 
-    auto fSaveState = std::bind(&MainApp::saveStateInThread, this);
+    auto fSaveState = std::bind(&MainApp::saveStateInThread, this, false);
     timer.addCallback(fSaveState, 900000, "Save state.");
-
-    auto fSendPendingWills = std::bind(&MainApp::queueSendQueuedWills, this);
-    timer.addCallback(fSendPendingWills, 2000, "Publish pending wills.");
 }
 
 MainApp::~MainApp()
@@ -154,7 +164,15 @@ void MainApp::showLicense()
     puts("Author: Wiebe Cazemier <wiebe@halfgaar.net>");
 }
 
-std::list<ScopedSocket> MainApp::createListenSocket(const std::shared_ptr<Listener> &listener)
+/**
+ * @brief MainApp::createListenSocket creates the sockets of a listener, and adds them to an epoll set.
+ * @param listener
+ * @param epollFd is of the main thread, or of a worker thread with 'listen_sockets_per_thread'.
+ * @return the sockets, or none when creating one of them failed.
+ *
+ * The sockets have SO_REUSEPORT, so each thread can have its own socket on the same address, and the kernel divides the connections.
+ */
+std::list<ScopedSocket> MainApp::createListenSocket(const std::shared_ptr<Listener> &listener, int epollFd)
 {
     std::list<ScopedSocket> result;
 
@@ -183,9 +201,9 @@ std::list<ScopedSocket> MainApp::createListenSocket(const std::shared_ptr<Listen
 
             int listen_fd = check<std::runtime_error>(socket(family, SOCK_STREAM, 0));
 
-            // Not needed for now. Maybe I will make multiple accept threads later, with SO_REUSEPORT.
             int optval = 1;
-            check<std::runtime_error>(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &optval, sizeof(optval)));
+            check<std::runtime_error>(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)));
+            check<std::runtime_error>(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)));
 
             int flags = fcntl(listen_fd, F_GETFL);
             check<std::runtime_error>(fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK ));
@@ -198,7 +216,7 @@ std::list<ScopedSocket> MainApp::createListenSocket(const std::shared_ptr<Listen
 
             ev.data.fd = listen_fd;
             ev.events = EPOLLIN;
-            check<std::runtime_error>(epoll_ctl(this->epollFdAccept, EPOLL_CTL_ADD, listen_fd, &ev));
+            check<std::runtime_error>(epoll_ctl(epollFd, EPOLL_CTL_ADD, listen_fd, &ev));
 
             result.push_back(ScopedSocket(listen_fd));
 
@@ -220,12 +238,40 @@ void MainApp::wakeUpThread()
     check<std::runtime_error>(write(taskEventFd, &one, sizeof(uint64_t)));
 }
 
-void MainApp::queueKeepAliveCheckAtAllThreads()
+/**
+ * @brief MainApp::getThreadForNewClient selects the thread to give an accepted connection to. See 'client_thread_assignment'.
+ * @return
+ *
+ * The least loaded thread is the one with the lowest client count, weighed by how busy its event loop was in the last second. The
+ * client count counts immediately, so a burst of connections is still spread. The search starts at the next thread in turn, so ties
+ * are divided like round robin.
+ */
+std::shared_ptr<ThreadData> &MainApp::getThreadForNewClient()
 {
-    for (std::shared_ptr<ThreadData> &thread : threads)
+    const uint start = nextThreadIndex++;
+
+    if (settings.clientThreadAssignment == ClientThreadAssignment::RoundRobin)
+        return threads[start % num_threads];
+
+    size_t bestIndex = start % num_threads;
+    uint64_t bestScore = std::numeric_limits<uint64_t>::max();
+
+    for (int i = 0; i < num_threads; i++)
     {
-        thread->queueDoKeepAliveCheck();
+        const size_t index = (start + i) % num_threads;
+        const std::shared_ptr<ThreadData> &t = threads[index];
+
+        // A fully busy thread counts its clients five times.
+        const uint64_t score = static_cast<uint64_t>(t->getNrOfClients() + 1) * (1000 + 4 * t->getLoopBusyPermille());
+
+        if (score < bestScore)
+        {
+            bestScore = score;
+            bestIndex = index;
+        }
     }
+
+    return threads[bestIndex];
 }
 
 void MainApp::queuePasswordFileReloadAllThreads()
@@ -267,8 +313,9 @@ void MainApp::queuePublishStatsOnDollarTopic()
 
 /**
  * @brief MainApp::saveStateInThread starts a thread for disk IO, because file IO is not async.
+ * @param retainedMessagesOnly is for compacting the retained messages write-ahead log, without saving the sessions.
  */
-void MainApp::saveStateInThread()
+void MainApp::saveStateInThread(bool retainedMessagesOnly)
 {
     // Prevent queueing it again when it's still running.
     std::unique_lock<std::mutex> locker(saveStateMutex, std::try_to_lock);
@@ -279,20 +326,29 @@ void MainApp::saveStateInThread()
     if (saveStateThread.joinable())
         saveStateThread.join();
 
-    auto f = std::bind(&MainApp::saveState, this, this->settings);
+    auto f = std::bind(&MainApp::saveState, this, this->settings, retainedMessagesOnly);
     saveStateThread = std::thread(f);
 
     pthread_t native = saveStateThread.native_handle();
     pthread_setname_np(native, "SaveState");
 }
 
-void MainApp::queueSendQueuedWills()
+/**
+ * @brief MainApp::syncRetainedMessagesWal writes the changes to retained messages logged since the last time, with one fsync. It runs on the
+ * timer thread, so the worker threads don't wait for the disk.
+ */
+void MainApp::syncRetainedMessagesWal()
 {
-    if (!threads.empty())
+    try
     {
-        int threadnr = rand() % threads.size();
-        std::shared_ptr<ThreadData> t = threads[threadnr];
-        t->queueSendingQueuedWills();
+        subscriptionStore->syncRetainedMessagesWal();
+
+        if (subscriptionStore->retainedMessagesWalNeedsCompaction())
+            saveStateInThread(true);
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Error syncing retained messages write-ahead log: %s", ex.what());
     }
 }
 
@@ -329,8 +385,11 @@ void MainApp::queueRetainedMessageExpiration()
 /**
  * @brief MainApp::saveState
  * @param settings A local settings, copied from a std::bind copy, because of read safety.
+ * @param retainedMessagesOnly see saveStateInThread().
+ *
+ * With the retained messages write-ahead log, the retained messages are only saved when the log has grown enough, and on exit.
  */
-void MainApp::saveState(const Settings &settings)
+void MainApp::saveState(const Settings &settings, bool retainedMessagesOnly)
 {
     std::lock_guard<std::mutex> lg(saveStateMutex);
 
@@ -339,10 +398,26 @@ void MainApp::saveState(const Settings &settings)
         if (!settings.storageDir.empty())
         {
             const std::string retainedDBPath = settings.getRetainedMessagesDBFile();
-            if (settings.retainedMessagesMode == RetainedMessagesMode::Enabled)
-                subscriptionStore->saveRetainedMessages(retainedDBPath);
-            else
+            bool saveRetainedMessages = false;
+            if (settings.retainedMessagesMode != RetainedMessagesMode::Enabled)
                 logger->logf(LOG_INFO, "Not saving '%s', because 'retained_messages_mode' is not 'enabled'.", retainedDBPath.c_str());
+            else if (running && subscriptionStore->hasRetainedMessagesWal() && !subscriptionStore->retainedMessagesWalNeedsCompaction())
+                logger->logf(LOG_DEBUG, "Not saving '%s' yet, because the write-ahead log has the changes.", retainedDBPath.c_str());
+            else
+                saveRetainedMessages = true;
+
+            // On exit, the threads are gone, so there is nothing to gain from it.
+            if (running && settings.saveStateInChildProcess && (saveRetainedMessages || !retainedMessagesOnly))
+            {
+                if (saveStateInChildProcess(settings, saveRetainedMessages, !retainedMessagesOnly))
+                    return;
+            }
+
+            if (saveRetainedMessages)
+                subscriptionStore->saveRetainedMessages(retainedDBPath);
+
+            if (retainedMessagesOnly)
+                return;
 
             const std::string sessionsDBPath = settings.getSessionsDBFile();
             subscriptionStore->saveSessionsAndSubscriptions(sessionsDBPath);
@@ -356,6 +431,146 @@ void MainApp::saveState(const Settings &settings)
     }
 }
 
+/**
+ * @brief MainApp::saveStateInChildProcess saves in a forked child, which has a copy-on-write image of the memory, so the saving doesn't take
+ * the locks of the subscription store. See 'save_state_in_child_process'.
+ * @return false when the worker threads couldn't be paused, and nothing was done.
+ *
+ * The worker threads are paused for the fork, so the child doesn't get anything they were in the middle of changing. The child only writes
+ * the files; the parent finishes the save, like removing the write-ahead logs that are in the saved DB, and reports.
+ */
+bool MainApp::saveStateInChildProcess(const Settings &settings, bool saveRetainedMessages, bool saveSessions)
+{
+    // Fixed size, so it's written in one go, and read in one go.
+    struct ChildResult
+    {
+        bool success = false;
+        uint64_t retainedBytesWritten = 0;
+        uint64_t privateDirtyKb = 0;
+        char error[256] = {};
+    };
+
+    static_assert(sizeof(ChildResult) <= PIPE_BUF);
+
+    const std::string retainedDBPath = settings.getRetainedMessagesDBFile();
+    const std::string sessionsDBPath = settings.getSessionsDBFile();
+
+    const std::chrono::time_point<std::chrono::steady_clock> pauseStart = std::chrono::steady_clock::now();
+
+    std::shared_ptr<ThreadsPause> pause = std::make_shared<ThreadsPause>();
+
+    for (std::shared_ptr<ThreadData> &thread : threads)
+    {
+        thread->queuePause(pause);
+    }
+
+    if (!pause->waitForThreads(threads.size(), std::chrono::seconds(5)))
+    {
+        pause->release();
+        logger->logf(LOG_WARNING, "Not all threads could be paused to fork, so saving state in this thread.");
+        return false;
+    }
+
+    uint64_t walGeneration = std::numeric_limits<uint64_t>::max();
+    if (saveRetainedMessages)
+        walGeneration = subscriptionStore->startSavingRetainedMessages();
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        pause->release();
+        throw std::runtime_error(formatString("Can't make pipe for the child process: %s", strerror(errno)));
+    }
+
+    const std::chrono::time_point<std::chrono::steady_clock> forkStart = std::chrono::steady_clock::now();
+    const pid_t pid = subscriptionStore->forkWithStoreLocked();
+    const std::chrono::time_point<std::chrono::steady_clock> forkEnd = std::chrono::steady_clock::now();
+
+    if (pid == 0)
+    {
+        // The threads don't exist here, and nothing else refers to the copy of the memory, so nothing of it is cleaned up on exit.
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        closeAllFdsExcept(fds[1]);
+
+        ChildResult result;
+
+        try
+        {
+            if (saveRetainedMessages)
+                result.retainedBytesWritten = subscriptionStore->writeRetainedMessages(retainedDBPath);
+
+            if (saveSessions)
+                subscriptionStore->saveSessionsAndSubscriptions(sessionsDBPath);
+
+            result.success = true;
+        }
+        catch (std::exception &ex)
+        {
+            strncpy(result.error, ex.what(), sizeof(result.error) - 1);
+        }
+
+        result.privateDirtyKb = getPrivateDirtyKb();
+
+        if (write(fds[1], &result, sizeof(result)) < 0)
+            _exit(2);
+
+        _exit(result.success ? 0 : 1);
+    }
+
+    pause->release();
+    const std::chrono::time_point<std::chrono::steady_clock> pauseEnd = std::chrono::steady_clock::now();
+    close(fds[1]);
+
+    if (pid < 0)
+    {
+        close(fds[0]);
+        throw std::runtime_error(formatString("Forking to save state failed: %s", strerror(errno)));
+    }
+
+    GlobalStats *globalStats = GlobalStats::getInstance();
+    globalStats->saveStateForkPause.record(pauseEnd - pauseStart);
+
+    ChildResult result;
+    size_t bytesRead = 0;
+    while (bytesRead < sizeof(result))
+    {
+        const ssize_t n = read(fds[0], reinterpret_cast<char*>(&result) + bytesRead, sizeof(result) - bytesRead);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        bytesRead += n;
+    }
+
+    close(fds[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (bytesRead < sizeof(result))
+        throw std::runtime_error(formatString("Child process %d saving state ended without result, with status %d.", pid, status));
+
+    if (!result.success)
+        throw std::runtime_error(formatString("In child process %d: %s", pid, result.error));
+
+    if (saveRetainedMessages)
+        subscriptionStore->finishSavingRetainedMessages(retainedDBPath, walGeneration, result.retainedBytesWritten);
+
+    const uint64_t copiedPages = result.privateDirtyKb * 1024 / static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    globalStats->saveStateCopiedOnWritePages = copiedPages;
+
+    const std::chrono::milliseconds saveDuration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - forkStart);
+    const std::chrono::duration<double, std::milli> pauseDuration = pauseEnd - pauseStart;
+    const std::chrono::duration<double, std::milli> forkDuration = forkEnd - forkStart;
+    logger->logf(LOG_INFO, "Saved state in child process %d in %ld ms. The worker threads were paused for %.2f ms, of which forking took %.2f ms. "
+                           "%lu pages (%lu kB) were copied on write.", pid, saveDuration.count(), pauseDuration.count(), forkDuration.count(),
+                 copiedPages, result.privateDirtyKb);
+
+    return true;
+}
+
 void MainApp::initMainApp(int argc, char *argv[])
 {
     if (instance != nullptr)
@@ -465,9 +680,13 @@ void MainApp::start()
     std::map<int, std::shared_ptr<Listener>> listenerMap; // For finding listeners by fd.
     std::list<ScopedSocket> activeListenSockets; // For RAII/ownership
 
+    // With 'listen_sockets_per_thread', the threads get their own sockets, below.
     for(std::shared_ptr<Listener> &listener : this->listeners)
     {
-        std::list<ScopedSocket> scopedSockets = createListenSocket(listener);
+        if (settings.listenSocketsPerThread)
+            break;
+
+        std::list<ScopedSocket> scopedSockets = createListenSocket(listener, this->epollFdAccept);
 
         for (ScopedSocket &scopedSocket : scopedSockets)
         {
@@ -579,6 +798,18 @@ void MainApp::start()
     for (int i = 0; i < num_threads; i++)
     {
         std::shared_ptr<ThreadData> t = std::make_shared<ThreadData>(i, settings, pluginLoader);
+
+        if (settings.listenSocketsPerThread)
+        {
+            for(std::shared_ptr<Listener> &listener : this->listeners)
+            {
+                for (ScopedSocket &scopedSocket : createListenSocket(listener, t->epollfd))
+                {
+                    t->addListenSocket(std::move(scopedSocket), listener);
+                }
+            }
+        }
+
         t->start(&do_thread_work);
         threads.push_back(t);
     }
@@ -589,8 +820,6 @@ void MainApp::start()
 
     timer.start();
 
-    uint next_thread_index = 0;
-
     struct epoll_event events[MAX_EVENTS];
     memset(&events, 0, sizeof (struct epoll_event)*MAX_EVENTS);
 
@@ -614,34 +843,10 @@ void MainApp::start()
                 if (cur_fd != taskEventFd)
                 {
                     std::shared_ptr<Listener> listener = listenerMap[cur_fd];
-                    std::shared_ptr<ThreadData> thread_data = threads[next_thread_index++ % num_threads];
-
-                    logger->logf(LOG_DEBUG, "Accepting connection on thread %d on %s", thread_data->threadnr, listener->getProtocolName().c_str());
-
-                    struct sockaddr_in6 addrBiggest;
-                    struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
-                    socklen_t len = sizeof(struct sockaddr_in6);
-                    memset(addr, 0, len);
-                    int fd = check<std::runtime_error>(accept(cur_fd, addr, &len));
-
-                    SSL *clientSSL = nullptr;
-                    if (listener->isSsl())
-                    {
-                        clientSSL = SSL_new(listener->sslctx->get());
-
-                        if (clientSSL == NULL)
-                        {
-                            logger->logf(LOG_ERR, "Problem creating SSL object. Closing client.");
-                            close(fd);
-                            continue;
-                        }
-
-                        SSL_set_fd(clientSSL, fd);
-                    }
-
-                    std::shared_ptr<Client> client = std::make_shared<Client>(fd, thread_data, clientSSL, listener->websocket, listener->isHaProxy(), addr, settings);
+                    std::shared_ptr<ThreadData> &thread_data = getThreadForNewClient();
 
-                    thread_data->giveClient(client);
+                    if (!thread_data->acceptClient(cur_fd, listener, settings))
+                        continue;
 
                     globalStats->socketConnects.inc();
                 }
@@ -861,7 +1066,7 @@ void MainApp::queueCleanup()
     {
         int threadnr = rand() % threads.size();
         std::shared_ptr<ThreadData> t = threads[threadnr];
-        t->queueRemoveExpiredSessions();
+        t->queueCleanupSubscriptionTree();
     }
 }
 
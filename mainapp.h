@@ -49,6 +49,7 @@ class MainApp
     bool started = false;
     bool running = true;
     std::vector<std::shared_ptr<ThreadData>> threads;
+    uint nextThreadIndex = 0;
     std::shared_ptr<SubscriptionStore> subscriptionStore;
     std::unique_ptr<ConfigFileParser> confFileParser;
     std::list<std::function<void()>> taskQueue;
@@ -77,16 +78,17 @@ class MainApp
     void reopenLogfile();
     static void doHelp(const char *arg);
     static void showLicense();
-    std::list<ScopedSocket> createListenSocket(const std::shared_ptr<Listener> &listener);
+    std::list<ScopedSocket> createListenSocket(const std::shared_ptr<Listener> &listener, int epollFd);
     void wakeUpThread();
-    void queueKeepAliveCheckAtAllThreads();
+    std::shared_ptr<ThreadData> &getThreadForNewClient();
     void queuePasswordFileReloadAllThreads();
     void queuepluginPeriodicEventAllThreads();
     void setFuzzFile(const std::string &fuzzFilePath);
     void queuePublishStatsOnDollarTopic();
-    void saveState(const Settings &settings);
-    void saveStateInThread();
-    void queueSendQueuedWills();
+    void saveState(const Settings &settings, bool retainedMessagesOnly = false);
+    void saveStateInThread(bool retainedMessagesOnly);
+    bool saveStateInChildProcess(const Settings &settings, bool saveRetainedMessages, bool saveSessions);
+    void syncRetainedMessagesWal();
     void waitForWillsQueued();
     void waitForDisconnectsInitiated();
     void queueRetainedMessageExpiration();
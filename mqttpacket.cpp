@@ -455,6 +455,39 @@ void MqttPacket::handle()
         handleExtendedAuth();
 }
 
+/**
+ * @brief MqttPacket::continueAfterAsyncAclCheck finishes handling a publish or subscribe, with the result the plugin gave later.
+ * @param aclResult
+ *
+ * See flashmq_continue_async_acl_check().
+ */
+void MqttPacket::continueAfterAsyncAclCheck(AuthResult aclResult)
+{
+    assert(waitingForAsyncAclCheck);
+
+    this->waitingForAsyncAclCheck = false;
+
+    if (sender->isBeingDisconnected())
+        return;
+
+    if (aclResult == AuthResult::async)
+    {
+        logger->logf(LOG_ERR, "Plugin continued ACL check with async, which is not a result.");
+        aclResult = AuthResult::error;
+    }
+
+    if (packetType == PacketType::PUBLISH)
+    {
+        handlePublishAclResult(aclResult);
+    }
+    else if (packetType == PacketType::SUBSCRIBE)
+    {
+        std::shared_ptr<SubscribeProgress> progress = std::move(this->subscribeProgress);
+        addSubscribeAclResult(*progress, aclResult);
+        handleSubscribeFilters(*progress);
+    }
+}
+
 ConnectData MqttPacket::parseConnectData()
 {
     if (this->packetType != PacketType::CONNECT)
@@ -1038,7 +1071,7 @@ void MqttPacket::handleSubscribe()
     if (firstByteFirstNibble != 2)
         throw ProtocolError("First LSB of first byte is wrong value for subscribe packet.", ReasonCodes::MalformedPacket);
 
-    const uint16_t packet_id = readTwoBytesToUInt16();
+    this->packet_id = readTwoBytesToUInt16();
 
     if (packet_id == 0)
     {
@@ -1067,66 +1100,114 @@ void MqttPacket::handleSubscribe()
         }
     }
 
-    Authentication &authentication = *ThreadGlobals::getAuth();
+    SubscribeProgress progress;
+    handleSubscribeFilters(progress);
+}
 
-    std::forward_list<SubscriptionTuple> deferredSubscribes;
+/**
+ * @brief MqttPacket::handleSubscribeFilters handles the topic filters of a subscribe packet from the current position, and sends the ack.
+ * @param progress
+ *
+ * When the plugin does an ACL check asynchronously, it stops and stores the progress, to resume from continueAfterAsyncAclCheck().
+ */
+void MqttPacket::handleSubscribeFilters(SubscribeProgress &progress)
+{
+    Authentication &authentication = *ThreadGlobals::getAuth();
 
-    std::list<ReasonCodes> subs_reponse_codes;
     while (remainingAfterPos() > 0)
     {
-        std::string topic = readBytesToString(true);
+        progress.topic = readBytesToString(true);
 
         const uint8_t subscriptionOptions = readUint8();
-        uint8_t qos = subscriptionOptions & 0x03;
+        progress.qos = subscriptionOptions & 0x03;
 
-        std::vector<std::string> subtopics;
-        splitTopic(topic, subtopics);
+        progress.subtopics.clear();
+        splitTopic(progress.topic, progress.subtopics);
 
-        if (authentication.alterSubscribe(sender->getClientId(), topic, subtopics, qos, getUserProperties()))
-            splitTopic(topic, subtopics);
+        if (authentication.alterSubscribe(sender->getClientId(), progress.topic, progress.subtopics, progress.qos, getUserProperties()))
+            splitTopic(progress.topic, progress.subtopics);
 
-        if (topic.empty())
+        if (progress.topic.empty())
             throw ProtocolError("Subscribe topic is empty.", ReasonCodes::MalformedPacket);
 
-        if (!isValidSubscribePath(topic))
-            throw ProtocolError(formatString("Invalid subscribe path: %s", topic.c_str()), ReasonCodes::MalformedPacket);
+        if (!isValidSubscribePath(progress.topic))
+            throw ProtocolError(formatString("Invalid subscribe path: %s", progress.topic.c_str()), ReasonCodes::MalformedPacket);
 
-        if (qos > 2)
+        if (progress.qos > 2)
             throw ProtocolError("QoS is greater than 2, and/or reserved bytes in QoS field are not 0.", ReasonCodes::MalformedPacket);
 
-        std::string shareName;
-        parseSubscriptionShare(subtopics, shareName);
+        progress.shareName.clear();
+        parseSubscriptionShare(progress.subtopics, progress.shareName);
+
+        AuthResult aclResult = AuthResult::error;
 
-        if (authentication.aclCheck(sender->getClientId(), sender->getUsername(), topic, subtopics, std::string_view(), AclAccess::subscribe, qos, false, getUserProperties()) == AuthResult::success)
         {
-            deferredSubscribes.emplace_front(topic, subtopics, qos, shareName);
-            subs_reponse_codes.push_back(static_cast<ReasonCodes>(qos));
+            AsyncAclCheckScope asyncScope(authentication, sender);
+            aclResult = authentication.aclCheck(sender->getClientId(), sender->getUsername(), progress.topic, progress.subtopics, std::string_view(),
+                                                AclAccess::subscribe, progress.qos, false, getUserProperties());
         }
-        else
-        {
-            logger->logf(LOG_SUBSCRIBE, "Client '%s' subscribe to '%s' denied or failed.", sender->repr().c_str(), topic.c_str());
 
-            // We can't not send an ack, because if there are multiple subscribes, you'd send fewer acks back, losing sync.
-            ReasonCodes return_code = sender->getProtocolVersion() >= ProtocolVersion::Mqtt311 ? ReasonCodes::NotAuthorized : static_cast<ReasonCodes>(qos);
-            subs_reponse_codes.push_back(return_code);
+        if (aclResult == AuthResult::async)
+        {
+            this->subscribeProgress = std::make_shared<SubscribeProgress>(std::move(progress));
+            this->waitingForAsyncAclCheck = true;
+            return;
         }
+
+        addSubscribeAclResult(progress, aclResult);
     }
 
     // MQTT-3.8.3-3
-    if (subs_reponse_codes.empty())
+    if (progress.responseCodes.empty())
     {
         throw ProtocolError("No topics specified to subscribe to.", ReasonCodes::MalformedPacket);
     }
 
-    SubAck subAck(this->protocolVersion, packet_id, subs_reponse_codes);
+    SubAck subAck(this->protocolVersion, packet_id, progress.responseCodes);
     MqttPacket response(subAck);
     sender->writeMqttPacket(response);
 
     // Adding the subscription will also send publishes for retained messages, so that's why we're doing it at the end.
-    for(const SubscriptionTuple &tup : deferredSubscribes)
+    for(const SubscriptionTuple &tup : progress.deferredSubscribes)
     {
         logger->logf(LOG_SUBSCRIBE, "Client '%s' subscribed to '%s' QoS %d", sender->repr().c_str(), tup.topic.c_str(), tup.qos);
-        MainApp::getMainApp()->getSubscriptionStore()->addSubscription(sender, tup.subtopics, tup.qos, tup.shareName);
+        MainApp::getMainApp()->getSubscriptionStore()->addSubscription(sender, tup.subtopics, tup.qos, tup.shareName, tup.readAclPreauthorization);
+    }
+}
+
+/**
+ * @brief MqttPacket::addSubscribeAclResult stages the subscription to the topic filter in 'progress', or the denial of it.
+ */
+void MqttPacket::addSubscribeAclResult(SubscribeProgress &progress, AuthResult aclResult)
+{
+    if (aclResult == AuthResult::success)
+    {
+        const Settings *settings = ThreadGlobals::getSettings();
+        uint32_t readAclPreauthorization = 0;
+
+        // The topic of what a subscription without wildcards receives is known now, so we can decide read access once.
+        if (settings->preauthorizeLiteralSubscriptions)
+        {
+            const std::string &topic = progress.topic;
+            const std::string filter = progress.shareName.empty() ? topic : topic.substr(progress.shareName.length() + 8); // Strip '$share/<name>/'.
+
+            if (filter.find_first_of("+#") == std::string::npos)
+            {
+                Authentication &authentication = *ThreadGlobals::getAuth();
+                readAclPreauthorization = authentication.preauthorizeRead(sender->getClientId(), sender->getUsername(), filter, progress.subtopics, getUserProperties());
+            }
+        }
+
+        progress.deferredSubscribes.emplace_front(progress.topic, progress.subtopics, progress.qos, progress.shareName, readAclPreauthorization);
+        progress.responseCodes.push_back(static_cast<ReasonCodes>(progress.qos));
+    }
+    else
+    {
+        logger->logf(LOG_SUBSCRIBE, "Client '%s' subscribe to '%s' denied or failed.", sender->repr().c_str(), progress.topic.c_str());
+
+        // We can't not send an ack, because if there are multiple subscribes, you'd send fewer acks back, losing sync.
+        ReasonCodes return_code = sender->getProtocolVersion() >= ProtocolVersion::Mqtt311 ? ReasonCodes::NotAuthorized : static_cast<ReasonCodes>(progress.qos);
+        progress.responseCodes.push_back(return_code);
     }
 }
 
@@ -1321,63 +1402,83 @@ void MqttPacket::handlePublish()
     Authentication &authentication = *ThreadGlobals::getAuth();
     const Settings *settings = ThreadGlobals::getSettings();
 
-    // Working with a local copy because the subscribing action will modify this->packet_id. See the PublishCopyFactory.
-    const uint16_t _packet_id = this->packet_id;
-
-    // Stage the ack, with the proper ID.
-    AckSender ackSender(this->publishData.qos, this->packet_id, this->protocolVersion, sender);
-
     if (publishData.retain && settings->retainedMessagesMode == RetainedMessagesMode::DisconnectWithError)
     {
         throw ProtocolError("Retained messages not supported and 'retained_messages_mode' set to 'disconnect_with_error'.", ReasonCodes::RetainNotSupported);
     }
 
-    if (publishData.qos == 2 && sender->getSession()->incomingQoS2MessageIdInTransit(_packet_id))
+    if (publishData.qos == 2 && sender->getSession()->incomingQoS2MessageIdInTransit(this->packet_id))
     {
+        AckSender ackSender(this->publishData.qos, this->packet_id, this->protocolVersion, sender);
         ackSender.setAckCode(ReasonCodes::PacketIdentifierInUse);
+        return;
     }
-    else
-    {
-        // Doing this before the authentication on purpose, so when the publish is not allowed, the QoS control packets are allowed and can finish.
-        if (publishData.qos == 2)
-            sender->getSession()->addIncomingQoS2MessageId(_packet_id);
 
-        this->alteredByPlugin = authentication.alterPublish(this->publishData.client_id, this->publishData.topic, this->publishData.getSubtopics(),
-                                                            getPayloadView(), this->publishData.qos, this->publishData.retain, this->publishData.getUserProperties());
+    // Doing this before the authentication on purpose, so when the publish is not allowed, the QoS control packets are allowed and can finish.
+    if (publishData.qos == 2)
+        sender->getSession()->addIncomingQoS2MessageId(this->packet_id);
 
-        if (authentication.aclCheck(this->publishData, getPayloadView()) == AuthResult::success)
-        {
-            if (publishData.retain && settings->retainedMessagesMode == RetainedMessagesMode::Enabled)
-            {
-                publishData.payload = getPayloadCopy();
-                MainApp::getMainApp()->getSubscriptionStore()->setRetainedMessage(publishData, publishData.getSubtopics());
-            }
+    this->alteredByPlugin = authentication.alterPublish(this->publishData.client_id, this->publishData.topic, this->publishData.getSubtopics(),
+                                                        getPayloadView(), this->publishData.qos, this->publishData.retain, this->publishData.getUserProperties());
 
-            if (!publishData.retain || settings->retainedMessagesMode <= RetainedMessagesMode::Downgrade)
-            {
-                // Set dup flag to 0, because that must not be propagated [MQTT-3.3.1-3].
-                // Existing subscribers don't get retain=1. [MQTT-3.3.1-9]
-                bites[0] &= 0b11110110;
-                first_byte = bites[0];
-                publishData.retain = false;
+    AuthResult aclResult = AuthResult::error;
 
-                PublishCopyFactory factory(this);
+    {
+        AsyncAclCheckScope asyncScope(authentication, sender);
+        aclResult = authentication.aclCheck(this->publishData, getPayloadView());
+    }
 
-                if (settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::SenderHash)
-                {
-                    const size_t senderHash = std::hash<std::string>()(sender->getClientId());
-                    factory.setSharedSubscriptionHashKey(senderHash);
-                }
+    if (aclResult == AuthResult::async)
+    {
+        this->waitingForAsyncAclCheck = true;
+        return;
+    }
 
-                ackSender.sendNow();
-                MainApp::getMainApp()->getSubscriptionStore()->queuePacketAtSubscribers(factory);
-            }
+    handlePublishAclResult(aclResult);
+}
+
+/**
+ * @brief MqttPacket::handlePublishAclResult is the part of handling a publish after the ACL check, which the plugin may have done asynchronously.
+ */
+void MqttPacket::handlePublishAclResult(AuthResult aclResult)
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    // Stage the ack, with the proper ID. It keeps a copy, because the subscribing action will modify this->packet_id. See the PublishCopyFactory.
+    AckSender ackSender(this->publishData.qos, this->packet_id, this->protocolVersion, sender);
+
+    if (aclResult == AuthResult::success)
+    {
+        if (publishData.retain && settings->retainedMessagesMode == RetainedMessagesMode::Enabled)
+        {
+            publishData.payload = getPayloadCopy();
+            MainApp::getMainApp()->getSubscriptionStore()->setRetainedMessage(publishData, publishData.getSubtopics());
         }
-        else
+
+        if (!publishData.retain || settings->retainedMessagesMode <= RetainedMessagesMode::Downgrade)
         {
-            ackSender.setAckCode(ReasonCodes::NotAuthorized);
+            // Set dup flag to 0, because that must not be propagated [MQTT-3.3.1-3].
+            // Existing subscribers don't get retain=1. [MQTT-3.3.1-9]
+            bites[0] &= 0b11110110;
+            first_byte = bites[0];
+            publishData.retain = false;
+
+            PublishCopyFactory factory(this);
+
+            if (settings->sharedSubscriptionTargeting == SharedSubscriptionTargeting::SenderHash)
+            {
+                const size_t senderHash = std::hash<std::string>()(sender->getClientId());
+                factory.setSharedSubscriptionHashKey(senderHash);
+            }
+
+            ackSender.sendNow();
+            MainApp::getMainApp()->getSubscriptionStore()->queuePacketAtSubscribers(factory);
         }
     }
+    else
+    {
+        ackSender.setAckCode(ReasonCodes::NotAuthorized);
+    }
 
 #ifndef NDEBUG
     // Protection against using the altered packet id (because we change the incoming byte array for each subscriber).
@@ -1663,6 +1764,11 @@ const std::vector<std::string> &MqttPacket::getSubtopics()
     return this->publishData.getSubtopics();
 }
 
+const std::vector<size_t> &MqttPacket::getSubtopicHashes()
+{
+    return this->publishData.getSubtopicHashes();
+}
+
 std::shared_ptr<Client> MqttPacket::getSender() const
 {
     return sender;
@@ -1910,11 +2016,29 @@ bool MqttPacket::isAlteredByPlugin() const
 }
 
 void MqttPacket::readIntoBuf(CirBuf &buf) const
+{
+    readIntoBuf(buf, bites.size());
+}
+
+/**
+ * @brief MqttPacket::readIntoBufExceptPayload is for when the payload is sent from elsewhere. The payload is always at the end of a publish.
+ * @param buf
+ */
+void MqttPacket::readIntoBufExceptPayload(CirBuf &buf) const
+{
+    assert(packetType == PacketType::PUBLISH);
+    assert(payloadStart + payloadLen == bites.size());
+
+    readIntoBuf(buf, payloadStart);
+}
+
+void MqttPacket::readIntoBuf(CirBuf &buf, size_t byteCount) const
 {
     assert(packetType != PacketType::PUBLISH || (first_byte & 0b00000110) >> 1 == publishData.qos);
     assert(publishData.qos == 0 || packet_id > 0);
+    assert(byteCount <= bites.size());
 
-    buf.ensureFreeSpace(getSizeIncludingNonPresentHeader());
+    buf.ensureFreeSpace(getSizeIncludingNonPresentHeader() - (bites.size() - byteCount));
 
     if (!containsFixedHeader())
     {
@@ -1927,14 +2051,16 @@ void MqttPacket::readIntoBuf(CirBuf &buf) const
         assert(bites.data()[0] == first_byte);
     }
 
-    buf.write(bites.data(), bites.size());
+    buf.write(bites.data(), byteCount);
 }
 
-SubscriptionTuple::SubscriptionTuple(const std::string &topic, const std::vector<std::string> &subtopics, uint8_t qos, const std::string &shareName) :
+SubscriptionTuple::SubscriptionTuple(const std::string &topic, const std::vector<std::string> &subtopics, uint8_t qos, const std::string &shareName,
+                                     uint32_t readAclPreauthorization) :
     topic(topic),
     subtopics(subtopics),
     qos(qos),
-    shareName(shareName)
+    shareName(shareName),
+    readAclPreauthorization(readAclPreauthorization)
 {
 
 }
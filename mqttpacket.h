@@ -22,6 +22,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <memory>
 #include <vector>
 #include <exception>
+#include <forward_list>
+#include <list>
 
 #include "forward_declarations.h"
 
@@ -33,6 +35,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "mqtt5properties.h"
 #include "packetdatatypes.h"
 
+struct SubscribeProgress;
+
 /**
  * @brief The MqttPacket class represents incoming and outgonig packets.
  *
@@ -61,6 +65,10 @@ class MqttPacket
     bool hasTopicAlias = false;
     bool alteredByPlugin = false;
 
+    // See flashmq_continue_async_acl_check(). A shared pointer, because in testing packets are copied.
+    bool waitingForAsyncAclCheck = false;
+    std::shared_ptr<SubscribeProgress> subscribeProgress;
+
     // It's important to understand that this class is used for incoming packets as well as new outgoing packets. When we create
     // new outgoing packets, we generally know exactly who it's for and the information is only stored in this->bites. So, the
     // publishData and fields like hasTopicAlias are invalid in those cases.
@@ -88,6 +96,11 @@ class MqttPacket
     void calculateRemainingLength();
     void setPosToDataStart();
     bool atEnd() const;
+    void readIntoBuf(CirBuf &buf, size_t byteCount) const;
+
+    void handleSubscribeFilters(SubscribeProgress &progress);
+    void addSubscribeAclResult(SubscribeProgress &progress, AuthResult aclResult);
+    void handlePublishAclResult(AuthResult aclResult);
 
 #ifndef TESTING
     // In production, I want to be sure I don't accidentally copy packets, because it's slow.
@@ -120,6 +133,8 @@ public:
     static void bufferToMqttPackets(CirBuf &buf, std::vector<MqttPacket> &packetQueueIn, std::shared_ptr<Client> &sender);
 
     void handle();
+    void continueAfterAsyncAclCheck(AuthResult aclResult);
+    bool isWaitingForAsyncAclCheck() const { return waitingForAsyncAclCheck; }
     AuthPacketData parseAuthData();
     ConnectData parseConnectData();
     ConnAckData parseConnAckData();
@@ -150,6 +165,7 @@ public:
     ProtocolVersion getProtocolVersion() const { return protocolVersion;}
     const std::string &getTopic() const;
     const std::vector<std::string> &getSubtopics();
+    const std::vector<size_t> &getSubtopicHashes();
     std::shared_ptr<Client> getSender() const;
     void setSender(const std::shared_ptr<Client> &value);
     bool containsFixedHeader() const;
@@ -157,8 +173,10 @@ public:
     uint16_t getPacketId() const;
     void setDuplicate();
     void readIntoBuf(CirBuf &buf) const;
+    void readIntoBufExceptPayload(CirBuf &buf) const;
     std::string getPayloadCopy() const;
     std::string_view getPayloadView() const;
+    size_t getPayloadLen() const { return payloadLen; }
     bool getRetain() const;
     void setRetain();
     const Publish &getPublishData();
@@ -173,8 +191,25 @@ struct SubscriptionTuple
     const std::vector<std::string> subtopics;
     const uint8_t qos;
     const std::string shareName;
+    const uint32_t readAclPreauthorization;
+
+    SubscriptionTuple(const std::string &topic, const std::vector<std::string> &subtopics, uint8_t qos, const std::string &shareName,
+                      uint32_t readAclPreauthorization);
+};
 
-    SubscriptionTuple(const std::string &topic, const std::vector<std::string> &subtopics, uint8_t qos, const std::string &shareName);
+/**
+ * @brief The SubscribeProgress struct is what a subscribe packet has done so far, so it can continue after an asynchronous ACL check.
+ */
+struct SubscribeProgress
+{
+    std::forward_list<SubscriptionTuple> deferredSubscribes;
+    std::list<ReasonCodes> responseCodes;
+
+    // The topic filter being checked.
+    std::string topic;
+    std::vector<std::string> subtopics;
+    uint8_t qos = 0;
+    std::string shareName;
 };
 
 #endif // MQTTPACKET_H
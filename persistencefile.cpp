@@ -26,13 +26,18 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <cstring>
 #include <libgen.h>
+#include <sys/mman.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 
 #include "utils.h"
 #include "logger.h"
+#include "threadglobals.h"
 
 PersistenceFile::PersistenceFile(const std::string &filePath) :
-    digestContext(EVP_MD_CTX_new()),
-    buf(1024*1024)
+    digestContext(EVP_MD_CTX_new())
 {
     if (!filePath.empty() && filePath[filePath.size() - 1] == '/')
         throw std::runtime_error("Target file can't contain trailing slash.");
@@ -69,123 +74,190 @@ PersistenceFile::~PersistenceFile()
     }
 }
 
-/**
- * @brief RetainedMessagesDB::hashFile hashes the data after the headers and writes the hash in the header. Uses SHA512.
- *
- */
 void PersistenceFile::writeCheck(const void *ptr, size_t size, size_t n, FILE *s)
 {
     if (fwrite(ptr, size, n, s) != n)
     {
         throw std::runtime_error(formatString("Error writing: %s", strerror(errno)));
     }
+
+    if (checksumming)
+        addToBlockChecksums(static_cast<const char*>(ptr), size * n);
 }
 
-ssize_t PersistenceFile::readCheck(void *ptr, size_t size, size_t n, FILE *stream)
+/**
+ * @brief PersistenceFile::addToBlockChecksums checksums the data as it's written, so the file doesn't have to be read back when closing.
+ */
+void PersistenceFile::addToBlockChecksums(const char *data, size_t size)
 {
-    size_t nread = fread(ptr, size, n, stream);
+    dataSize += size;
 
-    if (nread != n)
+    while (size > 0)
     {
-        if (feof(f))
-            return -1;
+        const size_t n = std::min(size, checksumBlockSize - blockBytes);
+        blockChecksum = crc32c(data, n, blockChecksum);
+        blockBytes += n;
+        data += n;
+        size -= n;
 
-        throw std::runtime_error(formatString("Error reading: %s", strerror(errno)));
+        if (blockBytes == checksumBlockSize)
+        {
+            blockChecksums.push_back(blockChecksum);
+            blockChecksum = 0;
+            blockBytes = 0;
+        }
     }
-
-    return nread;
 }
 
-void PersistenceFile::hashFile()
+/**
+ * @brief PersistenceFile::writeBlockChecksums writes the table of block checksums after the data, and the fields describing it in the header.
+ */
+void PersistenceFile::writeBlockChecksums()
 {
-    logger->logf(LOG_DEBUG, "Calculating and saving hash of '%s'.", filePath.c_str());
+    logger->logf(LOG_DEBUG, "Saving block checksums of '%s'.", filePath.c_str());
 
-    fseek(f, TOTAL_HEADER_SIZE, SEEK_SET);
+    checksumming = false;
 
+    if (blockBytes > 0)
+    {
+        blockChecksums.push_back(blockChecksum);
+        blockChecksum = 0;
+        blockBytes = 0;
+    }
+
+    PersistenceBuffer table;
+    for (uint32_t checksum : blockChecksums)
+        table.writeUint32(checksum);
+
+    PersistenceBuffer header;
+    header.writeUint32(checksumBlockSize);
+    header.writeInt64(dataSize);
+
+    const uint32_t tableChecksum = crc32c(table.data(), table.size(), crc32c(header.data(), header.size()));
+    header.writeUint32(tableChecksum);
+
+    writeBuffer(table);
+
+    fseek(f, MAGIC_STRING_LENGH, SEEK_SET);
+    writeBuffer(header);
+}
+
+/**
+ * @brief PersistenceFile::verifyHash checks the hash of the mapped file. It's run in a thread, while the data is being parsed. See waitForVerifiedHash().
+ */
+void PersistenceFile::verifyHash()
+{
     unsigned int output_len = 0;
     unsigned char md_value[EVP_MAX_MD_SIZE];
     std::memset(md_value, 0, EVP_MAX_MD_SIZE);
 
     EVP_MD_CTX_reset(digestContext);
     EVP_DigestInit_ex(digestContext, sha512, NULL);
-
-    while (!feof(f))
-    {
-        size_t n = fread(buf.data(), 1, buf.size(), f);
-        EVP_DigestUpdate(digestContext, buf.data(), n);
-    }
-
+    EVP_DigestUpdate(digestContext, mappedData + TOTAL_HEADER_SIZE, mappedSize - TOTAL_HEADER_SIZE);
     EVP_DigestFinal_ex(digestContext, md_value, &output_len);
 
     if (output_len != HASH_SIZE)
         throw std::runtime_error("Impossible: calculated hash size wrong length");
 
-    fseek(f, MAGIC_STRING_LENGH, SEEK_SET);
+    if (std::memcmp(mappedData + MAGIC_STRING_LENGH, md_value, output_len) != 0)
+        moveAsideAndThrow("hash mismatch");
 
-    writeCheck(md_value, output_len, 1, f);
+    logger->logf(LOG_DEBUG, "Hash of '%s' correct", filePath.c_str());
 }
 
-void PersistenceFile::verifyHash()
+void PersistenceFile::moveAsideAndThrow(const std::string &reason)
 {
-    fseek(f, 0, SEEK_END);
-    const size_t size = ftell(f);
-
-    if (size < TOTAL_HEADER_SIZE)
-        throw std::runtime_error(formatString("File '%s' is too small for it even to contain a header.", filePath.c_str()));
+    if (rename(filePath.c_str(), filePathCorrupt.c_str()) == 0)
+    {
+        throw std::runtime_error(formatString("File '%s' is corrupt: %s. Moved aside to '%s'.", filePath.c_str(), reason.c_str(), filePathCorrupt.c_str()));
+    }
+    else
+    {
+        throw std::runtime_error(formatString("File '%s' is corrupt: %s. Tried to move aside, but that failed: '%s'.",
+                                              filePath.c_str(), reason.c_str(), strerror(errno)));
+    }
+}
 
-    unsigned char md_from_disk[HASH_SIZE];
-    std::memset(md_from_disk, 0, HASH_SIZE);
+/**
+ * @brief PersistenceFile::verifyBlockChecksums verifies the blocks in parallel. When blocks are damaged, the file is moved aside. The header
+ * and table have to be intact.
+ * @param loadUpToDamage makes the data before the first damaged block readable. Otherwise, damage makes the whole file corrupt, for files of
+ * which a part is not usable on its own.
+ */
+void PersistenceFile::verifyBlockChecksums(bool loadUpToDamage)
+{
+    PersistenceReader header(mappedData, TOTAL_HEADER_SIZE, MAGIC_STRING_LENGH);
+    const uint32_t blockSize = header.readUint32();
+    const uint64_t storedDataSize = header.readInt64();
+    const uint32_t tableChecksum = header.readUint32();
 
-    fseek(f, MAGIC_STRING_LENGH, SEEK_SET);
-    readCheck(md_from_disk, 1, HASH_SIZE, f);
+    if (blockSize == 0 || storedDataSize > mappedSize - TOTAL_HEADER_SIZE)
+        moveAsideAndThrow("invalid block checksum header");
 
-    unsigned int output_len = 0;
-    unsigned char md_value[EVP_MAX_MD_SIZE];
-    std::memset(md_value, 0, EVP_MAX_MD_SIZE);
+    const size_t blockCount = (storedDataSize + blockSize - 1) / blockSize;
+    const size_t tableStart = TOTAL_HEADER_SIZE + storedDataSize;
 
-    EVP_MD_CTX_reset(digestContext);
-    EVP_DigestInit_ex(digestContext, sha512, NULL);
+    if (mappedSize - tableStart != blockCount * 4)
+        moveAsideAndThrow("the file size doesn't match the block checksum header");
 
-    while (!feof(f))
-    {
-        size_t n = fread(buf.data(), 1, buf.size(), f);
-        EVP_DigestUpdate(digestContext, buf.data(), n);
-    }
+    const uint32_t calculatedTableChecksum = crc32c(mappedData + tableStart, blockCount * 4, crc32c(mappedData + MAGIC_STRING_LENGH, 12));
 
-    EVP_DigestFinal_ex(digestContext, md_value, &output_len);
+    if (calculatedTableChecksum != tableChecksum)
+        moveAsideAndThrow("block checksum table mismatch");
 
-    if (output_len != HASH_SIZE)
-        throw std::runtime_error("Impossible: calculated hash size wrong length");
+    std::vector<char> damaged(blockCount, 0);
 
-    if (std::memcmp(md_from_disk, md_value, output_len) != 0)
-    {
-        fclose(f);
-        f = nullptr;
+    parseInThreads(blockCount, 256, [&](size_t begin, size_t end) {
+        PersistenceReader table(mappedData + tableStart, blockCount * 4, begin * 4);
 
-        if (rename(filePath.c_str(), filePathCorrupt.c_str()) == 0)
+        for (size_t i = begin; i < end; i++)
         {
-            throw std::runtime_error(formatString("File '%s' is corrupt: hash mismatch. Moved aside to '%s'.", filePath.c_str(), filePathCorrupt.c_str()));
-        }
-        else
-        {
-            throw std::runtime_error(formatString("File '%s' is corrupt: hash mismatch. Tried to move aside, but that failed: '%s'.",
-                                                  filePath.c_str(), strerror(errno)));
+            const size_t blockStart = TOTAL_HEADER_SIZE + i * blockSize;
+            const size_t size = std::min<size_t>(blockSize, tableStart - blockStart);
+            damaged[i] = crc32c(mappedData + blockStart, size) != table.readUint32();
         }
+    });
+
+    dataEnd = tableStart;
+
+    const size_t damagedCount = std::count(damaged.begin(), damaged.end(), 1);
+
+    if (damagedCount == 0)
+    {
+        logger->logf(LOG_DEBUG, "Block checksums of '%s' correct", filePath.c_str());
+        return;
     }
 
-    logger->logf(LOG_DEBUG, "Hash of '%s' correct", filePath.c_str());
+    const size_t firstDamaged = std::find(damaged.begin(), damaged.end(), 1) - damaged.begin();
+    const size_t firstDamagedAt = TOTAL_HEADER_SIZE + firstDamaged * blockSize;
+
+    if (!loadUpToDamage)
+        moveAsideAndThrow(formatString("damaged in %lu of its %lu blocks of %u bytes, the first at byte %lu", damagedCount, blockCount, blockSize,
+                                       firstDamagedAt));
+
+    dataEnd = firstDamagedAt;
+    damagedBlocksFound = true;
+
+    std::string movedAside = "Moving it aside failed";
+    if (rename(filePath.c_str(), filePathCorrupt.c_str()) == 0)
+        movedAside = formatString("Moved it aside to '%s'", filePathCorrupt.c_str());
+
+    logger->logf(LOG_ERR, "File '%s' is damaged in %lu of its %lu blocks of %u bytes, the first at byte %lu. Only what comes before it is loaded. %s.",
+                 filePath.c_str(), damagedCount, blockCount, blockSize, dataEnd, movedAside.c_str());
 }
 
-/**
- * @brief PersistenceFile::makeSureBufSize grows the buffer if n is bigger.
- * @param n in bytes.
- *
- * Remember that when you're dealing with fields that are sized in MQTT by 16 bit ints, like topic paths, the buffer will always be big enough, because it's 1 MB.
- */
-void PersistenceFile::makeSureBufSize(size_t n)
+void PersistenceFile::unmap()
 {
-    if (n > buf.size())
-        buf.resize(n);
+    // The hash may still be being verified, when reading was aborted.
+    if (hashVerification.valid())
+        hashVerification.wait();
+
+    if (mappedData)
+    {
+        munmap(const_cast<char*>(mappedData), mappedSize);
+        mappedData = nullptr;
+        mappedSize = 0;
+    }
 }
 
 void PersistenceFile::writeInt64(const int64_t val)
@@ -247,61 +319,12 @@ void PersistenceFile::writeString(const std::string &s)
     writeCheck(s.c_str(), 1, s.size(), f);
 }
 
-int64_t PersistenceFile::readInt64(bool &eofFound)
-{
-    if (readCheck(buf.data(), 1, 8, f) < 0)
-        eofFound = true;
-
-    unsigned char *buf_ = reinterpret_cast<unsigned char *>(buf.data());
-    const uint64_t val1 = ((buf_[0]) << 24) | ((buf_[1]) << 16) | ((buf_[2]) << 8) | (buf_[3]);
-    const uint64_t val2 = ((buf_[4]) << 24) | ((buf_[5]) << 16) | ((buf_[6]) << 8) | (buf_[7]);
-    const int64_t val = (val1 << 32) | val2;
-    return val;
-}
-
-uint32_t PersistenceFile::readUint32(bool &eofFound)
+void PersistenceFile::writeBuffer(const PersistenceBuffer &buffer)
 {
-    if (readCheck(buf.data(), 1, 4, f) < 0)
-        eofFound = true;
-
-    uint32_t val;
-    unsigned char *buf_ = reinterpret_cast<unsigned char *>(buf.data());
-    val = ((buf_[0]) << 24) | ((buf_[1]) << 16) | ((buf_[2]) << 8) | (buf_[3]);
-    return val;
-}
-
-uint16_t PersistenceFile::readUint16(bool &eofFound)
-{
-    if (readCheck(buf.data(), 1, 2, f) < 0)
-        eofFound = true;
-
-    uint16_t val;
-    unsigned char *buf_ = reinterpret_cast<unsigned char *>(buf.data());
-    val = ((buf_[0]) << 8) | (buf_[1]);
-    return val;
-}
-
-uint8_t PersistenceFile::readUint8(bool &eofFound)
-{
-    uint8_t val;
-
-    if (readCheck(&val, 1, 1, f) < 0)
-        eofFound = true;
-
-    return val;
-}
-
-std::string PersistenceFile::readString(bool &eofFound)
-{
-    const uint32_t size = readUint32(eofFound);
-
-    if (size > 0xFFFF)
-        throw std::runtime_error("In MQTT world, strings are never longer than 65535 bytes.");
+    if (buffer.size() == 0)
+        return;
 
-    makeSureBufSize(size);
-    readCheck(buf.data(), 1, size, f);
-    std::string result(buf.data(), size);
-    return result;
+    writeCheck(buffer.data(), 1, buffer.size(), f);
 }
 
 /**
@@ -323,13 +346,25 @@ void PersistenceFile::openWrite(const std::string &versionString)
 
     openMode = FileMode::write;
 
-    writeCheck(buf.data(), 1, MAGIC_STRING_LENGH, f);
+    char zeroes[TOTAL_HEADER_SIZE];
+    std::memset(zeroes, 0, TOTAL_HEADER_SIZE);
+
+    writeCheck(zeroes, 1, TOTAL_HEADER_SIZE, f);
     rewind(f);
     writeCheck(versionString.c_str(), 1, versionString.length(), f);
-    fseek(f, MAGIC_STRING_LENGH, SEEK_SET);
-    writeCheck(buf.data(), 1, HASH_SIZE, f);
+    fseek(f, TOTAL_HEADER_SIZE, SEEK_SET);
+
+    blockChecksums.clear();
+    blockChecksum = 0;
+    blockBytes = 0;
+    dataSize = 0;
+    checksumming = true;
 }
 
+/**
+ * @brief PersistenceFile::openRead maps the file into memory. Depending on the version, start verifying it with startVerifyingHash() or
+ * verifyBlockChecksums(). Read it with getReader(), and call waitForVerifiedHash() before using what was read.
+ */
 void PersistenceFile::openRead()
 {
     if (openMode != FileMode::unknown)
@@ -342,23 +377,130 @@ void PersistenceFile::openRead()
 
     openMode = FileMode::read;
 
-    verifyHash();
-    rewind(f);
+    struct stat statbuf;
+    std::memset(&statbuf, 0, sizeof(struct stat));
 
-    readCheck(buf.data(), 1, MAGIC_STRING_LENGH, f);
-    detectedVersionString = std::string(buf.data(), strlen(buf.data()));
+    if (fstat(fileno(f), &statbuf) < 0)
+        throw std::runtime_error(formatString("Can't stat '%s': %s", filePath.c_str(), strerror(errno)));
 
-    fseek(f, TOTAL_HEADER_SIZE, SEEK_SET);
+    const size_t size = statbuf.st_size;
+
+    if (size < TOTAL_HEADER_SIZE)
+        throw std::runtime_error(formatString("File '%s' is too small for it even to contain a header.", filePath.c_str()));
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error(formatString("Mapping '%s' failed: %s", filePath.c_str(), strerror(errno)));
+
+    mappedData = static_cast<const char*>(mapped);
+    mappedSize = size;
+    dataEnd = size;
+
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    detectedVersionString = std::string(mappedData, strnlen(mappedData, MAGIC_STRING_LENGH));
+}
+
+/**
+ * @brief PersistenceFile::startVerifyingHash verifies the SHA512 hash of older files in a thread, while the data is being parsed.
+ */
+void PersistenceFile::startVerifyingHash()
+{
+    hashVerification = std::async(std::launch::async, [this]() {
+        verifyHash();
+    });
+}
+
+/**
+ * @brief PersistenceFile::getReader gives a reader of the data after the header.
+ */
+PersistenceReader PersistenceFile::getReader() const
+{
+    if (!mappedData)
+        throw std::runtime_error("File is not open for reading.");
+
+    return PersistenceReader(mappedData, dataEnd, TOTAL_HEADER_SIZE);
+}
+
+/**
+ * @brief PersistenceFile::waitForVerifiedHash throws when the file is corrupt.
+ */
+void PersistenceFile::waitForVerifiedHash()
+{
+    if (hashVerification.valid())
+        hashVerification.get();
+}
+
+/**
+ * @brief PersistenceFile::parseInThreads calls f for chunks of [0, count) in multiple threads, for parsing rows of which the place is
+ * known. Chunks can be done in any order. The first error is thrown, after all threads are done.
+ *
+ * The threads get the settings of the calling thread, because the objects being made need them.
+ */
+void PersistenceFile::parseInThreads(size_t count, size_t chunkSize, const std::function<void(size_t, size_t)> &f)
+{
+    const size_t chunks = (count + chunkSize - 1) / chunkSize;
+    const size_t threadCount = std::min<size_t>(std::clamp<unsigned int>(std::thread::hardware_concurrency(), 1, 8), chunks);
+
+    if (threadCount <= 1)
+    {
+        for (size_t begin = 0; begin < count; begin += chunkSize)
+            f(begin, std::min(count, begin + chunkSize));
+        return;
+    }
+
+    Settings *settings = ThreadGlobals::getSettings();
+    std::atomic<size_t> nextChunk {0};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    auto parse = [&]() {
+        ThreadGlobals::assignSettings(settings);
+
+        try
+        {
+            for (size_t chunk = nextChunk++; chunk < chunks; chunk = nextChunk++)
+            {
+                const size_t begin = chunk * chunkSize;
+                f(begin, std::min(count, begin + chunkSize));
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> locker(errorMutex);
+            if (!error)
+                error = std::current_exception();
+            nextChunk = chunks;
+        }
+    };
+
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(parse);
+    }
+
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
+
+    if (error)
+        std::rethrow_exception(error);
 }
 
 void PersistenceFile::closeFile()
 {
+    unmap();
+
     if (!f)
         return;
 
     if (openMode == FileMode::write)
     {
-        hashFile();
+        writeBlockChecksums();
 
         if (fflush(f) != 0)
         {
@@ -396,3 +538,107 @@ const std::string &PersistenceFile::getFilePath() const
 {
     return this->filePath;
 }
+
+void PersistenceBuffer::write(const void *data, size_t size)
+{
+    const char *d = static_cast<const char*>(data);
+    bytes.insert(bytes.end(), d, d + size);
+}
+
+void PersistenceBuffer::writeInt64(const int64_t val)
+{
+    for (int shift = 56; shift >= 0; shift -= 8)
+        bytes.push_back(static_cast<char>(val >> shift));
+}
+
+void PersistenceBuffer::writeUint32(const uint32_t val)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        bytes.push_back(static_cast<char>(val >> shift));
+}
+
+void PersistenceBuffer::writeUint16(const uint16_t val)
+{
+    bytes.push_back(static_cast<char>(val >> 8));
+    bytes.push_back(static_cast<char>(val));
+}
+
+void PersistenceBuffer::writeUint8(const uint8_t val)
+{
+    bytes.push_back(static_cast<char>(val));
+}
+
+void PersistenceBuffer::writeString(const std::string &s)
+{
+    writeUint32(s.size());
+    write(s.data(), s.size());
+}
+
+PersistenceReader::PersistenceReader(const char *data, size_t size, size_t pos) :
+    data(data),
+    size(size),
+    pos(pos)
+{
+
+}
+
+const unsigned char *PersistenceReader::take(size_t n)
+{
+    if (pos > size || n > size - pos)
+        throw PersistenceReadBeyondEnd("Reading beyond the end of the data. Is the file truncated?");
+
+    const unsigned char *result = reinterpret_cast<const unsigned char*>(data + pos);
+    pos += n;
+    return result;
+}
+
+int64_t PersistenceReader::readInt64()
+{
+    const unsigned char *p = take(8);
+    uint64_t val = 0;
+    for (int i = 0; i < 8; i++)
+        val = (val << 8) | p[i];
+    return static_cast<int64_t>(val);
+}
+
+uint32_t PersistenceReader::readUint32()
+{
+    const unsigned char *p = take(4);
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+uint16_t PersistenceReader::readUint16()
+{
+    const unsigned char *p = take(2);
+    return (p[0] << 8) | p[1];
+}
+
+uint8_t PersistenceReader::readUint8()
+{
+    return *take(1);
+}
+
+std::string PersistenceReader::readString()
+{
+    const uint32_t size = readUint32();
+
+    if (size > 0xFFFF)
+        throw std::runtime_error("In MQTT world, strings are never longer than 65535 bytes.");
+
+    return std::string(readBytes(size), size);
+}
+
+const char *PersistenceReader::readBytes(size_t n)
+{
+    return reinterpret_cast<const char*>(take(n));
+}
+
+void PersistenceReader::skip(size_t n)
+{
+    take(n);
+}
+
+void PersistenceReader::skipString()
+{
+    skip(readUint32());
+}
@@ -25,6 +25,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <openssl/evp.h>
 #include <stdexcept>
 #include <cstring>
+#include <future>
+#include <functional>
 
 #include "logger.h"
 
@@ -41,8 +43,75 @@ public:
     PersistenceFileCantBeOpened(const std::string &msg) : std::runtime_error(msg) {}
 };
 
+/**
+ * @brief The PersistenceBuffer class encodes like PersistenceFile does, but into memory, so other threads than the one writing the file
+ * can serialize. See PersistenceFile::writeBuffer().
+ */
+class PersistenceBuffer
+{
+    std::vector<char> bytes;
+
+public:
+    void write(const void *data, size_t size);
+    void writeInt64(const int64_t val);
+    void writeUint32(const uint32_t val);
+    void writeUint16(const uint16_t val);
+    void writeUint8(const uint8_t val);
+    void writeString(const std::string &s);
+
+    const char *data() const { return bytes.data(); }
+    size_t size() const { return bytes.size(); }
+    void clear() { bytes.clear(); }
+};
+
+/**
+ * @brief The PersistenceReadBeyondEnd class is thrown when data is shorter than its fields say.
+ */
+class PersistenceReadBeyondEnd : public std::runtime_error
+{
+public:
+    PersistenceReadBeyondEnd(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * @brief The PersistenceReader class decodes what PersistenceBuffer encodes, from memory, like a mapped file. Reading beyond the end throws.
+ */
+class PersistenceReader
+{
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+
+    const unsigned char *take(size_t n);
+
+public:
+    PersistenceReader(const char *data, size_t size, size_t pos = 0);
+
+    int64_t readInt64();
+    uint32_t readUint32();
+    uint16_t readUint16();
+    uint8_t readUint8();
+    std::string readString();
+    const char *readBytes(size_t n);
+    void skip(size_t n);
+    void skipString();
+
+    size_t getPos() const { return pos; }
+    void setPos(size_t pos) { this->pos = pos; }
+    bool atEnd() const { return pos >= size; }
+};
+
+/**
+ * @brief The PersistenceFile class is the base of the DB files. They have a header with a version string and an integrity check, and data.
+ *
+ * Files are written with a CRC32C per block of data, in a table after the data. The hash field in the header then has the block size,
+ * the data size and a checksum over those and the table. Blocks can be verified in parallel, and when one is damaged, what comes before it
+ * can still be loaded, if the file allows that. Older versions of the files have a SHA512 hash of all data instead.
+ */
 class PersistenceFile
 {
+    static constexpr size_t checksumBlockSize = 64 * 1024;
+
     std::string filePath;
     std::string filePathTemp;
     std::string filePathCorrupt;
@@ -51,8 +120,23 @@ class PersistenceFile
     EVP_MD_CTX *digestContext = nullptr;
     const EVP_MD *sha512 = EVP_sha512();
 
-    void hashFile();
+    const char *mappedData = nullptr;
+    size_t mappedSize = 0;
+    size_t dataEnd = 0;
+    bool damagedBlocksFound = false;
+    std::future<void> hashVerification;
+
+    bool checksumming = false;
+    std::vector<uint32_t> blockChecksums;
+    uint32_t blockChecksum = 0;
+    size_t blockBytes = 0;
+    uint64_t dataSize = 0;
+
+    void addToBlockChecksums(const char *data, size_t size);
+    void writeBlockChecksums();
     void verifyHash();
+    void moveAsideAndThrow(const std::string &reason);
+    void unmap();
 
 protected:
     enum class FileMode
@@ -63,27 +147,26 @@ protected:
     };
 
     FILE *f = nullptr;
-    std::vector<char> buf;
     FileMode openMode = FileMode::unknown;
     std::string detectedVersionString;
 
     Logger *logger = Logger::getInstance();
 
-    void makeSureBufSize(size_t n);
-
     void writeCheck(const void *__restrict __ptr, size_t __size, size_t __n, FILE *__restrict __s);
-    ssize_t readCheck(void *__restrict ptr, size_t size, size_t n, FILE *__restrict stream);
 
     void writeInt64(const int64_t val);
     void writeUint32(const uint32_t val);
     void writeUint16(const uint16_t val);
     void writeUint8(const uint8_t val);
     void writeString(const std::string &s);
-    int64_t readInt64(bool &eofFound);
-    uint32_t readUint32(bool &eofFound);
-    uint16_t readUint16(bool &eofFound);
-    uint8_t readUint8(bool &eofFound);
-    std::string readString(bool &eofFound);
+    void writeBuffer(const PersistenceBuffer &buffer);
+
+    PersistenceReader getReader() const;
+    void startVerifyingHash();
+    void verifyBlockChecksums(bool loadUpToDamage);
+    void waitForVerifiedHash();
+    bool hasDamagedBlocks() const { return damagedBlocksFound; }
+    static void parseInThreads(size_t count, size_t chunkSize, const std::function<void(size_t begin, size_t end)> &f);
 
 public:
     PersistenceFile(const std::string &filePath);
@@ -28,6 +28,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "exceptions.h"
 #include "unscopedlock.h"
 #include "utils.h"
+#include "client.h"
 
 std::mutex Authentication::initMutex;
 std::mutex Authentication::authChecksMutex;
@@ -131,6 +132,11 @@ void Authentication::loadPlugin(const PluginLoader &l)
             flashmq_plugin_acl_check_v2 = (F_flashmq_plugin_acl_check_v2)l.loadSymbol("flashmq_plugin_acl_check");
             flashmq_plugin_alter_publish_v2 = (F_flashmq_plugin_alter_publish_v2)l.loadSymbol("flashmq_plugin_alter_publish", false);
         }
+
+        if (flashmqPluginVersionNumber >= 3)
+        {
+            flashmq_plugin_check_batch_v3 = (F_flashmq_plugin_check_batch_v3)l.loadSymbol("flashmq_plugin_check_batch", false);
+        }
     }
     else
     {
@@ -213,6 +219,9 @@ void Authentication::securityInit(bool reloading)
     if (pluginFamily == PluginFamily::None)
         return;
 
+    // The plugin may give different results after (re)initializing.
+    AclCache::invalidateAll();
+
     UnscopedLock lock(initMutex);
     if (settings.pluginSerializeInit)
         lock.lock();
@@ -296,13 +305,69 @@ AuthResult Authentication::aclCheck(const std::string &clientid, const std::stri
     assert(retain || access == AclAccess::subscribe || !payload.empty());
 #endif
 
-    AuthResult firstResult = aclCheckFromMosquittoAclFile(clientid, username, subtopics, access);
+    aclCache.setSize(settings.aclCacheSize);
 
-    if (firstResult != AuthResult::success)
-        return firstResult;
+    if (!aclCache.enabled())
+    {
+        bool cacheable = false;
+        return aclCheckUncached(clientid, username, topic, subtopics, payload, access, qos, retain, userProperties, cacheable);
+    }
 
-    if (pluginFamily == PluginFamily::None)
+    AuthResult result = AuthResult::error;
+
+    if (aclCache.get(clientid, username, topic, access, result))
+        return result;
+
+    bool cacheable = false;
+    result = aclCheckUncached(clientid, username, topic, subtopics, payload, access, qos, retain, userProperties, cacheable);
+
+    if (cacheable && (result == AuthResult::success || result == AuthResult::acl_denied))
+        aclCache.set(clientid, username, topic, access, result);
+
+    return result;
+}
+
+/**
+ * @brief Authentication::preauthorizeRead decides read access for a subscription without wildcards once, so deliveries don't need to check it.
+ * @return the ACL generation the decision is valid for, or 0 when the result may depend on more than the client ID, username and topic,
+ *         or when read access is not granted. See 'preauthorize_literal_subscriptions'.
+ *
+ * Like for 'acl_cache_size', the Mosquitto ACL file always qualifies, and the FlashMQ plugin when it calls flashmq_acl_result_cacheable().
+ * Reloading the ACL file or plugin invalidates the decision.
+ */
+uint32_t Authentication::preauthorizeRead(const std::string &clientid, const std::string &username, const std::string &topic,
+                                          const std::vector<std::string> &subtopics, const std::vector<std::pair<std::string, std::string>> *userProperties)
+{
+    assert(subtopics.size() > 0);
+
+    const uint32_t generation = AclCache::getGeneration();
+
+    bool cacheable = false;
+    const AuthResult result = aclCheckUncached(clientid, username, topic, subtopics, std::string_view(), AclAccess::read, 0, false, userProperties, cacheable);
+
+    if (result != AuthResult::success || !cacheable)
+        return 0;
+
+    return generation;
+}
+
+/**
+ * @brief Authentication::aclCheckUncached does the ACL check with the ACL file and plugin.
+ * @param cacheable is set to whether the result only depends on the client ID, username, topic and access. See 'acl_cache_size'.
+ */
+AuthResult Authentication::aclCheckUncached(const std::string &clientid, const std::string &username, const std::string &topic, const std::vector<std::string> &subtopics,
+                                            std::string_view payload, AclAccess access, uint8_t qos, bool retain,
+                                            const std::vector<std::pair<std::string, std::string>> *userProperties, bool &cacheable)
+{
+    cacheable = false;
+
+    AuthResult firstResult = aclCheckFromMosquittoAclFile(clientid, username, subtopics, access);
+
+    if (firstResult != AuthResult::success || pluginFamily == PluginFamily::None)
+    {
+        cacheable = true;
         return firstResult;
+    }
 
     if (!initialized)
     {
@@ -340,10 +405,44 @@ AuthResult Authentication::aclCheck(const std::string &clientid, const std::stri
         // gets disconnected.
         try
         {
+            AclCache::pluginResultCacheable = false;
+
+            AuthResult result = AuthResult::error;
+
             if (flashmqPluginVersionNumber == 1)
-                return flashmq_plugin_acl_check_v1(pluginData, access, clientid, username, topic, subtopics, qos, retain, userProperties);
+                result = flashmq_plugin_acl_check_v1(pluginData, access, clientid, username, topic, subtopics, qos, retain, userProperties);
             else
-                return flashmq_plugin_acl_check_v2(pluginData, access, clientid, username, topic, subtopics, payload, qos, retain, userProperties);
+                result = flashmq_plugin_acl_check_v2(pluginData, access, clientid, username, topic, subtopics, payload, qos, retain, userProperties);
+
+            cacheable = AclCache::pluginResultCacheable;
+
+            if (result == AuthResult::async)
+            {
+                if (!asyncAclCheckClient)
+                {
+                    logger->logf(LOG_ERR, "ACL check by plugin returned async for topic '%s', but that's only possible for publishes and subscribes of clients.", topic.c_str());
+                    return AuthResult::error;
+                }
+
+                if (flashmq_plugin_check_batch_v3)
+                {
+                    FlashMQCheckRequest &request = checkBatch.emplace_back();
+                    request.client = *asyncAclCheckClient;
+                    request.aclCheckId = asyncAclCheckId;
+                    request.access = access;
+                    request.clientid = clientid;
+                    request.username = username;
+                    request.topic = topic;
+                    request.subtopics = subtopics;
+                    request.payload = payload;
+                    request.qos = qos;
+                    request.retain = retain;
+                    if (userProperties)
+                        request.userProperties = *userProperties;
+                }
+            }
+
+            return result;
         }
         catch (std::exception &ex)
         {
@@ -394,7 +493,20 @@ AuthResult Authentication::unPwdCheck(const std::string &clientid, const std::st
         // gets disconnected.
         try
         {
-            return flashmq_plugin_login_check_v1(pluginData, clientid, username, password, userProperties, client);
+            const AuthResult result = flashmq_plugin_login_check_v1(pluginData, clientid, username, password, userProperties, client);
+
+            if (result == AuthResult::async && flashmq_plugin_check_batch_v3)
+            {
+                FlashMQCheckRequest &request = checkBatch.emplace_back();
+                request.client = client;
+                request.clientid = clientid;
+                request.username = username;
+                request.password = password;
+                if (userProperties)
+                    request.userProperties = *userProperties;
+            }
+
+            return result;
         }
         catch (std::exception &ex)
         {
@@ -752,7 +864,9 @@ void Authentication::loadMosquittoAclFile()
 
         }
 
+        newTree.compile();
         aclTree = std::move(newTree);
+        AclCache::invalidateAll();
     }
     catch (std::exception &ex)
     {
@@ -856,6 +970,94 @@ void Authentication::periodicEvent()
     }
 }
 
+/**
+ * @brief Authentication::flushCheckBatch gives the plugin the checks it answered with AuthResult::async, in batches of at most checkBatchMaxSize.
+ *
+ * It's called once per iteration of the event loop. See flashmq_plugin_check_batch().
+ */
+void Authentication::flushCheckBatch()
+{
+    if (checkBatch.empty())
+        return;
+
+    std::vector<FlashMQCheckRequest> batch;
+    batch.swap(checkBatch);
+
+    UnscopedLock lock(authChecksMutex);
+    if (settings.pluginSerializeAuthChecks)
+        lock.lock();
+
+    for (size_t i = 0; i < batch.size(); i += checkBatchMaxSize)
+    {
+        const size_t end = std::min(batch.size(), i + checkBatchMaxSize);
+        const std::vector<FlashMQCheckRequest> part(std::make_move_iterator(batch.begin() + i), std::make_move_iterator(batch.begin() + end));
+
+        checkBatchAnswered.clear();
+        inCheckBatch = true;
+
+        try
+        {
+            flashmq_plugin_check_batch_v3(pluginData, part);
+            inCheckBatch = false;
+        }
+        catch (std::exception &ex)
+        {
+            inCheckBatch = false;
+
+            logger->logf(LOG_ERR, "Error doing batch of checks in plugin: '%s'. Failing the ones it didn't answer.", ex.what());
+
+            // Otherwise the clients wait forever.
+            for (const FlashMQCheckRequest &request : part)
+            {
+                std::shared_ptr<Client> client = request.client.lock();
+
+                // A second continuation would be taken as the result of the client's next check.
+                if (!client || checkBatchAnswered.count(client.get()) > 0)
+                    continue;
+
+                if (request.access == AclAccess::none)
+                    flashmq_continue_async_authentication(request.client, AuthResult::error, "", "");
+                else
+                    flashmq_continue_async_acl_check(request.client, request.aclCheckId, AuthResult::error);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Authentication::registerCheckAnswered is for continuations given in this thread, to know which checks of the batch being
+ * given to the plugin are answered, should it throw.
+ */
+void Authentication::registerCheckAnswered(const Client *client)
+{
+    if (!inCheckBatch)
+        return;
+
+    checkBatchAnswered.insert(client);
+}
+
+std::weak_ptr<Client> Authentication::getAsyncAclCheckClient(uint64_t &checkId) const
+{
+    if (!asyncAclCheckClient)
+        return std::weak_ptr<Client>();
+
+    checkId = asyncAclCheckId;
+    return *asyncAclCheckClient;
+}
+
+AsyncAclCheckScope::AsyncAclCheckScope(Authentication &authentication, const std::shared_ptr<Client> &client) :
+    authentication(authentication)
+{
+    authentication.asyncAclCheckClient = &client;
+    authentication.asyncAclCheckId = client->startAsyncAclCheck();
+}
+
+AsyncAclCheckScope::~AsyncAclCheckScope()
+{
+    authentication.asyncAclCheckClient = nullptr;
+    authentication.asyncAclCheckId = 0;
+}
+
 std::string AuthResultToString(AuthResult r)
 {
     if (r == AuthResult::success)
@@ -20,6 +20,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include <string>
 #include <string_view>
+#include <unordered_set>
 #include <cstring>
 
 #include "logger.h"
@@ -28,6 +29,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "pluginloader.h"
 #include "settings.h"
 #include "types.h"
+#include "aclcache.h"
 
 enum class PasswordHashType
 {
@@ -96,6 +98,8 @@ typedef AuthResult(*F_flashmq_plugin_acl_check_v2)(void *thread_data, const AclA
 typedef bool (*F_flashmq_plugin_alter_publish_v2)(void *thread_data, const std::string &clientid, std::string &topic, const std::vector<std::string> &subtopics,
                                                   std::string_view payload, uint8_t &qos, bool &retain, std::vector<std::pair<std::string, std::string>> *userProperties);
 
+typedef void (*F_flashmq_plugin_check_batch_v3)(void *thread_data, const std::vector<FlashMQCheckRequest> &requests);
+
 extern "C"
 {
     // Gets called by the plugin, so it needs to exist, globally
@@ -111,6 +115,8 @@ std::string AuthResultToString(AuthResult r);
  */
 class Authentication
 {
+    friend class AsyncAclCheckScope;
+
     // Mosquitto functions
     F_plugin_init_v2 init_v2 = nullptr;
     F_plugin_cleanup_v2 cleanup_v2 = nullptr;
@@ -136,6 +142,8 @@ class Authentication
     F_flashmq_plugin_acl_check_v2 flashmq_plugin_acl_check_v2 = nullptr;
     F_flashmq_plugin_alter_publish_v2 flashmq_plugin_alter_publish_v2 = nullptr;
 
+    F_flashmq_plugin_check_batch_v3 flashmq_plugin_check_batch_v3 = nullptr;
+
     static std::mutex initMutex;
     static std::mutex authChecksMutex;
 
@@ -167,6 +175,23 @@ class Authentication
     const EVP_MD *sha512 = EVP_sha512();
 
     AclTree aclTree;
+    AclCache aclCache;
+
+    // The client whose publish or subscribe is being ACL checked, when the plugin may answer with AuthResult::async.
+    const std::shared_ptr<Client> *asyncAclCheckClient = nullptr;
+    uint64_t asyncAclCheckId = 0;
+
+    // The checks the plugin answered with AuthResult::async during this iteration of the event loop. See flashmq_plugin_check_batch().
+    std::vector<FlashMQCheckRequest> checkBatch;
+    static constexpr size_t checkBatchMaxSize = 1000;
+
+    // The clients whose checks the plugin answered from within flashmq_plugin_check_batch(), so they aren't failed again when it throws.
+    std::unordered_set<const Client*> checkBatchAnswered;
+    bool inCheckBatch = false;
+
+    AuthResult aclCheckUncached(const std::string &clientid, const std::string &username, const std::string &topic, const std::vector<std::string> &subtopics,
+                                std::string_view payload, AclAccess access, uint8_t qos, bool retain,
+                                const std::vector<std::pair<std::string, std::string>> *userProperties, bool &cacheable);
 
     void *loadSymbol(void *handle, const char *symbol, bool exceptionOnError = true) const;
 public:
@@ -183,6 +208,8 @@ public:
     AuthResult aclCheck(Publish &publishData, std::string_view payload, AclAccess access = AclAccess::write);
     AuthResult aclCheck(const std::string &clientid, const std::string &username, const std::string &topic, const std::vector<std::string> &subtopics,
                         std::string_view payload, AclAccess access, uint8_t qos, bool retain, const std::vector<std::pair<std::string, std::string>> *userProperties);
+    uint32_t preauthorizeRead(const std::string &clientid, const std::string &username, const std::string &topic, const std::vector<std::string> &subtopics,
+                              const std::vector<std::pair<std::string, std::string>> *userProperties);
     AuthResult unPwdCheck(const std::string &clientid, const std::string &username, const std::string &password,
                           const std::vector<std::pair<std::string, std::string>> *userProperties, const std::weak_ptr<Client> &client);
     AuthResult extendedAuth(const std::string &clientid, ExtendedAuthStage stage, const std::string &authMethod,
@@ -203,6 +230,25 @@ public:
 
     void periodicEvent();
 
+    AclCache &getAclCache() { return aclCache; }
+    std::weak_ptr<Client> getAsyncAclCheckClient(uint64_t &checkId) const;
+    void flushCheckBatch();
+    void registerCheckAnswered(const Client *client);
+
+};
+
+/**
+ * @brief The AsyncAclCheckScope class allows the plugin to return AuthResult::async from the ACL checks done while it exists. The client
+ * then waits for flashmq_continue_async_acl_check().
+ */
+class AsyncAclCheckScope
+{
+    Authentication &authentication;
+
+public:
+    AsyncAclCheckScope(Authentication &authentication, const std::shared_ptr<Client> &client);
+    AsyncAclCheckScope(const AsyncAclCheckScope &other) = delete;
+    ~AsyncAclCheckScope();
 };
 
 #endif // PLUGIN_H
@@ -2,6 +2,8 @@
 
 #include "publishcopyfactory.h"
 #include "mqttpacket.h"
+#include "threadglobals.h"
+#include "settings.h"
 
 PublishCopyFactory::PublishCopyFactory(MqttPacket *packet) :
     packet(packet),
@@ -51,9 +53,31 @@ MqttPacket *PublishCopyFactory::getOptimumPacket(const uint8_t max_qos, const Pr
         return cachedPack.get();
     }
 
-    // Getting an instance of a Publish object happens at least on retained messages, will messages and SYS topics. It's low traffic, anyway.
+    // Getting an instance of a Publish object happens at least on retained messages, will messages, SYS topics and publishes given
+    // to other threads with 'cross_thread_publish_batching'. The latter can have many receivers, so we reuse packets when there is
+    // nothing client specific in them.
     assert(publish);
 
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    if (settings && settings->crossThreadPublishBatching && topic_alias == 0 && !skip_topic
+        && (protocolVersion < ProtocolVersion::Mqtt5 || !publish->getHasExpireInfo()))
+    {
+        const int cache_key = (static_cast<uint8_t>(protocolVersion) * 10) + actualQos;
+        std::unique_ptr<MqttPacket> &cachedPack = constructedPacketCache[cache_key];
+
+        if (!cachedPack)
+        {
+            publish->qos = actualQos;
+            publish->topicAlias = 0;
+            publish->skipTopic = false;
+            publish->clearClientSpecificProperties();
+            cachedPack = std::make_unique<MqttPacket>(protocolVersion, *publish);
+        }
+
+        return cachedPack.get();
+    }
+
     publish->qos = actualQos;
     publish->topicAlias = topic_alias;
     publish->skipTopic = skip_topic;
@@ -90,6 +114,20 @@ const std::vector<std::string> &PublishCopyFactory::getSubtopics()
     throw std::runtime_error("Bug in &PublishCopyFactory::getSubtopics()");
 }
 
+const std::vector<size_t> &PublishCopyFactory::getSubtopicHashes()
+{
+    if (packet)
+    {
+        return packet->getSubtopicHashes();
+    }
+    else if (publish)
+    {
+        return publish->getSubtopicHashes();
+    }
+
+    throw std::runtime_error("Bug in &PublishCopyFactory::getSubtopicHashes()");
+}
+
 std::string_view PublishCopyFactory::getPayload() const
 {
     if (packet)
@@ -98,6 +136,19 @@ std::string_view PublishCopyFactory::getPayload() const
     return publish->payload;
 }
 
+/**
+ * @brief PublishCopyFactory::getSharedPayload gives a copy of the payload that can outlive this factory, made once for all receivers. Clients
+ * queue it for sending instead of copying it into their write buffers. See 'shared_payload_min_bytes'.
+ * @return
+ */
+const std::shared_ptr<const std::string> &PublishCopyFactory::getSharedPayload()
+{
+    if (!sharedPayload)
+        sharedPayload = std::make_shared<const std::string>(getPayload());
+
+    return sharedPayload;
+}
+
 bool PublishCopyFactory::getRetain() const
 {
     if (packet)
@@ -139,6 +190,21 @@ Publish PublishCopyFactory::getNewPublish(uint8_t new_max_qos) const
     return p;
 }
 
+/**
+ * @brief PublishCopyFactory::getNewPublish gets a copy of the publish as-is, for when the delivery is done elsewhere, like another thread.
+ * @return
+ */
+Publish PublishCopyFactory::getNewPublish() const
+{
+    if (packet)
+    {
+        return Publish(packet->getPublishData());
+    }
+
+    assert(publish);
+    return Publish(*publish);
+}
+
 std::shared_ptr<Client> PublishCopyFactory::getSender()
 {
     if (packet)
@@ -23,6 +23,7 @@ class PublishCopyFactory
     std::unique_ptr<MqttPacket> oneShotPacket;
     const uint8_t orgQos;
     std::unordered_map<uint8_t, std::unique_ptr<MqttPacket>> constructedPacketCache;
+    std::shared_ptr<const std::string> sharedPayload;
     size_t sharedSubscriptionHashKey;
 public:
     PublishCopyFactory(MqttPacket *packet);
@@ -34,9 +35,12 @@ public:
     uint8_t getEffectiveQos(uint8_t max_qos) const;
     const std::string &getTopic() const;
     const std::vector<std::string> &getSubtopics();
+    const std::vector<size_t> &getSubtopicHashes();
     std::string_view getPayload() const;
+    const std::shared_ptr<const std::string> &getSharedPayload();
     bool getRetain() const;
     Publish getNewPublish(uint8_t new_max_qos) const;
+    Publish getNewPublish() const;
     std::shared_ptr<Client> getSender();
     const std::vector<std::pair<std::string, std::string>> *getUserProperties() const;
     void setSharedSubscriptionHashKey(size_t hash);
@@ -1,11 +1,6 @@
 #include "queuedtasks.h"
 #include "logger.h"
 
-bool QueuedTask::operator<(const QueuedTask &rhs) const
-{
-    return this->when < rhs.when;
-}
-
 QueuedTasks::QueuedTasks()
 {
 
@@ -13,27 +8,24 @@ QueuedTasks::QueuedTasks()
 
 uint32_t QueuedTasks::addTask(std::function<void ()> f, uint32_t delayInMs)
 {
-    std::chrono::time_point<std::chrono::steady_clock> when = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayInMs);
-
     while(++nextId == 0) {}
 
     const uint32_t id = nextId;
-    tasks[id] = f;
-
-    QueuedTask t;
-    t.id = id;
-    t.when = when;
-
-    queuedTasks.insert(t);
-
-    next = std::min(next, when);
-
+    uint32_t wheelValue = id;
+    QueuedTask &t = tasks[id];
+    t.f = f;
+    t.timer = queuedTasks.add(TimerWheelBase::now() + delayInMs, std::move(wheelValue));
     return id;
 }
 
 void QueuedTasks::eraseTask(uint32_t id)
 {
-    tasks.erase(id);
+    auto pos = tasks.find(id);
+    if (pos == tasks.end())
+        return;
+
+    queuedTasks.cancel(pos->second.timer);
+    tasks.erase(pos);
 }
 
 uint32_t QueuedTasks::getTimeTillNext() const
@@ -41,39 +33,21 @@ uint32_t QueuedTasks::getTimeTillNext() const
     if (__builtin_expect(tasks.empty(), 1))
         return std::numeric_limits<uint32_t>::max();
 
-    std::chrono::milliseconds x = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now());
-    std::chrono::milliseconds y = std::max<std::chrono::milliseconds>(std::chrono::milliseconds(0), x);
-    return y.count();
+    return queuedTasks.getMsTillNext(TimerWheelBase::now());
 }
 
 void QueuedTasks::performAll()
 {
-    next = std::chrono::time_point<std::chrono::steady_clock>::max();
-    const auto now = std::chrono::steady_clock::now();
-
-    auto _pos = queuedTasks.begin();
-    while (_pos != queuedTasks.end())
-    {
-        auto pos = _pos;
-        _pos++;
-
-        const QueuedTask &t = *pos;
-
-        if (t.when > now)
-        {
-            next = t.when;
-            break;
-        }
-
-        const uint32_t id = t.id;
-        queuedTasks.erase(pos);
+    if (__builtin_expect(queuedTasks.empty(), 1))
+        return;
 
+    queuedTasks.advance(TimerWheelBase::now(), [this](uint32_t id) {
         try
         {
             auto tpos = tasks.find(id);
             if (tpos != tasks.end())
             {
-                auto f = tpos->second;
+                auto f = tpos->second.f;
                 tasks.erase(tpos); // TODO: allow repeatable tasks? It would require more expensive nextId generation.
                 f();
             }
@@ -83,7 +57,5 @@ void QueuedTasks::performAll()
             Logger *logger = Logger::getInstance();
             logger->logf(LOG_ERR, "Error in delayed task: %s", ex.what());
         }
-    }
+    });
 }
-
-
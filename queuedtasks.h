@@ -2,30 +2,31 @@
 #define QUEUEDTASKS_H
 
 #include <functional>
-#include <set>
 #include <unordered_map>
 #include <memory>
 #include <chrono>
 
+#include "timerwheel.h"
+
 struct QueuedTask
 {
-    std::chrono::time_point<std::chrono::steady_clock> when;
-    uint32_t id = 0;
-
-    bool operator<(const QueuedTask &rhs) const;
+    std::function<void()> f;
+    uint64_t timer = 0;
 };
 
 /**
  * @brief Contains delayed tasks to perform.
  *
  * At this point, it's for the plugin, and therefore is thread-local, and not protected with mutexes etc.
+ *
+ * The timing is done by a TimerWheel. The tasks themselves are kept by ID, because the 32 bit IDs given to the plugin must not be
+ * confused with those of earlier tasks, and removing a task that already ran should do nothing.
  */
 class QueuedTasks
 {
     uint32_t nextId = 1;
-    std::multiset<QueuedTask> queuedTasks;
-    std::unordered_map<uint32_t, std::function<void()>> tasks;
-    std::chrono::time_point<std::chrono::steady_clock> next = std::chrono::time_point<std::chrono::steady_clock>::max();
+    TimerWheel<uint32_t> queuedTasks;
+    std::unordered_map<uint32_t, QueuedTask> tasks;
 
 public:
     QueuedTasks();
@@ -39,7 +39,7 @@ RetainedMessagesDB::RetainedMessagesDB(const std::string &filePath) : Persistenc
 
 void RetainedMessagesDB::openWrite()
 {
-    PersistenceFile::openWrite(MAGIC_STRING_V4);
+    PersistenceFile::openWrite(MAGIC_STRING_V5);
 }
 
 void RetainedMessagesDB::openRead()
@@ -54,58 +54,125 @@ void RetainedMessagesDB::openRead()
         readVersion = ReadVersion::v3;
     else if (detectedVersionString == MAGIC_STRING_V4)
         readVersion = ReadVersion::v4;
+    else if (detectedVersionString == MAGIC_STRING_V5)
+        readVersion = ReadVersion::v5;
     else
         throw std::runtime_error("Unknown file version.");
+
+    if (readVersion >= ReadVersion::v5)
+        verifyBlockChecksums(true);
+    else
+        startVerifyingHash();
 }
 
 /**
  * @brief RetainedMessagesDB::saveData doesn't explicitely name a file version (v1, etc), because we always write the current definition.
  * @param messages
+ * @return the number of bytes written.
  */
-void RetainedMessagesDB::saveData(const std::vector<RetainedMessage> &messages)
+size_t RetainedMessagesDB::saveData(const std::vector<RetainedMessage> &messages, const std::vector<MappedRetainedMessage> &mappedMessages)
 {
     if (!f)
-        return;
+        return 0;
 
     CirBuf cirbuf(1024);
+    PersistenceBuffer buffer;
+    size_t bytesWritten = TOTAL_HEADER_SIZE;
 
     const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
     logger->logf(LOG_DEBUG, "Saving current time stamp %ld in retained messages DB.", now_epoch);
     writeInt64(now_epoch);
 
-    writeUint32(messages.size());
+    writeUint32(messages.size() + mappedMessages.size());
 
     char reserved[RESERVED_SPACE_RETAINED_DB_V2];
     std::memset(reserved, 0, RESERVED_SPACE_RETAINED_DB_V2);
     writeCheck(reserved, 1, RESERVED_SPACE_RETAINED_DB_V2, f);
+    bytesWritten += 8 + 4 + RESERVED_SPACE_RETAINED_DB_V2;
 
     for (const RetainedMessage &rm : messages)
     {
         logger->logf(LOG_DEBUG, "Saving retained message for topic '%s' QoS %d, age %d seconds.", rm.publish.topic.c_str(), rm.publish.qos, rm.publish.getAge());
 
-        Publish pcopy(rm.publish);
-        MqttPacket pack(ProtocolVersion::Mqtt5, pcopy);
+        buffer.clear();
+        serializeMessage(rm.publish, buffer, cirbuf);
+        writeBuffer(buffer);
+        bytesWritten += buffer.size();
+    }
 
-        // Dummy, to please the parser on reading.
-        if (pcopy.qos > 0)
-            pack.setPacketId(666);
+    for (const MappedRetainedMessage &mrm : mappedMessages)
+    {
+        buffer.clear();
+        mrm.serialize(buffer);
+        writeBuffer(buffer);
+        bytesWritten += buffer.size();
+    }
 
-        const uint32_t packSize = pack.getSizeIncludingNonPresentHeader();
-        const uint32_t pubAge = ageFromTimePoint(pcopy.getCreatedAt());
+    fflush(f);
 
-        cirbuf.reset();
-        cirbuf.ensureFreeSpace(packSize + 32);
-        pack.readIntoBuf(cirbuf);
+    return bytesWritten;
+}
 
-        writeUint16(pack.getFixedHeaderLength());
-        writeUint32(pubAge);
-        writeUint32(packSize);
-        writeString(pcopy.client_id);
-        writeString(pcopy.username);
-        writeCheck(cirbuf.tailPtr(), 1, cirbuf.usedBytes(), f);
-    }
+/**
+ * @brief RetainedMessagesDB::serializeMessage encodes a message like it's stored in the DB. The write-ahead log uses the same encoding.
+ */
+void RetainedMessagesDB::serializeMessage(const Publish &publish, PersistenceBuffer &out, CirBuf &cirbuf)
+{
+    Publish pcopy(publish);
+    MqttPacket pack(ProtocolVersion::Mqtt5, pcopy);
+
+    // Dummy, to please the parser on reading.
+    if (pcopy.qos > 0)
+        pack.setPacketId(666);
+
+    const uint32_t packSize = pack.getSizeIncludingNonPresentHeader();
+    const uint32_t pubAge = ageFromTimePoint(pcopy.getCreatedAt());
+
+    cirbuf.reset();
+    cirbuf.ensureFreeSpace(packSize + 32);
+    pack.readIntoBuf(cirbuf);
+
+    out.writeUint16(pack.getFixedHeaderLength());
+    out.writeUint32(pubAge);
+    out.writeUint32(packSize);
+    out.writeString(pcopy.client_id);
+    out.writeString(pcopy.username);
+    out.write(cirbuf.tailPtr(), cirbuf.usedBytes());
+}
 
-    fflush(f);
+/**
+ * @brief RetainedMessagesDB::makeDummyClient makes the client that the packets are parsed with, when loading.
+ */
+std::shared_ptr<Client> RetainedMessagesDB::makeDummyClient()
+{
+    const Settings &settings = *ThreadGlobals::getSettings();
+    std::shared_ptr<ThreadData> dummyThreadData;
+    std::shared_ptr<Client> dummyClient(new Client(0, dummyThreadData, nullptr, false, false, nullptr, settings, false));
+    dummyClient->setClientProperties(ProtocolVersion::Mqtt5, "Dummyforloadingretained", "nobody", true, 60);
+    return dummyClient;
+}
+
+/**
+ * @brief RetainedMessagesDB::parseMessage is the opposite of serializeMessage(), once the fields are read.
+ * @param cirbuf contains the packet of packlen bytes.
+ * @param age is the age at the time of loading.
+ */
+RetainedMessage RetainedMessagesDB::parseMessage(CirBuf &cirbuf, uint32_t packlen, uint16_t fixedHeaderLength, uint32_t age, const std::string &clientId,
+                                                 const std::string &username, std::shared_ptr<Client> &dummyClient)
+{
+    MqttPacket pack(cirbuf, packlen, fixedHeaderLength, dummyClient);
+
+    pack.parsePublishData();
+    Publish pub(pack.getPublishData());
+
+    pub.client_id = clientId;
+    pub.username = username;
+
+    // A createdAt only means something when there is expire info (internal boolean is true), so we fake it first.
+    pub.setExpireAfter(std::numeric_limits<uint32_t>::max());
+    pub.createdAt = timepointFromAge(age);
+
+    return RetainedMessage(pub);
 }
 
 std::list<RetainedMessage> RetainedMessagesDB::readData()
@@ -119,84 +186,164 @@ std::list<RetainedMessage> RetainedMessagesDB::readData()
         logger->logf(LOG_WARNING, "File '%s' is version 1, an internal development version that was never finalized. Not reading.", getFilePath().c_str());
     if (readVersion == ReadVersion::v2)
         logger->logf(LOG_WARNING, "File '%s' is version 2, an internal development version that was never finalized. Not reading.", getFilePath().c_str());
-    if (readVersion == ReadVersion::v3 || readVersion == ReadVersion::v4)
-        return readDataV3V4();
+    if (readVersion >= ReadVersion::v3)
+    {
+        std::list<RetainedMessage> messages;
+
+        try
+        {
+            messages = readDataV3V4();
+        }
+        catch (...)
+        {
+            // Parsing happens while the hash is verified, and a corrupt file is more likely to be the cause.
+            waitForVerifiedHash();
+            throw;
+        }
+
+        waitForVerifiedHash();
+        return messages;
+    }
 
     return defaultResult;
 }
 
-std::list<RetainedMessage> RetainedMessagesDB::readDataV3V4()
+bool RetainedMessagesDB::canReadDataMapped() const
 {
-    std::list<RetainedMessage> messages;
+    return f && readVersion >= ReadVersion::v4;
+}
 
-    CirBuf cirbuf(1024);
+/**
+ * @brief RetainedMessagesDB::readDataMapped maps the file into memory, and gives the topic and place of each message, without parsing it.
+ * @return the number of messages.
+ */
+size_t RetainedMessagesDB::readDataMapped(const std::function<void(std::string_view, MappedRetainedMessage &&)> &f)
+{
+    if (!canReadDataMapped())
+        throw std::runtime_error("Only version 4 and newer files can be loaded lazily.");
 
-    const Settings &settings = *ThreadGlobals::getSettings();
-    std::shared_ptr<ThreadData> dummyThreadData;
-    std::shared_ptr<Client> dummyClient(new Client(0, dummyThreadData, nullptr, false, false, nullptr, settings, false));
-    dummyClient->setClientProperties(ProtocolVersion::Mqtt5, "Dummyforloadingretained", "nobody", true, 60);
+    // The messages are put in the tree as they are found, so first be sure they are correct.
+    waitForVerifiedHash();
+
+    std::shared_ptr<RetainedMessagesMapping> mapping = std::make_shared<RetainedMessagesMapping>(fileno(this->f), getFilePath());
+
+    const std::vector<RowPlace> rows = findRows();
 
-    while (!feof(f))
+    for (const RowPlace &place : rows)
     {
-        bool eofFound = false;
+        const RetainedMessagesMapping::Row row = mapping->readRow(place.offset);
+        MappedRetainedMessage message(mapping, place.offset, place.persistenceStateAge + row.age);
+        f(row.getTopic(), std::move(message));
+    }
+
+    mapping->doneLoading();
+
+    return rows.size();
+}
+
+/**
+ * @brief RetainedMessagesDB::findRows finds where the messages are, by only reading their lengths.
+ *
+ * When the file has damaged blocks, the messages before the first one are found.
+ */
+std::vector<RetainedMessagesDB::RowPlace> RetainedMessagesDB::findRows()
+{
+    std::vector<RowPlace> rows;
+    PersistenceReader reader = getReader();
 
-        int64_t persistence_state_age = 0;
+    const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 
-        if (readVersion >= ReadVersion::v4)
+    try
+    {
+        while (!reader.atEnd())
         {
-            const int64_t fileSavedAt = readInt64(eofFound);
-            if (eofFound)
-                continue;
+            int64_t persistence_state_age = 0;
 
-            const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-            persistence_state_age = fileSavedAt > now_epoch ? 0 : now_epoch - fileSavedAt;
+            if (readVersion >= ReadVersion::v4)
+            {
+                const int64_t fileSavedAt = reader.readInt64();
+                persistence_state_age = fileSavedAt > now_epoch ? 0 : now_epoch - fileSavedAt;
+            }
+
+            const uint32_t numberOfMessages = reader.readUint32();
+            reader.skip(RESERVED_SPACE_RETAINED_DB_V2);
+
+            for(uint32_t i = 0; i < numberOfMessages; i++)
+            {
+                const size_t offset = reader.getPos();
+
+                reader.skip(2);
+                if (readVersion >= ReadVersion::v4)
+                    reader.skip(4);
+                const uint32_t packlen = reader.readUint32();
+                reader.skipString();
+                reader.skipString();
+                reader.skip(packlen);
+
+                rows.push_back({offset, persistence_state_age});
+            }
         }
+    }
+    catch (PersistenceReadBeyondEnd &ex)
+    {
+        if (!hasDamagedBlocks())
+            throw;
+    }
 
-        const uint32_t numberOfMessages = readUint32(eofFound);
+    return rows;
+}
 
-        if (eofFound)
-            continue;
+/**
+ * @brief RetainedMessagesDB::readDataV3V4 finds the messages in the mapped file, and then parses them in multiple threads. Also reads v5,
+ * which only differs in its checksums.
+ */
+std::list<RetainedMessage> RetainedMessagesDB::readDataV3V4()
+{
+    const std::vector<RowPlace> rows = findRows();
 
-        fseek(f, RESERVED_SPACE_RETAINED_DB_V2, SEEK_CUR);
+    constexpr size_t chunkSize = 4096;
+    std::vector<std::list<RetainedMessage>> chunks((rows.size() + chunkSize - 1) / chunkSize);
 
-        for(uint32_t i = 0; i < numberOfMessages; i++)
+    parseInThreads(rows.size(), chunkSize, [&](size_t begin, size_t end) {
+        std::list<RetainedMessage> &messages = chunks.at(begin / chunkSize);
+        PersistenceReader reader = getReader();
+        CirBuf cirbuf(1024);
+        std::shared_ptr<Client> dummyClient = makeDummyClient();
+
+        for (size_t i = begin; i < end; i++)
         {
-            const uint16_t fixed_header_length = readUint16(eofFound);
+            const RowPlace &row = rows[i];
+            reader.setPos(row.offset);
+
+            const uint16_t fixed_header_length = reader.readUint16();
             uint32_t originalPubAge = 0;
             if (readVersion >= ReadVersion::v4)
             {
-                originalPubAge = readUint32(eofFound);
+                originalPubAge = reader.readUint32();
             }
-            const uint32_t newPubAge = persistence_state_age + originalPubAge;
-            const uint32_t packlen = readUint32(eofFound);
-
-            const std::string client_id = readString(eofFound);
-            const std::string username = readString(eofFound);
+            const uint32_t newPubAge = row.persistenceStateAge + originalPubAge;
+            const uint32_t packlen = reader.readUint32();
 
-            if (eofFound)
-                continue;
+            const std::string client_id = reader.readString();
+            const std::string username = reader.readString();
 
             cirbuf.reset();
             cirbuf.ensureFreeSpace(packlen + 32);
 
-            readCheck(cirbuf.headPtr(), 1, packlen, f);
+            std::memcpy(cirbuf.headPtr(), reader.readBytes(packlen), packlen);
             cirbuf.advanceHead(packlen);
-            MqttPacket pack(cirbuf, packlen, fixed_header_length, dummyClient);
-
-            pack.parsePublishData();
-            Publish pub(pack.getPublishData());
-
-            pub.client_id = client_id;
-            pub.username = username;
 
-            // A createdAt only means something when there is expire info (internal boolean is true), so we fake it first.
-            pub.setExpireAfter(std::numeric_limits<uint32_t>::max());
-            pub.createdAt = timepointFromAge(newPubAge);
-
-            RetainedMessage msg(pub);
+            RetainedMessage msg = parseMessage(cirbuf, packlen, fixed_header_length, newPubAge, client_id, username, dummyClient);
             logger->logf(LOG_DEBUG, "Loading retained message for topic '%s' QoS %d, age %d seconds.", msg.publish.topic.c_str(), msg.publish.qos, msg.publish.getAge());
             messages.push_back(std::move(msg));
         }
+    });
+
+    std::list<RetainedMessage> messages;
+
+    for (std::list<RetainedMessage> &chunk : chunks)
+    {
+        messages.splice(messages.end(), chunk);
     }
 
     return messages;
@@ -20,11 +20,17 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include "persistencefile.h"
 #include "retainedmessage.h"
+#include "cirbuf.h"
+#include "forward_declarations.h"
+#include "retainedmessagesmapping.h"
+
+#include <functional>
 
 #define MAGIC_STRING_V1 "FlashMQRetainedDBv1"
 #define MAGIC_STRING_V2 "FlashMQRetainedDBv2"
 #define MAGIC_STRING_V3 "FlashMQRetainedDBv3"
 #define MAGIC_STRING_V4 "FlashMQRetainedDBv4"
+#define MAGIC_STRING_V5 "FlashMQRetainedDBv5"
 #define RESERVED_SPACE_RETAINED_DB_V2 64
 
 /**
@@ -33,8 +39,9 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
  * The DB looks like, from the top:
  *
  * MAGIC_STRING_LENGH bytes file header
- * HASH_SIZE SHA512
+ * HASH_SIZE SHA512, or since v5, the block checksum fields. See PersistenceFile.
  * [MESSAGES]
+ * [BLOCK CHECKSUMS], since v5
  *
  * Each message has a row header, which is 8 bytes. See writeRowHeader().
  *
@@ -47,7 +54,8 @@ class RetainedMessagesDB : public PersistenceFile
         v1,
         v2,
         v3,
-        v4
+        v4,
+        v5
     };
 
     struct RowHeader
@@ -58,6 +66,13 @@ class RetainedMessagesDB : public PersistenceFile
 
     ReadVersion readVersion = ReadVersion::unknown;
 
+    struct RowPlace
+    {
+        size_t offset = 0;
+        int64_t persistenceStateAge = 0;
+    };
+
+    std::vector<RowPlace> findRows();
     std::list<RetainedMessage> readDataV3V4();
 public:
     RetainedMessagesDB(const std::string &filePath);
@@ -65,8 +80,15 @@ public:
     void openWrite();
     void openRead();
 
-    void saveData(const std::vector<RetainedMessage> &messages);
+    size_t saveData(const std::vector<RetainedMessage> &messages, const std::vector<MappedRetainedMessage> &mappedMessages = {});
     std::list<RetainedMessage> readData();
+    bool canReadDataMapped() const;
+    size_t readDataMapped(const std::function<void(std::string_view topic, MappedRetainedMessage &&message)> &f);
+
+    static void serializeMessage(const Publish &publish, PersistenceBuffer &out, CirBuf &cirbuf);
+    static std::shared_ptr<Client> makeDummyClient();
+    static RetainedMessage parseMessage(CirBuf &cirbuf, uint32_t packlen, uint16_t fixedHeaderLength, uint32_t age, const std::string &clientId,
+                                        const std::string &username, std::shared_ptr<Client> &dummyClient);
 };
 
 #endif // RETAINEDMESSAGESDB_H
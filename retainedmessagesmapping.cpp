@@ -0,0 +1,193 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "retainedmessagesmapping.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <stdexcept>
+
+#include "retainedmessagesdb.h"
+#include "persistencefile.h"
+#include "threadglobals.h"
+#include "settings.h"
+#include "cirbuf.h"
+#include "utils.h"
+
+RetainedMessagesMapping::RetainedMessagesMapping(int fd, const std::string &filePath) :
+    filePath(filePath)
+{
+    struct stat statbuf;
+    std::memset(&statbuf, 0, sizeof(struct stat));
+
+    if (fstat(fd, &statbuf) < 0)
+        throw std::runtime_error(formatString("Can't stat '%s': %s", filePath.c_str(), strerror(errno)));
+
+    size = statbuf.st_size;
+
+    if (size == 0)
+        throw std::runtime_error(formatString("Can't map '%s', because it's empty.", filePath.c_str()));
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (mapped == MAP_FAILED)
+        throw std::runtime_error(formatString("Mapping '%s' failed: %s", filePath.c_str(), strerror(errno)));
+
+    data = static_cast<const char*>(mapped);
+
+    // Loading reads it from start to end.
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    dummyClient = RetainedMessagesDB::makeDummyClient();
+}
+
+RetainedMessagesMapping::~RetainedMessagesMapping()
+{
+    if (data)
+        munmap(const_cast<char*>(data), size);
+}
+
+uint64_t RetainedMessagesMapping::readUint(size_t offset, int bytes) const
+{
+    if (offset > size || static_cast<size_t>(bytes) > size - offset)
+        throw std::runtime_error(formatString("Reading beyond the end of '%s'.", filePath.c_str()));
+
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(data + offset);
+    uint64_t val = 0;
+    for (int i = 0; i < bytes; i++)
+        val = (val << 8) | p[i];
+    return val;
+}
+
+RetainedMessagesMapping::Row RetainedMessagesMapping::readRow(size_t offset) const
+{
+    Row row;
+    size_t pos = offset;
+
+    auto readBytes = [&](size_t n) {
+        if (pos > size || n > size - pos)
+            throw std::runtime_error(formatString("Reading beyond the end of '%s'.", filePath.c_str()));
+
+        std::string_view result(data + pos, n);
+        pos += n;
+        return result;
+    };
+
+    row.fixedHeaderLength = readUint(pos, 2);
+    pos += 2;
+    row.age = readUint(pos, 4);
+    pos += 4;
+    const uint32_t packlen = readUint(pos, 4);
+    pos += 4;
+
+    const uint32_t clientIdLength = readUint(pos, 4);
+    pos += 4;
+    row.clientId = readBytes(clientIdLength);
+
+    const uint32_t usernameLength = readUint(pos, 4);
+    pos += 4;
+    row.username = readBytes(usernameLength);
+
+    row.packet = readBytes(packlen);
+    row.end = pos;
+
+    return row;
+}
+
+std::string_view RetainedMessagesMapping::Row::getTopic() const
+{
+    if (packet.size() < fixedHeaderLength + 2u)
+        throw std::runtime_error("Retained message packet is too short for a topic.");
+
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(packet.data() + fixedHeaderLength);
+    const uint16_t topicLength = (p[0] << 8) | p[1];
+
+    if (packet.size() < fixedHeaderLength + 2u + topicLength)
+        throw std::runtime_error("Retained message packet is too short for its topic.");
+
+    return packet.substr(fixedHeaderLength + 2, topicLength);
+}
+
+/**
+ * @brief RetainedMessagesMapping::doneLoading tells the kernel that from now on, messages are read at random.
+ */
+void RetainedMessagesMapping::doneLoading() const
+{
+    madvise(const_cast<char*>(data), size, MADV_RANDOM);
+}
+
+/**
+ * @brief RetainedMessagesMapping::load parses the message at offset. It's not kept, so it's parsed again the next time.
+ */
+Publish RetainedMessagesMapping::load(size_t offset, std::chrono::time_point<std::chrono::steady_clock> createdAt) const
+{
+    const Row row = readRow(offset);
+
+    CirBuf cirbuf(1024);
+    cirbuf.ensureFreeSpace(row.packet.size() + 32);
+    std::memcpy(cirbuf.headPtr(), row.packet.data(), row.packet.size());
+    cirbuf.advanceHead(row.packet.size());
+
+    std::shared_ptr<Client> client = dummyClient;
+    RetainedMessage rm = RetainedMessagesDB::parseMessage(cirbuf, row.packet.size(), row.fixedHeaderLength, ageFromTimePoint(createdAt),
+                                                          std::string(row.clientId), std::string(row.username), client);
+    return rm.publish;
+}
+
+MappedRetainedMessage::MappedRetainedMessage(const std::shared_ptr<const RetainedMessagesMapping> &mapping, size_t offset, uint32_t age) :
+    mapping(mapping),
+    offset(offset),
+    createdAt(timepointFromAge(age))
+{
+
+}
+
+/**
+ * @brief MappedRetainedMessage::hasExpired is like RetainedMessage::hasExpired(). Loaded messages don't have their own expiry anymore, so
+ * only 'expire_retained_messages_after_seconds' applies.
+ */
+bool MappedRetainedMessage::hasExpired() const
+{
+    const Settings *settings = ThreadGlobals::getSettings();
+    const std::chrono::seconds age = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - createdAt);
+    return age > std::chrono::seconds(settings->expireRetainedMessagesAfterSeconds);
+}
+
+Publish MappedRetainedMessage::load() const
+{
+    return mapping->load(offset, createdAt);
+}
+
+/**
+ * @brief MappedRetainedMessage::serialize writes the message for saving, like RetainedMessagesDB::serializeMessage(), but copies it from
+ * the mapping instead of parsing it.
+ */
+void MappedRetainedMessage::serialize(PersistenceBuffer &out) const
+{
+    const RetainedMessagesMapping::Row row = mapping->readRow(offset);
+
+    out.writeUint16(row.fixedHeaderLength);
+    out.writeUint32(ageFromTimePoint(createdAt));
+    out.writeUint32(row.packet.size());
+    out.writeUint32(row.clientId.size());
+    out.write(row.clientId.data(), row.clientId.size());
+    out.writeUint32(row.username.size());
+    out.write(row.username.data(), row.username.size());
+    out.write(row.packet.data(), row.packet.size());
+}
@@ -0,0 +1,95 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef RETAINEDMESSAGESMAPPING_H
+#define RETAINEDMESSAGESMAPPING_H
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <chrono>
+#include <stdint.h>
+
+#include "forward_declarations.h"
+#include "types.h"
+
+class PersistenceBuffer;
+
+/**
+ * @brief The RetainedMessagesMapping class is a retained messages DB mapped into memory, for 'retained_messages_lazy_loading'.
+ *
+ * Messages are parsed from it when needed, so the kernel pages them in on demand, and can drop those pages again under memory pressure.
+ * It's kept alive by the messages that refer to it, even after the DB has been saved anew and this file is unlinked.
+ */
+class RetainedMessagesMapping
+{
+    std::string filePath;
+    const char *data = nullptr;
+    size_t size = 0;
+
+    // Only read by the parser, so it can be shared by the threads.
+    std::shared_ptr<Client> dummyClient;
+
+public:
+    /**
+     * @brief The Row struct is a message as stored in the DB. See RetainedMessagesDB::serializeMessage().
+     */
+    struct Row
+    {
+        uint16_t fixedHeaderLength = 0;
+        uint32_t age = 0;
+        std::string_view clientId;
+        std::string_view username;
+        std::string_view packet;
+        size_t end = 0;
+
+        std::string_view getTopic() const;
+    };
+
+    RetainedMessagesMapping(int fd, const std::string &filePath);
+    RetainedMessagesMapping(const RetainedMessagesMapping &other) = delete;
+    RetainedMessagesMapping(RetainedMessagesMapping &&other) = delete;
+    ~RetainedMessagesMapping();
+
+    const std::string &getFilePath() const { return filePath; }
+    size_t getSize() const { return size; }
+    uint64_t readUint(size_t offset, int bytes) const;
+    Row readRow(size_t offset) const;
+    void doneLoading() const;
+    Publish load(size_t offset, std::chrono::time_point<std::chrono::steady_clock> createdAt) const;
+};
+
+/**
+ * @brief The MappedRetainedMessage struct is what a retained message node holds for a message that's still only in the mapped DB.
+ */
+struct MappedRetainedMessage
+{
+    std::shared_ptr<const RetainedMessagesMapping> mapping;
+    size_t offset = 0;
+    std::chrono::time_point<std::chrono::steady_clock> createdAt;
+
+    MappedRetainedMessage() = default;
+    MappedRetainedMessage(const std::shared_ptr<const RetainedMessagesMapping> &mapping, size_t offset, uint32_t age);
+
+    bool isSet() const { return static_cast<bool>(mapping); }
+    bool hasExpired() const;
+    Publish load() const;
+    void serialize(PersistenceBuffer &out) const;
+};
+
+#endif // RETAINEDMESSAGESMAPPING_H
@@ -0,0 +1,400 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "retainedmessageswal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+#include "retainedmessagesdb.h"
+#include "globalstats.h"
+#include "cirbuf.h"
+#include "utils.h"
+#include "settings.h"
+
+RetainedMessagesWal::RetainedMessagesWal(const std::string &dbPath) :
+    dbPath(dbPath)
+{
+
+}
+
+RetainedMessagesWal::~RetainedMessagesWal()
+{
+    try
+    {
+        sync();
+    }
+    catch (std::exception &ex)
+    {
+        logger->logf(LOG_ERR, "Error syncing retained messages write-ahead log: %s", ex.what());
+    }
+
+    closeFile();
+}
+
+std::string RetainedMessagesWal::getFilePath(uint64_t generation) const
+{
+    return formatString("%s.wal.%lu", dbPath.c_str(), generation);
+}
+
+void RetainedMessagesWal::openFile()
+{
+    const std::string path = getFilePath(generation);
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (fd < 0)
+        throw std::runtime_error(formatString("Can't open '%s': %s", path.c_str(), strerror(errno)));
+
+    char header[MAGIC_STRING_LENGH];
+    std::memset(header, 0, MAGIC_STRING_LENGH);
+    std::strncpy(header, MAGIC_STRING_RETAINED_WAL_V1, MAGIC_STRING_LENGH - 1);
+
+    if (write(fd, header, MAGIC_STRING_LENGH) != MAGIC_STRING_LENGH || fdatasync(fd) < 0)
+        throw std::runtime_error(formatString("Writing header of '%s' failed: %s", path.c_str(), strerror(errno)));
+
+    // Otherwise the file itself may not be there after a crash.
+    const std::string dir = dirnameOf(dbPath);
+    int dir_fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    fsync(dir_fd);
+    close(dir_fd);
+
+    logger->logf(LOG_INFO, "Logging changes to retained messages to '%s'.", path.c_str());
+}
+
+void RetainedMessagesWal::closeFile()
+{
+    if (fd < 0)
+        return;
+
+    close(fd);
+    fd = -1;
+}
+
+/**
+ * @brief RetainedMessagesWal::writePendingToFile writes what's appended so far. Needs the fileMutex.
+ *
+ * When writing fails halfway, what's left is kept with its offset, and written first the next time. Otherwise, the file would end up
+ * with a torn record in the middle, at which replay stops, losing all changes after it.
+ */
+void RetainedMessagesWal::writePendingToFile()
+{
+    while (true)
+    {
+        if (writing.empty())
+        {
+            std::lock_guard<std::mutex> locker(pendingMutex);
+            writing.swap(pending);
+            writingOffset = 0;
+        }
+
+        if (writing.empty())
+            return;
+
+        if (fd < 0)
+            throw std::runtime_error("Retained messages write-ahead log is not open.");
+
+        while (writingOffset < writing.size())
+        {
+            const ssize_t n = write(fd, writing.data() + writingOffset, writing.size() - writingOffset);
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                throw std::runtime_error(formatString("Writing '%s' failed: %s", getFilePath(generation).c_str(), strerror(errno)));
+            }
+
+            writingOffset += n;
+            bytesSinceNewGeneration += n;
+            GlobalStats::getInstance()->retainedMessagesWalBytesWritten.inc(n);
+        }
+
+        writing.clear();
+        writingOffset = 0;
+    }
+}
+
+/**
+ * @brief RetainedMessagesWal::open starts logging in a new file, after the ones that are there, which have been replayed on loading.
+ */
+void RetainedMessagesWal::open()
+{
+    std::lock_guard<std::mutex> locker(fileMutex);
+
+    const std::vector<std::pair<uint64_t, std::string>> files = findFiles(dbPath);
+    generation = files.empty() ? 1 : files.back().first + 1;
+    openFile();
+}
+
+/**
+ * @brief RetainedMessagesWal::serialize makes the record of a change. It's separate from append(), so the encoding can be done before locking.
+ */
+void RetainedMessagesWal::serialize(const Publish &publish, PersistenceBuffer &out)
+{
+    thread_local static CirBuf cirbuf(1024);
+
+    const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    out.writeInt64(now_epoch);
+    RetainedMessagesDB::serializeMessage(publish, out, cirbuf);
+}
+
+/**
+ * @brief RetainedMessagesWal::append adds a record to the buffer that sync() writes.
+ *
+ * Call it while holding the lock that orders the changes to the topic, so that replaying gives the same outcome.
+ */
+void RetainedMessagesWal::append(const PersistenceBuffer &record)
+{
+    const uint32_t len = record.size();
+    const uint32_t crc = crc32c(record.data(), record.size());
+
+    unsigned char header[8];
+    for (int i = 0; i < 4; i++)
+    {
+        header[i] = len >> (24 - i * 8);
+        header[4 + i] = crc >> (24 - i * 8);
+    }
+
+    std::lock_guard<std::mutex> locker(pendingMutex);
+    pending.insert(pending.end(), header, header + 8);
+    pending.insert(pending.end(), record.data(), record.data() + record.size());
+}
+
+/**
+ * @brief RetainedMessagesWal::sync writes and fsyncs what's appended since the last time, so all those changes cost one fsync.
+ */
+void RetainedMessagesWal::sync()
+{
+    std::lock_guard<std::mutex> locker(fileMutex);
+
+    if (fd < 0)
+        return;
+
+    const uint64_t before = bytesSinceNewGeneration;
+
+    writePendingToFile();
+
+    if (before == bytesSinceNewGeneration)
+        return;
+
+    if (fdatasync(fd) < 0)
+        throw std::runtime_error(formatString("fdatasync of '%s' failed: %s", getFilePath(generation).c_str(), strerror(errno)));
+
+    GlobalStats::getInstance()->retainedMessagesWalSyncs.inc();
+}
+
+/**
+ * @brief RetainedMessagesWal::startNewGeneration is the first step of compacting. Call it while no changes can be appended, so each change
+ * is either in the old generation and in the DB about to be saved, or in the new one.
+ * @return the new generation. Once the DB is saved, the ones before it can be removed.
+ */
+uint64_t RetainedMessagesWal::startNewGeneration()
+{
+    std::lock_guard<std::mutex> locker(fileMutex);
+
+    writePendingToFile();
+
+    if (fd >= 0 && fdatasync(fd) < 0)
+        throw std::runtime_error(formatString("fdatasync of '%s' failed: %s", getFilePath(generation).c_str(), strerror(errno)));
+
+    closeFile();
+    generation++;
+    bytesSinceNewGeneration = 0;
+    openFile();
+
+    return generation;
+}
+
+void RetainedMessagesWal::setDbSize(uint64_t size)
+{
+    std::lock_guard<std::mutex> locker(fileMutex);
+    this->dbSize = size;
+}
+
+/**
+ * @brief RetainedMessagesWal::needsCompaction says when the log has become bigger than the DB, so loading takes at most twice as long as
+ * loading the DB, and the DB is rewritten at most once per its size in changes.
+ */
+bool RetainedMessagesWal::needsCompaction()
+{
+    std::lock_guard<std::mutex> locker(fileMutex);
+    return bytesSinceNewGeneration >= std::max<uint64_t>(minBytesBeforeCompaction, dbSize);
+}
+
+/**
+ * @brief RetainedMessagesWal::findFiles finds the log files belonging to the DB.
+ * @return generations and paths, ordered by generation.
+ */
+std::vector<std::pair<uint64_t, std::string>> RetainedMessagesWal::findFiles(const std::string &dbPath)
+{
+    std::vector<std::pair<uint64_t, std::string>> result;
+
+    std::string dir = dirnameOf(dbPath);
+    const std::string prefix = formatString("%s.wal.", dbPath.substr(dir.empty() ? 0 : dir.size() + 1).c_str());
+    if (dir.empty())
+        dir = ".";
+
+    DIR *d = opendir(dir.c_str());
+
+    if (d == nullptr)
+        return result;
+
+    struct dirent *entry = nullptr;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        const std::string name(entry->d_name);
+
+        if (!startsWith(name, prefix))
+            continue;
+
+        const std::string number = name.substr(prefix.size());
+
+        if (number.empty() || !std::all_of(number.begin(), number.end(), [](char c) { return c >= '0' && c <= '9'; }))
+            continue;
+
+        result.emplace_back(std::stoull(number), formatString("%s/%s", dir.c_str(), name.c_str()));
+    }
+
+    closedir(d);
+
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+void RetainedMessagesWal::removeFilesBefore(const std::string &dbPath, uint64_t generation)
+{
+    for (const std::pair<uint64_t, std::string> &file : findFiles(dbPath))
+    {
+        if (file.first >= generation)
+            continue;
+
+        Logger::getInstance()->logf(LOG_DEBUG, "Removing '%s', because its changes are in '%s'.", file.second.c_str(), dbPath.c_str());
+
+        if (unlink(file.second.c_str()) < 0)
+            Logger::getInstance()->logf(LOG_ERR, "Removing '%s' failed: %s", file.second.c_str(), strerror(errno));
+    }
+}
+
+/**
+ * @brief RetainedMessagesWal::replay reads the log files of the DB, oldest first, and gives each change to apply.
+ * @return the number of changes.
+ */
+size_t RetainedMessagesWal::replay(const std::string &dbPath, const std::function<void(Publish &)> &apply)
+{
+    Logger *logger = Logger::getInstance();
+    size_t count = 0;
+    std::shared_ptr<Client> dummyClient;
+    CirBuf cirbuf(1024);
+    std::vector<char> record;
+
+    for (const std::pair<uint64_t, std::string> &file : findFiles(dbPath))
+    {
+        const std::string &path = file.second;
+
+        FILE *f = fopen(path.c_str(), "rb");
+
+        if (f == nullptr)
+        {
+            logger->logf(LOG_ERR, "Can't open '%s': %s", path.c_str(), strerror(errno));
+            continue;
+        }
+
+        logger->logf(LOG_INFO, "Replaying '%s'.", path.c_str());
+
+        try
+        {
+            char header[MAGIC_STRING_LENGH];
+            if (fread(header, 1, MAGIC_STRING_LENGH, f) != MAGIC_STRING_LENGH || strncmp(header, MAGIC_STRING_RETAINED_WAL_V1, MAGIC_STRING_LENGH) != 0)
+                throw std::runtime_error("Unknown file version.");
+
+            int64_t offset = MAGIC_STRING_LENGH;
+
+            while (true)
+            {
+                unsigned char recordHeader[8];
+                const size_t headerRead = fread(recordHeader, 1, 8, f);
+
+                if (headerRead == 0 && feof(f))
+                    break;
+
+                uint32_t len = 0;
+                uint32_t crc = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    len = (len << 8) | recordHeader[i];
+                    crc = (crc << 8) | recordHeader[4 + i];
+                }
+
+                if (headerRead == 8 && len <= ABSOLUTE_MAX_PACKET_SIZE + 0x30000)
+                {
+                    record.resize(len);
+
+                    if (fread(record.data(), 1, len, f) == len && crc32c(record.data(), len) == crc)
+                    {
+                        PersistenceReader reader(record.data(), record.size());
+                        const int64_t loggedAt = reader.readInt64();
+                        const uint16_t fixedHeaderLength = reader.readUint16();
+                        const uint32_t age = reader.readUint32();
+                        const uint32_t packlen = reader.readUint32();
+                        const std::string clientId = reader.readString();
+                        const std::string username = reader.readString();
+                        const char *packet = reader.readBytes(packlen);
+
+                        const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+                        const uint32_t ageNow = (loggedAt > now_epoch ? 0 : now_epoch - loggedAt) + age;
+
+                        cirbuf.reset();
+                        cirbuf.ensureFreeSpace(packlen + 32);
+                        std::memcpy(cirbuf.headPtr(), packet, packlen);
+                        cirbuf.advanceHead(packlen);
+
+                        if (!dummyClient)
+                            dummyClient = RetainedMessagesDB::makeDummyClient();
+
+                        RetainedMessage rm = RetainedMessagesDB::parseMessage(cirbuf, packlen, fixedHeaderLength, ageNow, clientId, username, dummyClient);
+                        apply(rm.publish);
+                        count++;
+                        offset += 8 + len;
+                        continue;
+                    }
+                }
+
+                logger->logf(LOG_WARNING, "'%s' has an incomplete or damaged record at offset %ld, probably from a crash while writing. Changes "
+                                          "after it are lost.", path.c_str(), offset);
+                break;
+            }
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error replaying '%s': %s", path.c_str(), ex.what());
+        }
+
+        fclose(f);
+    }
+
+    return count;
+}
@@ -0,0 +1,97 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef RETAINEDMESSAGESWAL_H
+#define RETAINEDMESSAGESWAL_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <stdint.h>
+
+#include "persistencefile.h"
+#include "types.h"
+
+#define MAGIC_STRING_RETAINED_WAL_V1 "FlashMQRetainedWALv1"
+
+/**
+ * @brief The RetainedMessagesWal class is an append-only log of the changes to the retained messages, so they survive a crash that happens
+ * between saves of the retained messages DB.
+ *
+ * Changes are appended to a buffer in memory, and sync() writes the buffer and fsyncs, so one fsync covers all changes of an interval. See
+ * 'retained_messages_wal_sync_interval_ms'.
+ *
+ * The log is a series of files, '<db>.wal.<generation>'. Saving the DB (compacting) starts a new generation first, and removes the older
+ * ones once the DB is on disk. Loading replays all generations over the DB, in order. Because the changes of a topic are logged in the
+ * order they are applied, replaying a change that is already in the DB gives the same end result.
+ *
+ * A file looks like, from the top:
+ *
+ * MAGIC_STRING_LENGH bytes file header
+ * [RECORDS]
+ *
+ * Each record is a uint32 length and the uint32 CRC32C of what follows, then the time stamp of logging (int64) and the message, encoded
+ * like in the DB. A clear is a message with an empty payload. Replay of a file stops at the first incomplete or damaged record, which
+ * is what a crash during writing leaves.
+ */
+class RetainedMessagesWal
+{
+    const std::string dbPath;
+    uint64_t generation = 0;
+    int fd = -1;
+
+    std::mutex pendingMutex;
+    std::vector<char> pending;
+    std::vector<char> writing;
+    size_t writingOffset = 0;
+
+    // Held while writing to the file, and when starting a new generation.
+    std::mutex fileMutex;
+    uint64_t bytesSinceNewGeneration = 0;
+    uint64_t dbSize = 0;
+
+    Logger *logger = Logger::getInstance();
+
+    std::string getFilePath(uint64_t generation) const;
+    void openFile();
+    void closeFile();
+    void writePendingToFile();
+
+public:
+    static constexpr uint64_t minBytesBeforeCompaction = 64 * 1024 * 1024;
+
+    RetainedMessagesWal(const std::string &dbPath);
+    RetainedMessagesWal(const RetainedMessagesWal &other) = delete;
+    RetainedMessagesWal(RetainedMessagesWal &&other) = delete;
+    ~RetainedMessagesWal();
+
+    void open();
+    static void serialize(const Publish &publish, PersistenceBuffer &out);
+    void append(const PersistenceBuffer &record);
+    void sync();
+    uint64_t startNewGeneration();
+    void setDbSize(uint64_t size);
+    bool needsCompaction();
+
+    static std::vector<std::pair<uint64_t, std::string>> findFiles(const std::string &dbPath);
+    static void removeFilesBefore(const std::string &dbPath, uint64_t generation);
+    static size_t replay(const std::string &dbPath, const std::function<void(Publish &publish)> &apply);
+};
+
+#endif // RETAINEDMESSAGESWAL_H
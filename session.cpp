@@ -24,6 +24,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "exceptions.h"
 #include "plugin.h"
 #include "settings.h"
+#include "globalstats.h"
 
 Session::Session()
 {
@@ -107,7 +108,8 @@ Session::Session(const Session &other)
 
 Session::~Session()
 {
-
+    // The subscription tree still points to this session, but those subscriptions are dead now.
+    GlobalStats::getInstance()->subscriptions.add(-subscriptionCount);
 }
 
 std::unique_ptr<Session> Session::getCopy() const
@@ -131,6 +133,11 @@ std::shared_ptr<Client> Session::makeSharedClient() const
 
 void Session::assignActiveConnection(std::shared_ptr<Client> &client)
 {
+    // Subscriptions that were authorized at subscribe time were authorized for the old username. That's only this session's concern, so
+    // we don't invalidate the ACL generation, which would be for all sessions.
+    if (this->username != client->getUsername() && !this->client_id.empty())
+        readAclPreauthorizationsRevokedIn.store(AclCache::getGeneration(), std::memory_order_relaxed);
+
     this->client = client;
     this->client_id = client->getClientId();
     this->username = client->getUsername();
@@ -138,6 +145,47 @@ void Session::assignActiveConnection(std::shared_ptr<Client> &client)
     this->removalQueued = false;
 }
 
+/**
+ * @brief Session::getThreadForCrossThreadPublish decides which thread writes a publish to this session. See 'cross_thread_publish_batching'.
+ * @param currentThread is the thread doing the publish.
+ * @return The thread to give the publish to, or null when the current thread can write it itself.
+ *
+ * As long as publishes are pending in a thread, the next ones go there as well, even if the client has since disconnected or
+ * moved. Writing those directly would overtake the pending ones. Each returned thread must call crossThreadPublishWritten() after writing.
+ */
+std::shared_ptr<ThreadData> Session::getThreadForCrossThreadPublish(const ThreadData *currentThread)
+{
+    std::shared_ptr<Client> c = makeSharedClient();
+    std::shared_ptr<ThreadData> td = c ? c->lockThreadData() : std::shared_ptr<ThreadData>();
+
+    if (crossThreadPublishesPending.load(std::memory_order_acquire) == 0 && (!td || td.get() == currentThread))
+        return std::shared_ptr<ThreadData>();
+
+    std::lock_guard<std::mutex> locker(crossThreadPublishMutex);
+
+    std::shared_ptr<ThreadData> pendingThread = crossThreadPublishThread.lock();
+
+    if (crossThreadPublishesPending.load(std::memory_order_acquire) > 0 && pendingThread)
+        td = pendingThread;
+    else
+    {
+        // A thread that's gone won't write its pending publishes anymore.
+        crossThreadPublishesPending.store(0, std::memory_order_relaxed);
+
+        if (!td || td.get() == currentThread)
+            return std::shared_ptr<ThreadData>();
+    }
+
+    crossThreadPublishesPending.fetch_add(1, std::memory_order_relaxed);
+    crossThreadPublishThread = td;
+    return td;
+}
+
+void Session::crossThreadPublishWritten()
+{
+    crossThreadPublishesPending.fetch_sub(1, std::memory_order_release);
+}
+
 /**
  * @brief Session::writePacket is the main way to give a client a packet -> it goes through the session.
  * @param packet is not const. We set the qos and packet id for each publish. This should be safe, because the packet
@@ -145,8 +193,10 @@ void Session::assignActiveConnection(std::shared_ptr<Client> &client)
  * @param max_qos
  * @param retain. Keep MQTT-3.3.1-9 in mind: existing subscribers don't get retain=1 on packets.
  * @param count. Reference value is updated. It's for statistics.
+ * @param readAclPreauthorization is the ACL generation for which the subscription was authorized at subscribe time, which makes the
+ *        read ACL check unnecessary as long as it's still the current one. See 'preauthorize_literal_subscriptions'.
  */
-void Session::writePacket(PublishCopyFactory &copyFactory, const uint8_t max_qos)
+void Session::writePacket(PublishCopyFactory &copyFactory, const uint8_t max_qos, uint32_t readAclPreauthorization)
 {
     assert(max_qos <= 2);
 
@@ -157,7 +207,10 @@ void Session::writePacket(PublishCopyFactory &copyFactory, const uint8_t max_qos
     Authentication *_auth = ThreadGlobals::getAuth();
     assert(_auth);
     Authentication &auth = *_auth;
-    if (auth.aclCheck(client_id, username, copyFactory.getTopic(), copyFactory.getSubtopics(), copyFactory.getPayload(), AclAccess::read, effectiveQos, copyFactory.getRetain(), copyFactory.getUserProperties()) == AuthResult::success)
+    const bool preauthorized = readAclPreauthorization != 0 && readAclPreauthorization == AclCache::getGeneration()
+                               && readAclPreauthorization != readAclPreauthorizationsRevokedIn.load(std::memory_order_relaxed);
+
+    if (preauthorized || auth.aclCheck(client_id, username, copyFactory.getTopic(), copyFactory.getSubtopics(), copyFactory.getPayload(), AclAccess::read, effectiveQos, copyFactory.getRetain(), copyFactory.getUserProperties()) == AuthResult::success)
     {
         std::shared_ptr<Client> c = makeSharedClient();
         if (effectiveQos == 0)
@@ -429,3 +482,12 @@ uint32_t Session::getCurrentSessionExpiryInterval() const
     return result;
 }
 
+/**
+ * @brief Session::adjustSubscriptionCount is called when a place in the subscription tree starts or stops pointing to this session. Must be
+ * called with the subscriptions write lock held.
+ */
+void Session::adjustSubscriptionCount(int64_t delta)
+{
+    subscriptionCount += delta;
+    GlobalStats::getInstance()->subscriptions.add(delta);
+}
@@ -22,6 +22,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <list>
 #include <mutex>
 #include <set>
+#include <atomic>
 
 #include "forward_declarations.h"
 #include "logger.h"
@@ -60,6 +61,16 @@ class Session
     std::shared_ptr<WillPublish> willPublish;
     bool removalQueued = false;
     std::chrono::time_point<std::chrono::steady_clock> removalQueuedAt;
+    int64_t subscriptionCount = 0;
+
+    // The ACL generation in which another username took over the session, making the preauthorizations of that generation not ours.
+    std::atomic<uint32_t> readAclPreauthorizationsRevokedIn{0};
+
+    // Publishes handed to another thread to write, and that thread. See 'cross_thread_publish_batching'.
+    std::mutex crossThreadPublishMutex;
+    std::weak_ptr<ThreadData> crossThreadPublishThread;
+    std::atomic<uint32_t> crossThreadPublishesPending{0};
+
     Logger *logger = Logger::getInstance();
 
     void increaseFlowControlQuota();
@@ -81,7 +92,9 @@ public:
     const std::string &getClientId() const { return client_id; }
     std::shared_ptr<Client> makeSharedClient() const;
     void assignActiveConnection(std::shared_ptr<Client> &client);
-    void writePacket(PublishCopyFactory &copyFactory, const uint8_t max_qos);
+    void writePacket(PublishCopyFactory &copyFactory, const uint8_t max_qos, uint32_t readAclPreauthorization = 0);
+    std::shared_ptr<ThreadData> getThreadForCrossThreadPublish(const ThreadData *currentThread);
+    void crossThreadPublishWritten();
     bool clearQosMessage(uint16_t packet_id, bool qosHandshakeEnds);
     void sendAllPendingQosData();
     bool hasActiveClient() const;
@@ -103,6 +116,7 @@ public:
     void setQueuedRemovalAt();
     uint32_t getSessionExpiryInterval() const;
     uint32_t getCurrentSessionExpiryInterval() const;
+    void adjustSubscriptionCount(int64_t delta);
 };
 
 #endif // SESSION_H
@@ -54,7 +54,7 @@ SessionsAndSubscriptionsDB::SessionsAndSubscriptionsDB(const std::string &filePa
 
 void SessionsAndSubscriptionsDB::openWrite()
 {
-    PersistenceFile::openWrite(MAGIC_STRING_SESSION_FILE_V4);
+    PersistenceFile::openWrite(MAGIC_STRING_SESSION_FILE_V5);
 }
 
 void SessionsAndSubscriptionsDB::openRead()
@@ -69,338 +69,450 @@ void SessionsAndSubscriptionsDB::openRead()
         readVersion = ReadVersion::v3;
     else if (detectedVersionString == MAGIC_STRING_SESSION_FILE_V4)
         readVersion = ReadVersion::v4;
+    else if (detectedVersionString == MAGIC_STRING_SESSION_FILE_V5)
+        readVersion = ReadVersion::v5;
     else
         throw std::runtime_error("Unknown file version.");
+
+    // Subscriptions are saved after all sessions, so sessions before a damaged block would be loaded without them, and clients would
+    // silently not get their messages.
+    if (readVersion >= ReadVersion::v5)
+        verifyBlockChecksums(false);
+    else
+        startVerifyingHash();
 }
 
-SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readDataV3V4()
+/**
+ * @brief SessionsAndSubscriptionsDB::skipSession moves the reader past a session, without parsing it. See readDataV3V4().
+ */
+void SessionsAndSubscriptionsDB::skipSession(PersistenceReader &reader)
 {
-    const Settings &settings = *ThreadGlobals::getSettings();
+    reader.skip(RESERVED_SPACE_SESSIONS_DB_V2);
+    reader.skipString();
+    reader.skipString();
 
-    SessionsAndSubscriptionsResult result;
+    const uint32_t nrOfQueuedQoSPackets = reader.readUint32();
+    for (uint32_t i = 0; i < nrOfQueuedQoSPackets; i++)
+    {
+        reader.skip(8);
+        const uint32_t packlen = reader.readUint32();
+        reader.skipString();
+        reader.skipString();
+        reader.skip(packlen);
+    }
+
+    const uint32_t nrOfIncomingPacketIds = reader.readUint32();
+    reader.skip(nrOfIncomingPacketIds * 2ul);
+
+    const uint32_t nrOfOutgoingPacketIds = reader.readUint32();
+    reader.skip(nrOfOutgoingPacketIds * 2ul);
+
+    reader.skip(6);
 
-    while (!feof(f))
+    const uint16_t hasWill = reader.readUint16();
+
+    if (hasWill)
     {
-        bool eofFound = false;
+        reader.skip(10);
+        const uint32_t packlen = reader.readUint32();
+        reader.skipString();
+        reader.skipString();
+        reader.skip(packlen);
+    }
+}
 
-        const int64_t fileSavedAt = readInt64(eofFound);
-        if (eofFound)
-            continue;
+std::shared_ptr<Session> SessionsAndSubscriptionsDB::readSession(PersistenceReader &reader, int64_t persistence_state_age, const Settings &settings,
+                                                                 CirBuf &cirbuf, std::shared_ptr<Client> &dummyClient)
+{
+    reader.skip(RESERVED_SPACE_SESSIONS_DB_V2);
 
-        const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-        const int64_t persistence_state_age = fileSavedAt > now_epoch ? 0 : now_epoch - fileSavedAt;
+    std::string username = reader.readString();
+    std::string clientId = reader.readString();
 
-        logger->logf(LOG_DEBUG, "Session file was saved at %ld. That's %ld seconds ago.", fileSavedAt, persistence_state_age);
+    std::shared_ptr<Session> ses = std::make_shared<Session>();
+    ses->username = username;
+    ses->client_id = clientId;
 
-        const uint32_t nrOfSessions = readUint32(eofFound);
+    logger->logf(LOG_DEBUG, "Loading session '%s'.", ses->getClientId().c_str());
 
-        if (eofFound)
-            continue;
+    const uint32_t nrOfQueuedQoSPackets = reader.readUint32();
+    for (uint32_t i = 0; i < nrOfQueuedQoSPackets; i++)
+    {
+        const uint16_t fixed_header_length = reader.readUint16();
+        const uint16_t id = reader.readUint16();
+        const uint32_t originalPubAge = reader.readUint32();
+        const uint32_t packlen = reader.readUint32();
+        const std::string sender_clientid = reader.readString();
+        const std::string sender_username = reader.readString();
 
-        std::vector<char> reserved(RESERVED_SPACE_SESSIONS_DB_V2);
-        CirBuf cirbuf(1024);
+        assert(id > 0);
 
-        std::shared_ptr<ThreadData> dummyThreadData; // which thread am I going get/use here?
-        std::shared_ptr<Client> dummyClient(new Client(0, dummyThreadData, nullptr, false, false, nullptr, settings, false));
-        dummyClient->setClientProperties(ProtocolVersion::Mqtt5, "Dummyforloadingqueuedqos", "nobody", true, 60);
+        cirbuf.reset();
+        cirbuf.ensureFreeSpace(packlen + 32);
 
-        for (uint32_t i = 0; i < nrOfSessions; i++)
-        {
-            readCheck(buf.data(), 1, RESERVED_SPACE_SESSIONS_DB_V2, f);
-
-            std::string username = readString(eofFound);
-            std::string clientId = readString(eofFound);
-
-            std::shared_ptr<Session> ses = std::make_shared<Session>();
-            result.sessions.push_back(ses);
-            ses->username = username;
-            ses->client_id = clientId;
-
-            logger->logf(LOG_DEBUG, "Loading session '%s'.", ses->getClientId().c_str());
-
-            const uint32_t nrOfQueuedQoSPackets = readUint32(eofFound);
-            for (uint32_t i = 0; i < nrOfQueuedQoSPackets; i++)
-            {
-                const uint16_t fixed_header_length = readUint16(eofFound);
-                const uint16_t id = readUint16(eofFound);
-                const uint32_t originalPubAge = readUint32(eofFound);
-                const uint32_t packlen = readUint32(eofFound);
-                const std::string sender_clientid = readString(eofFound);
-                const std::string sender_username = readString(eofFound);
-
-                assert(id > 0);
-
-                cirbuf.reset();
-                cirbuf.ensureFreeSpace(packlen + 32);
-
-                readCheck(cirbuf.headPtr(), 1, packlen, f);
-                cirbuf.advanceHead(packlen);
-                MqttPacket pack(cirbuf, packlen, fixed_header_length, dummyClient);
-
-                pack.parsePublishData();
-                Publish pub(pack.getPublishData());
-
-                pub.client_id = sender_clientid;
-                pub.username = sender_username;
-
-                const uint32_t newPubAge = persistence_state_age + originalPubAge;
-                pub.createdAt = timepointFromAge(newPubAge);
-
-                logger->logf(LOG_DEBUG, "Loaded QoS %d message for topic '%s' for session '%s'.", pub.qos, pub.topic.c_str(), ses->getClientId().c_str());
-                ses->qosPacketQueue.queuePublish(std::move(pub), id);
-            }
-
-            const uint32_t nrOfIncomingPacketIds = readUint32(eofFound);
-            for (uint32_t i = 0; i < nrOfIncomingPacketIds; i++)
-            {
-                uint16_t id = readUint16(eofFound);
-                assert(id > 0);
-                logger->logf(LOG_DEBUG, "Loaded incomming QoS2 message id %d.", id);
-                ses->incomingQoS2MessageIds.insert(id);
-            }
-
-            const uint32_t nrOfOutgoingPacketIds = readUint32(eofFound);
-            for (uint32_t i = 0; i < nrOfOutgoingPacketIds; i++)
-            {
-                uint16_t id = readUint16(eofFound);
-                assert(id > 0);
-                logger->logf(LOG_DEBUG, "Loaded outgoing QoS2 message id %d.", id);
-                ses->outgoingQoS2MessageIds.insert(id);
-            }
-
-            const uint16_t nextPacketId = readUint16(eofFound);
-            logger->logf(LOG_DEBUG, "Loaded next packetid %d.", ses->nextPacketId);
-            ses->nextPacketId = nextPacketId;
-
-            const uint32_t originalSessionExpiryInterval = readUint32(eofFound);
-            const uint32_t compensatedSessionExpiry = persistence_state_age > originalSessionExpiryInterval ? 0 : originalSessionExpiryInterval - persistence_state_age;
-            const uint32_t sessionExpiryInterval = std::min<uint32_t>(compensatedSessionExpiry, settings.getExpireSessionAfterSeconds());
-
-            // We will set the session expiry interval as it would have had time continued. If a connection picks up session, it will update
-            // it with a more relevant value.
-            // The protocol version 5 is just dummy, to get the behavior I want.
-            ses->setSessionProperties(0xFFFF, sessionExpiryInterval, 0, ProtocolVersion::Mqtt5);
-
-            const uint16_t hasWill = readUint16(eofFound);
-
-            if (hasWill)
-            {
-                const uint16_t fixed_header_length = readUint16(eofFound);
-                const uint32_t originalWillDelay = readUint32(eofFound);
-                const uint32_t originalWillQueueAge = readUint32(eofFound);
-                const uint32_t newWillDelayAfterMaybeAlreadyBeingQueued = originalWillQueueAge < originalWillDelay ? originalWillDelay - originalWillQueueAge : 0;
-                const uint32_t packlen = readUint32(eofFound);
-                const std::string sender_clientid = readString(eofFound);
-                const std::string sender_username = readString(eofFound);
-
-                const uint32_t stateAgecompensatedWillDelay =
-                        persistence_state_age > newWillDelayAfterMaybeAlreadyBeingQueued ? 0 : newWillDelayAfterMaybeAlreadyBeingQueued - persistence_state_age;
-
-                cirbuf.reset();
-                cirbuf.ensureFreeSpace(packlen + 32);
-
-                readCheck(cirbuf.headPtr(), 1, packlen, f);
-                cirbuf.advanceHead(packlen);
-                MqttPacket publishpack(cirbuf, packlen, fixed_header_length, dummyClient);
-                publishpack.parsePublishData();
-                WillPublish willPublish = publishpack.getPublishData();
-                willPublish.will_delay = stateAgecompensatedWillDelay;
-
-                willPublish.client_id = sender_clientid;
-                willPublish.username = sender_username;
-
-                if (settings.willsEnabled)
-                    ses->setWill(std::move(willPublish));
-            }
-        }
+        std::memcpy(cirbuf.headPtr(), reader.readBytes(packlen), packlen);
+        cirbuf.advanceHead(packlen);
+        MqttPacket pack(cirbuf, packlen, fixed_header_length, dummyClient);
 
-        const uint32_t nrOfSubscriptions = readUint32(eofFound);
-        for (uint32_t i = 0; i < nrOfSubscriptions; i++)
-        {
-            const std::string topic = readString(eofFound);
+        pack.parsePublishData();
+        Publish pub(pack.getPublishData());
+
+        pub.client_id = sender_clientid;
+        pub.username = sender_username;
 
-            logger->logf(LOG_DEBUG, "Loading subscriptions to topic '%s'.", topic.c_str());
+        const uint32_t newPubAge = persistence_state_age + originalPubAge;
+        pub.createdAt = timepointFromAge(newPubAge);
 
-            const uint32_t nrOfClientIds = readUint32(eofFound);
+        logger->logf(LOG_DEBUG, "Loaded QoS %d message for topic '%s' for session '%s'.", pub.qos, pub.topic.c_str(), ses->getClientId().c_str());
+        ses->qosPacketQueue.queuePublish(std::move(pub), id);
+    }
 
-            for (uint32_t i = 0; i < nrOfClientIds; i++)
-            {
-                std::string sharename;
-                if (readVersion >= ReadVersion::v4)
-                    sharename = readString(eofFound);
+    const uint32_t nrOfIncomingPacketIds = reader.readUint32();
+    for (uint32_t i = 0; i < nrOfIncomingPacketIds; i++)
+    {
+        uint16_t id = reader.readUint16();
+        assert(id > 0);
+        logger->logf(LOG_DEBUG, "Loaded incomming QoS2 message id %d.", id);
+        ses->incomingQoS2MessageIds.insert(id);
+    }
 
-                std::string clientId = readString(eofFound);
-                uint8_t qos = readUint8(eofFound);
+    const uint32_t nrOfOutgoingPacketIds = reader.readUint32();
+    for (uint32_t i = 0; i < nrOfOutgoingPacketIds; i++)
+    {
+        uint16_t id = reader.readUint16();
+        assert(id > 0);
+        logger->logf(LOG_DEBUG, "Loaded outgoing QoS2 message id %d.", id);
+        ses->outgoingQoS2MessageIds.insert(id);
+    }
 
-                logger->logf(LOG_DEBUG, "Saving session '%s' subscription to '%s' QoS %d.", clientId.c_str(), topic.c_str(), qos);
+    const uint16_t nextPacketId = reader.readUint16();
+    logger->logf(LOG_DEBUG, "Loaded next packetid %d.", ses->nextPacketId);
+    ses->nextPacketId = nextPacketId;
 
-                SubscriptionForSerializing sub(std::move(clientId), qos, sharename);
-                result.subscriptions[topic].push_back(std::move(sub));
-            }
+    const uint32_t originalSessionExpiryInterval = reader.readUint32();
+    const uint32_t compensatedSessionExpiry = persistence_state_age > originalSessionExpiryInterval ? 0 : originalSessionExpiryInterval - persistence_state_age;
+    const uint32_t sessionExpiryInterval = std::min<uint32_t>(compensatedSessionExpiry, settings.getExpireSessionAfterSeconds());
 
-        }
+    // We will set the session expiry interval as it would have had time continued. If a connection picks up session, it will update
+    // it with a more relevant value.
+    // The protocol version 5 is just dummy, to get the behavior I want.
+    ses->setSessionProperties(0xFFFF, sessionExpiryInterval, 0, ProtocolVersion::Mqtt5);
+
+    const uint16_t hasWill = reader.readUint16();
+
+    if (hasWill)
+    {
+        const uint16_t fixed_header_length = reader.readUint16();
+        const uint32_t originalWillDelay = reader.readUint32();
+        const uint32_t originalWillQueueAge = reader.readUint32();
+        const uint32_t newWillDelayAfterMaybeAlreadyBeingQueued = originalWillQueueAge < originalWillDelay ? originalWillDelay - originalWillQueueAge : 0;
+        const uint32_t packlen = reader.readUint32();
+        const std::string sender_clientid = reader.readString();
+        const std::string sender_username = reader.readString();
+
+        const uint32_t stateAgecompensatedWillDelay =
+                persistence_state_age > newWillDelayAfterMaybeAlreadyBeingQueued ? 0 : newWillDelayAfterMaybeAlreadyBeingQueued - persistence_state_age;
+
+        cirbuf.reset();
+        cirbuf.ensureFreeSpace(packlen + 32);
+
+        std::memcpy(cirbuf.headPtr(), reader.readBytes(packlen), packlen);
+        cirbuf.advanceHead(packlen);
+        MqttPacket publishpack(cirbuf, packlen, fixed_header_length, dummyClient);
+        publishpack.parsePublishData();
+        WillPublish willPublish = publishpack.getPublishData();
+        willPublish.will_delay = stateAgecompensatedWillDelay;
+
+        willPublish.client_id = sender_clientid;
+        willPublish.username = sender_username;
+
+        if (settings.willsEnabled)
+            ses->setWill(std::move(willPublish));
     }
 
-    return result;
+    return ses;
 }
 
-void SessionsAndSubscriptionsDB::writeRowHeader()
+/**
+ * @brief SessionsAndSubscriptionsDB::skipSubscriptions moves the reader past the subscriptions of a topic, without parsing them.
+ */
+void SessionsAndSubscriptionsDB::skipSubscriptions(PersistenceReader &reader)
 {
+    reader.skipString();
 
+    const uint32_t nrOfClientIds = reader.readUint32();
+
+    for (uint32_t i = 0; i < nrOfClientIds; i++)
+    {
+        if (readVersion >= ReadVersion::v4)
+            reader.skipString();
+
+        reader.skipString();
+        reader.skip(1);
+    }
 }
 
-void SessionsAndSubscriptionsDB::saveData(const std::vector<std::shared_ptr<Session>> &sessions, const std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &subscriptions)
+void SessionsAndSubscriptionsDB::readSubscriptions(PersistenceReader &reader, std::string &topic, std::list<SubscriptionForSerializing> &subscriptions)
 {
-    if (!f)
-        return;
+    topic = reader.readString();
 
-    char reserved[RESERVED_SPACE_SESSIONS_DB_V2];
-    std::memset(reserved, 0, RESERVED_SPACE_SESSIONS_DB_V2);
+    logger->logf(LOG_DEBUG, "Loading subscriptions to topic '%s'.", topic.c_str());
 
-    const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-    logger->logf(LOG_DEBUG, "Saving current time stamp %ld", now_epoch);
-    writeInt64(now_epoch);
+    const uint32_t nrOfClientIds = reader.readUint32();
 
-    std::vector<std::shared_ptr<Session>> sessionsToSave;
-    // Sessions created with clean session need to be destroyed when disconnecting, so no point in saving them.
-    std::copy_if(sessions.begin(), sessions.end(), std::back_inserter(sessionsToSave), [](const std::shared_ptr<Session> &ses) {
-        return !ses->destroyOnDisconnect;
-    });
+    for (uint32_t i = 0; i < nrOfClientIds; i++)
+    {
+        std::string sharename;
+        if (readVersion >= ReadVersion::v4)
+            sharename = reader.readString();
 
-    writeUint32(sessionsToSave.size());
+        std::string clientId = reader.readString();
+        uint8_t qos = reader.readUint8();
 
-    CirBuf cirbuf(1024);
+        logger->logf(LOG_DEBUG, "Saving session '%s' subscription to '%s' QoS %d.", clientId.c_str(), topic.c_str(), qos);
+
+        subscriptions.emplace_back(std::move(clientId), qos, sharename);
+    }
+}
 
-    for (const std::shared_ptr<Session> &_ses : sessionsToSave)
+/**
+ * @brief SessionsAndSubscriptionsDB::readDataV3V4 first finds where the sessions and subscriptions are in the mapped file, which is quick,
+ * because it only reads lengths. Then they are parsed in multiple threads. Also reads v5, which only differs in its checksums.
+ */
+SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readDataV3V4()
+{
+    struct SessionRow
     {
-        // Takes care of locking, and working on the snapshot/copy prevents doing disk IO under lock.
-        std::unique_ptr<Session> ses = _ses->getCopy();
+        size_t offset = 0;
+        int64_t persistenceStateAge = 0;
+    };
 
-        logger->logf(LOG_DEBUG, "Saving session '%s'.", ses->getClientId().c_str());
+    std::vector<SessionRow> sessionRows;
+    std::vector<size_t> subscriptionRows;
+    PersistenceReader reader = getReader();
 
-        writeRowHeader();
+    while (!reader.atEnd())
+    {
+        const int64_t fileSavedAt = reader.readInt64();
 
-        writeCheck(reserved, 1, RESERVED_SPACE_SESSIONS_DB_V2, f);
+        const int64_t now_epoch = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        const int64_t persistence_state_age = fileSavedAt > now_epoch ? 0 : now_epoch - fileSavedAt;
 
-        writeString(ses->username);
-        writeString(ses->client_id);
+        logger->logf(LOG_DEBUG, "Session file was saved at %ld. That's %ld seconds ago.", fileSavedAt, persistence_state_age);
 
-        const size_t qosPacketsExpected = ses->qosPacketQueue.size();
-        size_t qosPacketsCounted = 0;
-        writeUint32(qosPacketsExpected);
+        const uint32_t nrOfSessions = reader.readUint32();
 
-        std::shared_ptr<QueuedPublish> qp;
-        while ((qp = ses->qosPacketQueue.next()))
+        for (uint32_t i = 0; i < nrOfSessions; i++)
         {
-            QueuedPublish &p = *qp;
-
-            qosPacketsCounted++;
+            const size_t offset = reader.getPos();
+            skipSession(reader);
+            sessionRows.push_back({offset, persistence_state_age});
+        }
 
-            Publish &pub = p.getPublish();
+        const uint32_t nrOfSubscriptions = reader.readUint32();
 
-            assert(!pub.skipTopic);
-            assert(pub.topicAlias == 0);
+        for (uint32_t i = 0; i < nrOfSubscriptions; i++)
+        {
+            const size_t offset = reader.getPos();
+            skipSubscriptions(reader);
+            subscriptionRows.push_back(offset);
+        }
+    }
 
-            logger->logf(LOG_DEBUG, "Saving QoS %d message for topic '%s'.", pub.qos, pub.topic.c_str());
+    SessionsAndSubscriptionsResult result;
+    result.sessions.resize(sessionRows.size());
 
-            MqttPacket pack(ProtocolVersion::Mqtt5, pub);
-            pack.setPacketId(p.getPacketId());
-            const uint32_t packSize = pack.getSizeIncludingNonPresentHeader();
-            cirbuf.reset();
-            cirbuf.ensureFreeSpace(packSize + 32);
-            pack.readIntoBuf(cirbuf);
+    parseInThreads(sessionRows.size(), 1024, [&](size_t begin, size_t end) {
+        const Settings &settings = *ThreadGlobals::getSettings();
+        PersistenceReader reader = getReader();
+        CirBuf cirbuf(1024);
 
-            const uint32_t pubAge = ageFromTimePoint(pub.getCreatedAt());
+        std::shared_ptr<ThreadData> dummyThreadData; // which thread am I going get/use here?
+        std::shared_ptr<Client> dummyClient(new Client(0, dummyThreadData, nullptr, false, false, nullptr, settings, false));
+        dummyClient->setClientProperties(ProtocolVersion::Mqtt5, "Dummyforloadingqueuedqos", "nobody", true, 60);
 
-            writeUint16(pack.getFixedHeaderLength());
-            writeUint16(p.getPacketId());
-            writeUint32(pubAge);
-            writeUint32(packSize);
-            writeString(pub.client_id);
-            writeString(pub.username);
-            writeCheck(cirbuf.tailPtr(), 1, cirbuf.usedBytes(), f);
+        for (size_t i = begin; i < end; i++)
+        {
+            reader.setPos(sessionRows[i].offset);
+            result.sessions[i] = readSession(reader, sessionRows[i].persistenceStateAge, settings, cirbuf, dummyClient);
         }
+    });
 
-        assert(qosPacketsExpected == qosPacketsCounted);
+    std::vector<std::pair<std::string, std::list<SubscriptionForSerializing>>> subscriptions(subscriptionRows.size());
 
-        writeUint32(ses->incomingQoS2MessageIds.size());
-        for (uint16_t id : ses->incomingQoS2MessageIds)
-        {
-            logger->logf(LOG_DEBUG, "Writing incomming QoS2 message id %d.", id);
-            writeUint16(id);
-        }
+    parseInThreads(subscriptionRows.size(), 4096, [&](size_t begin, size_t end) {
+        PersistenceReader reader = getReader();
 
-        writeUint32(ses->outgoingQoS2MessageIds.size());
-        for (uint16_t id : ses->outgoingQoS2MessageIds)
+        for (size_t i = begin; i < end; i++)
         {
-            logger->logf(LOG_DEBUG, "Writing outgoing QoS2 message id %d.", id);
-            writeUint16(id);
+            reader.setPos(subscriptionRows[i]);
+            readSubscriptions(reader, subscriptions[i].first, subscriptions[i].second);
         }
+    });
+
+    // Sections can have subscriptions to the same topic.
+    result.subscriptions.reserve(subscriptions.size());
+    for (auto &pair : subscriptions)
+    {
+        std::list<SubscriptionForSerializing> &subs = result.subscriptions[pair.first];
+        subs.splice(subs.end(), pair.second);
+    }
+
+    return result;
+}
+
+/**
+ * @brief SessionsAndSubscriptionsDB::serializeSession encodes a session like a row in the file, so it can be done by any thread. See writeSection().
+ * @param ses should be a copy, made with Session::getCopy(), so the QoS queue isn't used under lock, and can be iterated.
+ */
+void SessionsAndSubscriptionsDB::serializeSession(Session &ses, PersistenceBuffer &out, CirBuf &cirbuf)
+{
+    char reserved[RESERVED_SPACE_SESSIONS_DB_V2];
+    std::memset(reserved, 0, RESERVED_SPACE_SESSIONS_DB_V2);
 
-        logger->logf(LOG_DEBUG, "Writing next packetid %d.", ses->nextPacketId);
-        writeUint16(ses->nextPacketId);
+    Logger *logger = Logger::getInstance();
 
-        writeUint32(ses->getCurrentSessionExpiryInterval());
+    logger->logf(LOG_DEBUG, "Saving session '%s'.", ses.getClientId().c_str());
 
-        const bool hasWillThatShouldSurviveRestart = ses->getWill().operator bool() && ses->getWill()->will_delay > 0;
-        writeUint16(static_cast<uint16_t>(hasWillThatShouldSurviveRestart));
+    out.write(reserved, RESERVED_SPACE_SESSIONS_DB_V2);
 
-        if (hasWillThatShouldSurviveRestart)
-        {
-            WillPublish &will = *ses->getWill().get();
-            MqttPacket willpacket(ProtocolVersion::Mqtt5, will);
-
-            // Dummy, to please the parser on reading.
-            if (will.qos > 0)
-                willpacket.setPacketId(666);
-
-            const uint32_t packSize = willpacket.getSizeIncludingNonPresentHeader();
-            cirbuf.reset();
-            cirbuf.ensureFreeSpace(packSize + 32);
-            willpacket.readIntoBuf(cirbuf);
-
-            writeUint16(willpacket.getFixedHeaderLength());
-            writeUint32(will.will_delay);
-            writeUint32(will.getQueuedAtAge());
-            writeUint32(packSize);
-            writeString(will.client_id);
-            writeString(will.username);
-            writeCheck(cirbuf.tailPtr(), 1, cirbuf.usedBytes(), f);
-        }
+    out.writeString(ses.username);
+    out.writeString(ses.client_id);
+
+    const size_t qosPacketsExpected = ses.qosPacketQueue.size();
+    size_t qosPacketsCounted = 0;
+    out.writeUint32(qosPacketsExpected);
+
+    std::shared_ptr<QueuedPublish> qp;
+    while ((qp = ses.qosPacketQueue.next()))
+    {
+        QueuedPublish &p = *qp;
+
+        qosPacketsCounted++;
+
+        Publish &pub = p.getPublish();
+
+        assert(!pub.skipTopic);
+        assert(pub.topicAlias == 0);
+
+        logger->logf(LOG_DEBUG, "Saving QoS %d message for topic '%s'.", pub.qos, pub.topic.c_str());
+
+        MqttPacket pack(ProtocolVersion::Mqtt5, pub);
+        pack.setPacketId(p.getPacketId());
+        const uint32_t packSize = pack.getSizeIncludingNonPresentHeader();
+        cirbuf.reset();
+        cirbuf.ensureFreeSpace(packSize + 32);
+        pack.readIntoBuf(cirbuf);
+
+        const uint32_t pubAge = ageFromTimePoint(pub.getCreatedAt());
+
+        out.writeUint16(pack.getFixedHeaderLength());
+        out.writeUint16(p.getPacketId());
+        out.writeUint32(pubAge);
+        out.writeUint32(packSize);
+        out.writeString(pub.client_id);
+        out.writeString(pub.username);
+        out.write(cirbuf.tailPtr(), cirbuf.usedBytes());
     }
 
-    writeUint32(subscriptions.size());
+    assert(qosPacketsExpected == qosPacketsCounted);
 
-    for (auto &pair : subscriptions)
+    out.writeUint32(ses.incomingQoS2MessageIds.size());
+    for (uint16_t id : ses.incomingQoS2MessageIds)
     {
-        const std::string &topic = pair.first;
-        const std::list<SubscriptionForSerializing> &subscriptions = pair.second;
+        logger->logf(LOG_DEBUG, "Writing incomming QoS2 message id %d.", id);
+        out.writeUint16(id);
+    }
+
+    out.writeUint32(ses.outgoingQoS2MessageIds.size());
+    for (uint16_t id : ses.outgoingQoS2MessageIds)
+    {
+        logger->logf(LOG_DEBUG, "Writing outgoing QoS2 message id %d.", id);
+        out.writeUint16(id);
+    }
+
+    logger->logf(LOG_DEBUG, "Writing next packetid %d.", ses.nextPacketId);
+    out.writeUint16(ses.nextPacketId);
+
+    out.writeUint32(ses.getCurrentSessionExpiryInterval());
+
+    const bool hasWillThatShouldSurviveRestart = ses.getWill().operator bool() && ses.getWill()->will_delay > 0;
+    out.writeUint16(static_cast<uint16_t>(hasWillThatShouldSurviveRestart));
+
+    if (hasWillThatShouldSurviveRestart)
+    {
+        WillPublish &will = *ses.getWill().get();
+        MqttPacket willpacket(ProtocolVersion::Mqtt5, will);
+
+        // Dummy, to please the parser on reading.
+        if (will.qos > 0)
+            willpacket.setPacketId(666);
+
+        const uint32_t packSize = willpacket.getSizeIncludingNonPresentHeader();
+        cirbuf.reset();
+        cirbuf.ensureFreeSpace(packSize + 32);
+        willpacket.readIntoBuf(cirbuf);
+
+        out.writeUint16(willpacket.getFixedHeaderLength());
+        out.writeUint32(will.will_delay);
+        out.writeUint32(will.getQueuedAtAge());
+        out.writeUint32(packSize);
+        out.writeString(will.client_id);
+        out.writeString(will.username);
+        out.write(cirbuf.tailPtr(), cirbuf.usedBytes());
+    }
+}
+
+void SessionsAndSubscriptionsDB::serializeSubscriptions(const std::string &topic, const std::list<SubscriptionForSerializing> &subscriptions, PersistenceBuffer &out)
+{
+    Logger *logger = Logger::getInstance();
 
-        logger->logf(LOG_DEBUG, "Writing subscriptions to topic '%s'.", topic.c_str());
+    logger->logf(LOG_DEBUG, "Writing subscriptions to topic '%s'.", topic.c_str());
 
-        writeString(topic);
+    out.writeString(topic);
 
-        writeUint32(subscriptions.size());
+    out.writeUint32(subscriptions.size());
 
-        for (const SubscriptionForSerializing &subscription : subscriptions)
+    for (const SubscriptionForSerializing &subscription : subscriptions)
+    {
+        if (!subscription.shareName.empty())
+        {
+            logger->logf(LOG_DEBUG, "Saving session '%s' subscription with sharename '%s' to '%s' QoS %d.", subscription.clientId.c_str(),
+                         subscription.shareName.c_str(), topic.c_str(), subscription.qos);
+        }
+        else
         {
-            if (!subscription.shareName.empty())
-            {
-                logger->logf(LOG_DEBUG, "Saving session '%s' subscription with sharename '%s' to '%s' QoS %d.", subscription.clientId.c_str(),
-                             subscription.shareName.c_str(), topic.c_str(), subscription.qos);
-            }
-            else
-            {
-                logger->logf(LOG_DEBUG, "Saving session '%s' subscription to '%s' QoS %d.", subscription.clientId.c_str(), topic.c_str(), subscription.qos);
-            }
-
-            writeString(subscription.shareName);
-            writeString(subscription.clientId);
-            writeUint8(subscription.qos);
+            logger->logf(LOG_DEBUG, "Saving session '%s' subscription to '%s' QoS %d.", subscription.clientId.c_str(), topic.c_str(), subscription.qos);
         }
+
+        out.writeString(subscription.shareName);
+        out.writeString(subscription.clientId);
+        out.writeUint8(subscription.qos);
     }
+}
+
+/**
+ * @brief SessionsAndSubscriptionsDB::writeSection appends a section of serialized sessions and subscriptions. Thread-safe.
+ * @param savedAt is the time in seconds since the epoch at which the ages in the section were determined.
+ *
+ * A file is a series of sections, which are read until the end of the file, so sessions and subscriptions can be written in parts, by
+ * multiple threads, without collecting them all first. Subscriptions can refer to sessions in other sections.
+ */
+void SessionsAndSubscriptionsDB::writeSection(int64_t savedAt, uint32_t nrOfSessions, const PersistenceBuffer &sessions, uint32_t nrOfTopics,
+                                              const PersistenceBuffer &subscriptions)
+{
+    std::lock_guard<std::mutex> locker(writeMutex);
+
+    if (!f)
+        return;
+
+    logger->logf(LOG_DEBUG, "Writing section with %u sessions and %u subscription topics, saved at %ld.", nrOfSessions, nrOfTopics, savedAt);
 
-    fflush(f);
+    writeInt64(savedAt);
+    writeUint32(nrOfSessions);
+    writeBuffer(sessions);
+    writeUint32(nrOfTopics);
+    writeBuffer(subscriptions);
 }
 
 SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readData()
@@ -415,7 +527,23 @@ SessionsAndSubscriptionsResult SessionsAndSubscriptionsDB::readData()
     if (readVersion == ReadVersion::v2)
         logger->logf(LOG_WARNING, "File '%s' is version 2, an internal development version that was never finalized. Not reading.", getFilePath().c_str());
     if (readVersion >= ReadVersion::v3 || readVersion == ReadVersion::v4)
-        return readDataV3V4();
+    {
+        SessionsAndSubscriptionsResult result;
+
+        try
+        {
+            result = readDataV3V4();
+        }
+        catch (...)
+        {
+            // Parsing happens while the hash is verified, and a corrupt file is more likely to be the cause.
+            waitForVerifiedHash();
+            throw;
+        }
+
+        waitForVerifiedHash();
+        return result;
+    }
 
     return defaultResult;
 }
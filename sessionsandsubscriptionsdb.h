@@ -20,14 +20,19 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 #include <list>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include "forward_declarations.h"
 #include "persistencefile.h"
+#include "cirbuf.h"
 
 #define MAGIC_STRING_SESSION_FILE_V1 "FlashMQRetainedDBv1" // That this is called 'retained' was a bug...
 #define MAGIC_STRING_SESSION_FILE_V2 "FlashMQSessionDBv2"
 #define MAGIC_STRING_SESSION_FILE_V3 "FlashMQSessionDBv3"
 #define MAGIC_STRING_SESSION_FILE_V4 "FlashMQSessionDBv4"
+#define MAGIC_STRING_SESSION_FILE_V5 "FlashMQSessionDBv5"
 #define RESERVED_SPACE_SESSIONS_DB_V2 32
 
 /**
@@ -46,7 +51,7 @@ struct SubscriptionForSerializing
 
 struct SessionsAndSubscriptionsResult
 {
-    std::list<std::shared_ptr<Session>> sessions;
+    std::vector<std::shared_ptr<Session>> sessions;
     std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptions;
 };
 
@@ -59,20 +64,29 @@ class SessionsAndSubscriptionsDB : public PersistenceFile
         v1,
         v2,
         v3,
-        v4
+        v4,
+        v5
     };
 
     ReadVersion readVersion = ReadVersion::unknown;
 
+    std::mutex writeMutex;
+
+    static void skipSession(PersistenceReader &reader);
+    std::shared_ptr<Session> readSession(PersistenceReader &reader, int64_t persistence_state_age, const Settings &settings, CirBuf &cirbuf,
+                                         std::shared_ptr<Client> &dummyClient);
+    void skipSubscriptions(PersistenceReader &reader);
+    void readSubscriptions(PersistenceReader &reader, std::string &topic, std::list<SubscriptionForSerializing> &subscriptions);
     SessionsAndSubscriptionsResult readDataV3V4();
-    void writeRowHeader();
 public:
     SessionsAndSubscriptionsDB(const std::string &filePath);
 
     void openWrite();
     void openRead();
 
-    void saveData(const std::vector<std::shared_ptr<Session>> &sessions, const std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &subscriptions);
+    static void serializeSession(Session &ses, PersistenceBuffer &out, CirBuf &cirbuf);
+    static void serializeSubscriptions(const std::string &topic, const std::list<SubscriptionForSerializing> &subscriptions, PersistenceBuffer &out);
+    void writeSection(int64_t savedAt, uint32_t nrOfSessions, const PersistenceBuffer &sessions, uint32_t nrOfTopics, const PersistenceBuffer &subscriptions);
     SessionsAndSubscriptionsResult readData();
 };
 
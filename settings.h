@@ -42,6 +42,12 @@ enum class SharedSubscriptionTargeting
     SenderHash
 };
 
+enum class ClientThreadAssignment
+{
+    RoundRobin,
+    LeastLoaded
+};
+
 class Settings
 {
     friend class ConfigFileParser;
@@ -75,6 +81,8 @@ public:
     uint32_t expireSessionsAfterSeconds = 1209600;
     uint32_t expireRetainedMessagesAfterSeconds = std::numeric_limits<uint32_t>::max();
     uint32_t expireRetainedMessagesTimeBudgetMs = 300;
+    uint32_t expireSessionsTimeBudgetMs = 10;
+    uint32_t subscriptionTreeCleanupSliceMs = 5;
     int pluginTimerPeriod = 60;
     std::string storageDir;
     int threadCount = 0;
@@ -82,7 +90,19 @@ public:
     uint maxQosBytesPendingPerClient = 65536;
     bool willsEnabled = true;
     RetainedMessagesMode retainedMessagesMode = RetainedMessagesMode::Enabled;
+    bool retainedMessagesWal = false;
+    uint32_t retainedMessagesWalSyncIntervalMs = 100;
+    bool retainedMessagesLazyLoading = false;
+    bool saveStateInChildProcess = false;
     SharedSubscriptionTargeting sharedSubscriptionTargeting = SharedSubscriptionTargeting::RoundRobin;
+    bool crossThreadPublishBatching = false;
+    bool batchedWriteFlushing = false;
+    uint32_t sharedPayloadMinBytes = 0;
+    bool ioUringBatchedSends = false;
+    bool listenSocketsPerThread = false;
+    ClientThreadAssignment clientThreadAssignment = ClientThreadAssignment::RoundRobin;
+    uint32_t aclCacheSize = 0;
+    bool preauthorizeLiteralSubscriptions = false;
     std::list<std::shared_ptr<Listener>> listeners; // Default one is created later, when none are defined.
 
     std::list<Network> setRealIpFrom;
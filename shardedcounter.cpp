@@ -0,0 +1,47 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "shardedcounter.h"
+
+/**
+ * @brief ShardedCounter::getShardIndex gives each thread the next shard, on first use. With more threads than shards, they share.
+ */
+size_t ShardedCounter::getShardIndex()
+{
+    static std::atomic<size_t> nextShard {0};
+    thread_local const size_t index = nextShard.fetch_add(1, std::memory_order_relaxed) % shardCount;
+    return index;
+}
+
+void ShardedCounter::add(int64_t n)
+{
+    if (n == 0)
+        return;
+
+    shards[getShardIndex()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+int64_t ShardedCounter::get() const
+{
+    int64_t result = 0;
+
+    for (const Shard &shard : shards)
+        result += shard.value.load(std::memory_order_relaxed);
+
+    return result;
+}
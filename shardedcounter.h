@@ -0,0 +1,51 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SHARDEDCOUNTER_H
+#define SHARDEDCOUNTER_H
+
+#include <array>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief The ShardedCounter class is a gauge that threads can change without contending on one cache line. Each thread adds to its own
+ * shard, and reading sums them.
+ *
+ * A thread's shard can go negative, when it removes what another thread added. Only the sum means something.
+ */
+class ShardedCounter
+{
+    static constexpr size_t shardCount = 16;
+
+    struct alignas(64) Shard
+    {
+        std::atomic<int64_t> value {0};
+    };
+
+    std::array<Shard, shardCount> shards {};
+
+    static size_t getShardIndex();
+
+public:
+    void add(int64_t n);
+    int64_t get() const;
+};
+
+#endif // SHARDEDCOUNTER_H
@@ -77,6 +77,17 @@ const Subscription *SharedSubscribers::getNext(size_t hash) const
     return result;
 }
 
+Subscription *SharedSubscribers::find(const std::string &clientid)
+{
+    auto index_pos = index.find(clientid);
+    if (index_pos == index.end())
+        return nullptr;
+
+    const int index = index_pos->second;
+    assert(index < static_cast<int>(members.size()));
+    return &members[index];
+}
+
 void SharedSubscribers::erase(const std::string &clientid)
 {
     auto index_pos = index.find(clientid);
@@ -26,6 +26,7 @@ public:
     Subscription& operator[](const std::string &clientid);
     const Subscription *getNext();
     const Subscription *getNext(size_t hash) const;
+    Subscription *find(const std::string &clientid);
     void erase(const std::string &clientid);
     void purgeAndReIndex();
     bool empty() const;
@@ -25,5 +25,6 @@ void Subscription::reset()
 {
     session.reset();
     qos = 0;
+    readAclPreauthorization = 0;
 }
 
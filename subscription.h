@@ -8,6 +8,7 @@ struct Subscription
 {
     std::weak_ptr<Session> session; // Weak pointer expires when session has been cleaned by 'clean session' connect or when it was remove because it expired
     uint8_t qos;
+    uint32_t readAclPreauthorization = 0; // The ACL generation for which read access was decided at subscribe time. See 'preauthorize_literal_subscriptions'.
     bool operator==(const Subscription &rhs) const;
     void reset();
 };
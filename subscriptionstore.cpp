@@ -18,6 +18,10 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "subscriptionstore.h"
 
 #include <cassert>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <unistd.h>
 
 #include "rwlockguard.h"
 #include "retainedmessagesdb.h"
@@ -28,10 +32,26 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "plugin.h"
 #include "exceptions.h"
 #include "threaddata.h"
+#include "globalstats.h"
 
-ReceivingSubscriber::ReceivingSubscriber(const std::shared_ptr<Session> &ses, uint8_t qos) :
+/*
+ * The subscribers of a publish are collected in this, to not have to allocate memory for each publish. It's swapped out of here
+ * while in use, because delivering can lead to new publishes on the same thread (by plugins, for instance).
+ */
+thread_local std::vector<ReceivingSubscriber> reusableReceivingSubscribers;
+
+ReceivingSubscriber::ReceivingSubscriber(std::shared_ptr<Session> &&ses, uint8_t qos, uint32_t readAclPreauthorization) :
+    session(std::move(ses)),
+    qos(qos),
+    readAclPreauthorization(readAclPreauthorization)
+{
+
+}
+
+ReceivingSubscriber::ReceivingSubscriber(const std::shared_ptr<Session> &ses, uint8_t qos, uint32_t readAclPreauthorization) :
     session(ses),
-    qos(qos)
+    qos(qos),
+    readAclPreauthorization(readAclPreauthorization)
 {
 
 }
@@ -42,14 +62,18 @@ SubscriptionNode::SubscriptionNode(const std::string &subtopic) :
 
 }
 
-const std::unordered_map<std::string, Subscription> &SubscriptionNode::getSubscribers() const
+const FlatMap<std::string, Subscription> &SubscriptionNode::getSubscribers() const
 {
     return subscribers;
 }
 
-std::unordered_map<std::string, SharedSubscribers> &SubscriptionNode::getSharedSubscribers()
+/**
+ * @brief SubscriptionNode::getSharedSubscribers returns the shared subscriptions, or nullptr when the node never had any.
+ * @return
+ */
+std::unordered_map<std::string, SharedSubscribers> *SubscriptionNode::getSharedSubscribers()
 {
-    return sharedSubscribers;
+    return sharedSubscribers.get();
 }
 
 const std::string &SubscriptionNode::getSubtopic() const
@@ -57,23 +81,61 @@ const std::string &SubscriptionNode::getSubtopic() const
     return subtopic;
 }
 
-void SubscriptionNode::addSubscriber(const std::shared_ptr<Session> &subscriber, uint8_t qos, const std::string &shareName)
+/**
+ * @brief assignSubscription fills a place in the subscription tree, keeping the subscription count of the sessions involved right.
+ *
+ * When the place was of a session that's gone, that session already stopped counting it when it was destroyed.
+ */
+static void assignSubscription(Subscription &place, const Subscription &sub, const std::shared_ptr<Session> &subscriber)
+{
+    std::shared_ptr<Session> previous = place.session.lock();
+
+    if (previous != subscriber)
+    {
+        if (previous)
+            previous->adjustSubscriptionCount(-1);
+        subscriber->adjustSubscriptionCount(1);
+    }
+
+    place = sub;
+}
+
+static void uncountSubscription(const Subscription &place)
+{
+    std::shared_ptr<Session> previous = place.session.lock();
+
+    if (previous)
+        previous->adjustSubscriptionCount(-1);
+}
+
+void SubscriptionNode::addSubscriber(const std::shared_ptr<Session> &subscriber, uint8_t qos, const std::string &shareName, uint32_t readAclPreauthorization)
 {
     Subscription sub;
     sub.session = subscriber;
     sub.qos = qos;
+    sub.readAclPreauthorization = readAclPreauthorization;
 
     const std::string &client_id = subscriber->getClientId();
 
     if (shareName.empty())
     {
-        subscribers[client_id] = sub;
+        assignSubscription(subscribers[client_id], sub, subscriber);
     }
     else
     {
-        SharedSubscribers &subscribers = sharedSubscribers[shareName];
-        subscribers.setName(shareName); // c++14 doesn't have try-emplace yet, in which case this separate step wouldn't be needed.
-        subscribers[client_id] = sub;
+        if (!sharedSubscribers)
+            sharedSubscribers = std::make_unique<std::unordered_map<std::string, SharedSubscribers>>();
+
+        auto pos = sharedSubscribers->find(shareName);
+        if (pos == sharedSubscribers->end())
+        {
+            pos = sharedSubscribers->emplace(shareName, SharedSubscribers()).first;
+            pos->second.setName(shareName);
+            GlobalStats::getInstance()->sharedSubscriptionGroups.add(1);
+        }
+
+        SharedSubscribers &subscribers = pos->second;
+        assignSubscription(subscribers[client_id], sub, subscriber);
     }
 }
 
@@ -91,16 +153,23 @@ void SubscriptionNode::removeSubscriber(const std::shared_ptr<Session> &subscrib
 
         if (it != subscribers.end())
         {
+            uncountSubscription(it->second);
             subscribers.erase(it);
         }
     }
-    else
+    else if (sharedSubscribers)
     {
-        auto pos = sharedSubscribers.find(shareName);
-        if (pos != sharedSubscribers.end())
+        auto pos = sharedSubscribers->find(shareName);
+        if (pos != sharedSubscribers->end())
         {
             SharedSubscribers &subscribers = pos->second;
-            subscribers.erase(clientId);
+            const Subscription *member = subscribers.find(clientId);
+
+            if (member)
+            {
+                uncountSubscription(*member);
+                subscribers.erase(clientId);
+            }
         }
     }
 }
@@ -113,12 +182,33 @@ void SubscriptionNode::removeSubscriber(const std::shared_ptr<Session> &subscrib
  */
 SubscriptionNode *SubscriptionNode::getChildren(const std::string &subtopic) const
 {
-    auto it = children.find(subtopic);
+    auto it = children.find(SubtopicKey(subtopic));
     if (it != children.end())
         return it->second.get();
     return nullptr;
 }
 
+/**
+ * @brief SubscriptionNode::getOrMakeChildren gets the children, and makes it if it's not there.
+ * @param subtopic
+ * @return
+ *
+ * The key in the map points to the subtopic string of the new node, so the node has to be made before it's placed.
+ */
+SubscriptionNode *SubscriptionNode::getOrMakeChildren(const std::string &subtopic)
+{
+    const SubtopicKey key(subtopic);
+
+    auto it = children.find(key);
+    if (it != children.end())
+        return it->second.get();
+
+    std::unique_ptr<SubscriptionNode> node = std::make_unique<SubscriptionNode>(subtopic);
+    const SubtopicKey nodeKey(node->getSubtopic(), key.getHash());
+    auto result = children.emplace(nodeKey, std::move(node));
+    return result.first->second.get();
+}
+
 
 SubscriptionStore::SubscriptionStore() :
     root("root"),
@@ -155,7 +245,10 @@ SubscriptionNode *SubscriptionStore::getDeepestNode(const std::vector<std::strin
         else if (subtopic == "+")
             selectedChildren = &deepestNode->childrenPlus;
         else
-            selectedChildren = &deepestNode->children[subtopic];
+        {
+            deepestNode = deepestNode->getOrMakeChildren(subtopic);
+            continue;
+        }
 
         std::unique_ptr<SubscriptionNode> &node = *selectedChildren;
 
@@ -176,8 +269,13 @@ void SubscriptionStore::addSubscription(std::shared_ptr<Client> &client, const s
     addSubscription(client, subtopics, qos, empty);
 }
 
+/**
+ * @brief SubscriptionStore::addSubscription
+ * @param readAclPreauthorization is the ACL generation for which read access to this literal topic was already decided, or 0. See
+ *        Authentication::preauthorizeRead().
+ */
 void SubscriptionStore::addSubscription(std::shared_ptr<Client> &client, const std::vector<std::string> &subtopics, uint8_t qos,
-                                        const std::string &shareName)
+                                        const std::string &shareName, uint32_t readAclPreauthorization)
 {
     RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
     lock_guard.wrlock();
@@ -190,8 +288,7 @@ void SubscriptionStore::addSubscription(std::shared_ptr<Client> &client, const s
         if (session_it != sessionsByIdConst.end())
         {
             const std::shared_ptr<Session> &ses = session_it->second;
-            deepestNode->addSubscriber(ses, qos, shareName);
-            subscriptionCount++;
+            deepestNode->addSubscriber(ses, qos, shareName, readAclPreauthorization);
             lock_guard.unlock();
 
             if (shareName.empty())
@@ -248,7 +345,6 @@ void SubscriptionStore::removeSubscription(std::shared_ptr<Client> &client, cons
         {
             const std::shared_ptr<Session> &ses = session_it->second;
             deepestNode->removeSubscriber(ses, shareName);
-            subscriptionCount--;
         }
     }
 
@@ -282,7 +378,7 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
 // Removes an existing client when it already exists [MQTT-3.1.4-2].
 void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval)
 {
-    ThreadGlobals::getThreadData()->queueClientNextKeepAliveCheckLocked(client, true);
+    ThreadGlobals::getThreadData()->queueClientNextKeepAliveCheck(client, true);
 
     // These destructors need to be called outside the sessions lock, so placing here.
     std::shared_ptr<Session> session;
@@ -319,6 +415,7 @@ void SubscriptionStore::registerClientAndKickExistingOne(std::shared_ptr<Client>
             session = std::make_shared<Session>();
 
             sessionsById[client->getClientId()] = session;
+            sessionCount.store(sessionsById.size(), std::memory_order_relaxed);
         }
     }
 
@@ -348,7 +445,7 @@ std::shared_ptr<Session> SubscriptionStore::lockSession(const std::string &clien
 }
 
 /**
- * @brief SubscriptionStore::sendQueuedWillMessages sends queued will messages.
+ * @brief SubscriptionStore::sendQueuedWillMessage sends a will message whose delay has passed.
  *
  * The expiry interval as set in the properties of the will message is not used to check for expiration here. To
  * quote the specs: "If present, the Four Byte value is the lifetime of the Will Message in seconds and is sent as
@@ -357,61 +454,42 @@ std::shared_ptr<Session> SubscriptionStore::lockSession(const std::string &clien
  * If a new Network Connection to this Session is made before the Will Delay Interval has passed, the Server
  * MUST NOT send the Will Message [MQTT-3.1.3-9].
  */
-void SubscriptionStore::sendQueuedWillMessages()
+void SubscriptionStore::sendQueuedWillMessage(QueuedWill &will)
 {
-    Authentication &auth = *ThreadGlobals::getAuth();
-
-    const auto now = std::chrono::steady_clock::now();
-    const std::chrono::seconds secondsSinceEpoch = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch());
-    std::lock_guard<std::mutex> locker(this->pendingWillsMutex);
-
-    auto it = pendingWillMessages.begin();
-    while (it != pendingWillMessages.end())
-    {
-        const std::chrono::seconds &sendAt = it->first;
-
-        if (sendAt > secondsSinceEpoch)
-            break;
+    std::shared_ptr<Publish> p = will.getWill().lock();
 
-        std::vector<QueuedWill> &willsOfSlot = it->second;
+    // If sessions get a new will, or the will is cleared from a new connecting client, this entry
+    // will be null and we can ignore it.
+    if (!p)
+        return;
 
-        for(QueuedWill &will : willsOfSlot)
-        {
-            std::shared_ptr<Publish> p = will.getWill().lock();
+    std::shared_ptr<Session> s = will.getSession();
 
-            // If sessions get a new will, or the will is cleared from a new connecting client, this entry
-            // will be null and we can ignore it.
-            if (p)
-            {
-                std::shared_ptr<Session> s = will.getSession();
+    // Check for stale wills, or sessions that have become active again.
+    if (!s || s->hasActiveClient())
+        return;
 
-                // Check for stale wills, or sessions that have become active again.
-                if (s && !s->hasActiveClient())
-                {
-                    logger->logf(LOG_DEBUG, "Sending delayed will on topic '%s'.", p->topic.c_str() );
-                    if (auth.aclCheck(*p, p->payload) == AuthResult::success)
-                    {
-                        PublishCopyFactory factory(p.get());
-                        queuePacketAtSubscribers(factory);
+    Authentication &auth = *ThreadGlobals::getAuth();
 
-                        if (p->retain)
-                            setRetainedMessage(*p, p->getSubtopics());
-                    }
+    logger->logf(LOG_DEBUG, "Sending delayed will on topic '%s'.", p->topic.c_str() );
+    if (auth.aclCheck(*p, p->payload) == AuthResult::success)
+    {
+        PublishCopyFactory factory(p.get());
+        queuePacketAtSubscribers(factory);
 
-                    s->clearWill();
-                }
-            }
-        }
-        it = pendingWillMessages.erase(it);
+        if (p->retain)
+            setRetainedMessage(*p, p->getSubtopics());
     }
+
+    s->clearWill();
 }
 
 /**
- * @brief SubscriptionStore::queueWillMessage queues the will message in a sorted map.
+ * @brief SubscriptionStore::queueWillMessage queues the will message in the timer wheel of the current worker thread, or hands it over.
  * @param willMessage
  * @param forceNow
  *
- * The queued will is only valid for that time. Should a new will be placed in the map for a session, the original shared_ptr
+ * The queued will is only valid for that time. Should a new will be placed for a session, the original shared_ptr
  * will be cleared and the previously queued entry is void (but still there, so it needs to be checked).
  */
 void SubscriptionStore::queueWillMessage(const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session, bool forceNow)
@@ -446,39 +524,41 @@ void SubscriptionStore::queueWillMessage(const std::shared_ptr<WillPublish> &wil
     willMessage->setQueuedAt();
 
     QueuedWill queuedWill(willMessage, session);
-    const std::chrono::time_point<std::chrono::steady_clock> sendWillAt = std::chrono::steady_clock::now() + std::chrono::seconds(willMessage->will_delay);
-    std::chrono::seconds secondsSinceEpoch = std::chrono::duration_cast<std::chrono::seconds>(sendWillAt.time_since_epoch());
+    const uint64_t sendWillAt = TimerWheelBase::now() + static_cast<uint64_t>(willMessage->will_delay) * 1000;
 
-    std::lock_guard<std::mutex> locker(this->pendingWillsMutex);
-    this->pendingWillMessages[secondsSinceEpoch].push_back(queuedWill);
+    ThreadData *threadData = ThreadGlobals::getThreadData();
+
+    if (threadData && threadData->processingTimers)
+        threadData->queuedWills.add(sendWillAt, std::move(queuedWill));
+    else
+        willsHandoff.push(sendWillAt, std::move(queuedWill));
 }
 
-void SubscriptionStore::publishNonRecursively(SubscriptionNode *this_node, std::forward_list<ReceivingSubscriber> &targetSessions, size_t distributionHash)
+void SubscriptionStore::publishNonRecursively(SubscriptionNode *this_node, std::vector<ReceivingSubscriber> &targetSessions, size_t distributionHash)
 {
     {
-        const std::unordered_map<std::string, Subscription> &subscribers = this_node->getSubscribers();
+        const FlatMap<std::string, Subscription> &subscribers = this_node->getSubscribers();
 
         for (auto &pair : subscribers)
         {
             const Subscription &sub = pair.second;
 
-            const std::shared_ptr<Session> session = sub.session.lock();
+            std::shared_ptr<Session> session = sub.session.lock();
             if (session) // Shared pointer expires when session has been cleaned by 'clean session' connect.
             {
-                ReceivingSubscriber x(session, sub.qos);
-                targetSessions.emplace_front(session, sub.qos);
+                targetSessions.emplace_back(std::move(session), sub.qos, sub.readAclPreauthorization);
             }
         }
     }
 
     {
-        std::unordered_map<std::string, SharedSubscribers> &sharedSubscribers = this_node->getSharedSubscribers();
+        std::unordered_map<std::string, SharedSubscribers> *sharedSubscribers = this_node->getSharedSubscribers();
 
-        if (!sharedSubscribers.empty())
+        if (sharedSubscribers && !sharedSubscribers->empty())
         {
             const Settings *settings = ThreadGlobals::getSettings();
 
-            for(auto &pair : sharedSubscribers)
+            for(auto &pair : *sharedSubscribers)
             {
                 SharedSubscribers &subscribers = pair.second;
 
@@ -492,11 +572,10 @@ void SubscriptionStore::publishNonRecursively(SubscriptionNode *this_node, std::
                 if (sub == nullptr)
                     continue;
 
-                const std::shared_ptr<Session> session = sub->session.lock();
+                std::shared_ptr<Session> session = sub->session.lock();
                 if (session) // Shared pointer expires when session has been cleaned by 'clean session' connect.
                 {
-                    ReceivingSubscriber x(session, sub->qos);
-                    targetSessions.emplace_front(session, sub->qos);
+                    targetSessions.emplace_back(std::move(session), sub->qos, sub->readAclPreauthorization);
                 }
             }
         }
@@ -515,7 +594,8 @@ void SubscriptionStore::publishNonRecursively(SubscriptionNode *this_node, std::
  * look at objdump --disassemble --demangle to see how many calls (not jumps) to itself are made and compare.
  */
 void SubscriptionStore::publishRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
-                                           SubscriptionNode *this_node, std::forward_list<ReceivingSubscriber> &targetSessions, size_t distributionHash)
+                                           std::vector<size_t>::const_iterator cur_hash_it, SubscriptionNode *this_node,
+                                           std::vector<ReceivingSubscriber> &targetSessions, size_t distributionHash)
 {
     if (cur_subtopic_it == end) // This is the end of the topic path, so look for subscribers here.
     {
@@ -532,23 +612,25 @@ void SubscriptionStore::publishRecursively(std::vector<std::string>::const_itera
         return;
 
     const std::string &cur_subtop = *cur_subtopic_it;
+    const SubtopicKey cur_key(cur_subtop, *cur_hash_it);
 
     const auto next_subtopic = ++cur_subtopic_it;
+    const auto next_hash = ++cur_hash_it;
 
     if (this_node->childrenPound)
     {
         publishNonRecursively(this_node->childrenPound.get(), targetSessions, distributionHash);
     }
 
-    const auto &sub_node = this_node->children.find(cur_subtop);
+    const auto &sub_node = this_node->children.find(cur_key);
     if (sub_node != this_node->children.end())
     {
-        publishRecursively(next_subtopic, end, sub_node->second.get(), targetSessions, distributionHash);
+        publishRecursively(next_subtopic, end, next_hash, sub_node->second.get(), targetSessions, distributionHash);
     }
 
     if (this_node->childrenPlus)
     {
-        publishRecursively(next_subtopic, end, this_node->childrenPlus.get(), targetSessions, distributionHash);
+        publishRecursively(next_subtopic, end, next_hash, this_node->childrenPlus.get(), targetSessions, distributionHash);
     }
 }
 
@@ -571,19 +653,66 @@ void SubscriptionStore::queuePacketAtSubscribers(PublishCopyFactory &copyFactory
 
     SubscriptionNode *startNode = dollar ? &rootDollar : &root;
 
-    std::forward_list<ReceivingSubscriber> subscriberSessions;
+    std::vector<ReceivingSubscriber> subscriberSessions;
+    subscriberSessions.swap(reusableReceivingSubscribers);
 
     {
         const std::vector<std::string> &subtopics = copyFactory.getSubtopics();
+        const std::vector<size_t> &subtopicHashes = copyFactory.getSubtopicHashes();
         RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
         lock_guard.rdlock();
-        publishRecursively(subtopics.begin(), subtopics.end(), startNode, subscriberSessions, copyFactory.getSharedSubscriptionHashKey());
+        publishRecursively(subtopics.begin(), subtopics.end(), subtopicHashes.begin(), startNode, subscriberSessions,
+                           copyFactory.getSharedSubscriptionHashKey());
     }
 
-    for(const ReceivingSubscriber &x : subscriberSessions)
+    ThreadData *currentThreadData = ThreadGlobals::getThreadData();
+    const Settings *settings = ThreadGlobals::getSettings();
+
+    if (!currentThreadData || !settings || !settings->crossThreadPublishBatching)
     {
-        x.session->writePacket(copyFactory, x.qos);
+        for(const ReceivingSubscriber &x : subscriberSessions)
+        {
+            x.session->writePacket(copyFactory, x.qos, x.readAclPreauthorization);
+        }
     }
+    else
+    {
+        // Group the receivers that live in other threads per thread, and let those threads write to their own clients.
+        std::vector<std::pair<std::shared_ptr<ThreadData>, CrossThreadPublish>> otherThreads;
+
+        for(const ReceivingSubscriber &x : subscriberSessions)
+        {
+            // Offline sessions only need their QoS queue filled, which is fine to do from here, unless that would overtake earlier
+            // publishes still pending in another thread.
+            std::shared_ptr<ThreadData> td = x.session->getThreadForCrossThreadPublish(currentThreadData);
+
+            if (!td)
+            {
+                x.session->writePacket(copyFactory, x.qos, x.readAclPreauthorization);
+                continue;
+            }
+
+            auto pos = std::find_if(otherThreads.begin(), otherThreads.end(), [&td](const auto &p) { return p.first == td; });
+
+            if (pos == otherThreads.end())
+            {
+                otherThreads.emplace_back(td, CrossThreadPublish(copyFactory.getNewPublish()));
+                pos = std::prev(otherThreads.end());
+            }
+
+            pos->second.receivers.emplace_back(x.session, x.qos, x.readAclPreauthorization);
+        }
+
+        for(auto &p : otherThreads)
+        {
+            p.first->queueCrossThreadPublish(std::move(p.second));
+        }
+    }
+
+    // Give the memory back for the next publish. A nested publish may have given back a smaller one in the meantime.
+    subscriberSessions.clear();
+    if (subscriberSessions.capacity() > reusableReceivingSubscribers.capacity())
+        reusableReceivingSubscribers.swap(subscriberSessions);
 }
 
 void SubscriptionStore::giveClientRetainedMessagesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it,
@@ -616,6 +745,25 @@ void SubscriptionStore::giveClientRetainedMessagesRecursively(std::vector<std::s
                 }
             }
         }
+
+        if (this_node->mappedMessage.isSet() && !this_node->mappedMessage.hasExpired())
+        {
+            try
+            {
+                Publish publish = this_node->mappedMessage.load();
+                if (auth.aclCheck(publish, publish.payload) == AuthResult::success)
+                {
+                    packetList.push_front(std::move(publish));
+                    count++;
+                }
+            }
+            catch (std::exception &ex)
+            {
+                Logger::getInstance()->logf(LOG_ERR, "Error loading retained message from '%s': %s",
+                                            this_node->mappedMessage.mapping->getFilePath().c_str(), ex.what());
+            }
+        }
+
         if (poundMode)
         {
             for (auto &pair : this_node->children)
@@ -649,7 +797,7 @@ void SubscriptionStore::giveClientRetainedMessagesRecursively(std::vector<std::s
     }
     else if (count <= countLimit)
     {
-        RetainedMessageNode *children = this_node->getChildren(cur_subtop);
+        RetainedMessageNode *children = this_node->getChildren(SubtopicKey(cur_subtop));
 
         if (children)
         {
@@ -694,6 +842,12 @@ void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::ve
     if (!subtopics.empty() && !subtopics[0].empty() > 0 && subtopics[0][0] == '$')
         deepestNode = &retainedMessagesRootDollar;
 
+    // Like the DB, the log doesn't have the '$' topics.
+    RetainedMessagesWal *wal = deepestNode == &retainedMessagesRoot ? retainedMessagesWal.get() : nullptr;
+    PersistenceBuffer walRecord;
+    if (wal)
+        RetainedMessagesWal::serialize(publish, walRecord);
+
     bool needsWriteLock = false;
     auto subtopic_pos = subtopics.begin();
 
@@ -704,22 +858,14 @@ void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::ve
 
         while(subtopic_pos != subtopics.end())
         {
-            auto pos = deepestNode->children.find(*subtopic_pos);
-
-            if (pos == deepestNode->children.end())
-            {
-                needsWriteLock = true;
-                break;
-            }
-
-            std::unique_ptr<RetainedMessageNode> &selectedChildren = pos->second;
+            RetainedMessageNode *selectedChildren = deepestNode->getChildren(SubtopicKey(*subtopic_pos));
 
             if (!selectedChildren)
             {
                 needsWriteLock = true;
                 break;
             }
-            deepestNode = selectedChildren.get();
+            deepestNode = selectedChildren;
             subtopic_pos++;
         }
 
@@ -727,7 +873,7 @@ void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::ve
 
         if (!needsWriteLock && deepestNode)
         {
-            deepestNode->addPayload(publish, retainedMessageCount);
+            deepestNode->addPayload(publish, retainedMessageCount, wal, walRecord);
         }
     }
 
@@ -738,13 +884,7 @@ void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::ve
 
         while(subtopic_pos != subtopics.end())
         {
-            std::unique_ptr<RetainedMessageNode> &selectedChildren = deepestNode->children[*subtopic_pos];
-
-            if (!selectedChildren)
-            {
-                selectedChildren = std::make_unique<RetainedMessageNode>();
-            }
-            deepestNode = selectedChildren.get();
+            deepestNode = deepestNode->getOrMakeChildren(SubtopicKey(*subtopic_pos));
             subtopic_pos++;
         }
 
@@ -752,69 +892,36 @@ void SubscriptionStore::setRetainedMessage(const Publish &publish, const std::ve
 
         if (deepestNode)
         {
-            deepestNode->addPayload(publish, retainedMessageCount);
+            deepestNode->addPayload(publish, retainedMessageCount, wal, walRecord);
         }
     }
 }
 
-// Clean up the weak pointers to sessions and remove nodes that are empty.
-int SubscriptionNode::cleanSubscriptions()
+/**
+ * @brief SubscriptionNode::cleanSubscribers removes the subscribers whose session is gone. Not recursive; see SubscriptionTreeSweep.
+ * @return whether the node is empty and can be removed.
+ */
+bool SubscriptionNode::cleanSubscribers()
 {
-    int subscribersLeftInChildren = 0;
-    auto childrenIt = children.begin();
-    while(childrenIt != children.end())
-    {
-        int n = childrenIt->second->cleanSubscriptions();
-        subscribersLeftInChildren += n;
-
-        if (n > 0)
-            childrenIt++;
-        else
-        {
-            Logger::getInstance()->logf(LOG_DEBUG, "Removing orphaned subscriber node from %s", childrenIt->first.c_str());
-            childrenIt = children.erase(childrenIt);
-        }
-    }
-
-    std::list<std::unique_ptr<SubscriptionNode>*> wildcardChildren;
-    wildcardChildren.push_back(&childrenPlus);
-    wildcardChildren.push_back(&childrenPound);
-
-    for (std::unique_ptr<SubscriptionNode> *node : wildcardChildren)
-    {
-        std::unique_ptr<SubscriptionNode> &node_ = *node;
-
-        if (!node_)
-            continue;
-        int n = node_->cleanSubscriptions();
-        subscribersLeftInChildren += n;
-
-        if (n == 0)
-        {
-            Logger::getInstance()->logf(LOG_DEBUG, "Resetting wildcard children");
-            node_.reset();
-        }
-    }
-
     {
         // This is not particularlly fast when it's many items. But we don't do it often, so is probably okay.
         auto it = subscribers.begin();
         while (it != subscribers.end())
         {
-            auto cur_it = it;
-            it++;
-
-            if (cur_it->second.session.expired())
+            if (it->second.session.expired())
             {
                 Logger::getInstance()->logf(LOG_DEBUG, "Removing empty spot in subscribers map");
-                subscribers.erase(cur_it);
+                it = subscribers.erase(it); // Moves the last one into this spot, so we don't advance.
             }
+            else
+                it++;
         }
     }
 
+    if (sharedSubscribers)
     {
-        auto shared_it = sharedSubscribers.begin();
-        while (shared_it != sharedSubscribers.end())
+        auto shared_it = sharedSubscribers->begin();
+        while (shared_it != sharedSubscribers->end())
         {
             auto cur_shared = shared_it;
             shared_it++;
@@ -823,11 +930,135 @@ int SubscriptionNode::cleanSubscriptions()
             subscribers_of_share.purgeAndReIndex();
 
             if (subscribers_of_share.empty())
-                sharedSubscribers.erase(cur_shared);
+            {
+                sharedSubscribers->erase(cur_shared);
+                GlobalStats::getInstance()->sharedSubscriptionGroups.add(-1);
+            }
         }
+
+        if (sharedSubscribers->empty())
+            sharedSubscribers.reset();
     }
 
-    return subscribers.size() + sharedSubscribers.size() + subscribersLeftInChildren;
+    return subscribers.empty() && !sharedSubscribers && children.empty() && !childrenPlus && !childrenPound;
+}
+
+void SubscriptionNode::removeChild(const SubscriptionNode *child)
+{
+    if (childrenPlus.get() == child)
+    {
+        Logger::getInstance()->logf(LOG_DEBUG, "Resetting wildcard children");
+        childrenPlus.reset();
+        return;
+    }
+
+    if (childrenPound.get() == child)
+    {
+        Logger::getInstance()->logf(LOG_DEBUG, "Resetting wildcard children");
+        childrenPound.reset();
+        return;
+    }
+
+    auto pos = children.find(SubtopicKey(child->getSubtopic()));
+    if (pos != children.end() && pos->second.get() == child)
+    {
+        Logger::getInstance()->logf(LOG_DEBUG, "Removing orphaned subscriber node from %s", child->getSubtopic().c_str());
+        children.erase(pos);
+    }
+}
+
+void SubscriptionTreeSweep::push(SubscriptionNode *node)
+{
+    Frame frame;
+    frame.node = node;
+    frame.children.reserve(node->children.size() + 2);
+
+    for (auto &pair : node->children)
+        frame.children.push_back(pair.second.get());
+
+    if (node->childrenPlus)
+        frame.children.push_back(node->childrenPlus.get());
+    if (node->childrenPound)
+        frame.children.push_back(node->childrenPound.get());
+
+    stack.push_back(std::move(frame));
+}
+
+/**
+ * @brief SubscriptionTreeSweep::start begins a new sweep. The roots themselves are cleaned, but never removed.
+ *
+ * Must be called with the write lock held.
+ */
+void SubscriptionTreeSweep::start(const std::vector<SubscriptionNode*> &roots)
+{
+    stack.clear();
+    reclaimed = 0;
+
+    Frame top;
+    top.children = roots;
+    stack.push_back(std::move(top));
+}
+
+void SubscriptionTreeSweep::stop()
+{
+    stack.clear();
+}
+
+bool SubscriptionTreeSweep::running() const
+{
+    return !stack.empty();
+}
+
+/**
+ * @brief SubscriptionTreeSweep::advance walks the tree depth first, removing nodes that are empty once their children are done.
+ * @param deadline after which it stops; the clock is only looked at every so many nodes.
+ * @return the number of nodes removed in this slice.
+ *
+ * Must be called with the write lock held.
+ */
+size_t SubscriptionTreeSweep::advance(std::chrono::time_point<std::chrono::steady_clock> deadline)
+{
+    size_t reclaimedNow = 0;
+    int steps = 0;
+
+    while (!stack.empty())
+    {
+        if ((++steps & 0x3F) == 0 && std::chrono::steady_clock::now() > deadline)
+            break;
+
+        Frame &frame = stack.back();
+
+        if (frame.next < frame.children.size())
+        {
+            SubscriptionNode *child = frame.children[frame.next++];
+            push(child); // Invalidates 'frame'.
+            continue;
+        }
+
+        SubscriptionNode *node = frame.node;
+        stack.pop_back();
+
+        if (!node)
+            continue;
+
+        const bool empty = node->cleanSubscribers();
+
+        SubscriptionNode *parent = stack.empty() ? nullptr : stack.back().node;
+
+        if (empty && parent)
+        {
+            parent->removeChild(node);
+            reclaimedNow++;
+        }
+    }
+
+    reclaimed += reclaimedNow;
+    return reclaimedNow;
+}
+
+size_t SubscriptionTreeSweep::getReclaimed() const
+{
+    return reclaimed;
 }
 
 void SubscriptionStore::removeSession(const std::shared_ptr<Session> &session)
@@ -852,6 +1083,7 @@ void SubscriptionStore::removeSession(const std::shared_ptr<Session> &session)
         {
             sessionsToRemove.push_back(session_it->second);
             sessionsById.erase(session_it);
+            sessionCount.store(sessionsById.size(), std::memory_order_relaxed);
         }
     }
 
@@ -862,77 +1094,101 @@ void SubscriptionStore::removeSession(const std::shared_ptr<Session> &session)
 }
 
 /**
- * @brief SubscriptionStore::removeExpiredSessionsClients removes expired sessions.
+ * @brief SubscriptionStore::cleanupSubscriptionTree periodically sweeps the subscription tree for empty nodes, holding the write lock for one slice at a time.
+ * @param sliceLength is how long the lock is held, roughly. See 'subscription_tree_cleanup_slice_ms'.
+ * @param continuing should be true when the caller continues a sweep it got true for before. Only that caller advances a running sweep.
+ * @return whether the sweep is unfinished, and the caller should call again later.
  *
- * For Mqtt3 this is non-standard, but the standard doesn't keep real world constraints into account.
+ * Expired sessions are removed by the worker threads when their removal is due; see ThreadData::removeExpiredSessions().
  */
-void SubscriptionStore::removeExpiredSessionsClients()
+bool SubscriptionStore::cleanupSubscriptionTree(std::chrono::milliseconds sliceLength, bool continuing)
 {
-    logger->logf(LOG_DEBUG, "Cleaning out old sessions");
+    std::unique_lock<std::mutex> locker(treeCleanupMutex, std::try_to_lock);
+
+    // Saving the subscriptions holds it for longer, so a running sweep tries again later.
+    if (!locker.owns_lock())
+        return continuing;
 
     const std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
-    const std::chrono::seconds secondsSinceEpoch = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch());
 
-    // Collect sessions to remove for a separate step, to avoid holding two locks at the same time.
-    std::vector<std::shared_ptr<Session>> sessionsToRemove;
+    if (treeSweep.running() != continuing)
+        return false;
+
+    if (!continuing && lastTreeCleanup + std::chrono::minutes(30) >= now)
+        return false;
 
-    int removedSessions = 0;
-    int processedRemovals = 0;
-    int queuedRemovalsLeft = -1;
+    RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
+    lock_guard.wrlock();
 
+    const std::chrono::time_point<std::chrono::steady_clock> lockedAt = std::chrono::steady_clock::now();
+
+    if (!continuing)
     {
-        std::lock_guard<std::mutex> locker(this->queuedSessionRemovalsMutex);
+        logger->logf(LOG_NOTICE, "Sweeping subscription tree for empty nodes");
+        lastTreeCleanup = now;
+        treeSweep.start({&root, &rootDollar});
+    }
 
-        queuedRemovalsLeft = queuedSessionRemovals.size();
+    GlobalStats *globalStats = GlobalStats::getInstance();
 
-        auto it = queuedSessionRemovals.begin();
-        while (it != queuedSessionRemovals.end())
-        {
-            const std::chrono::seconds &removeAt = it->first;
+    try
+    {
+        const size_t reclaimed = treeSweep.advance(lockedAt + sliceLength);
+        globalStats->subscriptionNodesReclaimed.inc(reclaimed);
+    }
+    catch (...)
+    {
+        treeSweep.stop();
+        throw;
+    }
 
-            if (removeAt > secondsSinceEpoch)
-            {
-                break;
-            }
+    globalStats->subscriptionTreeCleanupLockHold.record(std::chrono::steady_clock::now() - lockedAt);
 
-            std::vector<std::weak_ptr<Session>> &sessionsFromSlot = it->second;
+    if (treeSweep.running())
+        return true;
 
-            for (std::weak_ptr<Session> ses : sessionsFromSlot)
-            {
-                std::shared_ptr<Session> lockedSession = ses.lock();
+    logger->logf(LOG_NOTICE, "Subscription tree sweep done. Removed %zu empty nodes.", treeSweep.getReclaimed());
+    return false;
+}
 
-                // A session could have been picked up again, so we have to verify its expiration status.
-                if (lockedSession && !lockedSession->hasActiveClient())
-                {
-                    sessionsToRemove.push_back(lockedSession);
-                }
-            }
-            it = queuedSessionRemovals.erase(it);
+/**
+ * @brief SubscriptionStore::removeExpiredSessions removes a batch of sessions whose expiry is due, taking the write lock once for all of them.
+ * @param sessions that the caller keeps, so they are destroyed after the lock is released.
+ *
+ * How long the lock is held is recorded, see 'expire_sessions_time_budget_ms'.
+ */
+void SubscriptionStore::removeExpiredSessions(const std::vector<std::shared_ptr<Session>> &sessions)
+{
+    for (const std::shared_ptr<Session> &session : sessions)
+    {
+        logger->logf(LOG_DEBUG, "Removing session of client '%s'.", session->getClientId().c_str());
 
-            processedRemovals++;
+        std::shared_ptr<WillPublish> &will = session->getWill();
+        if (will)
+        {
+            queueWillMessage(will, session, true);
         }
-
-        queuedRemovalsLeft = queuedSessionRemovals.size();
     }
 
-    for(std::shared_ptr<Session> &session : sessionsToRemove)
-    {
-        removeSession(session);
-        removedSessions++;
-    }
+    RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
+    lock_guard.wrlock();
 
-    logger->logf(LOG_DEBUG, "Processed %d queued session removals, resulting in %d deleted expired sessions. %d queued removals in the future.",
-                 processedRemovals, removedSessions, queuedRemovalsLeft);
+    const std::chrono::time_point<std::chrono::steady_clock> lockedAt = std::chrono::steady_clock::now();
 
-    if (lastTreeCleanup + std::chrono::minutes(30) < now)
+    for (const std::shared_ptr<Session> &session : sessions)
     {
-        RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
-        lock_guard.wrlock();
+        // A session could have been picked up again, so we have to verify its expiration status.
+        if (session->hasActiveClient())
+            continue;
 
-        logger->logf(LOG_NOTICE, "Rebuilding subscription tree");
-        root.cleanSubscriptions();
-        lastTreeCleanup = now;
+        auto session_it = sessionsById.find(session->getClientId());
+        if (session_it != sessionsById.end() && session_it->second == session)
+            sessionsById.erase(session_it);
     }
+
+    sessionCount.store(sessionsById.size(), std::memory_order_relaxed);
+
+    GlobalStats::getInstance()->sessionExpiryLockHold.record(std::chrono::steady_clock::now() - lockedAt);
 }
 
 void SubscriptionStore::expireRetainedMessages()
@@ -945,20 +1201,36 @@ void SubscriptionStore::expireRetainedMessages()
 }
 
 /**
- * @brief SubscriptionStore::queueSessionRemoval places session efficiently in a sorted map that is periodically dequeued.
+ * @brief SubscriptionStore::queueSessionRemoval places the session in the timer wheel of the current worker thread, or hands it over.
  * @param session
+ *
+ * For Mqtt3 this is non-standard, but the standard doesn't keep real world constraints into account.
  */
 void SubscriptionStore::queueSessionRemoval(const std::shared_ptr<Session> &session)
 {
     if (!session)
         return;
 
-    std::chrono::time_point<std::chrono::steady_clock> removeAt = std::chrono::steady_clock::now() + std::chrono::seconds(session->getSessionExpiryInterval());
-    std::chrono::seconds secondsSinceEpoch = std::chrono::duration_cast<std::chrono::seconds>(removeAt.time_since_epoch());
+    const uint64_t removeAt = TimerWheelBase::now() + static_cast<uint64_t>(session->getSessionExpiryInterval()) * 1000;
     session->setQueuedRemovalAt();
 
-    std::lock_guard<std::mutex> locker(this->queuedSessionRemovalsMutex);
-    queuedSessionRemovals[secondsSinceEpoch].push_back(session);
+    std::weak_ptr<Session> queuedSession = session;
+    ThreadData *threadData = ThreadGlobals::getThreadData();
+
+    if (threadData && threadData->processingTimers)
+        threadData->queuedSessionRemovals.add(removeAt, std::move(queuedSession));
+    else
+        sessionRemovalsHandoff.push(removeAt, std::move(queuedSession));
+}
+
+/**
+ * @brief SubscriptionStore::takeHandedOverTimers moves the session removals and wills other threads queued into the wheels of the calling
+ * worker thread.
+ */
+void SubscriptionStore::takeHandedOverTimers(TimerWheel<QueuedWill> &wills, TimerWheel<std::weak_ptr<Session>> &sessionRemovals)
+{
+    willsHandoff.moveInto(wills);
+    sessionRemovalsHandoff.moveInto(sessionRemovals);
 }
 
 int64_t SubscriptionStore::getRetainedMessageCount() const
@@ -968,43 +1240,29 @@ int64_t SubscriptionStore::getRetainedMessageCount() const
 
 uint64_t SubscriptionStore::getSessionCount() const
 {
-    return sessionsByIdConst.size();
+    return sessionCount.load(std::memory_order_relaxed);
 }
 
 /**
- * @brief SubscriptionStore::getSubscriptionCount Gets the approximate subscription count and occassionally accurately refreshes.
- * @return
+ * @brief SubscriptionStore::getSubscriptionCount gets the number of subscriptions of existing sessions, without walking the tree.
  *
- * With sessions that expire, log off, etc, one would have to validate each subscription's existence to count accurately. It's just not worth
- * it to do so.
+ * It's kept up to date as subscriptions are made and removed, and sessions destroyed; see Session::adjustSubscriptionCount().
  */
-int64_t SubscriptionStore::getSubscriptionCount()
+int64_t SubscriptionStore::getSubscriptionCount() const
 {
-    if (this->lastSubscriptionCountRefreshedAt + std::chrono::minutes(30) > std::chrono::steady_clock::now())
-        return this->subscriptionCount;
-
-    int64_t count = 0;
-
-    {
-        RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
-        lock_guard.rdlock();
-
-        countSubscriptions(&root, count);
-        countSubscriptions(&rootDollar, count);
-    }
-
-    {
-        RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
-        lock_guard.wrlock();
-
-        lastSubscriptionCountRefreshedAt = std::chrono::steady_clock::now();
-        this->subscriptionCount = count;
-    }
+    return GlobalStats::getInstance()->subscriptions.get();
+}
 
-    return count;
+/**
+ * @brief SubscriptionStore::getSharedSubscriptionGroupCount gets the number of share names per topic filter, like '$share/group/topic'.
+ */
+int64_t SubscriptionStore::getSharedSubscriptionGroupCount() const
+{
+    return GlobalStats::getInstance()->sharedSubscriptionGroups.get();
 }
 
-void SubscriptionStore::getRetainedMessages(RetainedMessageNode *this_node, std::vector<RetainedMessage> &outputList) const
+void SubscriptionStore::getRetainedMessages(RetainedMessageNode *this_node, std::vector<RetainedMessage> &outputList,
+                                            std::vector<MappedRetainedMessage> &mappedOutputList) const
 {
     {
         std::lock_guard<std::mutex> locker(this_node->messageSetMutex);
@@ -1013,25 +1271,28 @@ void SubscriptionStore::getRetainedMessages(RetainedMessageNode *this_node, std:
         {
             outputList.push_back(rm);
         }
+
+        if (this_node->mappedMessage.isSet())
+            mappedOutputList.push_back(this_node->mappedMessage);
     }
 
     for(auto &pair : this_node->children)
     {
         const std::unique_ptr<RetainedMessageNode> &child = pair.second;
-        getRetainedMessages(child.get(), outputList);
+        getRetainedMessages(child.get(), outputList, mappedOutputList);
     }
 }
 
 /**
- * @brief SubscriptionStore::getSubscriptions
- * @param this_node
- * @param composedTopic
- * @param root bool. Every subtopic is concatenated with a '/', but not the first topic to 'root'. The root is a bit weird, virtual, so it needs different treatment.
- * @param outputList
+ * @brief SubscriptionStore::getSubscriptionsOfNode is the non-recursive part of getSubscriptions().
+ * @return the number of subscriptions added.
  */
-void SubscriptionStore::getSubscriptions(SubscriptionNode *this_node, const std::string &composedTopic, bool root,
-                                         std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList) const
+size_t SubscriptionStore::getSubscriptionsOfNode(SubscriptionNode *this_node, const std::string &composedTopic,
+                                                 std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList)
 {
+    std::list<SubscriptionForSerializing> &output = outputList[composedTopic];
+    const size_t sizeBefore = output.size();
+
     for (auto &pair : this_node->getSubscribers())
     {
         const Subscription &node = pair.second;
@@ -1039,62 +1300,57 @@ void SubscriptionStore::getSubscriptions(SubscriptionNode *this_node, const std:
         if (ses)
         {
             SubscriptionForSerializing sub(ses->getClientId(), node.qos);
-            outputList[composedTopic].push_back(sub);
+            output.push_back(sub);
         }
     }
 
-    for (auto &pair : this_node->getSharedSubscribers())
+    const std::unordered_map<std::string, SharedSubscribers> *sharedSubscribers = this_node->getSharedSubscribers();
+    if (sharedSubscribers)
     {
-        const SharedSubscribers &node = pair.second;
-        node.getForSerializing(composedTopic, outputList);
+        for (auto &pair : *sharedSubscribers)
+        {
+            const SharedSubscribers &node = pair.second;
+            node.getForSerializing(composedTopic, outputList);
+        }
     }
 
-    for (auto &pair : this_node->children)
-    {
-        SubscriptionNode *node = pair.second.get();
-        const std::string topicAtNextLevel = root ? pair.first : composedTopic + "/" + pair.first;
-        getSubscriptions(node, topicAtNextLevel, false, outputList);
-    }
+    const size_t added = output.size() - sizeBefore;
 
-    if (this_node->childrenPlus)
-    {
-        const std::string topicAtNextLevel = root ? "+" : composedTopic + "/+";
-        getSubscriptions(this_node->childrenPlus.get(), topicAtNextLevel, false, outputList);
-    }
+    if (output.empty())
+        outputList.erase(composedTopic);
 
-    if (this_node->childrenPound)
-    {
-        const std::string topicAtNextLevel = root ? "#" : composedTopic + "/#";
-        getSubscriptions(this_node->childrenPound.get(), topicAtNextLevel, false, outputList);
-    }
+    return added;
 }
 
-void SubscriptionStore::countSubscriptions(SubscriptionNode *this_node, int64_t &count) const
+/**
+ * @brief SubscriptionStore::getSubscriptions
+ * @param this_node
+ * @param composedTopic
+ * @param root bool. Every subtopic is concatenated with a '/', but not the first topic to 'root'. The root is a bit weird, virtual, so it needs different treatment.
+ * @param outputList
+ */
+void SubscriptionStore::getSubscriptions(SubscriptionNode *this_node, const std::string &composedTopic, bool root,
+                                         std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList) const
 {
-    for (auto &pair : this_node->getSubscribers())
-    {
-        const Subscription &node = pair.second;
-        std::shared_ptr<Session> ses = node.session.lock();
-        if (ses)
-        {
-            count++;
-        }
-    }
+    getSubscriptionsOfNode(this_node, composedTopic, outputList);
 
     for (auto &pair : this_node->children)
     {
         SubscriptionNode *node = pair.second.get();
-        countSubscriptions(node, count);
+        const std::string topicAtNextLevel = root ? node->getSubtopic() : composedTopic + "/" + node->getSubtopic();
+        getSubscriptions(node, topicAtNextLevel, false, outputList);
     }
 
     if (this_node->childrenPlus)
     {
-        countSubscriptions(this_node->childrenPlus.get(), count);
+        const std::string topicAtNextLevel = root ? "+" : composedTopic + "/+";
+        getSubscriptions(this_node->childrenPlus.get(), topicAtNextLevel, false, outputList);
     }
 
     if (this_node->childrenPound)
     {
-        countSubscriptions(this_node->childrenPound.get(), count);
+        const std::string topicAtNextLevel = root ? "#" : composedTopic + "/#";
+        getSubscriptions(this_node->childrenPound.get(), topicAtNextLevel, false, outputList);
     }
 }
 
@@ -1115,6 +1371,12 @@ void SubscriptionStore::expireRetainedMessages(RetainedMessageNode *this_node, c
         }
     }
 
+    if (this_node->mappedMessage.isSet() && this_node->mappedMessage.hasExpired())
+    {
+        this_node->mappedMessage = MappedRetainedMessage();
+        this->retainedMessageCount--;
+    }
+
     auto cpos = this_node->children.begin();
     while (cpos != this_node->children.end())
     {
@@ -1142,56 +1404,213 @@ void SubscriptionStore::expireRetainedMessages(RetainedMessageNode *this_node, c
     }
 }
 
+/**
+ * @brief SubscriptionStore::saveRetainedMessages saves the retained messages DB. With the write-ahead log, this compacts it: the log starts a
+ * new generation, and the older ones are removed once their changes are safely in the DB.
+ */
 void SubscriptionStore::saveRetainedMessages(const std::string &filePath)
+{
+    const uint64_t walGeneration = startSavingRetainedMessages();
+    const size_t bytesWritten = writeRetainedMessages(filePath);
+    finishSavingRetainedMessages(filePath, walGeneration, bytesWritten);
+}
+
+/**
+ * @brief SubscriptionStore::startSavingRetainedMessages makes the write-ahead log start a new generation, for the changes after this save.
+ * @return the new generation, or the maximum when there is no log.
+ */
+uint64_t SubscriptionStore::startSavingRetainedMessages()
+{
+    if (!retainedMessagesWal)
+        return std::numeric_limits<uint64_t>::max();
+
+    // With the write lock, no change is half applied and logged.
+    RWLockGuard locker(&retainedMessagesRwlock);
+    locker.wrlock();
+    return retainedMessagesWal->startNewGeneration();
+}
+
+/**
+ * @brief SubscriptionStore::writeRetainedMessages collects the retained messages and writes them to the DB. It can be done by a forked child.
+ * @return the bytes written.
+ */
+size_t SubscriptionStore::writeRetainedMessages(const std::string &filePath)
 {
     logger->logf(LOG_INFO, "Saving retained messages to '%s'", filePath.c_str());
 
     std::vector<RetainedMessage> result;
+    std::vector<MappedRetainedMessage> mappedResult;
 
     {
         RWLockGuard locker(&retainedMessagesRwlock);
         locker.rdlock();
         result.reserve(std::max<int64_t>(retainedMessageCount, 0));
-        getRetainedMessages(&retainedMessagesRoot, result);
+        getRetainedMessages(&retainedMessagesRoot, result, mappedResult);
     }
 
-    logger->logf(LOG_DEBUG, "Collected %ld retained messages to save.", result.size());
+    logger->logf(LOG_DEBUG, "Collected %ld retained messages to save, of which %ld still only mapped.", result.size() + mappedResult.size(),
+                 mappedResult.size());
 
     // Then do the IO without locking the threads.
     RetainedMessagesDB db(filePath);
     db.openWrite();
-    db.saveData(result);
+    const size_t bytesWritten = db.saveData(result, mappedResult);
+    db.closeFile();
+
+    return bytesWritten;
 }
 
+/**
+ * @brief SubscriptionStore::finishSavingRetainedMessages removes the write-ahead logs that are in the saved DB now.
+ * @param walGeneration as returned by startSavingRetainedMessages().
+ */
+void SubscriptionStore::finishSavingRetainedMessages(const std::string &filePath, uint64_t walGeneration, size_t bytesWritten)
+{
+    GlobalStats *globalStats = GlobalStats::getInstance();
+    globalStats->retainedMessagesDbBytesWritten.inc(bytesWritten);
+
+    // Without the log, this removes logs left by an earlier run, because replaying them over this DB would undo newer changes.
+    RetainedMessagesWal::removeFilesBefore(filePath, walGeneration);
+
+    if (retainedMessagesWal)
+    {
+        retainedMessagesWal->setDbSize(bytesWritten);
+
+        const uint64_t walBytes = globalStats->retainedMessagesWalBytesWritten.get();
+        const uint64_t dbBytes = globalStats->retainedMessagesDbBytesWritten.get();
+
+        if (walBytes > 0)
+        {
+            const double amplification = static_cast<double>(walBytes + dbBytes) / walBytes;
+            logger->logf(LOG_INFO, "Compacted retained messages write-ahead log into '%s'. Written since start: %lu bytes of log and %lu bytes "
+                                   "of DB, so a write amplification of %.2f.", filePath.c_str(), walBytes, dbBytes, amplification);
+        }
+    }
+}
+
+/**
+ * @brief SubscriptionStore::loadRetainedMessages loads the DB, and then replays the write-ahead log, if there is one.
+ *
+ * The log is replayed even when it's not enabled (anymore), otherwise changes after the last save would be lost.
+ */
 void SubscriptionStore::loadRetainedMessages(const std::string &filePath)
 {
+    const std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    size_t loaded = 0;
+
     try
     {
         logger->logf(LOG_INFO, "Loading '%s'", filePath.c_str());
 
         RetainedMessagesDB db(filePath);
         db.openRead();
-        std::list<RetainedMessage> messages = db.readData();
 
-        for (RetainedMessage &rm : messages)
+        const Settings *settings = ThreadGlobals::getSettings();
+
+        if (settings->retainedMessagesLazyLoading && db.canReadDataMapped())
         {
-            setRetainedMessage(rm.publish, rm.publish.getSubtopics());
+            loaded = loadRetainedMessagesMapped(db);
+        }
+        else
+        {
+            if (settings->retainedMessagesLazyLoading)
+                logger->logf(LOG_WARNING, "'%s' is of an older version and can't be loaded lazily. It will be, once saved again.", filePath.c_str());
+
+            std::list<RetainedMessage> messages = db.readData();
+
+            for (RetainedMessage &rm : messages)
+            {
+                setRetainedMessage(rm.publish, rm.publish.getSubtopics());
+            }
+
+            loaded = messages.size();
         }
     }
     catch (PersistenceFileCantBeOpened &ex)
     {
         logger->logf(LOG_WARNING, "File '%s' is not there (yet)", filePath.c_str());
     }
+
+    const size_t replayed = RetainedMessagesWal::replay(filePath, [this](Publish &publish) {
+        setRetainedMessage(publish, publish.getSubtopics());
+    });
+
+    const std::chrono::milliseconds duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    logger->logf(LOG_INFO, "Loaded %lu retained messages and replayed %lu changes from the write-ahead log in %ld ms.", loaded, replayed, duration.count());
+}
+
+/**
+ * @brief SubscriptionStore::loadRetainedMessagesMapped puts the messages of the mapped DB in the tree, without parsing them. They are
+ * loaded from the mapping when given to subscribers, and written back from it when saving.
+ * @return the number of messages.
+ */
+size_t SubscriptionStore::loadRetainedMessagesMapped(RetainedMessagesDB &db)
+{
+    RWLockGuard locker(&retainedMessagesRwlock);
+    locker.wrlock();
+
+    std::vector<std::string> subtopics;
+
+    return db.readDataMapped([this, &subtopics](std::string_view topic, MappedRetainedMessage &&message) {
+        if (message.hasExpired())
+            return;
+
+        subtopics.clear();
+        splitTopic(std::string(topic), subtopics);
+
+        RetainedMessageNode *deepestNode = &retainedMessagesRoot;
+        for (const std::string &subtopic : subtopics)
+        {
+            deepestNode = deepestNode->getOrMakeChildren(SubtopicKey(subtopic));
+        }
+
+        deepestNode->setMappedMessage(std::move(message), retainedMessageCount);
+    });
+}
+
+/**
+ * @brief SubscriptionStore::startRetainedMessagesWal starts logging changes to the retained messages. Do it after loading, and before
+ * there are other threads.
+ */
+void SubscriptionStore::startRetainedMessagesWal(const std::string &filePath)
+{
+    std::unique_ptr<RetainedMessagesWal> wal = std::make_unique<RetainedMessagesWal>(filePath);
+    wal->open();
+    wal->setDbSize(std::max<ssize_t>(getFileSize(filePath), 0));
+    retainedMessagesWal = std::move(wal);
+}
+
+bool SubscriptionStore::hasRetainedMessagesWal() const
+{
+    return static_cast<bool>(retainedMessagesWal);
+}
+
+void SubscriptionStore::syncRetainedMessagesWal()
+{
+    if (retainedMessagesWal)
+        retainedMessagesWal->sync();
+}
+
+bool SubscriptionStore::retainedMessagesWalNeedsCompaction() const
+{
+    return retainedMessagesWal && retainedMessagesWal->needsCompaction();
 }
 
+/**
+ * @brief SubscriptionStore::saveSessionsAndSubscriptions streams the sessions and subscriptions to disk in sections, without copying them all first.
+ *
+ * Sessions are serialized by several threads, each copying one session at a time and writing a section when its buffer is full. Meanwhile,
+ * this thread walks the subscription tree in slices under the read lock. So, the extra memory is about a buffer per thread, plus a pointer
+ * per session. The downside is that it's not a snapshot of one moment, but with sessions and subscriptions changing all the time, it can't
+ * be anyway, other than at shutdown.
+ */
 void SubscriptionStore::saveSessionsAndSubscriptions(const std::string &filePath)
 {
     logger->logf(LOG_INFO, "Saving sessions and subscriptions to '%s' in thread.", filePath.c_str());
 
     const std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
 
-    std::vector<std::shared_ptr<Session>> sessionPointers;
-    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> subscriptionCopies;
+    std::vector<std::weak_ptr<Session>> sessionPointers;
 
     {
         RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
@@ -1203,39 +1622,236 @@ void SubscriptionStore::saveSessionsAndSubscriptions(const std::string &filePath
         {
             sessionPointers.push_back(pair.second);
         }
+    }
+
+    SessionsAndSubscriptionsDB db(filePath);
+    db.openWrite();
+
+    std::atomic<size_t> nextSession {0};
+    std::atomic<size_t> sessionsSaved {0};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+
+    auto runAndKeepError = [&](const std::function<void()> &f) {
+        try
+        {
+            f();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> locker(errorMutex);
+            if (!error)
+                error = std::current_exception();
+            nextSession = sessionPointers.size();
+        }
+    };
+
+    auto saveSessions = [&]() {
+        const PersistenceBuffer noSubscriptions;
+        PersistenceBuffer buffer;
+        CirBuf cirbuf(1024);
+        uint32_t count = 0;
+        int64_t savedAt = 0;
+
+        for (size_t i = nextSession++; i < sessionPointers.size(); i = nextSession++)
+        {
+            std::shared_ptr<Session> session = sessionPointers[i].lock();
+
+            // Sessions created with clean session need to be destroyed when disconnecting, so no point in saving them.
+            if (!session || session->getDestroyOnDisconnect())
+                continue;
+
+            // Takes care of locking, and working on the snapshot/copy prevents doing disk IO under lock.
+            std::unique_ptr<Session> copy = session->getCopy();
+            session.reset();
+
+            if (count == 0)
+                savedAt = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+            SessionsAndSubscriptionsDB::serializeSession(*copy, buffer, cirbuf);
+            count++;
+
+            if (buffer.size() >= sessionsSectionBytes)
+            {
+                db.writeSection(savedAt, count, buffer, 0, noSubscriptions);
+                sessionsSaved += count;
+                buffer.clear();
+                count = 0;
+            }
+        }
+
+        if (count > 0)
+        {
+            db.writeSection(savedAt, count, buffer, 0, noSubscriptions);
+            sessionsSaved += count;
+        }
+    };
+
+    const unsigned int threadCount = std::clamp<unsigned int>(std::thread::hardware_concurrency() / 2, 1, 4);
+    std::vector<std::thread> threads;
 
-        getSubscriptions(&root, "", true, subscriptionCopies);
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        threads.emplace_back(runAndKeepError, saveSessions);
     }
 
-    const std::chrono::time_point<std::chrono::steady_clock> doneCopying = std::chrono::steady_clock::now();
+    size_t subscriptionsSaved = 0;
+    runAndKeepError([&]() {
+        subscriptionsSaved = saveSubscriptions(db);
+    });
 
-    const std::chrono::milliseconds copyDuration = std::chrono::duration_cast<std::chrono::milliseconds>(doneCopying - start);
-    logger->logf(LOG_DEBUG, "Collected %ld sessions and %ld subscriptions to save in %ld ms.", sessionPointers.size(), subscriptionCopies.size(), copyDuration.count());
+    for (std::thread &t : threads)
+    {
+        t.join();
+    }
 
-    SessionsAndSubscriptionsDB db(filePath);
-    db.openWrite();
-    db.saveData(sessionPointers, subscriptionCopies);
+    if (error)
+        std::rethrow_exception(error);
 
-    const std::chrono::time_point<std::chrono::steady_clock> doneSaving = std::chrono::steady_clock::now();
+    db.closeFile();
 
-    const std::chrono::milliseconds saveDuration = std::chrono::duration_cast<std::chrono::milliseconds>(doneSaving - doneCopying);
-    logger->logf(LOG_INFO, "Saved %ld sessions and %ld subscriptions to '%s' in %ld ms.",
-                 sessionPointers.size(), subscriptionCopies.size(), filePath.c_str(), saveDuration.count());
+    const std::chrono::milliseconds saveDuration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    logger->logf(LOG_INFO, "Saved %ld sessions and %ld subscriptions to '%s' in %ld ms, with %u threads.",
+                 sessionsSaved.load(), subscriptionsSaved, filePath.c_str(), saveDuration.count(), threadCount);
 }
 
+/**
+ * @brief SubscriptionStore::saveSubscriptions walks the subscription tree and writes the subscriptions in sections, holding the read lock
+ * for one section at a time.
+ * @return the number of subscriptions written.
+ *
+ * Between slices, the nodes on the stack stay valid, because the tree cleanup, the only thing that removes nodes, waits for the
+ * 'treeCleanupMutex'. Nodes made in the mean time may not be visited.
+ */
+size_t SubscriptionStore::saveSubscriptions(SessionsAndSubscriptionsDB &db)
+{
+    struct Frame
+    {
+        SubscriptionNode *node = nullptr;
+        std::string topic;
+        std::vector<SubscriptionNode*> children;
+        size_t next = 0;
+    };
+
+    std::lock_guard<std::mutex> cleanupLocker(treeCleanupMutex);
+
+    const PersistenceBuffer noSessions;
+    PersistenceBuffer buffer;
+    std::unordered_map<std::string, std::list<SubscriptionForSerializing>> batch;
+    std::vector<Frame> stack;
+    size_t inBatch = 0;
+    size_t total = 0;
+
+    // Collects the subscriptions of the node right away, so the stack only holds pointers and topic paths.
+    auto push = [&](SubscriptionNode *node, std::string &&topic) -> size_t {
+        Frame frame;
+        frame.node = node;
+        frame.topic = std::move(topic);
+
+        for (auto &pair : node->children)
+            frame.children.push_back(pair.second.get());
+        if (node->childrenPlus)
+            frame.children.push_back(node->childrenPlus.get());
+        if (node->childrenPound)
+            frame.children.push_back(node->childrenPound.get());
+
+        const size_t n = getSubscriptionsOfNode(node, frame.topic, batch);
+        stack.push_back(std::move(frame));
+        return n;
+    };
+
+    {
+        RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
+        lock_guard.rdlock();
+        inBatch = push(&root, "");
+        total = inBatch;
+    }
+
+    while (!stack.empty())
+    {
+        {
+            RWLockGuard lock_guard(&sessionsAndSubscriptionsRwlock);
+            lock_guard.rdlock();
+
+            while (!stack.empty() && inBatch < subscriptionsPerSection)
+            {
+                Frame &frame = stack.back();
+
+                if (frame.next >= frame.children.size())
+                {
+                    stack.pop_back();
+                    continue;
+                }
+
+                SubscriptionNode *child = frame.children[frame.next++];
+                std::string topic = frame.node == &root ? child->getSubtopic() : frame.topic + "/" + child->getSubtopic();
+                const size_t n = push(child, std::move(topic)); // Invalidates 'frame'.
+                inBatch += n;
+                total += n;
+            }
+        }
+
+        if (batch.empty())
+            continue;
+
+        const int64_t savedAt = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        for (auto &pair : batch)
+            SessionsAndSubscriptionsDB::serializeSubscriptions(pair.first, pair.second, buffer);
+
+        db.writeSection(savedAt, 0, noSessions, batch.size(), buffer);
+        buffer.clear();
+        batch.clear();
+        inBatch = 0;
+    }
+
+    return total;
+}
+
+/**
+ * @brief SubscriptionStore::forkWithStoreLocked forks while holding the locks of the store, so nothing is half changed in the child's copy.
+ * @return like fork().
+ *
+ * The locks are read locks, and are only held for the fork itself. Threads that only read may still hold them in the child's copy, but
+ * there, nobody takes them for writing anymore.
+ */
+pid_t SubscriptionStore::forkWithStoreLocked()
+{
+    std::lock_guard<std::mutex> cleanupLocker(treeCleanupMutex);
+
+    RWLockGuard sessionsLocker(&sessionsAndSubscriptionsRwlock);
+    sessionsLocker.rdlock();
+
+    RWLockGuard retainedLocker(&retainedMessagesRwlock);
+    retainedLocker.rdlock();
+
+    return fork();
+}
+
+/**
+ * @brief SubscriptionStore::loadSessionsAndSubscriptions loads the file, which is parsed by multiple threads, and then puts it all in the store
+ * under the write lock.
+ */
 void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath)
 {
     try
     {
         logger->logf(LOG_INFO, "Loading '%s'", filePath.c_str());
 
+        const std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+
         SessionsAndSubscriptionsDB db(filePath);
         db.openRead();
         SessionsAndSubscriptionsResult loadedData = db.readData();
+        db.closeFile();
+
+        const std::chrono::time_point<std::chrono::steady_clock> parsed = std::chrono::steady_clock::now();
 
         RWLockGuard locker(&sessionsAndSubscriptionsRwlock);
         locker.wrlock();
 
+        sessionsById.reserve(sessionsById.size() + loadedData.sessions.size());
+
         for (std::shared_ptr<Session> &session : loadedData.sessions)
         {
             sessionsById[session->getClientId()] = session;
@@ -1243,27 +1859,37 @@ void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath
             queueWillMessage(session->getWill(), session);
         }
 
+        sessionCount.store(sessionsById.size(), std::memory_order_relaxed);
+
         std::vector<std::string> subtopics;
+        size_t subscriptionsAdded = 0;
 
         for (auto &pair : loadedData.subscriptions)
         {
             const std::string &topic = pair.first;
             const std::list<SubscriptionForSerializing> &subs = pair.second;
 
+            splitTopic(topic, subtopics);
+            SubscriptionNode *subscriptionNode = getDeepestNode(subtopics);
+
             for (const SubscriptionForSerializing &sub : subs)
             {
-                splitTopic(topic, subtopics);
-                SubscriptionNode *subscriptionNode = getDeepestNode(subtopics);
-
                 auto session_it = sessionsByIdConst.find(sub.clientId);
                 if (session_it != sessionsByIdConst.end())
                 {
                     const std::shared_ptr<Session> &ses = session_it->second;
                     subscriptionNode->addSubscriber(ses, sub.qos, sub.shareName);
+                    subscriptionsAdded++;
                 }
 
             }
         }
+
+        const std::chrono::time_point<std::chrono::steady_clock> end = std::chrono::steady_clock::now();
+        const std::chrono::milliseconds parseDuration = std::chrono::duration_cast<std::chrono::milliseconds>(parsed - start);
+        const std::chrono::milliseconds storeDuration = std::chrono::duration_cast<std::chrono::milliseconds>(end - parsed);
+        logger->logf(LOG_INFO, "Loaded %lu sessions and %lu subscriptions from '%s'. Reading took %ld ms and adding them %ld ms.",
+                     loadedData.sessions.size(), subscriptionsAdded, filePath.c_str(), parseDuration.count(), storeDuration.count());
     }
     catch (PersistenceFileCantBeOpened &ex)
     {
@@ -1271,10 +1897,21 @@ void SubscriptionStore::loadSessionsAndSubscriptions(const std::string &filePath
     }
 }
 
-void RetainedMessageNode::addPayload(const Publish &publish, int64_t &totalCount)
+void RetainedMessageNode::addPayload(const Publish &publish, int64_t &totalCount, RetainedMessagesWal *wal, const PersistenceBuffer &walRecord)
 {
     std::lock_guard<std::mutex> locker(this->messageSetMutex);
 
+    // Under the lock, so the log has the changes of this topic in the order they are applied.
+    if (wal)
+        wal->append(walRecord);
+
+    // The mapped message is the same topic, so is replaced or removed by any change.
+    if (mappedMessage.isSet())
+    {
+        mappedMessage = MappedRetainedMessage();
+        totalCount--;
+    }
+
     const int64_t countBefore = retainedMessages.size();
     RetainedMessage rm(publish);
 
@@ -1300,22 +1937,59 @@ void RetainedMessageNode::addPayload(const Publish &publish, int64_t &totalCount
     totalCount += diffCount;
 }
 
+/**
+ * @brief RetainedMessageNode::setMappedMessage sets the message of this topic as still in the mapped DB. Only done when loading, under the write lock.
+ */
+void RetainedMessageNode::setMappedMessage(MappedRetainedMessage &&message, int64_t &totalCount)
+{
+    totalCount -= retainedMessages.size();
+    retainedMessages.clear();
+
+    if (!mappedMessage.isSet())
+        totalCount++;
+
+    mappedMessage = std::move(message);
+}
+
+RetainedMessageNode::RetainedMessageNode(const std::string &subtopic) :
+    subtopic(subtopic)
+{
+
+}
+
 /**
  * @brief RetainedMessageNode::getChildren return the children or nullptr when there are none. Const, so doesn't default construct.
  * @param subtopic
  * @return
  */
-RetainedMessageNode *RetainedMessageNode::getChildren(const std::string &subtopic) const
+RetainedMessageNode *RetainedMessageNode::getChildren(const SubtopicKey &key) const
 {
-    auto it = children.find(subtopic);
+    auto it = children.find(key);
     if (it != children.end())
         return it->second.get();
     return nullptr;
 }
 
+/**
+ * @brief RetainedMessageNode::getOrMakeChildren is like SubscriptionNode::getOrMakeChildren().
+ * @param key
+ * @return
+ */
+RetainedMessageNode *RetainedMessageNode::getOrMakeChildren(const SubtopicKey &key)
+{
+    auto it = children.find(key);
+    if (it != children.end())
+        return it->second.get();
+
+    std::unique_ptr<RetainedMessageNode> node = std::make_unique<RetainedMessageNode>(std::string(key.getSubtopic()));
+    const SubtopicKey nodeKey(node->subtopic, key.getHash());
+    auto result = children.emplace(nodeKey, std::move(node));
+    return result.first->second.get();
+}
+
 bool RetainedMessageNode::isOrphaned() const
 {
-    return children.empty() && retainedMessages.empty();
+    return children.empty() && retainedMessages.empty() && !mappedMessage.isSet();
 }
 
 QueuedWill::QueuedWill(const std::shared_ptr<WillPublish> &will, const std::shared_ptr<Session> &session) :
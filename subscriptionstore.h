@@ -26,6 +26,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <vector>
 #include <pthread.h>
 #include <unordered_set>
+#include <atomic>
 
 #include "client.h"
 #include "session.h"
@@ -33,53 +34,99 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "logger.h"
 #include "subscription.h"
 #include "sharedsubscribers.h"
+#include "subtopickey.h"
+#include "flatmap.h"
+#include "timerwheel.h"
+#include "retainedmessageswal.h"
+#include "retainedmessagesmapping.h"
 
 
 struct ReceivingSubscriber
 {
-    const std::shared_ptr<Session> session;
-    const uint8_t qos;
+    std::shared_ptr<Session> session;
+    uint8_t qos;
+    uint32_t readAclPreauthorization = 0;
 
 public:
-    ReceivingSubscriber(const std::shared_ptr<Session> &ses, uint8_t qos);
+    ReceivingSubscriber(std::shared_ptr<Session> &&ses, uint8_t qos, uint32_t readAclPreauthorization);
+    ReceivingSubscriber(const std::shared_ptr<Session> &ses, uint8_t qos, uint32_t readAclPreauthorization);
 };
 
 class SubscriptionNode
 {
     std::string subtopic;
-    std::unordered_map<std::string, Subscription> subscribers;
-    std::unordered_map<std::string, SharedSubscribers> sharedSubscribers;
+    FlatMap<std::string, Subscription> subscribers;
+    std::unique_ptr<std::unordered_map<std::string, SharedSubscribers>> sharedSubscribers; // Made when used, because most nodes don't have them.
 
 public:
     SubscriptionNode(const std::string &subtopic);
     SubscriptionNode(const SubscriptionNode &node) = delete;
     SubscriptionNode(SubscriptionNode &&node) = delete;
 
-    const std::unordered_map<std::string, Subscription> &getSubscribers() const;
-    std::unordered_map<std::string, SharedSubscribers> &getSharedSubscribers();
+    const FlatMap<std::string, Subscription> &getSubscribers() const;
+    std::unordered_map<std::string, SharedSubscribers> *getSharedSubscribers();
     const std::string &getSubtopic() const;
-    void addSubscriber(const std::shared_ptr<Session> &subscriber, uint8_t qos, const std::string &shareName);
+    void addSubscriber(const std::shared_ptr<Session> &subscriber, uint8_t qos, const std::string &shareName, uint32_t readAclPreauthorization = 0);
     void removeSubscriber(const std::shared_ptr<Session> &subscriber, const std::string &shareName);
-    std::unordered_map<std::string, std::unique_ptr<SubscriptionNode>> children;
+    FlatMap<SubtopicKey, std::unique_ptr<SubscriptionNode>, SubtopicKeyHash> children;
     std::unique_ptr<SubscriptionNode> childrenPlus;
     std::unique_ptr<SubscriptionNode> childrenPound;
 
     SubscriptionNode *getChildren(const std::string &subtopic) const;
+    SubscriptionNode *getOrMakeChildren(const std::string &subtopic);
 
-    int cleanSubscriptions();
+    bool cleanSubscribers();
+    void removeChild(const SubscriptionNode *child);
+};
+
+/**
+ * @brief The SubscriptionTreeSweep class removes the empty nodes from the subscription tree, a slice at a time, so the write lock isn't held
+ * for the whole tree at once.
+ *
+ * Between slices the lock is released, and the nodes on the stack stay valid only because nothing but the sweep removes subscription nodes.
+ * Nodes made in the mean time are visited by the next sweep.
+ */
+class SubscriptionTreeSweep
+{
+    struct Frame
+    {
+        SubscriptionNode *node = nullptr;
+        std::vector<SubscriptionNode*> children;
+        size_t next = 0;
+    };
+
+    std::vector<Frame> stack;
+    size_t reclaimed = 0;
+
+    void push(SubscriptionNode *node);
+
+public:
+    void start(const std::vector<SubscriptionNode*> &roots);
+    void stop();
+    bool running() const;
+    size_t advance(std::chrono::time_point<std::chrono::steady_clock> deadline);
+    size_t getReclaimed() const;
 };
 
 class RetainedMessageNode
 {
     friend class SubscriptionStore;
 
-    std::unordered_map<std::string, std::unique_ptr<RetainedMessageNode>> children;
+    std::string subtopic;
+    SubtopicMap<std::unique_ptr<RetainedMessageNode>> children;
     std::mutex messageSetMutex;
     std::unordered_set<RetainedMessage> retainedMessages;
+    MappedRetainedMessage mappedMessage; // Until the message is changed, when loaded with 'retained_messages_lazy_loading'.
 
-    void addPayload(const Publish &publish, int64_t &totalCount);
-    RetainedMessageNode *getChildren(const std::string &subtopic) const;
+    void addPayload(const Publish &publish, int64_t &totalCount, RetainedMessagesWal *wal, const PersistenceBuffer &walRecord);
+    void setMappedMessage(MappedRetainedMessage &&message, int64_t &totalCount);
+    RetainedMessageNode *getChildren(const SubtopicKey &key) const;
+    RetainedMessageNode *getOrMakeChildren(const SubtopicKey &key);
     bool isOrphaned() const;
+
+public:
+    RetainedMessageNode() = default;
+    RetainedMessageNode(const std::string &subtopic);
 };
 
 class QueuedWill
@@ -88,6 +135,7 @@ class QueuedWill
     std::weak_ptr<Session> session;
 
 public:
+    QueuedWill() = default;
     QueuedWill(const std::shared_ptr<WillPublish> &will, const std::shared_ptr<Session> &session);
 
     const std::weak_ptr<WillPublish> &getWill() const;
@@ -100,55 +148,66 @@ class SubscriptionStore
     friend class MainTests;
 #endif
 
+    // How much is saved per section of the sessions file. See saveSessionsAndSubscriptions().
+    static constexpr size_t sessionsSectionBytes = 1024 * 1024;
+    static constexpr size_t subscriptionsPerSection = 10000;
+
     SubscriptionNode root;
     SubscriptionNode rootDollar;
     pthread_rwlock_t sessionsAndSubscriptionsRwlock = PTHREAD_RWLOCK_INITIALIZER;
     std::unordered_map<std::string, std::shared_ptr<Session>> sessionsById;
     const std::unordered_map<std::string, std::shared_ptr<Session>> &sessionsByIdConst;
 
-    std::mutex queuedSessionRemovalsMutex;
-    std::map<std::chrono::seconds, std::vector<std::weak_ptr<Session>>> queuedSessionRemovals;
+    // Session removals and delayed wills are timed by the worker threads, see ThreadData::processTimers(). Other threads, like the main
+    // thread when loading sessions, hand them over here, and the first worker thread to look takes them.
+    TimerHandoff<std::weak_ptr<Session>> sessionRemovalsHandoff;
+    TimerHandoff<QueuedWill> willsHandoff;
 
     pthread_rwlock_t retainedMessagesRwlock = PTHREAD_RWLOCK_INITIALIZER;
     RetainedMessageNode retainedMessagesRoot;
     RetainedMessageNode retainedMessagesRootDollar;
     int64_t retainedMessageCount = 0;
+    std::unique_ptr<RetainedMessagesWal> retainedMessagesWal; // Only made at start-up, after loading. See startRetainedMessagesWal().
 
-    int64_t subscriptionCount = 0;
-    std::chrono::time_point<std::chrono::steady_clock> lastSubscriptionCountRefreshedAt;
-
-    std::mutex pendingWillsMutex;
-    std::map<std::chrono::seconds, std::vector<QueuedWill>> pendingWillMessages;
+    std::atomic<uint64_t> sessionCount {0}; // The size of 'sessionsById', to read without the lock.
 
+    std::mutex treeCleanupMutex; // Keeps subscription nodes from being removed. Also held while saving the subscriptions.
     std::chrono::time_point<std::chrono::steady_clock> lastTreeCleanup;
+    SubscriptionTreeSweep treeSweep;
 
     Logger *logger = Logger::getInstance();
 
     static void publishNonRecursively(SubscriptionNode *this_node,
-                               std::forward_list<ReceivingSubscriber> &targetSessions, size_t distributionHash);
+                               std::vector<ReceivingSubscriber> &targetSessions, size_t distributionHash);
     static void publishRecursively(std::vector<std::string>::const_iterator cur_subtopic_it, std::vector<std::string>::const_iterator end,
-                            SubscriptionNode *this_node, std::forward_list<ReceivingSubscriber> &targetSessions, size_t distributionHash);
+                            std::vector<size_t>::const_iterator cur_hash_it, SubscriptionNode *this_node,
+                            std::vector<ReceivingSubscriber> &targetSessions, size_t distributionHash);
     static void giveClientRetainedMessagesRecursively(std::vector<std::string>::const_iterator cur_subtopic_it,
                                                std::vector<std::string>::const_iterator end, RetainedMessageNode *this_node, bool poundMode,
                                                std::forward_list<Publish> &packetList, int &count);
-    void getRetainedMessages(RetainedMessageNode *this_node, std::vector<RetainedMessage> &outputList) const;
+    void getRetainedMessages(RetainedMessageNode *this_node, std::vector<RetainedMessage> &outputList,
+                             std::vector<MappedRetainedMessage> &mappedOutputList) const;
+    static size_t getSubscriptionsOfNode(SubscriptionNode *this_node, const std::string &composedTopic,
+                                         std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList);
+    size_t saveSubscriptions(SessionsAndSubscriptionsDB &db);
     void getSubscriptions(SubscriptionNode *this_node, const std::string &composedTopic, bool root,
                           std::unordered_map<std::string, std::list<SubscriptionForSerializing>> &outputList) const;
-    void countSubscriptions(SubscriptionNode *this_node, int64_t &count) const;
     void expireRetainedMessages(RetainedMessageNode *this_node, const std::chrono::time_point<std::chrono::steady_clock> &limit);
+    size_t loadRetainedMessagesMapped(RetainedMessagesDB &db);
 
     SubscriptionNode *getDeepestNode(const std::vector<std::string> &subtopics);
 public:
     SubscriptionStore();
 
     void addSubscription(std::shared_ptr<Client> &client, const std::vector<std::string> &subtopics, uint8_t qos);
-    void addSubscription(std::shared_ptr<Client> &client, const std::vector<std::string> &subtopics, uint8_t qos, const std::string &shareName);
+    void addSubscription(std::shared_ptr<Client> &client, const std::vector<std::string> &subtopics, uint8_t qos, const std::string &shareName,
+                         uint32_t readAclPreauthorization = 0);
     void removeSubscription(std::shared_ptr<Client> &client, const std::string &topic);
     void registerClientAndKickExistingOne(std::shared_ptr<Client> &client);
     void registerClientAndKickExistingOne(std::shared_ptr<Client> &client, bool clean_start, uint16_t clientReceiveMax, uint32_t sessionExpiryInterval);
     std::shared_ptr<Session> lockSession(const std::string &clientid);
 
-    void sendQueuedWillMessages();
+    void sendQueuedWillMessage(QueuedWill &will);
     void queueWillMessage(const std::shared_ptr<WillPublish> &willMessage, const std::shared_ptr<Session> &session, bool forceNow = false);
     void queuePacketAtSubscribers(PublishCopyFactory &copyFactory, bool dollar = false);
     void giveClientRetainedMessages(const std::shared_ptr<Session> &ses,
@@ -157,20 +216,32 @@ public:
     void setRetainedMessage(const Publish &publish, const std::vector<std::string> &subtopics);
 
     void removeSession(const std::shared_ptr<Session> &session);
-    void removeExpiredSessionsClients();
+    void removeExpiredSessions(const std::vector<std::shared_ptr<Session>> &sessions);
+    bool cleanupSubscriptionTree(std::chrono::milliseconds sliceLength, bool continuing);
     void expireRetainedMessages();
 
     int64_t getRetainedMessageCount() const;
     uint64_t getSessionCount() const;
-    int64_t getSubscriptionCount();
+    int64_t getSubscriptionCount() const;
+    int64_t getSharedSubscriptionGroupCount() const;
 
     void saveRetainedMessages(const std::string &filePath);
+    uint64_t startSavingRetainedMessages();
+    size_t writeRetainedMessages(const std::string &filePath);
+    void finishSavingRetainedMessages(const std::string &filePath, uint64_t walGeneration, size_t bytesWritten);
     void loadRetainedMessages(const std::string &filePath);
+    void startRetainedMessagesWal(const std::string &filePath);
+    bool hasRetainedMessagesWal() const;
+    void syncRetainedMessagesWal();
+    bool retainedMessagesWalNeedsCompaction() const;
 
     void saveSessionsAndSubscriptions(const std::string &filePath);
     void loadSessionsAndSubscriptions(const std::string &filePath);
 
+    pid_t forkWithStoreLocked();
+
     void queueSessionRemoval(const std::shared_ptr<Session> &session);
+    void takeHandedOverTimers(TimerWheel<QueuedWill> &wills, TimerWheel<std::weak_ptr<Session>> &sessionRemovals);
 };
 
 #endif // SUBSCRIPTIONSTORE_H
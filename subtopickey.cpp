@@ -0,0 +1,53 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "subtopickey.h"
+
+SubtopicKey::SubtopicKey(std::string_view subtopic) :
+    subtopic(subtopic),
+    hash(hashSubtopic(subtopic))
+{
+
+}
+
+SubtopicKey::SubtopicKey(std::string_view subtopic, size_t hash) :
+    subtopic(subtopic),
+    hash(hash)
+{
+
+}
+
+size_t SubtopicKey::hashSubtopic(std::string_view subtopic)
+{
+    return std::hash<std::string_view>()(subtopic);
+}
+
+/**
+ * @brief hashSubtopics calculates the hashes of all subtopics of a topic, for use in SubtopicKey lookups.
+ * @param subtopics
+ * @param output is cleared first.
+ */
+void hashSubtopics(const std::vector<std::string> &subtopics, std::vector<size_t> &output)
+{
+    output.clear();
+    output.reserve(subtopics.size());
+
+    for (const std::string &subtopic : subtopics)
+    {
+        output.push_back(SubtopicKey::hashSubtopic(subtopic));
+    }
+}
@@ -0,0 +1,66 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SUBTOPICKEY_H
+#define SUBTOPICKEY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+/**
+ * @brief The SubtopicKey class is the key of the children maps in the subscription, retained message and ACL trees.
+ *
+ * It doesn't own the subtopic string. In the map, it points to the subtopic stored in the child node itself. For lookups, it points
+ * to the subtopic of the topic being looked up, with the hash calculated once per topic (see Publish::getSubtopicHashes()), so walking
+ * several trees with the same topic doesn't hash the same strings over and over. Comparing is then mostly an integer compare.
+ */
+class SubtopicKey
+{
+    std::string_view subtopic;
+    size_t hash = 0;
+
+public:
+    SubtopicKey(std::string_view subtopic);
+    SubtopicKey(std::string_view subtopic, size_t hash);
+
+    static size_t hashSubtopic(std::string_view subtopic);
+
+    std::string_view getSubtopic() const { return subtopic; }
+    size_t getHash() const { return hash; }
+
+    bool operator==(const SubtopicKey &other) const
+    {
+        return this->hash == other.hash && this->subtopic == other.subtopic;
+    }
+};
+
+struct SubtopicKeyHash
+{
+    size_t operator()(const SubtopicKey &key) const noexcept
+    {
+        return key.getHash();
+    }
+};
+
+template<typename T>
+using SubtopicMap = std::unordered_map<SubtopicKey, T, SubtopicKeyHash>;
+
+void hashSubtopics(const std::vector<std::string> &subtopics, std::vector<size_t> &output);
+
+#endif // SUBTOPICKEY_H
@@ -24,6 +24,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "subscriptionstore.h"
 #include "mainapp.h"
 #include "utils.h"
+#include "threadglobals.h"
+#include "exceptions.h"
 
 KeepAliveCheck::KeepAliveCheck(const std::shared_ptr<Client> client) :
     client(client)
@@ -40,6 +42,33 @@ AsyncAuth::AsyncAuth(std::weak_ptr<Client> client, AuthResult result, const std:
 
 }
 
+AsyncAclCheck::AsyncAclCheck(const std::weak_ptr<Client> &client, uint64_t checkId, AuthResult result) :
+    client(client),
+    checkId(checkId),
+    result(result)
+{
+
+}
+
+CrossThreadPublish::CrossThreadPublish(const Publish &publish) :
+    publish(publish)
+{
+    // Writing a publish changes the client specific properties in the builder, so each receiving thread needs its own.
+    if (this->publish.propertyBuilder)
+        this->publish.propertyBuilder = std::make_shared<Mqtt5PropertyBuilder>(*this->publish.propertyBuilder);
+}
+
+CrossThreadPublishWrittenGuard::CrossThreadPublishWrittenGuard(const std::shared_ptr<Session> &session) :
+    session(session)
+{
+
+}
+
+CrossThreadPublishWrittenGuard::~CrossThreadPublishWrittenGuard()
+{
+    session->crossThreadPublishWritten();
+}
+
 ThreadData::ThreadData(int threadnr, const Settings &settings, const PluginLoader &pluginLoader) :
     pluginLoader(pluginLoader),
     settingsLocalCopy(settings),
@@ -111,36 +140,40 @@ void ThreadData::queuePublishStatsOnDollarTopic(std::vector<std::shared_ptr<Thre
     wakeUpThread();
 }
 
-void ThreadData::queueSendingQueuedWills()
+void ThreadData::queueCleanupSubscriptionTree()
 {
     std::lock_guard<std::mutex> locker(taskQueueMutex);
 
-    auto f = std::bind(&ThreadData::sendQueuedWills, this);
+    auto f = std::bind(&ThreadData::cleanupSubscriptionTree, this, false);
     taskQueue.push_back(f);
 
     wakeUpThread();
 }
 
-void ThreadData::queueRemoveExpiredSessions()
+void ThreadData::queueRemoveExpiredRetainedMessages()
 {
     std::lock_guard<std::mutex> locker(taskQueueMutex);
 
-    auto f = std::bind(&ThreadData::removeExpiredSessions, this);
+    auto f = std::bind(&ThreadData::removeExpiredRetainedMessages, this);
     taskQueue.push_back(f);
 
     wakeUpThread();
 }
 
-void ThreadData::queueRemoveExpiredRetainedMessages()
+void ThreadData::queuePause(const std::shared_ptr<ThreadsPause> &pause)
 {
     std::lock_guard<std::mutex> locker(taskQueueMutex);
 
-    auto f = std::bind(&ThreadData::removeExpiredRetainedMessages, this);
+    auto f = std::bind(&ThreadsPause::pause, pause);
     taskQueue.push_back(f);
 
     wakeUpThread();
 }
 
+/**
+ * @brief ThreadData::queueClientNextKeepAliveCheck can be called from any thread. Other threads than this one hand the check over, which
+ * doesn't need a lock.
+ */
 void ThreadData::queueClientNextKeepAliveCheck(std::shared_ptr<Client> &client, bool keepRechecking)
 {
     const std::chrono::seconds k = client->getSecondsTillKillTime();
@@ -148,17 +181,15 @@ void ThreadData::queueClientNextKeepAliveCheck(std::shared_ptr<Client> &client,
     if (k == std::chrono::seconds(0))
         return;
 
-    const std::chrono::seconds when = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch() + k);
+    const uint64_t when = TimerWheelBase::now() + std::chrono::duration_cast<std::chrono::milliseconds>(k).count();
 
     KeepAliveCheck check(client);
     check.recheck = keepRechecking;
-    queuedKeepAliveChecks[when].push_back(check);
-}
 
-void ThreadData::queueClientNextKeepAliveCheckLocked(std::shared_ptr<Client> &client, bool keepRechecking)
-{
-    std::lock_guard<std::mutex> locker(this->queuedKeepAliveMutex);
-    queueClientNextKeepAliveCheck(client, keepRechecking);
+    if (ThreadGlobals::getThreadData() == this)
+        queuedKeepAliveChecks.add(when, std::move(check));
+    else
+        keepAliveChecksHandoff.push(when, std::move(check));
 }
 
 /**
@@ -243,6 +274,48 @@ void ThreadData::continueAsyncAuths()
     }
 }
 
+/**
+ * @brief ThreadData::continueAsyncAclChecks gives the clients the results of their asynchronous ACL checks, which handles the packets
+ * that waited for them.
+ */
+void ThreadData::continueAsyncAclChecks()
+{
+    assert(pthread_self() == thread.native_handle());
+
+    std::vector<AsyncAclCheck> checks;
+
+    {
+        std::lock_guard<std::mutex> locker(asyncAclChecksReadyMutex);
+        checks = std::move(this->asyncAclChecksReady);
+        asyncAclChecksReady.clear();
+    }
+
+    for (AsyncAclCheck &check : checks)
+    {
+        std::shared_ptr<Client> c = check.client.lock();
+
+        if (!c)
+            continue;
+
+        try
+        {
+            c->continueAfterAsyncAclCheck(check.checkId, check.result);
+        }
+        catch (ProtocolError &ex)
+        {
+            c->setDisconnectReason(ex.what());
+            logger->logf(LOG_ERR, "Protocol error: %s. Removing client.", ex.what());
+            removeClient(c);
+        }
+        catch (std::exception &ex)
+        {
+            c->setDisconnectReason(ex.what());
+            logger->logf(LOG_ERR, "Packet read/write error: %s. Removing client.", ex.what());
+            removeClient(c);
+        }
+    }
+}
+
 void ThreadData::clientDisconnectEvent(const std::string &clientid)
 {
     authentication.clientDisconnected(clientid);
@@ -268,6 +341,26 @@ void ThreadData::queueContinuationOfAuthentication(const std::shared_ptr<Client>
     }
 }
 
+void ThreadData::queueContinuationOfAclCheck(const std::shared_ptr<Client> &client, uint64_t checkId, AuthResult result)
+{
+    bool wakeUpNeeded = true;
+
+    {
+        std::lock_guard<std::mutex> locker(asyncAclChecksReadyMutex);
+        wakeUpNeeded = asyncAclChecksReady.empty();
+        asyncAclChecksReady.emplace_back(client, checkId, result);
+    }
+
+    if (wakeUpNeeded)
+    {
+        auto f = std::bind(&ThreadData::continueAsyncAclChecks, this);
+        std::lock_guard<std::mutex> lockertaskQueue(taskQueueMutex);
+        taskQueue.push_back(f);
+
+        wakeUpThread();
+    }
+}
+
 void ThreadData::queueClientDisconnectEvent(const std::string &clientid)
 {
     auto f = std::bind(&ThreadData::clientDisconnectEvent, this, clientid);
@@ -277,6 +370,254 @@ void ThreadData::queueClientDisconnectEvent(const std::string &clientid)
     wakeUpThread();
 }
 
+/**
+ * @brief ThreadData::writeCrossThreadPublishes writes the publishes other threads have given us to our own clients.
+ *
+ * Like continueAsyncAuths(), it takes the whole pending list at once, so publishes queued between the wake-up and this point
+ * are handled in the same go.
+ */
+void ThreadData::writeCrossThreadPublishes()
+{
+    assert(pthread_self() == thread.native_handle());
+
+    std::vector<CrossThreadPublish> publishes;
+
+    {
+        std::lock_guard<std::mutex> locker(crossThreadPublishesMutex);
+        publishes.swap(this->crossThreadPublishes);
+    }
+
+    for(CrossThreadPublish &p : publishes)
+    {
+        PublishCopyFactory factory(&p.publish);
+
+        for(auto &receiver : p.receivers)
+        {
+            CrossThreadPublishWrittenGuard writtenGuard(receiver.session);
+
+            try
+            {
+                receiver.session->writePacket(factory, receiver.qos, receiver.readAclPreauthorization);
+            }
+            catch (std::exception &ex)
+            {
+                logger->logf(LOG_ERR, "Error writing publish from other thread: %s", ex.what());
+            }
+        }
+    }
+}
+
+/**
+ * @brief ThreadData::queueCrossThreadPublish takes a publish for sessions of which this thread does the writing, to be written by this thread.
+ * @param publish
+ */
+void ThreadData::queueCrossThreadPublish(CrossThreadPublish &&publish)
+{
+    bool wakeUpNeeded = true;
+
+    {
+        std::lock_guard<std::mutex> locker(crossThreadPublishesMutex);
+        wakeUpNeeded = crossThreadPublishes.empty();
+        crossThreadPublishes.push_back(std::move(publish));
+    }
+
+    if (wakeUpNeeded)
+    {
+        auto f = std::bind(&ThreadData::writeCrossThreadPublishes, this);
+        std::lock_guard<std::mutex> lockertaskQueue(taskQueueMutex);
+        taskQueue.push_back(f);
+
+        wakeUpThread();
+    }
+}
+
+/**
+ * @brief ThreadData::queueClientFlush remembers a client of this thread with data in its write buffer, to be written at the end of the event loop iteration.
+ * @param fd
+ *
+ * Only for same-thread calling. See 'batched_write_flushing'.
+ */
+void ThreadData::queueClientFlush(int fd)
+{
+    clientsQueuedForFlushing.push_back(fd);
+}
+
+/**
+ * @brief ThreadData::flushQueuedClientWrites writes the buffers of the clients queued with queueClientFlush(). Clients whose socket doesn't
+ * take all data get marked for EPOLLOUT, like normal.
+ *
+ * The lists are swapped, so clients that are queued while flushing, will be done in the next iteration.
+ *
+ * Clients to remove are only removed at the end, when no batched write holds a write buffer lock anymore. Removing can destroy a
+ * client, and its will can be written to our own clients, which would lock the write buffer of one we still hold.
+ */
+void ThreadData::flushQueuedClientWrites()
+{
+    if (clientsQueuedForFlushing.empty())
+        return;
+
+    clientsBeingFlushed.swap(clientsQueuedForFlushing);
+    flushRound++;
+
+    std::vector<std::shared_ptr<Client>> clientsToRemove;
+
+#ifdef FLASHMQ_IO_URING
+    IoUring *ring = getIoUring();
+#endif
+
+    for (int fd : clientsBeingFlushed)
+    {
+        // The client may have been removed since, in which case we skip it. If the fd has been reused, flushing the new client is harmless.
+        std::shared_ptr<Client> client = getClient(fd);
+
+        if (!client || !client->startFlushRound(flushRound))
+            continue;
+
+#ifdef FLASHMQ_IO_URING
+        if (ring)
+        {
+            if (batchedWritesCount == batchedWrites.size())
+                submitBatchedWrites(clientsToRemove);
+
+            BatchedWrite &w = batchedWrites[batchedWritesCount];
+
+            if (client->prepareBatchedWrite(w))
+            {
+                w.client = std::move(client);
+                ring->prepareSendMsg(fd, &w.msg, MSG_DONTWAIT | MSG_NOSIGNAL, batchedWritesCount);
+                batchedWritesCount++;
+                continue;
+            }
+        }
+#endif
+
+        try
+        {
+            if (!client->writeBufIntoFd() || client->readyForDisconnecting())
+                clientsToRemove.push_back(std::move(client));
+        }
+        catch(std::exception &ex)
+        {
+            client->setDisconnectReason(ex.what());
+            logger->logf(LOG_ERR, "Packet write error: %s. Removing client.", ex.what());
+            clientsToRemove.push_back(std::move(client));
+        }
+    }
+
+#ifdef FLASHMQ_IO_URING
+    submitBatchedWrites(clientsToRemove);
+#endif
+
+    clientsBeingFlushed.clear();
+
+    for (std::shared_ptr<Client> &client : clientsToRemove)
+    {
+        removeClient(client);
+    }
+}
+
+#ifdef FLASHMQ_IO_URING
+/**
+ * @brief ThreadData::getIoUring makes the io_uring on first use, so threads don't have one when the setting is off.
+ * @return nullptr when 'io_uring_batched_sends' is off, or the kernel doesn't let us have an io_uring.
+ */
+IoUring *ThreadData::getIoUring()
+{
+    if (!settingsLocalCopy.ioUringBatchedSends || ioUringUnavailable)
+        return nullptr;
+
+    if (!ioUring)
+    {
+        try
+        {
+            ioUring = std::make_unique<IoUring>(128);
+            batchedWrites.resize(ioUring->getEntries());
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Can't use io_uring in thread %d, falling back to normal writes: %s", threadnr, ex.what());
+            ioUringUnavailable = true;
+            ioUring.reset();
+            return nullptr;
+        }
+    }
+
+    return ioUring.get();
+}
+
+/**
+ * @brief ThreadData::submitBatchedWrites sends the writes prepared in flushQueuedClientWrites() with one system call, and processes the results.
+ * @param clientsToRemove gets the clients to remove after all write buffer locks have been released.
+ */
+void ThreadData::submitBatchedWrites(std::vector<std::shared_ptr<Client>> &clientsToRemove)
+{
+    if (batchedWritesCount == 0)
+        return;
+
+    try
+    {
+        ioUring->submitAndWaitAll();
+    }
+    catch (std::exception &ex)
+    {
+        // The ring is left alone, because the kernel may still have work in it.
+        logger->logf(LOG_ERR, "Error submitting batched writes, falling back to normal writes: %s", ex.what());
+        ioUringUnavailable = true;
+    }
+
+    uint64_t i = 0;
+    int result = 0;
+    while (ioUring->popCompletion(i, result))
+    {
+        BatchedWrite &w = batchedWrites.at(i);
+        std::shared_ptr<Client> client = std::move(w.client);
+        ioUringSendCounter.inc();
+
+        try
+        {
+            client->finishBatchedWrite(w, result);
+
+            if (client->readyForDisconnecting())
+                clientsToRemove.push_back(std::move(client));
+        }
+        catch(std::exception &ex)
+        {
+            client->setDisconnectReason(ex.what());
+            logger->logf(LOG_ERR, "Packet write error: %s. Removing client.", ex.what());
+            clientsToRemove.push_back(std::move(client));
+        }
+    }
+
+    // Only when submitting failed. We don't know how much of these was sent, so they can't continue.
+    for (size_t j = 0; j < batchedWritesCount; j++)
+    {
+        BatchedWrite &w = batchedWrites[j];
+
+        if (!w.client)
+            continue;
+
+        w.lock.unlock();
+        w.client->setDisconnectReason("batched write failed");
+        clientsToRemove.push_back(std::move(w.client));
+    }
+
+    batchedWritesCount = 0;
+}
+#endif
+
+/**
+ * @brief ThreadData::countEpollCtl counts an epoll_ctl call at the calling thread, which is not necessarily the thread of the fd.
+ *
+ * The counters aren't thread-safe, so we can't count at the thread of the fd.
+ */
+void ThreadData::countEpollCtl()
+{
+    ThreadData *td = ThreadGlobals::getThreadData();
+
+    if (td)
+        td->epollCtlCounter.inc();
+}
+
 void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads)
 {
     uint nrOfClients = 0;
@@ -288,6 +629,24 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
     uint64_t mqttConnectCountPerSecond = 0;
     uint64_t mqttConnectCount = 0;
 
+    uint64_t epollCtlCountPerSecond = 0;
+    uint64_t epollCtlCount = 0;
+
+    uint64_t sharedPayloadCountPerSecond = 0;
+    uint64_t sharedPayloadCount = 0;
+    uint64_t ioUringSendCountPerSecond = 0;
+    uint64_t ioUringSendCount = 0;
+
+    uint64_t aclCacheHitsPerSecond = 0;
+    uint64_t aclCacheHits = 0;
+    uint64_t aclCacheMissesPerSecond = 0;
+    uint64_t aclCacheMisses = 0;
+
+    GlobalStats *globalStats = GlobalStats::getInstance();
+
+    uint64_t socketConnectCountPerSecond = globalStats->socketConnects.getPerSecond();
+    uint64_t socketConnectCount = globalStats->socketConnects.get();
+
     for (const std::shared_ptr<ThreadData> &thread : threads)
     {
         nrOfClients += thread->getNrOfClients();
@@ -300,12 +659,28 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
 
         mqttConnectCountPerSecond += thread->mqttConnectCounter.getPerSecond();
         mqttConnectCount += thread->mqttConnectCounter.get();
-    }
 
-    GlobalStats *globalStats = GlobalStats::getInstance();
+        epollCtlCountPerSecond += thread->epollCtlCounter.getPerSecond();
+        epollCtlCount += thread->epollCtlCounter.get();
 
-    publishStat("$SYS/broker/network/socketconnects/total", globalStats->socketConnects.get());
-    publishStat("$SYS/broker/network/socketconnects/persecond", globalStats->socketConnects.getPerSecond());
+        socketConnectCountPerSecond += thread->socketConnectCounter.getPerSecond();
+        socketConnectCount += thread->socketConnectCounter.get();
+
+        sharedPayloadCountPerSecond += thread->sharedPayloadCounter.getPerSecond();
+        sharedPayloadCount += thread->sharedPayloadCounter.get();
+
+        ioUringSendCountPerSecond += thread->ioUringSendCounter.getPerSecond();
+        ioUringSendCount += thread->ioUringSendCounter.get();
+
+        AclCache &aclCache = thread->authentication.getAclCache();
+        aclCacheHitsPerSecond += aclCache.hits.getPerSecond();
+        aclCacheHits += aclCache.hits.get();
+        aclCacheMissesPerSecond += aclCache.misses.getPerSecond();
+        aclCacheMisses += aclCache.misses.get();
+    }
+
+    publishStat("$SYS/broker/network/socketconnects/total", socketConnectCount);
+    publishStat("$SYS/broker/network/socketconnects/persecond", socketConnectCountPerSecond);
 
     publishStat("$SYS/broker/clients/mqttconnects/total", mqttConnectCount);
     publishStat("$SYS/broker/clients/mqttconnects/persecond", mqttConnectCountPerSecond);
@@ -318,13 +693,65 @@ void ThreadData::publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadDat
     publishStat("$SYS/broker/load/messages/sent/total", sentMessageCount);
     publishStat("$SYS/broker/load/messages/sent/persecond", sentMessageCountPerSecond);
 
+    publishStat("$SYS/broker/load/epoll_ctl/total", epollCtlCount);
+    publishStat("$SYS/broker/load/epoll_ctl/persecond", epollCtlCountPerSecond);
+
+    if (settingsLocalCopy.sharedPayloadMinBytes > 0)
+    {
+        publishStat("$SYS/broker/load/messages/shared_payloads/total", sharedPayloadCount);
+        publishStat("$SYS/broker/load/messages/shared_payloads/persecond", sharedPayloadCountPerSecond);
+    }
+
+    if (settingsLocalCopy.ioUringBatchedSends)
+    {
+        publishStat("$SYS/broker/load/io_uring_sends/total", ioUringSendCount);
+        publishStat("$SYS/broker/load/io_uring_sends/persecond", ioUringSendCountPerSecond);
+    }
+
+    if (settingsLocalCopy.aclCacheSize > 0)
+    {
+        publishStat("$SYS/broker/acl_cache/hits/total", aclCacheHits);
+        publishStat("$SYS/broker/acl_cache/hits/persecond", aclCacheHitsPerSecond);
+        publishStat("$SYS/broker/acl_cache/misses/total", aclCacheMisses);
+        publishStat("$SYS/broker/acl_cache/misses/persecond", aclCacheMissesPerSecond);
+
+        const uint64_t lookups = aclCacheHits + aclCacheMisses;
+        publishStat("$SYS/broker/acl_cache/hit_percentage", lookups > 0 ? aclCacheHits * 100 / lookups : 0);
+    }
+
     std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
 
     publishStat("$SYS/broker/retained messages/count", subscriptionStore->getRetainedMessageCount());
 
+    if (subscriptionStore->hasRetainedMessagesWal())
+    {
+        publishStat("$SYS/broker/retained messages/wal/bytes_written", globalStats->retainedMessagesWalBytesWritten.get());
+        publishStat("$SYS/broker/retained messages/wal/syncs", globalStats->retainedMessagesWalSyncs.get());
+        publishStat("$SYS/broker/retained messages/db/bytes_written", globalStats->retainedMessagesDbBytesWritten.get());
+    }
+
     publishStat("$SYS/broker/sessions/total", subscriptionStore->getSessionCount());
 
     publishStat("$SYS/broker/subscriptions/count", subscriptionStore->getSubscriptionCount());
+    publishStat("$SYS/broker/subscriptions/shared_groups", subscriptionStore->getSharedSubscriptionGroupCount());
+
+    publishHistogram("$SYS/broker/sessions/expiry_lock_hold", globalStats->sessionExpiryLockHold);
+    publishHistogram("$SYS/broker/subscriptions/cleanup_lock_hold", globalStats->subscriptionTreeCleanupLockHold);
+    publishStat("$SYS/broker/subscriptions/nodes_reclaimed", globalStats->subscriptionNodesReclaimed.get());
+
+    if (settingsLocalCopy.saveStateInChildProcess)
+    {
+        publishHistogram("$SYS/broker/save_state/fork_pause", globalStats->saveStateForkPause);
+        publishStat("$SYS/broker/save_state/copied_on_write_pages", globalStats->saveStateCopiedOnWritePages.load());
+    }
+}
+
+void ThreadData::publishHistogram(const std::string &topicPrefix, const DurationHistogram &histogram)
+{
+    publishStat(topicPrefix + "/count", histogram.getCount());
+    publishStat(topicPrefix + "/p50_us", histogram.getPercentileMicroseconds(50));
+    publishStat(topicPrefix + "/p99_us", histogram.getPercentileMicroseconds(99));
+    publishStat(topicPrefix + "/max_us", histogram.getMaxMicroseconds());
 }
 
 void ThreadData::publishStat(const std::string &topic, uint64_t n)
@@ -338,23 +765,94 @@ void ThreadData::publishStat(const std::string &topic, uint64_t n)
 }
 
 /**
- * @brief ThreadData::sendQueuedWills is not an operation per thread, but it's good practice to perform certain tasks in the worker threads, where
- * the thread-local globals work.
+ * @brief ThreadData::sendQueuedWills sends the delayed wills that are due, until the deadline.
+ * @return whether all due wills were sent.
+ */
+bool ThreadData::sendQueuedWills(uint64_t now, std::chrono::time_point<std::chrono::steady_clock> deadline)
+{
+    if (queuedWills.empty())
+        return true;
+
+    std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
+
+    return queuedWills.advance(now, [&](QueuedWill &will) {
+        try
+        {
+            subscriptionStore->sendQueuedWillMessage(will);
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error sending delayed will: %s", ex.what());
+        }
+    }, deadline);
+}
+
+/**
+ * @brief ThreadData::removeExpiredSessions removes the sessions whose expiry is due, until the deadline, in batches per write lock.
+ * @return whether all due sessions were removed.
  */
-void ThreadData::sendQueuedWills()
+bool ThreadData::removeExpiredSessions(uint64_t now, std::chrono::time_point<std::chrono::steady_clock> deadline)
 {
+    if (queuedSessionRemovals.empty())
+        return true;
+
+    const size_t batchSize = 1000;
+
     std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
-    subscriptionStore->sendQueuedWillMessages();
+    std::vector<std::shared_ptr<Session>> sessionsToRemove;
+    size_t removed = 0;
+
+    auto removeBatch = [&]() {
+        try
+        {
+            subscriptionStore->removeExpiredSessions(sessionsToRemove);
+            removed += sessionsToRemove.size();
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Error removing expired sessions: %s", ex.what());
+        }
+
+        // Destroys them, outside of the lock.
+        sessionsToRemove.clear();
+    };
+
+    const bool done = queuedSessionRemovals.advance(now, [&](std::weak_ptr<Session> &ses) {
+        std::shared_ptr<Session> lockedSession = ses.lock();
+
+        // A session could have been picked up again, so we have to verify its expiration status.
+        if (lockedSession && !lockedSession->hasActiveClient())
+        {
+            sessionsToRemove.push_back(lockedSession);
+
+            if (sessionsToRemove.size() >= batchSize)
+                removeBatch();
+        }
+    }, deadline);
+
+    if (!sessionsToRemove.empty())
+        removeBatch();
+
+    if (removed > 0)
+        logger->logf(LOG_DEBUG, "Removed %d expired sessions in thread %d.", static_cast<int>(removed), threadnr);
+
+    return done;
 }
 
 /**
- * @brief ThreadData::removeExpiredSessions is not an operation per thread, but it's good practice to perform certain tasks in the worker threads, where
+ * @brief ThreadData::cleanupSubscriptionTree is not an operation per thread, but it's good practice to perform certain tasks in the worker threads, where
  * the thread-local globals work.
  */
-void ThreadData::removeExpiredSessions()
+void ThreadData::cleanupSubscriptionTree(bool continuing)
 {
     std::shared_ptr<SubscriptionStore> subscriptionStore = MainApp::getMainApp()->getSubscriptionStore();
-    subscriptionStore->removeExpiredSessionsClients();
+    const std::chrono::milliseconds sliceLength(settingsLocalCopy.subscriptionTreeCleanupSliceMs);
+
+    if (subscriptionStore->cleanupSubscriptionTree(sliceLength, continuing))
+    {
+        auto f = std::bind(&ThreadData::cleanupSubscriptionTree, this, true);
+        addTask(f, settingsLocalCopy.subscriptionTreeCleanupSliceMs);
+    }
 }
 
 /**
@@ -429,9 +927,104 @@ void ThreadData::removeQueuedClients()
             int fd = client->getFd();
             clients_by_fd.erase(fd);
         }
+
+        clientCount.store(clients_by_fd.size(), std::memory_order_relaxed);
     }
 }
 
+/**
+ * @brief ThreadData::addListenSocket gives the thread its own listen socket, for 'listen_sockets_per_thread'. Do this before start().
+ * @param socket must be in the epoll set of this thread.
+ * @param listener
+ */
+void ThreadData::addListenSocket(ScopedSocket &&socket, const std::shared_ptr<Listener> &listener)
+{
+    listenersByFd[socket.socket] = listener;
+    listenSockets.push_back(std::move(socket));
+}
+
+/**
+ * @brief ThreadData::acceptClient accepts a connection and gives the client to this thread. It can be called by other threads.
+ * @param listenFd is a non-blocking listen socket.
+ * @param listener
+ * @param settings
+ * @return false when there was no connection to accept, or it couldn't be set up.
+ */
+bool ThreadData::acceptClient(int listenFd, const std::shared_ptr<Listener> &listener, const Settings &settings)
+{
+    struct sockaddr_in6 addrBiggest;
+    struct sockaddr *addr = reinterpret_cast<sockaddr*>(&addrBiggest);
+    socklen_t len = sizeof(struct sockaddr_in6);
+    memset(addr, 0, len);
+    int fd = accept(listenFd, addr, &len);
+
+    if (fd < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+
+        check<std::runtime_error>(fd);
+    }
+
+    logger->logf(LOG_DEBUG, "Accepting connection on thread %d on %s", threadnr, listener->getProtocolName().c_str());
+
+    SSL *clientSSL = nullptr;
+    if (listener->isSsl())
+    {
+        clientSSL = SSL_new(listener->sslctx->get());
+
+        if (clientSSL == NULL)
+        {
+            logger->logf(LOG_ERR, "Problem creating SSL object. Closing client.");
+            close(fd);
+            return false;
+        }
+
+        SSL_set_fd(clientSSL, fd);
+    }
+
+    std::shared_ptr<Client> client = std::make_shared<Client>(fd, shared_from_this(), clientSSL, listener->websocket, listener->isHaProxy(), addr, settings);
+
+    giveClient(client);
+
+    return true;
+}
+
+/**
+ * @brief ThreadData::acceptClientsIfListenSocket accepts pending connections when the fd is one of our own listen sockets.
+ * @param fd
+ * @return whether fd is a listen socket.
+ *
+ * A limited amount is accepted at once, so clients aren't kept waiting during connection storms. The socket stays readable for the rest.
+ */
+bool ThreadData::acceptClientsIfListenSocket(int fd)
+{
+    auto pos = listenersByFd.find(fd);
+
+    if (pos == listenersByFd.end())
+        return false;
+
+    const std::shared_ptr<Listener> &listener = pos->second;
+
+    for (int i = 0; i < 64; i++)
+    {
+        try
+        {
+            if (!acceptClient(fd, listener, settingsLocalCopy))
+                break;
+
+            socketConnectCounter.inc();
+        }
+        catch (std::exception &ex)
+        {
+            logger->logf(LOG_ERR, "Problem accepting connection in thread %d: %s", threadnr, ex.what());
+            break;
+        }
+    }
+
+    return true;
+}
+
 void ThreadData::giveClient(std::shared_ptr<Client> client)
 {
     const int fd = client->getFd();
@@ -439,15 +1032,17 @@ void ThreadData::giveClient(std::shared_ptr<Client> client)
     {
         std::lock_guard<std::mutex> locker(clients_by_fd_mutex);
         clients_by_fd[fd] = client;
+        clientCount.store(clients_by_fd.size(), std::memory_order_relaxed);
     }
 
-    queueClientNextKeepAliveCheckLocked(client, false);
+    queueClientNextKeepAliveCheck(client, false);
 
     struct epoll_event ev;
     memset(&ev, 0, sizeof (struct epoll_event));
     ev.data.fd = fd;
     ev.events = EPOLLIN;
     check<std::runtime_error>(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev));
+    countEpollCtl();
 }
 
 std::shared_ptr<Client> ThreadData::getClient(int fd)
@@ -524,16 +1119,7 @@ void ThreadData::removeClient(std::shared_ptr<Client> client)
 
     std::lock_guard<std::mutex> lck(clients_by_fd_mutex);
     clients_by_fd.erase(client->getFd());
-}
-
-void ThreadData::queueDoKeepAliveCheck()
-{
-    std::lock_guard<std::mutex> locker(taskQueueMutex);
-
-    auto f = std::bind(&ThreadData::doKeepAliveCheck, this);
-    taskQueue.push_back(f);
-
-    wakeUpThread();
+    clientCount.store(clients_by_fd.size(), std::memory_order_relaxed);
 }
 
 void ThreadData::queueQuit()
@@ -566,9 +1152,41 @@ void ThreadData::queuePasswdFileReload()
     wakeUpThread();
 }
 
+/**
+ * @brief ThreadData::getNrOfClients can be called from any thread.
+ * @return
+ */
 int ThreadData::getNrOfClients() const
 {
-    return clients_by_fd.size();
+    return clientCount.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief ThreadData::accountLoopBusyTime is called by the thread loop, with the time it spent doing work instead of waiting for events.
+ * @param busyStart
+ * @param busyEnd
+ */
+void ThreadData::accountLoopBusyTime(std::chrono::time_point<std::chrono::steady_clock> busyStart, std::chrono::time_point<std::chrono::steady_clock> busyEnd)
+{
+    loopBusyTime += busyEnd - busyStart;
+
+    const std::chrono::nanoseconds period = busyEnd - loopPeriodStart;
+
+    if (period < std::chrono::seconds(1))
+        return;
+
+    loopBusyPermille = std::min<uint64_t>(loopBusyTime.count() * 1000 / period.count(), 1000);
+    loopBusyTime = std::chrono::nanoseconds(0);
+    loopPeriodStart = busyEnd;
+}
+
+/**
+ * @brief ThreadData::getLoopBusyPermille can be called from other threads.
+ * @return The part of the last second or so the event loop was working, in 1/1000.
+ */
+uint32_t ThreadData::getLoopBusyPermille() const
+{
+    return loopBusyPermille.load(std::memory_order_relaxed);
 }
 
 void ThreadData::queuepluginPeriodicEvent()
@@ -623,11 +1241,13 @@ void ThreadData::pollExternalFd(int fd, uint32_t events, const std::weak_ptr<voi
     ev.data.fd = fd;
     ev.events = events;
     check<std::runtime_error>(epoll_ctl(this->epollfd, mode, fd, &ev));
+    countEpollCtl();
 }
 
 void ThreadData::pollExternalRemove(int fd)
 {
     this->externalFds.erase(fd);
+    countEpollCtl();
     if (epoll_ctl(this->epollfd, EPOLL_CTL_DEL, fd, NULL) != 0)
     {
         Logger *logger = Logger::getInstance();
@@ -645,69 +1265,34 @@ void ThreadData::removeTask(uint32_t id)
     delayedTasks.eraseTask(id);
 }
 
-void ThreadData::doKeepAliveCheck()
+void ThreadData::doKeepAliveCheck(uint64_t now)
 {
-    logger->logf(LOG_DEBUG, "doKeepAliveCheck in thread %d", threadnr);
-
-    const std::chrono::seconds now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch());
-
     try
     {
-        // Put clients to delete in here, to avoid holding two locks.
+        // Put clients to delete in here, to avoid holding the lock during the callbacks.
         std::vector<std::shared_ptr<Client>> clientsToRemove;
 
-        std::vector<std::shared_ptr<Client>> clientsToRecheck;
+        queuedKeepAliveChecks.advance(now, [&](KeepAliveCheck &k) {
+            std::shared_ptr<Client> client = k.client.lock();
 
-        const int slotsTotal = this->queuedKeepAliveChecks.size();
-        int slotsProcessed = 0;
-        int clientsChecked = 0;
+            if (!client)
+                return;
 
-        {
-            logger->logf(LOG_DEBUG, "Checking clients with pending keep-alive checks in thread %d", threadnr);
-
-            std::lock_guard<std::mutex> locker(this->queuedKeepAliveMutex);
-
-            auto pos = this->queuedKeepAliveChecks.begin();
-            while (pos != this->queuedKeepAliveChecks.end())
+            if (client->keepAliveExpired())
             {
-                const std::chrono::seconds &doCheckAt = pos->first;
-
-                if (doCheckAt > now)
-                    break;
-
-                slotsProcessed++;
-
-                std::vector<KeepAliveCheck> &checks = pos->second;
-
-                for (KeepAliveCheck &k : checks)
-                {
-                    std::shared_ptr<Client> client = k.client.lock();
-                    if (client)
-                    {
-                        clientsChecked++;
-
-                        if (client->keepAliveExpired())
-                        {
-                            clientsToRemove.push_back(client);
-                        }
-                        else if (k.recheck)
-                        {
-                            clientsToRecheck.push_back(client);
-                        }
-                    }
-                }
-
-                pos = this->queuedKeepAliveChecks.erase(pos);
+                clientsToRemove.push_back(client);
             }
-
-            for (std::shared_ptr<Client> &c : clientsToRecheck)
+            else if (k.recheck)
             {
-                c->resetBuffersIfEligible();
-                queueClientNextKeepAliveCheck(c, true);
+                client->resetBuffersIfEligible();
+                queueClientNextKeepAliveCheck(client, true);
             }
-        }
+        });
 
-        logger->logf(LOG_DEBUG, "Checked %d clients in %d of %d keep-alive slots in thread %d", clientsChecked, slotsProcessed, slotsTotal, threadnr);
+        if (clientsToRemove.empty())
+            return;
+
+        logger->logf(LOG_DEBUG, "Removing %d clients with expired keep-alive in thread %d", static_cast<int>(clientsToRemove.size()), threadnr);
 
         {
             std::unique_lock<std::mutex> lock(clients_by_fd_mutex);
@@ -717,6 +1302,8 @@ void ThreadData::doKeepAliveCheck()
                 c->setDisconnectReason("Keep-alive expired: " + c->getKeepAliveInfoString());
                 clients_by_fd.erase(c->getFd());
             }
+
+            clientCount.store(clients_by_fd.size(), std::memory_order_relaxed);
         }
     }
     catch (std::exception &ex)
@@ -725,6 +1312,47 @@ void ThreadData::doKeepAliveCheck()
     }
 }
 
+/**
+ * @brief ThreadData::processTimers does what's due in the timer wheels of this thread: delayed tasks, keep-alive checks, delayed wills and
+ * session removals. It's called every iteration of the thread loop, and the wheels are only advanced when a tick has passed, or when
+ * there is unfinished work from the last time.
+ */
+void ThreadData::processTimers()
+{
+    delayedTasks.performAll();
+
+    const uint64_t now = TimerWheelBase::now();
+
+    if (now == lastTimerTick && !timersUnfinished)
+        return;
+
+    lastTimerTick = now;
+
+    keepAliveChecksHandoff.moveInto(queuedKeepAliveChecks);
+    MainApp::getMainApp()->getSubscriptionStore()->takeHandedOverTimers(queuedWills, queuedSessionRemovals);
+
+    doKeepAliveCheck(now);
+
+    // A mass expiry is spread over loop iterations, so the clients of this thread are still served. See 'expire_sessions_time_budget_ms'.
+    const std::chrono::time_point<std::chrono::steady_clock> deadline = std::chrono::steady_clock::now() +
+                                                                         std::chrono::milliseconds(settingsLocalCopy.expireSessionsTimeBudgetMs);
+
+    timersUnfinished = !sendQueuedWills(now, deadline);
+    timersUnfinished = !removeExpiredSessions(now, deadline) || timersUnfinished;
+}
+
+/**
+ * @brief ThreadData::getTimeTillNextTimer is for the epoll timeout.
+ * @return 0 when processTimers() ran out of time and needs to continue.
+ */
+uint32_t ThreadData::getTimeTillNextTimer() const
+{
+    if (timersUnfinished)
+        return 0;
+
+    return delayedTasks.getTimeTillNext();
+}
+
 void ThreadData::initplugin()
 {
     authentication.loadMosquittoPasswordFile();
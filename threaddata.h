@@ -29,6 +29,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <functional>
 #include <chrono>
 #include <forward_list>
+#include <atomic>
 
 #include "client.h"
 #include "plugin.h"
@@ -36,6 +37,12 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "derivablecounter.h"
 #include "queuedtasks.h"
 #include "settings.h"
+#include "iouring.h"
+#include "scopedsocket.h"
+#include "subscriptionstore.h"
+#include "timerwheel.h"
+#include "durationhistogram.h"
+#include "threadspause.h"
 
 typedef void (*thread_f)(ThreadData *);
 
@@ -44,6 +51,7 @@ struct KeepAliveCheck
     std::weak_ptr<Client> client;
     bool recheck = true;
 
+    KeepAliveCheck() = default;
     KeepAliveCheck(const std::shared_ptr<Client> client);
 };
 
@@ -58,10 +66,54 @@ public:
     AsyncAuth(std::weak_ptr<Client> client, AuthResult result, const std::string authMethod, const std::string &authData);
 };
 
-class ThreadData
+/**
+ * @brief The AsyncAclCheck struct is the result of an ACL check the plugin did asynchronously. See flashmq_continue_async_acl_check().
+ */
+struct AsyncAclCheck
 {
+    std::weak_ptr<Client> client;
+    uint64_t checkId = 0;
+    AuthResult result;
+
+public:
+    AsyncAclCheck(const std::weak_ptr<Client> &client, uint64_t checkId, AuthResult result);
+};
+
+/**
+ * @brief The CrossThreadPublish struct holds a publish and its receivers that live in one specific thread. See 'cross_thread_publish_batching'.
+ */
+struct CrossThreadPublish
+{
+    Publish publish;
+    std::vector<ReceivingSubscriber> receivers;
+
+public:
+    CrossThreadPublish(const Publish &publish);
+};
+
+/**
+ * @brief The CrossThreadPublishWrittenGuard class marks a cross-thread publish as done for a session, also when writing it failed, so the
+ * session isn't kept on the writing thread.
+ */
+class CrossThreadPublishWrittenGuard
+{
+    const std::shared_ptr<Session> &session;
+public:
+    CrossThreadPublishWrittenGuard(const std::shared_ptr<Session> &session);
+    ~CrossThreadPublishWrittenGuard();
+};
+
+class ThreadData : public std::enable_shared_from_this<ThreadData>
+{
+#ifdef TESTING
+    friend class MainTests;
+#endif
+
     std::unordered_map<int, std::shared_ptr<Client>> clients_by_fd;
     std::mutex clients_by_fd_mutex;
+
+    // The size of clients_by_fd, for other threads to read without locking. Only changed while holding clients_by_fd_mutex.
+    std::atomic<int> clientCount{0};
     Logger *logger;
 
     std::mutex clientsToRemoveMutex;
@@ -70,28 +122,67 @@ class ThreadData
     std::mutex asyncClientsReadyMutex;
     std::forward_list<AsyncAuth> asyncClientsReady;
 
-    std::mutex queuedKeepAliveMutex;
-    std::map<std::chrono::seconds, std::vector<KeepAliveCheck>> queuedKeepAliveChecks;
+    std::mutex asyncAclChecksReadyMutex;
+    std::vector<AsyncAclCheck> asyncAclChecksReady;
+
+    std::mutex crossThreadPublishesMutex;
+    std::vector<CrossThreadPublish> crossThreadPublishes;
+
+    // Only used by the thread itself, so not locked. See 'batched_write_flushing'.
+    std::vector<int> clientsQueuedForFlushing;
+    std::vector<int> clientsBeingFlushed;
+    uint64_t flushRound = 0;
+
+    // How much of the time the event loop is not waiting, for 'client_thread_assignment'. Updated about every second.
+    std::chrono::time_point<std::chrono::steady_clock> loopPeriodStart = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds loopBusyTime = std::chrono::nanoseconds(0);
+    std::atomic<uint32_t> loopBusyPermille = 0;
+
+    // See 'listen_sockets_per_thread'. Only used by the thread itself, after start.
+    std::list<ScopedSocket> listenSockets;
+    std::unordered_map<int, std::shared_ptr<Listener>> listenersByFd;
+
+#ifdef FLASHMQ_IO_URING
+    // See 'io_uring_batched_sends'. The batched writes are pre-allocated, because the kernel refers to their msghdr and iovecs.
+    std::unique_ptr<IoUring> ioUring;
+    bool ioUringUnavailable = false;
+    std::vector<BatchedWrite> batchedWrites;
+    size_t batchedWritesCount = 0;
+#endif
+
+    // Only used by the thread itself; other threads hand keep-alive checks over. See TimerWheel.
+    TimerWheel<KeepAliveCheck> queuedKeepAliveChecks;
+    TimerHandoff<KeepAliveCheck> keepAliveChecksHandoff;
+    uint64_t lastTimerTick = 0;
+    bool timersUnfinished = false;
 
     const PluginLoader &pluginLoader;
 
     void reload(const Settings &settings);
     void wakeUpThread();
-    void doKeepAliveCheck();
+    void doKeepAliveCheck(uint64_t now);
     void quit();
     void publishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads);
     void publishStat(const std::string &topic, uint64_t n);
-    void sendQueuedWills();
-    void removeExpiredSessions();
+    void publishHistogram(const std::string &topicPrefix, const DurationHistogram &histogram);
+    bool sendQueuedWills(uint64_t now, std::chrono::time_point<std::chrono::steady_clock> deadline);
+    bool removeExpiredSessions(uint64_t now, std::chrono::time_point<std::chrono::steady_clock> deadline);
+    void cleanupSubscriptionTree(bool continuing);
     void removeExpiredRetainedMessages();
     void sendAllWills();
     void sendAllDisconnects();
-    void queueClientNextKeepAliveCheck(std::shared_ptr<Client> &client, bool keepRechecking);
     void continueAsyncAuths();
+    void continueAsyncAclChecks();
     void clientDisconnectEvent(const std::string &clientid);
+    void writeCrossThreadPublishes();
 
     void removeQueuedClients();
 
+#ifdef FLASHMQ_IO_URING
+    IoUring *getIoUring();
+    void submitBatchedWrites(std::vector<std::shared_ptr<Client>> &clientsToRemove);
+#endif
+
 public:
     Settings settingsLocalCopy; // Is updated on reload, within the thread loop.
     Authentication authentication;
@@ -106,11 +197,20 @@ public:
     std::mutex taskQueueMutex;
     std::list<std::function<void()>> taskQueue;
     QueuedTasks delayedTasks;
+
+    // Wills and session removals of the SubscriptionStore, timed by the thread that queued them. Only used by the thread itself.
+    TimerWheel<QueuedWill> queuedWills;
+    TimerWheel<std::weak_ptr<Session>> queuedSessionRemovals;
+    bool processingTimers = false; // Set by the thread itself, once it's running processTimers().
     std::unordered_map<int, std::weak_ptr<void>> externalFds;
 
     DerivableCounter receivedMessageCounter;
     DerivableCounter sentMessageCounter;
     DerivableCounter mqttConnectCounter;
+    DerivableCounter epollCtlCounter;
+    DerivableCounter socketConnectCounter; // Only of 'listen_sockets_per_thread'; the main thread counts the others.
+    DerivableCounter sharedPayloadCounter; // See 'shared_payload_min_bytes'.
+    DerivableCounter ioUringSendCounter; // See 'io_uring_batched_sends'.
 
     ThreadData(int threadnr, const Settings &settings, const PluginLoader &pluginLoader);
     ThreadData(const ThreadData &other) = delete;
@@ -118,6 +218,9 @@ public:
 
     void start(thread_f f);
 
+    void addListenSocket(ScopedSocket &&socket, const std::shared_ptr<Listener> &listener);
+    bool acceptClient(int listenFd, const std::shared_ptr<Listener> &listener, const Settings &settings);
+    bool acceptClientsIfListenSocket(int fd);
     void giveClient(std::shared_ptr<Client> client);
     std::shared_ptr<Client> getClient(int fd);
     void removeClientQueued(const std::shared_ptr<Client> &client);
@@ -127,20 +230,28 @@ public:
     void initplugin();
     void cleanupplugin();
     void queueReload(const Settings &settings);
-    void queueDoKeepAliveCheck();
     void queueQuit();
     void waitForQuit();
     void queuePasswdFileReload();
     void queuePublishStatsOnDollarTopic(std::vector<std::shared_ptr<ThreadData>> &threads);
-    void queueSendingQueuedWills();
-    void queueRemoveExpiredSessions();
+    void queueCleanupSubscriptionTree();
     void queueRemoveExpiredRetainedMessages();
-    void queueClientNextKeepAliveCheckLocked(std::shared_ptr<Client> &client, bool keepRechecking);
+    void queuePause(const std::shared_ptr<ThreadsPause> &pause);
+    void queueClientNextKeepAliveCheck(std::shared_ptr<Client> &client, bool keepRechecking);
+    void processTimers();
+    uint32_t getTimeTillNextTimer() const;
     void continuationOfAuthentication(std::shared_ptr<Client> &client, AuthResult authResult, const std::string &authMethod, const std::string &returnData);
     void queueContinuationOfAuthentication(const std::shared_ptr<Client> &client, AuthResult authResult, const std::string &authMethod, const std::string &returnData);
+    void queueContinuationOfAclCheck(const std::shared_ptr<Client> &client, uint64_t checkId, AuthResult result);
     void queueClientDisconnectEvent(const std::string &clientid);
+    void queueCrossThreadPublish(CrossThreadPublish &&publish);
+    void queueClientFlush(int fd);
+    void flushQueuedClientWrites();
+    static void countEpollCtl();
 
     int getNrOfClients() const;
+    void accountLoopBusyTime(std::chrono::time_point<std::chrono::steady_clock> busyStart, std::chrono::time_point<std::chrono::steady_clock> busyEnd);
+    uint32_t getLoopBusyPermille() const;
 
     void queuepluginPeriodicEvent();
     void pluginPeriodicEvent();
@@ -53,17 +53,28 @@ void do_thread_work(ThreadData *threadData)
         instance->quit();
     }
 
+    std::chrono::time_point<std::chrono::steady_clock> busyStart = std::chrono::steady_clock::now();
+
+    threadData->processingTimers = true;
+
     while (threadData->running)
     {
-        const uint32_t next_task_delay = threadData->delayedTasks.getTimeTillNext();
+        // Writes of the previous iteration, when 'batched_write_flushing' is on. Done before waiting, so also after a wake-up for a task.
+        threadData->flushQueuedClientWrites();
+
+        // Likewise for the async plugin checks, see flashmq_plugin_check_batch().
+        threadData->authentication.flushCheckBatch();
+
+        const uint32_t next_task_delay = threadData->getTimeTillNextTimer();
         const uint32_t epoll_wait_time = std::min<uint32_t>(next_task_delay, 100);
 
+        threadData->accountLoopBusyTime(busyStart, std::chrono::steady_clock::now());
+
         int fdcount = epoll_wait(epoll_fd, events, MAX_EVENTS, epoll_wait_time);
 
-        if (__builtin_expect(epoll_wait_time == 0, 0))
-        {
-            threadData->delayedTasks.performAll();
-        }
+        busyStart = std::chrono::steady_clock::now();
+
+        threadData->processTimers();
 
         if (fdcount < 0)
         {
@@ -101,6 +112,9 @@ void do_thread_work(ThreadData *threadData)
 
             if (__builtin_expect(!client, 0))
             {
+                if (threadData->acceptClientsIfListenSocket(fd))
+                    continue;
+
                 // If the fd is not a client, it may be an externally monitored fd, from the plugin.
                 auto pos = threadData->externalFds.find(fd);
                 if (pos != threadData->externalFds.end())
@@ -145,7 +159,7 @@ void do_thread_work(ThreadData *threadData)
                             client->onPacketReceived(packet);
                         else
 #endif
-                        packet.handle();
+                        client->handlePacket(packet);
                     }
 
                     if (!readSuccess)
@@ -199,6 +213,11 @@ void do_thread_work(ThreadData *threadData)
         }
     }
 
+    // Timers queued from now on, like wills of clients that are destroyed, are handed over, like from non-worker threads.
+    threadData->processingTimers = false;
+
+    threadData->flushQueuedClientWrites();
+
     try
     {
         logger->logf(LOG_NOTICE, "Thread %d doing auth cleanup.", threadData->threadnr);
@@ -0,0 +1,49 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "threadspause.h"
+
+/**
+ * @brief ThreadsPause::pause is called by the threads to pause, in their own loop.
+ */
+void ThreadsPause::pause()
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    arrived++;
+    condition.notify_all();
+    condition.wait(locker, [this]() { return released; });
+}
+
+/**
+ * @brief ThreadsPause::waitForThreads waits until the threads are paused.
+ * @return whether all threads were paused within the timeout.
+ */
+bool ThreadsPause::waitForThreads(size_t count, std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> locker(mutex);
+    return condition.wait_for(locker, timeout, [this, count]() { return arrived >= count; });
+}
+
+void ThreadsPause::release()
+{
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        released = true;
+    }
+
+    condition.notify_all();
+}
@@ -0,0 +1,42 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADSPAUSE_H
+#define THREADSPAUSE_H
+
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**
+ * @brief The ThreadsPause class parks threads in a task, until released, so they're not in the middle of changing anything. Threads that
+ * get to it after the release don't wait anymore. See 'save_state_in_child_process'.
+ */
+class ThreadsPause
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t arrived = 0;
+    bool released = false;
+
+public:
+    void pause();
+    bool waitForThreads(size_t count, std::chrono::milliseconds timeout);
+    void release();
+};
+
+#endif // THREADSPAUSE_H
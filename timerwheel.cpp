@@ -0,0 +1,283 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include "timerwheel.h"
+
+#include <limits>
+#include <cassert>
+
+TimerWheelBase::TimerWheelBase()
+{
+    slotHeads.fill(none);
+    currentTick = now();
+}
+
+/**
+ * @brief TimerWheelBase::toTick gives the tick of a time point: milliseconds of the steady clock.
+ */
+uint64_t TimerWheelBase::toTick(std::chrono::time_point<std::chrono::steady_clock> t)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+uint64_t TimerWheelBase::now()
+{
+    return toTick(std::chrono::steady_clock::now());
+}
+
+uint32_t TimerWheelBase::allocEntry(uint64_t expiresAt)
+{
+    uint32_t index = 0;
+
+    if (freeEntries.empty())
+    {
+        index = entries.size();
+        entries.emplace_back();
+    }
+    else
+    {
+        index = freeEntries.back();
+        freeEntries.pop_back();
+    }
+
+    Entry &e = entries[index];
+    e.used = true;
+    e.expiresAt = expiresAt;
+
+    // Generation 0 is skipped, so handles are never 0.
+    if (++e.generation == 0)
+        e.generation = 1;
+
+    link(index);
+    count++;
+    return index;
+}
+
+void TimerWheelBase::freeEntry(uint32_t index)
+{
+    Entry &e = entries[index];
+    assert(e.used && e.slot == none);
+    e.used = false;
+    freeEntries.push_back(index);
+    count--;
+}
+
+/**
+ * @brief TimerWheelBase::link puts the entry in the slot that belongs to its expiry, seen from the current tick.
+ *
+ * Entries less than 64 ticks away go in level 0, less than 64*64 in level 1, etc. Entries that already expired go in the slot of the
+ * current tick.
+ */
+void TimerWheelBase::link(uint32_t index)
+{
+    Entry &e = entries[index];
+    assert(e.slot == none);
+
+    const uint64_t expiresAt = std::max(e.expiresAt, currentTick);
+    const uint64_t delta = expiresAt - currentTick;
+
+    int level = 0;
+    while (level < levels - 1 && (delta >> (levelBits * (level + 1))) != 0)
+        level++;
+
+    uint32_t slotInLevel = 0;
+
+    if ((delta >> (levelBits * (level + 1))) != 0)
+    {
+        // Beyond the reach of the top level. The slot that comes around last is used, and then it's placed again.
+        slotInLevel = ((currentTick >> (levelBits * level)) + slotsPerLevel - 1) & (slotsPerLevel - 1);
+    }
+    else
+    {
+        slotInLevel = (expiresAt >> (levelBits * level)) & (slotsPerLevel - 1);
+    }
+
+    const uint32_t slot = level * slotsPerLevel + slotInLevel;
+    const uint32_t oldHead = slotHeads[slot];
+
+    e.slot = slot;
+    e.prev = none;
+    e.next = oldHead;
+
+    if (oldHead != none)
+        entries[oldHead].prev = index;
+
+    slotHeads[slot] = index;
+    occupied[level] |= (1ULL << slotInLevel);
+}
+
+void TimerWheelBase::unlink(uint32_t index)
+{
+    Entry &e = entries[index];
+
+    // Entries that are collected as due are already out of their slot.
+    if (e.slot == none)
+        return;
+
+    if (e.prev != none)
+        entries[e.prev].next = e.next;
+    else
+        slotHeads[e.slot] = e.next;
+
+    if (e.next != none)
+        entries[e.next].prev = e.prev;
+
+    if (slotHeads[e.slot] == none)
+        occupied[e.slot / slotsPerLevel] &= ~(1ULL << (e.slot % slotsPerLevel));
+
+    e.slot = none;
+    e.prev = none;
+    e.next = none;
+}
+
+/**
+ * @brief TimerWheelBase::relinkSlot takes the entries out of a slot of a higher level and places them again. Seen from the current
+ * tick, they now go in a lower level.
+ */
+void TimerWheelBase::relinkSlot(uint32_t slot)
+{
+    uint32_t index = slotHeads[slot];
+    slotHeads[slot] = none;
+    occupied[slot / slotsPerLevel] &= ~(1ULL << (slot % slotsPerLevel));
+
+    while (index != none)
+    {
+        Entry &e = entries[index];
+        const uint32_t next = e.next;
+        e.slot = none;
+        link(index);
+        index = next;
+    }
+}
+
+/**
+ * @brief TimerWheelBase::nextTickToVisit gives the first tick at which there's a slot to fire or a higher level slot to move down.
+ * @return max uint64 when there are none.
+ */
+uint64_t TimerWheelBase::nextTickToVisit() const
+{
+    uint64_t result = std::numeric_limits<uint64_t>::max();
+
+    const uint64_t pos = currentTick & (slotsPerLevel - 1);
+    const uint64_t bitsAhead = occupied[0] >> pos;
+
+    if (bitsAhead)
+        result = currentTick + __builtin_ctzll(bitsAhead);
+    else if (occupied[0])
+        result = (currentTick | (slotsPerLevel - 1)) + 1 + __builtin_ctzll(occupied[0]);
+
+    for (int level = 1; level < levels; level++)
+    {
+        if (occupied[level] == 0)
+            continue;
+
+        // The lowest occupied level has the first boundary. Boundaries of the higher levels coincide with those.
+        const uint64_t mask = (1ULL << (levelBits * level)) - 1;
+        const uint64_t boundary = (currentTick + mask) & ~mask;
+        result = std::min(result, boundary);
+        break;
+    }
+
+    return result;
+}
+
+/**
+ * @brief TimerWheelBase::collectDue advances the current tick to past 'now', putting the entries that expire on the way in 'due'.
+ */
+void TimerWheelBase::collectDue(uint64_t now)
+{
+    while (currentTick <= now)
+    {
+        const uint64_t tick = nextTickToVisit();
+
+        if (tick > now)
+        {
+            currentTick = now + 1;
+            break;
+        }
+
+        currentTick = tick;
+
+        if ((currentTick & (slotsPerLevel - 1)) == 0)
+        {
+            int top = 1;
+            while (top < levels - 1 && (currentTick & ((1ULL << (levelBits * (top + 1))) - 1)) == 0)
+                top++;
+
+            // Higher levels first, because their entries can end up in the slots of the lower levels that are moved down here too.
+            for (int level = top; level >= 1; level--)
+            {
+                const uint32_t slotInLevel = (currentTick >> (levelBits * level)) & (slotsPerLevel - 1);
+                const uint32_t slot = level * slotsPerLevel + slotInLevel;
+
+                if (slotHeads[slot] != none)
+                    relinkSlot(slot);
+            }
+        }
+
+        const uint32_t slot = currentTick & (slotsPerLevel - 1);
+        uint32_t index = slotHeads[slot];
+        slotHeads[slot] = none;
+        occupied[0] &= ~(1ULL << slot);
+
+        while (index != none)
+        {
+            Entry &e = entries[index];
+            const uint32_t next = e.next;
+            e.slot = none;
+            e.prev = none;
+            e.next = none;
+            due.emplace_back(index, e.generation);
+            index = next;
+        }
+
+        currentTick++;
+    }
+}
+
+bool TimerWheelBase::isValid(uint64_t handle) const
+{
+    const uint32_t index = static_cast<uint32_t>(handle);
+    const uint32_t generation = static_cast<uint32_t>(handle >> 32);
+
+    if (index >= entries.size())
+        return false;
+
+    const Entry &e = entries[index];
+    return e.used && e.generation == generation;
+}
+
+/**
+ * @brief TimerWheelBase::getMsTillNext gives how long until the wheel needs advancing again, for an epoll timeout.
+ * @return max uint32 when there are no timers.
+ */
+uint32_t TimerWheelBase::getMsTillNext(uint64_t now) const
+{
+    if (__builtin_expect(count == 0, 1))
+        return std::numeric_limits<uint32_t>::max();
+
+    if (hasUnprocessedDue())
+        return 0;
+
+    const uint64_t tick = nextTickToVisit();
+
+    if (tick <= now)
+        return 0;
+
+    return std::min<uint64_t>(tick - now, std::numeric_limits<uint32_t>::max());
+}
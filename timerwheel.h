@@ -0,0 +1,248 @@
+/*
+This file is part of FlashMQ (https://www.flashmq.org)
+Copyright (C) 2021 Wiebe Cazemier
+
+FlashMQ is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, version 3.
+
+FlashMQ is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public
+License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <vector>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <utility>
+#include <stdint.h>
+
+/**
+ * @brief The TimerWheelBase class is the bookkeeping of TimerWheel, which doesn't depend on what is stored.
+ *
+ * It's a hierarchical timing wheel with a tick of one millisecond. Each level has 64 slots, and each slot of a level spans all 64 slots
+ * of the level below it, so with six levels, it reaches about two years ahead. Timers further away are put in the last slot of the top
+ * level, and are simply placed again when that slot comes around. Slots are doubly linked lists of entry indexes, so adding and
+ * cancelling are O(1), without allocations once the entry vector is big enough. When time advances past a slot boundary of a higher
+ * level, the entries of that slot are placed again, which moves them down. A bitmap per level makes advancing skip empty stretches.
+ */
+class TimerWheelBase
+{
+protected:
+    static constexpr int levelBits = 6;
+    static constexpr uint32_t slotsPerLevel = 1 << levelBits;
+    static constexpr int levels = 6;
+    static constexpr uint32_t none = UINT32_MAX;
+
+    struct Entry
+    {
+        uint64_t expiresAt = 0;
+        uint32_t prev = none;
+        uint32_t next = none;
+        uint32_t generation = 0;
+        uint32_t slot = none; // Index in slotHeads; 'none' when not in a slot.
+        bool used = false;
+    };
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> freeEntries;
+    std::array<uint32_t, levels * slotsPerLevel> slotHeads;
+    std::array<uint64_t, levels> occupied {};
+    uint64_t currentTick = 0; // All ticks before this one have been processed.
+    size_t count = 0;
+
+    // Entries that expired, with their generation, as collected by collectDue(). The ones before dueProcessed are done.
+    std::vector<std::pair<uint32_t, uint32_t>> due;
+    size_t dueProcessed = 0;
+
+    uint32_t allocEntry(uint64_t expiresAt);
+    void freeEntry(uint32_t index);
+    void link(uint32_t index);
+    void unlink(uint32_t index);
+    void relinkSlot(uint32_t slot);
+    void collectDue(uint64_t now);
+    bool isValid(uint64_t handle) const;
+    uint64_t nextTickToVisit() const;
+
+public:
+    TimerWheelBase();
+    TimerWheelBase(const TimerWheelBase &other) = delete;
+    TimerWheelBase(TimerWheelBase &&other) = delete;
+
+    static uint64_t toTick(std::chrono::time_point<std::chrono::steady_clock> t);
+    static uint64_t now();
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool hasUnprocessedDue() const { return dueProcessed < due.size(); }
+    uint32_t getMsTillNext(uint64_t now) const;
+};
+
+/**
+ * @brief The TimerWheel class holds values that expire at a certain tick (see TimerWheelBase::toTick()).
+ *
+ * It's not thread-safe; it's meant to be owned by one thread. Other threads can hand timers over with a TimerHandoff.
+ */
+template<typename T>
+class TimerWheel : public TimerWheelBase
+{
+    std::vector<T> values;
+
+public:
+    /**
+     * @brief add
+     * @return a handle for cancel(). It's never 0.
+     */
+    uint64_t add(uint64_t expiresAt, T &&value)
+    {
+        const uint32_t index = allocEntry(expiresAt);
+
+        if (index >= values.size())
+            values.resize(index + 1);
+
+        values[index] = std::move(value);
+        return (static_cast<uint64_t>(entries[index].generation) << 32) | index;
+    }
+
+    /**
+     * @brief cancel removes the timer, if it's still there.
+     * @return whether it was there.
+     */
+    bool cancel(uint64_t handle)
+    {
+        if (!isValid(handle))
+            return false;
+
+        const uint32_t index = static_cast<uint32_t>(handle);
+        unlink(index);
+        values[index] = T();
+        freeEntry(index);
+        return true;
+    }
+
+    /**
+     * @brief advance calls f with each value that expired at or before tick 'now', in order of expiry (within the same tick, in no
+     * particular order).
+     * @param deadline is when to stop, even when there are more expired timers. They are kept, and done first the next time.
+     * @return whether all expired timers were done.
+     *
+     * It's safe for f to add and cancel timers, but not to advance. When f throws, the exception is passed on, and the timers that were
+     * due after the one that threw are kept, for the next time.
+     */
+    template<typename F>
+    bool advance(uint64_t now, F &&f, std::chrono::time_point<std::chrono::steady_clock> deadline = std::chrono::time_point<std::chrono::steady_clock>::max())
+    {
+        if (now >= currentTick)
+            collectDue(now);
+
+        const bool budgeted = deadline != std::chrono::time_point<std::chrono::steady_clock>::max();
+
+        while (dueProcessed < due.size())
+        {
+            // Looking at the clock for every timer is relatively expensive.
+            if (budgeted && (dueProcessed & 31) == 0 && std::chrono::steady_clock::now() > deadline)
+                return false;
+
+            const std::pair<uint32_t, uint32_t> d = due[dueProcessed++];
+            const uint32_t index = d.first;
+            const Entry &e = entries[index];
+
+            // It may have been cancelled by an earlier callback.
+            if (!e.used || e.generation != d.second)
+                continue;
+
+            T value = std::move(values[index]);
+            values[index] = T();
+            freeEntry(index);
+            f(value);
+        }
+
+        due.clear();
+        dueProcessed = 0;
+        return true;
+    }
+};
+
+/**
+ * @brief The TimerHandoff class is how threads that don't own a TimerWheel give it timers, without locking.
+ *
+ * Pushing is a compare-and-swap on the head of a singly linked list. Taking is exchanging the whole list for an empty one, so there is
+ * no ABA problem, and any number of threads can push and take.
+ */
+template<typename T>
+class TimerHandoff
+{
+    struct Node
+    {
+        uint64_t expiresAt;
+        T value;
+        Node *next = nullptr;
+
+        Node(uint64_t expiresAt, T &&value) :
+            expiresAt(expiresAt),
+            value(std::move(value))
+        {
+
+        }
+    };
+
+    std::atomic<Node*> head {nullptr};
+
+    static void deleteList(Node *n)
+    {
+        while (n)
+        {
+            Node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+public:
+    TimerHandoff() = default;
+    TimerHandoff(const TimerHandoff &other) = delete;
+    TimerHandoff(TimerHandoff &&other) = delete;
+
+    ~TimerHandoff()
+    {
+        deleteList(head.exchange(nullptr));
+    }
+
+    void push(uint64_t expiresAt, T &&value)
+    {
+        Node *n = new Node(expiresAt, std::move(value));
+        n->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    bool empty() const
+    {
+        return head.load(std::memory_order_relaxed) == nullptr;
+    }
+
+    void moveInto(TimerWheel<T> &wheel)
+    {
+        if (empty())
+            return;
+
+        Node *n = head.exchange(nullptr, std::memory_order_acquire);
+
+        for (Node *cur = n; cur; cur = cur->next)
+        {
+            wheel.add(cur->expiresAt, std::move(cur->value));
+        }
+
+        deleteList(n);
+    }
+};
+
+#endif // TIMERWHEEL_H
@@ -22,6 +22,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include "exceptions.h"
 
 #include "utils.h"
+#include "subtopickey.h"
 
 ConnAck::ConnAck(const ProtocolVersion protVersion, ReasonCodes return_code, bool session_present) :
     protocol_version(protVersion),
@@ -284,6 +285,20 @@ const std::vector<std::string> &Publish::getSubtopics()
     return this->subtopics;
 }
 
+/**
+ * @brief Publish::getSubtopicHashes gives the hashes of the subtopics, calculated once, for looking them up in the various trees.
+ * @return
+ */
+const std::vector<size_t> &Publish::getSubtopicHashes()
+{
+    const std::vector<std::string> &subtopics = getSubtopics();
+
+    if (subtopicHashes.size() != subtopics.size())
+        hashSubtopics(subtopics, subtopicHashes);
+
+    return this->subtopicHashes;
+}
+
 WillPublish::WillPublish(const Publish &other) :
     Publish(other)
 {
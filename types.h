@@ -242,6 +242,7 @@ public:
 class Publish : public PublishBase
 {
     std::vector<std::string> subtopics;
+    std::vector<size_t> subtopicHashes;
 
 public:
     Publish() = default;
@@ -251,6 +252,7 @@ public:
     Publish& operator=(const Publish &other);
 
     const std::vector<std::string> &getSubtopics();
+    const std::vector<size_t> &getSubtopicHashes();
 };
 
 class WillPublish : public Publish
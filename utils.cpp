@@ -25,6 +25,8 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 #include <cstdio>
 #include <cstring>
 #include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -37,6 +39,7 @@ License along with FlashMQ. If not, see <https://www.gnu.org/licenses/>.
 
 
 #ifdef __SSE4_2__
+#include <nmmintrin.h>
 #include "threadlocalutils.h"
 thread_local SimdUtils simdUtils;
 #endif
@@ -680,6 +683,45 @@ ssize_t getFileSize(const std::string &path)
     return statbuf.st_size;
 }
 
+/**
+ * @brief crc32c calculates the CRC-32C (Castagnoli) checksum, with the SSE4.2 instruction when available.
+ * @param crc is the result of the previous part, to continue a checksum over several calls.
+ */
+uint32_t crc32c(const void *data, size_t len, uint32_t crc)
+{
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+
+#ifdef __SSE4_2__
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = crc64;
+
+    while (len > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#else
+    while (len > 0)
+    {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        len--;
+    }
+#endif
+
+    return ~crc;
+}
+
 std::string sockaddrToString(const sockaddr *addr)
 {
     if (!addr)
@@ -784,6 +826,62 @@ int maskAllSignalsCurrentThread()
     return r;
 }
 
+/**
+ * @brief closeAllFdsExcept is for a forked child, to close what it inherited, other than stdin, stdout and stderr. Otherwise, for instance,
+ * a connection the parent closes would stay open as long as the child runs.
+ */
+void closeAllFdsExcept(int keepFd)
+{
+    std::vector<int> fds;
+
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir)
+        return;
+
+    const int dirFd = dirfd(dir);
+    struct dirent *entry = nullptr;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        const int fd = atoi(entry->d_name);
+        if (fd > 2 && fd != keepFd && fd != dirFd)
+            fds.push_back(fd);
+    }
+
+    closedir(dir);
+
+    for (int fd : fds)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * @brief getPrivateDirtyKb gives the memory of this process that is changed and not shared (anymore). In a forked child, that's mostly what
+ * was copied on write.
+ * @return kB, or 0 when the kernel doesn't tell.
+ */
+uint64_t getPrivateDirtyKb()
+{
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f)
+        return 0;
+
+    uint64_t result = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long kb = 0;
+        if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1)
+            result += kb;
+    }
+
+    fclose(f);
+    return result;
+}
+
 void parseSubscriptionShare(std::vector<std::string> &subtopics, std::string &shareName)
 {
     if (subtopics.size() < 3)
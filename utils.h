@@ -97,6 +97,8 @@ BindAddr getBindAddr(int family, const std::string &bindAddress, int port);
 
 ssize_t getFileSize(const std::string &path);
 
+uint32_t crc32c(const void *data, size_t len, uint32_t crc = 0);
+
 std::string sockaddrToString(const struct sockaddr *addr);
 
 template<typename ex> void checkWritableDir(const std::string &path)
@@ -137,6 +139,9 @@ ReasonCodes authResultToReasonCode(AuthResult authResult);
 
 int maskAllSignalsCurrentThread();
 
+void closeAllFdsExcept(int keepFd);
+uint64_t getPrivateDirtyKb();
+
 void parseSubscriptionShare(std::vector<std::string> &subtopics, std::string &shareName);
 
 